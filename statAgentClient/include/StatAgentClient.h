@@ -9,6 +9,13 @@
 
 extern const char *logCursorPostfix;
 
+// one gauge of a batch, all of it logged at the same time
+typedef struct stat_agent_gauge_tag {
+	int16_t iid;
+	uint8_t gtype;
+	int64_t gval;
+} stat_agent_gauge_t;
+
 class StatAgentClient {
 public:
 	static StatAgentClient _inst;
@@ -22,6 +29,8 @@ public:
 		 stat_id_t sid(pid, mid, iid);
 		 return logGauge(0, sid, gtype, gval);
 	}
+	// in one write to the stat file
+	int logGauges(const stat_agent_gauge_t *gauges, size_t count);
 
 	int logLcall(uint32_t ip4, const stat_id_t& sid, int32_t retcode, const stat_result_t& result, const char *key, const char *extra);
 	int logLcall(int16_t iid, int32_t retcode, const stat_result_t& result, const char *key, const char *extra) {
@@ -117,6 +117,39 @@ int StatAgentClient::logGauge(uint32_t ip4, const stat_id_t& sid, uint8_t gtype,
 	return doLog(ts.tv_sec, data, msg.getWptr());
 }
 
+// gauges encoded on stack up to this, in a malloc-ed buffer beyond
+#define GAUGE_BATCH_STACK_COUNT	128
+
+int StatAgentClient::logGauges(const stat_agent_gauge_t *gauges, size_t count)
+{
+	if (count == 0) return 0;
+
+	struct timeval ts;
+	gettimeofday(&ts, NULL);
+
+	const size_t itemSize = 4 + sizeof(StatItemGauge);
+	unsigned char stackData[GAUGE_BATCH_STACK_COUNT * itemSize];
+	unsigned char *data = stackData;
+	if (count > GAUGE_BATCH_STACK_COUNT && (data = (unsigned char *)malloc(count * itemSize)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	MemoryBuffer msg(data, count * itemSize, false);
+	for (size_t i = 0; i < count; ++i) {
+		StatItemGauge gauge(TV2MS(&ts), this->hip, stat_id_t(pid, mid, gauges[i].iid), gauges[i].gtype, gauges[i].gval);
+
+		msg.writeUint8(STAT_ITEM_GAUGE);
+		int retval = gauge.encodeTo(&msg);
+		assert(retval == 0);
+	}
+
+	int retval = doLog(ts.tv_sec, data, msg.getWptr());
+	if (data != stackData) free(data);
+
+	return retval;
+}
+
 int StatAgentClient::logLcall(uint32_t ip4, const stat_id_t& sid, int32_t retcode, 
 			      const stat_result_t& result, const char *key, const char *extra)
 {
@@ -395,7 +395,8 @@ void StatAgentProcessor::onSaveStatsDone(beyondy::Async::Message *msg)
 	struct proto_h16_res *h;
 	if (msg->getWptr() >= (long)sizeof(struct proto_h16_res)) {
 		h = (struct proto_h16_res *)msg->data();
-		APPLOG_DEBUG("stat-msg(ack=%u) saved result: %d", h->ack, h->ret);
+		if (h->ret != 0) APPLOG_ERROR("stat-msg(ack=%u) save failed: %d", h->ack, h->ret);
+		else APPLOG_DEBUG("stat-msg(ack=%u) saved result: %d", h->ack, h->ret);
 	}
 	else {
 		APPLOG_ERROR("stat-msg rsp is too little: size=%ld, should be %ld", msg->getWptr(), (long)sizeof(*h));
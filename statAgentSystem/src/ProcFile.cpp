@@ -0,0 +1,66 @@
+/* ProcFile.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ProcFile.h"
+
+// enough for all but /proc/stat on large hosts
+#define PROC_FILE_INITIAL_SIZE	4096
+
+ProcFile::ProcFile(const char *_path)
+	: path(_path), fd(-1), buf(NULL), capacity(0)
+{
+	// nothing
+}
+
+ProcFile::~ProcFile()
+{
+	if (fd >= 0) close(fd);
+	free(buf);
+}
+
+char *ProcFile::read(size_t& size)
+{
+	if (fd < 0 && (fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "open(%s) failed: %m\n", path);
+		return NULL;
+	}
+
+	if (buf == NULL) {
+		if ((buf = (char *)malloc(PROC_FILE_INITIAL_SIZE)) == NULL)
+			return NULL;
+		capacity = PROC_FILE_INITIAL_SIZE;
+	}
+
+	// /proc may stop a read at a record boundary, so go on from where
+	// it stopped till the end, growing the buffer once it is full
+	size_t used = 0;
+	while (true) {
+		if (used == capacity - 1) {
+			char *nbuf = (char *)realloc(buf, capacity * 2);
+			if (nbuf == NULL) return NULL;
+			buf = nbuf;
+			capacity *= 2;
+		}
+
+		ssize_t rlen = pread(fd, buf + used, capacity - 1 - used, used);
+		if (rlen < 0 && errno == EINTR) continue;
+		if (rlen < 0) {
+			fprintf(stderr, "read(%s) failed: %m\n", path);
+			close(fd); fd = -1;
+			return NULL;
+		}
+
+		if (rlen == 0) break;
+		used += rlen;
+	}
+
+	buf[used] = 0;
+	size = used;
+	return buf;
+}
@@ -0,0 +1,110 @@
+/* ProcFile.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __PROC_FILE__H
+#define __PROC_FILE__H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// a /proc file opened once and read again from its start each time,
+// into a buffer kept across reads and grown only when it was filled.
+//
+class ProcFile {
+public:
+	ProcFile(const char *_path);
+	~ProcFile();
+private:
+	ProcFile(const ProcFile&);
+	ProcFile& operator=(const ProcFile&);
+public:
+	const char *getPath() const { return path; }
+
+	// the whole content, 0-terminated, valid till the next read.
+	// NULL on error, the file is opened again next time
+	char *read(size_t& size);
+private:
+	const char *path;
+	int fd;
+	char *buf;
+	size_t capacity;
+};
+
+//
+// walks a read content in place, never allocates. values are parsed
+// within the current line, names are 0-terminated over their separator.
+//
+class ProcScanner {
+public:
+	ProcScanner(char *data, size_t size) : ptr(data), end(data + size) {}
+public:
+	bool atEnd() const { return ptr >= end; }
+	bool atLineEnd() const { return ptr >= end || *ptr == '\n'; }
+
+	void skipLine() {
+		while (ptr < end && *ptr++ != '\n') /* nothing */;
+	}
+
+	void skipSpaces() {
+		while (ptr < end && (*ptr == ' ' || *ptr == '\t')) ++ptr;
+	}
+
+	// consumes prefix if the rest of the line starts with it
+	bool startsWith(const char *prefix, size_t len) {
+		if ((size_t)(end - ptr) < len || memcmp(ptr, prefix, len) != 0)
+			return false;
+		ptr += len;
+		return true;
+	}
+
+	bool atDigit() const { return ptr < end && *ptr >= '0' && *ptr <= '9'; }
+
+	// 0 if there is no number
+	uint64_t readUint() {
+		skipSpaces();
+		uint64_t val = 0;
+		while (atDigit()) val = val * 10 + (*ptr++ - '0');
+		return val;
+	}
+
+	// "0.52" by scale 100 is 52, digits beyond scale dropped
+	int64_t readFixed(int64_t scale) {
+		int64_t val = (int64_t)readUint() * scale;
+		if (ptr < end && *ptr == '.') {
+			++ptr;
+			for (int64_t unit = scale / 10; atDigit(); ++ptr) {
+				val += (*ptr - '0') * unit;
+				unit /= 10;
+			}
+		}
+		return val;
+	}
+
+	// a k/m size unit after a value, 1 if none
+	uint64_t readUnit() {
+		skipSpaces();
+		if (ptr < end && (*ptr == 'k' || *ptr == 'K')) return 1024;
+		if (ptr < end && (*ptr == 'm' || *ptr == 'M')) return 1024 * 1024;
+		return 1;
+	}
+
+	// a name ending at stop (any whitespace for ' '), NULL if the
+	// line ends before it
+	char *readName(char stop) {
+		skipSpaces();
+		char *name = ptr;
+		while (ptr < end && *ptr != '\n' && *ptr != stop && !(stop == ' ' && *ptr == '\t'))
+			++ptr;
+		if (ptr == name || atLineEnd())
+			return NULL;
+		*ptr++ = 0;
+		return name;
+	}
+private:
+	char *ptr;
+	char *end;
+};
+
+#endif /* __PROC_FILE__H */
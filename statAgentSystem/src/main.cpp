@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <regex.h>
 #include <tr1/unordered_map>
+#include <vector>
 
 #include "utils.h"
 #include "Log.h"
@@ -13,6 +14,7 @@
 #include "StatAgentClient.h"
 #include "StatSystemIids.h"
 #include "NameFilter.h"
+#include "ProcFile.h"
 
 
 static NameFilter netNameFilter;
@@ -46,292 +48,160 @@ static long gapNextPeriodStart(struct timeval *tv, int ftype, int freqs)
 }
 
 
-// parse out at most the first n fields
-static int splitString(char *line, char **arrs, int n)
-{
-	const char *sep = " \t";
-	char *eptr;
-	int i = 0;
+static ProcFile procStat("/proc/stat");
+static ProcFile procLoadAvg("/proc/loadavg");
+static ProcFile procMemInfo("/proc/meminfo");
+static ProcFile procNetDev("/proc/net/dev");
+static ProcFile procDiskStats("/proc/diskstats");
 
-	char *nptr = strtok_r(line, sep, &eptr);
-	while (nptr != NULL && i < n) {
-		arrs[i++] = nptr;
-		nptr = strtok_r(NULL, sep, &eptr);
-	}
+// one interval's gauges, logged in one write; kept to reuse its room
+typedef std::vector<stat_agent_gauge_t> gauge_list_t;
+static gauge_list_t gauges;
 
-	return i;
+static inline void addGauge(int16_t iid, int64_t gval)
+{
+	stat_agent_gauge_t gauge = { iid, SGT_SNAPSHOT, gval };
+	gauges.push_back(gauge);
 }
 
-static void collectCpuUsage(struct timeval& tnow)
+static void collectCpuUsage()
 {
-	struct timeval t2; gettimeofday(&t2, NULL);
-	fprintf(stderr, "tnow=%ld, %ld, while t2(real)=%ld, %ld\n", tnow.tv_sec, tnow.tv_usec, t2.tv_sec, t2.tv_usec);
-	static long lastUsr = 0;
-
-	FILE *fp = fopen("/proc/stat", "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open(/proc/stat) for cpu usage failed: %m\n");
-		return;
-	}
-
-	StatAgentClient *cltAgent = StatAgentClient::getInstance();
-	assert(cltAgent != NULL);
-
-	char buf[1024]; // hope buffer is enough for one read
-	while (fgets(buf, sizeof buf, fp) != NULL) {
-		buf[sizeof buf - 1] = 0;
-		char *eptr = buf + strlen(buf);
-		while (eptr >= buf && (eptr[-1] == '\r' || eptr[-1] == '\n'))
-			--eptr;
-		*eptr = 0;
-
-		//     user  nice sys  idl      iowat irq softirq steal guest guest-nice
-		//cpu  26853 20 154637 12695753 21345 0 34601 0 0 0
-		//cpu0 11742 10 104853 6309223 11142 0 18475 0 0 0
-		//cpu1 15110 9 49784 6386529 10203 0 16125 0 0 0
-		if (strncmp(buf, "cpu", 3) != 0)
+	size_t size;
+	char *data = procStat.read(size);
+	if (data == NULL) return;
+
+	//     user  nice sys  idl      iowat irq softirq steal guest guest-nice
+	//cpu  26853 20 154637 12695753 21345 0 34601 0 0 0
+	//cpu0 11742 10 104853 6309223 11142 0 18475 0 0 0
+	//cpu1 15110 9 49784 6386529 10203 0 16125 0 0 0
+	for (ProcScanner scan(data, size); !scan.atEnd(); scan.skipLine()) {
+		if (!scan.startsWith("cpu", 3))
 			continue;
-		int cno = 99;
-		if (buf[3] >= '0' && buf[3] <= '9')
-			cno = strtoul(buf + 3, &eptr, 0);
-		else
-			eptr = buf + 3;
-		long usr = strtoul(eptr + 1, &eptr, 0);
-if (cno == 99) {
-	long delta = usr - lastUsr;
-	fprintf(stderr, "lastUsr=%ld, usr=%ld, delta=%ld\n", lastUsr, usr, delta);
-	lastUsr = usr;
-}
-		long nis = strtoul(eptr + 1, &eptr, 0);
-		long sys = strtoul(eptr + 1, &eptr, 0);
-		long idl = strtoul(eptr + 1, &eptr, 0);
-		long wat = strtoul(eptr + 1, &eptr, 0);
-//		long irq = strtoul(eptr + 1, &eptr, 0);
-//		long softIRQ = strtoul(eptr + 1, &eptr, 0);
-//		long steal = strtoul(eptr + 1, &eptr, 0);
-//		long guest = strtoul(eptr + 1, &eptr, 0);
-//		long guestNice = strtoul(eptr + 1, &eptr, 0);
-
-		cltAgent->logGauge(IID_CPU(cno, CPU_USR), SGT_SNAPSHOT, usr+nis);
-		cltAgent->logGauge(IID_CPU(cno, CPU_SYS), SGT_SNAPSHOT, sys);
-		cltAgent->logGauge(IID_CPU(cno, CPU_IDL), SGT_SNAPSHOT, idl);
-		cltAgent->logGauge(IID_CPU(cno, CPU_WT), SGT_SNAPSHOT, wat);
+		int cno = scan.atDigit() ? (int)scan.readUint() : 99;
+
+		int64_t usr = scan.readUint();
+		int64_t nis = scan.readUint();
+		int64_t sys = scan.readUint();
+		int64_t idl = scan.readUint();
+		int64_t wat = scan.readUint();
+
+		addGauge(IID_CPU(cno, CPU_USR), usr + nis);
+		addGauge(IID_CPU(cno, CPU_SYS), sys);
+		addGauge(IID_CPU(cno, CPU_IDL), idl);
+		addGauge(IID_CPU(cno, CPU_WT), wat);
 	}
-
-	fclose(fp);
-	return;
 }
 
-static void collectLoadAverage(const struct timeval& tv)
+static void collectLoadAverage()
 {
-	FILE *fp = fopen("/proc/loadavg", "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open(/proc/loadavg) for load-avg failed: %m");
-		return;
-	}
-
-	char buf[1024];
-	if (fgets(buf, sizeof buf, fp) != NULL) {
-		buf[sizeof buf - 1] = 0;
-		char *eptr = buf + strlen(buf);
-		while (eptr >= buf && (eptr[-1] == '\r' || eptr[-1] == '\n'))
-			--eptr;
-		*eptr = 0;
-
-		float m1 = strtof(buf, &eptr) * 100;
-		float m5 = strtof(eptr + 1, &eptr) * 100;
-		float m15 = strtof(eptr + 1, &eptr) * 100;
-
-		StatAgentClient *cltAgent = StatAgentClient::getInstance();
-		assert(cltAgent != NULL);
-fprintf(stderr, "load-avg at %ld-%ld: m1=%.2f, m4=%.2f, m15=%.2f\n", tv.tv_sec, tv.tv_usec, m1, m5, m15);
-		cltAgent->logGauge(IID_LOADAVG_1, SGT_SNAPSHOT, m1);
-		cltAgent->logGauge(IID_LOADAVG_5, SGT_SNAPSHOT, m5);
-		cltAgent->logGauge(IID_LOADAVG_15, SGT_SNAPSHOT, m15);
-	}
-
-	fclose(fp);
-	return;
+	size_t size;
+	char *data = procLoadAvg.read(size);
+	if (data == NULL) return;
+
+	// 0.52 0.58 0.59 1/467 12345
+	ProcScanner scan(data, size);
+	int64_t m1 = scan.readFixed(100);
+	int64_t m5 = scan.readFixed(100);
+	int64_t m15 = scan.readFixed(100);
+
+	addGauge(IID_LOADAVG_1, m1);
+	addGauge(IID_LOADAVG_5, m5);
+	addGauge(IID_LOADAVG_15, m15);
 }
 
-static void collectMemoryUsage(const struct timeval& tv)
+static void collectMemoryUsage()
 {
-	FILE *fp = fopen("/proc/meminfo", "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open(/proc/meminfo) for memory usage failed: %m");
-		return;
-	}
-
-	unsigned long total = 0, free = 0, buffers = 0, cached = 0, used;
-	unsigned long swapTotal = 0, swapFree = 0, swapUsed;
-	char buf[1024]; // hope buffer is enough for one read
-	while (fgets(buf, sizeof buf, fp) != NULL) {
-		buf[sizeof buf - 1] = 0;
-		char *eptr = buf + strlen(buf);
-		while (eptr >= buf && (eptr[-1] == '\r' || eptr[-1] == '\n'))
-			--eptr;
-		*eptr = 0;
-
-#define MULTI(v) do { while (*eptr == ' ' || *eptr == '\t') ++eptr; \
-		if (*eptr == 'k' || *eptr == 'K') (v) *= 1024; \
-		else if (*eptr == 'm' || *eptr == 'M') (v) *= 1024 * 1024; } while(0)
-	
-		if (strncmp(buf, "MemTotal:", 9) == 0) {
-			total = strtoul(buf + 9, &eptr, 0);
-			MULTI(total);	
-		}
-		else if (strncmp(buf, "MemFree:", 8) == 0) {
-			free = strtoul(buf + 8, &eptr, 0);
-			MULTI(free);
-		}
-		else if (strncmp(buf, "Buffers:", 8) == 0) {
-			buffers = strtoul(buf + 8, &eptr, 0);
-			MULTI(buffers);
-		}
-		else if (strncmp(buf, "Cached:", 7) == 0) {
-			cached = strtoul(buf + 7, &eptr, 0);
-			MULTI(cached);
-		}
-		else if (strncmp(buf, "SwapTotal:", 10) == 0) {
-			swapTotal = strtoul(buf + 10, &eptr, 0);
-			MULTI(swapTotal);
-		}
-		else if (strncmp(buf, "SwapFree:", 9) == 0) {
-			swapFree = strtoul(buf + 9, &eptr, 0);
-			MULTI(swapFree);
-		}
-#undef MULTI
+	size_t size;
+	char *data = procMemInfo.read(size);
+	if (data == NULL) return;
+
+	uint64_t total = 0, free = 0, buffers = 0, cached = 0, used;
+	uint64_t swapTotal = 0, swapFree = 0, swapUsed;
+
+	// MemTotal:       16318360 kB
+	for (ProcScanner scan(data, size); !scan.atEnd(); scan.skipLine()) {
+		uint64_t *pval;
+		if (scan.startsWith("MemTotal:", 9)) pval = &total;
+		else if (scan.startsWith("MemFree:", 8)) pval = &free;
+		else if (scan.startsWith("Buffers:", 8)) pval = &buffers;
+		else if (scan.startsWith("Cached:", 7)) pval = &cached;
+		else if (scan.startsWith("SwapTotal:", 10)) pval = &swapTotal;
+		else if (scan.startsWith("SwapFree:", 9)) pval = &swapFree;
+		else continue;
+
+		*pval = scan.readUint();
+		*pval *= scan.readUnit();
 	}
 
 	used = total - free - buffers - cached;
 	swapUsed = swapTotal - swapFree;
 
-	StatAgentClient *cltAgent = StatAgentClient::getInstance();
-	assert(cltAgent != NULL);
-
-	cltAgent->logGauge(IID_MEM_USED, SGT_SNAPSHOT, used);
-	cltAgent->logGauge(IID_MEM_FREE, SGT_SNAPSHOT, free);
-	cltAgent->logGauge(IID_MEM_CACHED, SGT_SNAPSHOT, cached);
-	cltAgent->logGauge(IID_MEM_BUFFERS, SGT_SNAPSHOT, buffers);
-	cltAgent->logGauge(IID_SWAP_USED, SGT_SNAPSHOT, swapUsed);
-	cltAgent->logGauge(IID_SWAP_FREE, SGT_SNAPSHOT, swapFree);
-
-	fclose(fp);
-	return;
+	addGauge(IID_MEM_USED, used);
+	addGauge(IID_MEM_FREE, free);
+	addGauge(IID_MEM_CACHED, cached);
+	addGauge(IID_MEM_BUFFERS, buffers);
+	addGauge(IID_SWAP_USED, swapUsed);
+	addGauge(IID_SWAP_FREE, swapFree);
 }
 
-static void collectNetworkUsage(const struct timeval& tv) 
+static void collectNetworkUsage()
 {
-	FILE *fp = fopen("/proc/net/dev", "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open(/proc/net/dev) for network usage failed: %m");
-		return;
-	}
-
-	char buf[1024]; // hope buffer is enough for one read
-	while (fgets(buf, sizeof buf, fp) != NULL) {
-		buf[sizeof buf - 1] = 0;
-		char *eptr = buf + strlen(buf);
-		while (eptr >= buf && (eptr[-1] == '\r' || eptr[-1] == '\n'))
-			--eptr;
-		*eptr = 0;
-
-		// the first two lines are header, discard them
-		// assume there is no ':'
-		char *cptr = strchr(buf, ':');
-		if (cptr == NULL) continue;
-
-		// skip whitespaces
-		char *nptr = buf;
-		while (nptr < cptr && (*nptr == ' ' || *nptr == '\t')) ++nptr;
-		if (nptr >= cptr) {
-			fprintf(stderr, "no net-name found in line: %s\n", buf);
-			continue;
-		}
-
-		*cptr = 0;
-		int nno = netNameFilter.getId(nptr);
+	size_t size;
+	char *data = procNetDev.read(size);
+	if (data == NULL) return;
+
+	// face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed
+	// eno16777736: 412184835  301829    0    0    0     0          0         0  8250721  131693    0    0    0     0       0   0
+	// the first two lines are header without ':', discard them
+	for (ProcScanner scan(data, size); !scan.atEnd(); scan.skipLine()) {
+		char *name = scan.readName(':');
+		if (name == NULL) continue;
+
+		int nno = netNameFilter.getId(name);
 		if (nno < 0) continue;
-		
- 		// face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed
-		// eno16777736: 412184835  301829    0    0    0     0          0         0  8250721  131693    0    0    0     0       0   0
-		char *arrs[16];
-		int n = splitString(cptr + 1, arrs, sizeof(arrs)/sizeof(arrs[0]));
-		if (n < 10) continue;
 
 		// TODO: more data
-		int64_t inBytes, inPkts, outBytes, outPkts;
-		inBytes = strtoul(arrs[0], &eptr, 0);
-		inPkts = strtoul(arrs[1], &eptr, 0);
-		outBytes = strtoul(arrs[8], &eptr, 0);
-		outPkts = strtoul(arrs[9], &eptr, 0);	
-		fprintf(stderr, "%s in-{bytes: %ld, pkts: %ld}, out-{bytes: %ld, pkts: %ld}\n", nptr, inBytes, inPkts, outBytes, outPkts);
-
-		StatAgentClient *cltAgent = StatAgentClient::getInstance();
-		assert(cltAgent != NULL);
-
-		cltAgent->logGauge(IID_NET(nno, NET_T_IN_BYTES), SGT_SNAPSHOT, inBytes);
-		cltAgent->logGauge(IID_NET(nno, NET_T_IN_PKTS), SGT_SNAPSHOT, inPkts);
-		cltAgent->logGauge(IID_NET(nno, NET_T_OUT_BYTES), SGT_SNAPSHOT, outBytes);
-		cltAgent->logGauge(IID_NET(nno, NET_T_OUT_BYTES), SGT_SNAPSHOT, outPkts);
+		int64_t fields[10];
+		for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+			fields[i] = scan.readUint();
+
+		addGauge(IID_NET(nno, NET_T_IN_BYTES), fields[0]);
+		addGauge(IID_NET(nno, NET_T_IN_PKTS), fields[1]);
+		addGauge(IID_NET(nno, NET_T_OUT_BYTES), fields[8]);
+		addGauge(IID_NET(nno, NET_T_OUT_PKTS), fields[9]);
 	}
-
-	fclose(fp);
-	return;
 }
 
-static void collectDiskUsage(const struct timeval& tv)
+static void collectDiskUsage()
 {
-	FILE *fp = fopen("/proc/diskstats", "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open(/proc/diskstats) for disk usage failed: %m");
-		return;
-	}
-
-	char buf[1024]; // hope buffer is enough for one read
-	while (fgets(buf, sizeof buf, fp) != NULL) {
-		buf[sizeof buf - 1] = 0;
-		char *eptr = buf + strlen(buf);
-		while (eptr >= buf && (eptr[-1] == '\r' || eptr[-1] == '\n'))
-			--eptr;
-		*eptr = 0;
-
-		// 8 0 sda 218816 138882 19416939 8584688 44089 264373 4073727 1166561 0 1212670 9743408
-		char *arrs[14];
-		int n = splitString(buf, arrs, sizeof(arrs)/sizeof(arrs[0]));
-		if (n < 11) continue;
-
-		int dno = diskNameFilter.getId(arrs[2]);
+	size_t size;
+	char *data = procDiskStats.read(size);
+	if (data == NULL) return;
+
+	// 8 0 sda 218816 138882 19416939 8584688 44089 264373 4073727 1166561 0 1212670 9743408
+	for (ProcScanner scan(data, size); !scan.atEnd(); scan.skipLine()) {
+		scan.readUint();	// major
+		scan.readUint();	// minor
+		char *name = scan.readName(' ');
+		if (name == NULL) continue;
+
+		int dno = diskNameFilter.getId(name);
 		if (dno < 0) continue;
 
 		// TODO: more data
-		int64_t rCalls, rMerged, rBytes, rTime, wCalls, wMerged, wBytes, wTime;
-		rCalls = strtoul(arrs[3], &eptr, 0);
-		rMerged = strtoul(arrs[4], &eptr, 0);
-		rBytes = strtoul(arrs[5], &eptr, 0);
-		rTime = strtoul(arrs[6], &eptr, 0);
-		wCalls = strtoul(arrs[7], &eptr, 0);
-		wMerged = strtoul(arrs[8], &eptr, 0);
-		wBytes = strtoul(arrs[9], &eptr, 0);
-		wTime = strtoul(arrs[10], &eptr, 0);
-		fprintf(stderr, "%s R-{calls: %ld, merged: %ld}, W-{rcalls: %ld, merged: %ld}\n", arrs[2], rCalls, rMerged, wCalls, wMerged);
-	
-		StatAgentClient *cltAgent = StatAgentClient::getInstance();
-		assert(cltAgent != NULL);
-
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_R_CALLS), SGT_SNAPSHOT, rCalls);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_R_MERGED), SGT_SNAPSHOT, rMerged);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_R_BYTES), SGT_SNAPSHOT, rBytes);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_R_TIME), SGT_SNAPSHOT, rTime);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_W_CALLS), SGT_SNAPSHOT, wCalls);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_W_MERGED), SGT_SNAPSHOT, wMerged);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_W_BYTES), SGT_SNAPSHOT, wBytes);
-		cltAgent->logGauge(IID_DISK(dno, DISK_T_W_TIME), SGT_SNAPSHOT, wTime);
+		int64_t fields[8];
+		for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+			fields[i] = scan.readUint();
+
+		addGauge(IID_DISK(dno, DISK_T_R_CALLS), fields[0]);
+		addGauge(IID_DISK(dno, DISK_T_R_MERGED), fields[1]);
+		addGauge(IID_DISK(dno, DISK_T_R_BYTES), fields[2]);
+		addGauge(IID_DISK(dno, DISK_T_R_TIME), fields[3]);
+		addGauge(IID_DISK(dno, DISK_T_W_CALLS), fields[4]);
+		addGauge(IID_DISK(dno, DISK_T_W_MERGED), fields[5]);
+		addGauge(IID_DISK(dno, DISK_T_W_BYTES), fields[6]);
+		addGauge(IID_DISK(dno, DISK_T_W_TIME), fields[7]);
 	}
-
-	fclose(fp);
-	return;
-	
 }
 
 int main(int argc, char **argv)
@@ -408,11 +278,15 @@ int main(int argc, char **argv)
 		long ms = gapNextPeriodStart(&tv, ftype, freqs);
 		totalSleep(ms);
 	
-		collectCpuUsage(tv);
-		collectLoadAverage(tv);
-		collectMemoryUsage(tv);
-		collectNetworkUsage(tv);
-		collectDiskUsage(tv);
+		gauges.clear();
+		collectCpuUsage();
+		collectLoadAverage();
+		collectMemoryUsage();
+		collectNetworkUsage();
+		collectDiskUsage();
+
+		if (cltAgent->logGauges(gauges.empty() ? NULL : &gauges[0], gauges.size()) < 0)
+			fprintf(stderr, "log %d gauges failed: %m\n", (int)gauges.size());
 	}
 
 	return 0;
@@ -0,0 +1,87 @@
+/* QueryProfile.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __QUERY_PROFILE__H
+#define __QUERY_PROFILE__H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class MemoryBuffer;
+
+// flags of a query request
+#define QUERY_FLAG_PROFILE	0x01	/* return the profile with the result */
+
+// stages of a query, in usec
+#define PROFILE_EXPAND		0	/* series from the catalog */
+#define PROFILE_LOAD		1	/* planning, reading and parsing files */
+#define PROFILE_MERGE		2	/* reducing partial mergers */
+#define PROFILE_COMBINE		3	/* grouping into the combiner */
+#define PROFILE_ENCODE		4	/* encoding and sending the result */
+#define PROFILE_STAGES		5
+
+// counters of a query
+#define PROFILE_FILES_OPENED	0
+#define PROFILE_BYTES_READ	1
+#define PROFILE_RECORDS_PARSED	2	/* items in the range */
+#define PROFILE_RECORDS_SKIPPED	3	/* items read but out of the range */
+#define PROFILE_SERIES_MATCHED	4
+#define PROFILE_COUNTERS	5
+
+//
+// where the time of one query goes. the query thread makes it the
+// current one of its thread and of the tasks it runs, so loading
+// code counts into it without passing it around; counters are added
+// by tasks in parallel.
+//
+class QueryProfile {
+public:
+	QueryProfile();
+public:
+	void addTime(int stage, int64_t usec) { __sync_add_and_fetch(&stages[stage], usec); }
+	void addCount(int counter, int64_t n) { __sync_add_and_fetch(&counters[counter], n); }
+	int64_t getTime(int stage) const { return stages[stage]; }
+	int64_t getCount(int counter) const { return counters[counter]; }
+	int64_t getTotal() const;
+
+	// stageCount, stages, counterCount, counters
+	size_t encodedSize() const;
+	int encodeTo(MemoryBuffer *msg) const;
+	int parseFrom(MemoryBuffer *msg);
+
+	static const char *stageName(int stage);
+	static const char *counterName(int counter);
+
+	static QueryProfile *current();
+	static void setCurrent(QueryProfile *profile);
+
+	// into the current profile of the thread if any
+	static void count(int counter, int64_t n) {
+		QueryProfile *profile = current();
+		if (profile != NULL) profile->addCount(counter, n);
+	}
+
+	static int64_t now();
+private:
+	volatile int64_t stages[PROFILE_STAGES];
+	volatile int64_t counters[PROFILE_COUNTERS];
+};
+
+//
+// time of a scope into a stage of the current profile
+//
+class ProfileStage {
+public:
+	ProfileStage(int _stage) : stage(_stage), profile(QueryProfile::current()) {
+		if (profile != NULL) since = QueryProfile::now();
+	}
+	~ProfileStage() {
+		if (profile != NULL) profile->addTime(stage, QueryProfile::now() - since);
+	}
+private:
+	int stage;
+	QueryProfile *profile;
+	int64_t since;
+};
+
+#endif /* __QUERY_PROFILE__H */
@@ -0,0 +1,71 @@
+/* StatAgentProcessor.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __STAT_COMBINER__H
+#define __STAT_COMBINER__H
+
+#include <stddef.h>
+#include <tr1/unordered_map>
+#include "StatData.h"
+
+//
+// combined stats go as one or more frames, each of the periods
+// [first, first + count) in columns (rcalls are not sent):
+//	flags ftype freqs periodStartTime periodCount first count
+//	gauge-series key * n | (gtype present (offset gval) * present) * n
+//	lcall-series key * m | (present (offset nrets (retcode mresult) * nrets) * present) * m
+// a series is in a frame if it has a value in any period of it
+//
+#define COMBINER_FRAME_LAST		0x01
+#define COMBINER_FRAME_INCOMPLETE	0x02	/* some data could not be loaded */
+
+class StatCombiner {
+public:
+	StatCombiner(int ftype, int freqs, int64_t periodStartTime, int n);
+	~StatCombiner();
+private:
+	StatCombiner(const StatCombiner&);
+	StatCombiner& operator=(const StatCombiner&);
+public:
+	int addItemGauge(const local_key_t& key, const StatItemGauge& gauge);
+	int addMergedGauge(const local_key_t& key, const StatMergedGauge& gauge);
+
+	int addItemLcall(const local_key_t& key, const StatItemLcall& lcall);
+	int addMergedLcall(const local_key_t& key, const StatMergedLcall& lcall);
+
+	int addItemRcall(const rcall_key_t& key, const StatItemRcall& rcall);
+	int addMergedRcall(const rcall_key_t& key, const StatMergedRcall& rcall);
+
+	// one frame, returns 1 for the last frame and 0 for more
+	int parseFrom(MemoryBuffer *msg);
+	// all periods in one frame
+	int encodeTo(MemoryBuffer *msg);
+
+	// periods from first fitting in maxSize bytes, 0 if even one does not
+	int framePeriods(int first, size_t maxSize) const;
+	size_t frameSize(int first, int count) const;
+	int encodeTo(MemoryBuffer *msg, int first, int count, bool last) const;
+	// free periods already sent
+	void clearPeriods(int first, int count);
+private:
+	int64_t periodStart(int64_t timestamp);
+	int periodIndex(int64_t timestamp);
+	int64_t periodLength() const;
+public:
+	int ftype;
+	int freqs;
+
+	int64_t periodStartTime;
+
+	int periodCount;
+	merged_gauge_map_t *mergedGauges;
+	merged_lcall_map_t *mergedLcalls;
+	merged_rcall_map_t *mergedRcalls;
+
+	// some data could not be loaded (a file not read, say), so the
+	// periods may change once it can. sent in each frame, and set by
+	// any frame parsed
+	bool incomplete;
+};
+
+#endif /* __STAT_COMBINER__H */
@@ -20,7 +20,39 @@ enum {
 	CMD_STAT_GET_USER_STATS_REQ,
 	CMD_STAT_GET_USER_STATS_RSP,
 
+	CMD_STAT_GET_CALL_GRAPH_REQ,
+	CMD_STAT_GET_CALL_GRAPH_RSP,
+
+	// health check of a kept connection, no body
+	CMD_STAT_PING_REQ,
+	CMD_STAT_PING_RSP,
+
+	// system stats of a selection pushed as periods close, frames
+	// of the response until unsubscribed, see LIVE_FRAME_ below
+	CMD_STAT_SUBSCRIBE_REQ,
+	CMD_STAT_SUBSCRIBE_RSP,
+
+	CMD_STAT_UNSUBSCRIBE_REQ,
+	CMD_STAT_UNSUBSCRIBE_RSP,
+
+	// system stats of several queries at once, each frame of the
+	// response has the index of its query before the stats
+	CMD_STAT_GET_SYSTEM_STATS_BATCH_REQ,
+	CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP,
+
+	// sent by the storage server to itself when responses built on
+	// other threads are queued for its processor thread, no response
+	CMD_STAT_WAKEUP_REQ,
+	CMD_STAT_WAKEUP_RSP,
+
 	CMD_BUTT
 };
 
+// the first byte of a subscribe response frame
+enum {
+	LIVE_FRAME_ACK = 0,		// id:uint64 of the subscription, the first frame
+	LIVE_FRAME_STATS,		// one closed period, as StatCombiner encodes it
+	LIVE_FRAME_HEARTBEAT		// nothing new, no body
+};
+
 #endif /* __STAT_COMMAND__H */
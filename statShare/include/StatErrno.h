@@ -22,6 +22,10 @@ enum {
 	E_STAT_GET_SYSTEM_STATS_FAILED,
 	E_STAT_OOM,
 	E_STAT_ENCODE_FAILED,
+	E_STAT_SERVER_BUSY,
+	E_STAT_GET_USER_STATS_FAILED,
+	E_STAT_GET_CALL_GRAPH_FAILED,
+	E_STAT_SUBSCRIBE_FAILED,
 
 	E_BUTT
 };
@@ -29,10 +29,13 @@ public:
 
 	int addItemRcall(const StatItemRcall& rcall);
 	int addMergedRcall(const StatMergedRcall& rcall);
+
+	// merge another one of the same ftype/freqs/periodStartTime
+	int addMerger(const StatMerger& other);
 public:
 	void moveAhead(int n);
-private:
 	int64_t periodStart(int64_t timestamp);
+private:
 	int64_t periodAdd(int64_t timestamp, int  count);
 	int periodIndex(int64_t timestamp);
 	int locateIndex(int64_t timestamp);
@@ -52,6 +55,9 @@ public:
 	merged_gauge_map_t *mergedGauges;
 	merged_lcall_map_t *mergedLcalls;
 	merged_rcall_map_t *mergedRcalls;
+
+	// some data could not be loaded, see StatCombiner
+	bool incomplete;
 };
 
 #endif /* __STAT_MERGER__H */
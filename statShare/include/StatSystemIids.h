@@ -43,7 +43,8 @@
 #define NET_T_CONN_ESTABLISHED	4
 #define NET_T_CONN_WAIT		5
 
-#define IID_NET_ALL		99
+// the last no inside [2100, 3000), as 99 would be a disk iid
+#define IID_NET_ALL		89
 
 #define IID_NET(no,type)	(2100+(no)*10+(type))
 #define IID_IS4NET(id)		((id) >= 2100 && (id) < 3000)
@@ -0,0 +1,101 @@
+/* QueryProfile.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <string.h>
+
+#include "MemoryBuffer.h"
+#include "QueryProfile.h"
+
+static __thread QueryProfile *currentProfile = NULL;
+
+static const char *stageNames[PROFILE_STAGES] = {
+	"expand", "load", "merge", "combine", "encode"
+};
+
+static const char *counterNames[PROFILE_COUNTERS] = {
+	"files-opened", "bytes-read", "records-parsed", "records-skipped", "series-matched"
+};
+
+QueryProfile::QueryProfile()
+{
+	for (int i = 0; i < PROFILE_STAGES; ++i) stages[i] = 0;
+	for (int i = 0; i < PROFILE_COUNTERS; ++i) counters[i] = 0;
+}
+
+int64_t QueryProfile::getTotal() const
+{
+	int64_t total = 0;
+	for (int i = 0; i < PROFILE_STAGES; ++i) total += stages[i];
+	return total;
+}
+
+size_t QueryProfile::encodedSize() const
+{
+	return 1 + PROFILE_STAGES * 8 + 1 + PROFILE_COUNTERS * 8;
+}
+
+int QueryProfile::encodeTo(MemoryBuffer *msg) const
+{
+	if (msg->writeUint8(PROFILE_STAGES) < 0) return -1;
+	for (int i = 0; i < PROFILE_STAGES; ++i) {
+		if (msg->writeInt64(stages[i]) < 0) return -1;
+	}
+
+	if (msg->writeUint8(PROFILE_COUNTERS) < 0) return -1;
+	for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+		if (msg->writeInt64(counters[i]) < 0) return -1;
+	}
+
+	return 0;
+}
+
+//
+// stages or counters unknown here (of a newer peer) are skipped
+//
+int QueryProfile::parseFrom(MemoryBuffer *msg)
+{
+	uint8_t count;
+	int64_t value;
+
+	if (msg->readUint8(count) < 0) return -1;
+	for (int i = 0; i < count; ++i) {
+		if (msg->readInt64(value) < 0) return -1;
+		if (i < PROFILE_STAGES) stages[i] = value;
+	}
+
+	if (msg->readUint8(count) < 0) return -1;
+	for (int i = 0; i < count; ++i) {
+		if (msg->readInt64(value) < 0) return -1;
+		if (i < PROFILE_COUNTERS) counters[i] = value;
+	}
+
+	return 0;
+}
+
+const char *QueryProfile::stageName(int stage)
+{
+	return stage >= 0 && stage < PROFILE_STAGES ? stageNames[stage] : "unknown";
+}
+
+const char *QueryProfile::counterName(int counter)
+{
+	return counter >= 0 && counter < PROFILE_COUNTERS ? counterNames[counter] : "unknown";
+}
+
+QueryProfile *QueryProfile::current()
+{
+	return currentProfile;
+}
+
+void QueryProfile::setCurrent(QueryProfile *profile)
+{
+	currentProfile = profile;
+}
+
+int64_t QueryProfile::now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
@@ -0,0 +1,481 @@
+/* StatCombiner.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <assert.h>
+#include <errno.h>
+#include <vector>
+#include <tr1/unordered_set>
+
+#include "MemoryBuffer.h"
+#include "StatCombiner.h"
+
+#define PERIOD_MAX	2
+
+// encoded sizes of frame parts, a key is an ip4 host and sid
+#define FRAME_HEAD_SIZE		(3 + 8 + 4 + 4 + 2 + 4 + 4)
+#define FRAME_KEY_SIZE		(5 + 6)
+#define FRAME_GAUGE_SERIES	(FRAME_KEY_SIZE + 1 + 2)
+#define FRAME_GAUGE_VALUE	(2 + 8)
+#define FRAME_LCALL_SERIES	(FRAME_KEY_SIZE + 2)
+#define FRAME_LCALL_VALUE	(2 + 2)
+#define FRAME_LCALL_RET		(4 + 16)
+#define FRAME_PERIODS_MAX	65535
+
+typedef std::tr1::unordered_set<local_key_t, LocalKeyHash> frame_key_set_t;
+
+StatCombiner::StatCombiner(int _ftype, int _freqs, int64_t _periodStartTime, int _n)
+	: ftype(_ftype), freqs(_freqs), periodStartTime(_periodStartTime),
+	  periodCount(_n), mergedGauges(0), mergedLcalls(0), mergedRcalls(0), incomplete(false)
+{
+	if (periodCount < PERIOD_MAX) periodCount = PERIOD_MAX;
+	
+	mergedGauges = new merged_gauge_map_t[periodCount];
+	mergedLcalls = new merged_lcall_map_t[periodCount];
+	mergedRcalls = new merged_rcall_map_t[periodCount];
+}
+
+StatCombiner::~StatCombiner()
+{
+	delete[] mergedGauges;
+	delete[] mergedLcalls;
+	delete[] mergedRcalls;
+}
+
+int64_t StatCombiner::periodStart(int64_t time)
+{
+	if (ftype == FT_SECOND) {
+		return time / 1000 / freqs * freqs * 1000;
+	}
+
+	if (ftype == FT_MINUTE) {
+		// assume TZ is HOUR
+		return time / 60000 / freqs * freqs * 60000;
+	}
+
+	if (ftype == FT_HOUR) {
+		return time / 3600000 / freqs * freqs * 3600000;
+	}
+
+	if (ftype == FT_DAY) {
+		return time / 86400000 / freqs * freqs * 86400000;
+	}
+
+	assert("TODO" == NULL);
+	return time;
+}
+
+int StatCombiner::periodIndex(int64_t timestamp)
+{
+	int64_t delta = timestamp - periodStartTime;
+	if (ftype == FT_SECOND) return delta / (freqs * 1000);
+	if (ftype == FT_MINUTE) return delta / (freqs * 60000);
+	if (ftype == FT_HOUR) return delta / (freqs * 3600000LL);
+	if (ftype == FT_DAY) return delta / (freqs * 86400000LL);
+
+	assert("TODO" == NULL);
+	return 0;
+}
+
+int64_t StatCombiner::periodLength() const
+{
+	if (ftype == FT_SECOND) return freqs * 1000LL;
+	if (ftype == FT_MINUTE) return freqs * 60000LL;
+	if (ftype == FT_HOUR) return freqs * 3600000LL;
+	if (ftype == FT_DAY) return freqs * 86400000LL;
+
+	return 0;
+}
+
+int StatCombiner::addItemGauge(const local_key_t& key, const StatItemGauge& gauge)
+{
+	return -1;
+}
+
+int StatCombiner::addMergedGauge(const local_key_t& key, const StatMergedGauge& gauge)
+{
+	int64_t periodTime = periodStart(gauge.timestamp);
+	int index = periodIndex(gauge.timestamp);
+	if (index < 0 || index >= periodCount)
+		return -1;
+
+	merged_gauge_map_t& maps = mergedGauges[index];
+	gauge_iterator iter = maps.find(key);
+	if (iter == maps.end()) {
+		StatMergedGauge& mgauge = maps[key];
+		mgauge.timestamp = periodTime;
+		mgauge.hip = key.hip;	// use key's IP and ID
+		mgauge.sid = key.sid;	// ignore gauge's
+		mgauge.ftype = ftype;
+		mgauge.freqs = freqs;
+		mgauge.gtype = gauge.gtype;
+		mgauge.gval = gauge.gval;
+	}
+	else {
+		StatMergedGauge& mgauge = iter->second;
+		if (gauge.gtype == SGT_SNAPSHOT) {
+			mgauge.gtype = gauge.gtype;
+			mgauge.gval += gauge.gval;
+		}
+		else if (gauge.gtype == SGT_DELTA) {
+			// TODO:
+			mgauge.gtype = gauge.gtype;
+			mgauge.gval += gauge.gval;
+		}
+	}
+	
+	return 0;
+}
+
+int StatCombiner::addItemLcall(const local_key_t& key, const StatItemLcall& lcall)
+{
+	return -1;
+}
+
+int StatCombiner::addMergedLcall(const local_key_t& key, const StatMergedLcall& lcall)
+{
+	int64_t periodTime = periodStart(lcall.timestamp);
+	int index = periodIndex(lcall.timestamp);
+	if (index < 0 || index >= periodCount)
+		return -1;
+
+	merged_lcall_map_t& maps = mergedLcalls[index];
+	lcall_iterator iter = maps.find(key);
+	if (iter == maps.end()) {
+		StatMergedLcall& mcalls = maps[key];	// create a new one first
+		mcalls.timestamp = periodTime;
+		mcalls.hip = key.hip;
+		mcalls.sid = key.sid;
+		mcalls.ftype = ftype;
+		mcalls.freqs = freqs;
+
+		mcalls.rets.insert(lcall.rets.begin(), lcall.rets.end());
+	}
+	else {
+		StatMergedLcall& mcalls = iter->second;
+		for (StatMergedLcall::const_iterator iter2 = lcall.rets.begin(); iter2 != lcall.rets.end(); ++iter2) {
+			StatMergedLcall::iterator iter3 = mcalls.rets.find(iter2->first);
+			if (iter3 == mcalls.rets.end()) {
+				mcalls.rets.insert(*iter2);
+			}
+			else {
+				stat_mresult_t& mresult = iter3->second;
+				MRESULT_MERGE(mresult, iter2->second);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int StatCombiner::addItemRcall(const rcall_key_t& key, const StatItemRcall& rcall)
+{
+	return -1;
+}
+
+// param is not const for potential swap
+int StatCombiner::addMergedRcall(const rcall_key_t& key, const StatMergedRcall& rcall)
+{
+	int64_t periodTime = periodStart(rcall.timestamp);
+	int index = periodIndex(rcall.timestamp);
+	if (index < 0 || index >= periodCount)
+		return -1;
+
+	merged_rcall_map_t& maps = mergedRcalls[index];
+	rcall_iterator iter = maps.find(key);
+	if (iter == maps.end()) {
+		StatMergedRcall& mcalls = maps[key];	// insert one
+		mcalls.timestamp = periodTime;
+		mcalls.src_hip = key.src_hip;
+		mcalls.src_sid = key.src_sid;
+		mcalls.dst_hip = key.dst_hip;
+		mcalls.dst_sid = key.dst_sid;
+		mcalls.ftype = ftype;	// use member's frequency
+		mcalls.freqs = freqs;
+
+		mcalls.rets.insert(rcall.rets.begin(), rcall.rets.end());
+	}
+	else {
+		StatMergedRcall& mcalls = iter->second;
+		for (StatMergedRcall::const_iterator iter2 = rcall.rets.begin(); iter2 != rcall.rets.end(); ++iter2) {
+			StatMergedRcall::iterator iter3 = mcalls.rets.find(iter2->first);
+			if (iter3 == mcalls.rets.end()) {
+				mcalls.rets.insert(*iter2);
+			}
+			else {
+				stat_mresult_t& mresult = iter3->second;
+				MRESULT_MERGE(mresult, iter2->second);
+			}
+		}
+	}
+
+	return 0;
+}
+
+//
+// bytes a period adds to a frame whose series so far are in the
+// sets, which take its series too if commit
+//
+static size_t periodSize(const merged_gauge_map_t& gauges, const merged_lcall_map_t& lcalls,
+			 frame_key_set_t& gaugeKeys, frame_key_set_t& lcallKeys, bool commit)
+{
+	size_t size = 0;
+	for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+		if (gaugeKeys.find(iter->first) == gaugeKeys.end()) {
+			size += FRAME_GAUGE_SERIES;
+			if (commit) gaugeKeys.insert(iter->first);
+		}
+		size += FRAME_GAUGE_VALUE;
+	}
+
+	for (const_lcall_iterator iter = lcalls.begin(); iter != lcalls.end(); ++iter) {
+		if (lcallKeys.find(iter->first) == lcallKeys.end()) {
+			size += FRAME_LCALL_SERIES;
+			if (commit) lcallKeys.insert(iter->first);
+		}
+		size += FRAME_LCALL_VALUE + iter->second.rets.size() * FRAME_LCALL_RET;
+	}
+
+	return size;
+}
+
+int StatCombiner::framePeriods(int first, size_t maxSize) const
+{
+	frame_key_set_t gaugeKeys, lcallKeys;
+	size_t size = FRAME_HEAD_SIZE;
+	int count = 0;
+
+	for (int i = first; i < periodCount && count < FRAME_PERIODS_MAX; ++i, ++count) {
+		size_t more = periodSize(mergedGauges[i], mergedLcalls[i], gaugeKeys, lcallKeys, false);
+		if (size + more > maxSize) break;
+
+		size += periodSize(mergedGauges[i], mergedLcalls[i], gaugeKeys, lcallKeys, true);
+	}
+
+	return count;
+}
+
+size_t StatCombiner::frameSize(int first, int count) const
+{
+	frame_key_set_t gaugeKeys, lcallKeys;
+	size_t size = FRAME_HEAD_SIZE;
+
+	for (int i = first; i < first + count && i < periodCount; ++i) {
+		size += periodSize(mergedGauges[i], mergedLcalls[i], gaugeKeys, lcallKeys, true);
+	}
+
+	return size;
+}
+
+static int encodeKey(MemoryBuffer *msg, const local_key_t& key)
+{
+	if (encodeTo(msg, key.hip) < 0 || encodeTo(msg, key.sid) < 0)
+		return -1;
+	return 0;
+}
+
+int StatCombiner::encodeTo(MemoryBuffer *msg, int first, int count, bool last) const
+{
+	if (first < 0 || count < 0 || first + count > periodCount || count > FRAME_PERIODS_MAX)
+		return -1;
+
+	// series of the frame in order of appearance, and their columns
+	typedef std::tr1::unordered_map<local_key_t, size_t, LocalKeyHash> series_index_t;
+	series_index_t gaugeIndex, lcallIndex;
+	std::vector<local_key_t> gaugeKeys, lcallKeys;
+	std::vector<std::vector<std::pair<uint16_t, const StatMergedGauge *> > > gaugeColumns;
+	std::vector<std::vector<std::pair<uint16_t, const StatMergedLcall *> > > lcallColumns;
+
+	for (int i = 0; i < count; ++i) {
+		const merged_gauge_map_t& gauges = mergedGauges[first + i];
+		for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+			series_index_t::iterator index = gaugeIndex.find(iter->first);
+			if (index == gaugeIndex.end()) {
+				index = gaugeIndex.insert(std::make_pair(iter->first, gaugeKeys.size())).first;
+				gaugeKeys.push_back(iter->first);
+				gaugeColumns.resize(gaugeKeys.size());
+			}
+
+			gaugeColumns[index->second].push_back(std::make_pair((uint16_t)i, &iter->second));
+		}
+
+		const merged_lcall_map_t& lcalls = mergedLcalls[first + i];
+		for (const_lcall_iterator iter = lcalls.begin(); iter != lcalls.end(); ++iter) {
+			series_index_t::iterator index = lcallIndex.find(iter->first);
+			if (index == lcallIndex.end()) {
+				index = lcallIndex.insert(std::make_pair(iter->first, lcallKeys.size())).first;
+				lcallKeys.push_back(iter->first);
+				lcallColumns.resize(lcallKeys.size());
+			}
+
+			lcallColumns[index->second].push_back(std::make_pair((uint16_t)i, &iter->second));
+		}
+	}
+
+	uint8_t flags = (last ? COMBINER_FRAME_LAST : 0) | (incomplete ? COMBINER_FRAME_INCOMPLETE : 0);
+	if (msg->writeUint8(flags) < 0
+		|| msg->writeUint8(ftype) < 0 || msg->writeUint8(freqs) < 0
+		|| msg->writeInt64(periodStartTime) < 0 || msg->writeUint32(periodCount) < 0
+			|| msg->writeUint32(first) < 0 || msg->writeUint16(count) < 0)
+		return -1;
+
+	if (msg->writeUint32(gaugeKeys.size()) < 0)
+		return -1;
+	for (size_t k = 0; k < gaugeKeys.size(); ++k) {
+		if (encodeKey(msg, gaugeKeys[k]) < 0) return -1;
+	}
+
+	for (size_t k = 0; k < gaugeColumns.size(); ++k) {
+		// a series keeps its gauge type
+		if (msg->writeUint8(gaugeColumns[k][0].second->gtype) < 0
+			|| msg->writeUint16(gaugeColumns[k].size()) < 0)
+			return -1;
+
+		for (size_t j = 0; j < gaugeColumns[k].size(); ++j) {
+			if (msg->writeUint16(gaugeColumns[k][j].first) < 0
+				|| msg->writeInt64(gaugeColumns[k][j].second->gval) < 0)
+				return -1;
+		}
+	}
+
+	if (msg->writeUint32(lcallKeys.size()) < 0)
+		return -1;
+	for (size_t k = 0; k < lcallKeys.size(); ++k) {
+		if (encodeKey(msg, lcallKeys[k]) < 0) return -1;
+	}
+
+	for (size_t k = 0; k < lcallColumns.size(); ++k) {
+		if (msg->writeUint16(lcallColumns[k].size()) < 0)
+			return -1;
+
+		for (size_t j = 0; j < lcallColumns[k].size(); ++j) {
+			const StatMergedLcall *lcall = lcallColumns[k][j].second;
+			if (msg->writeUint16(lcallColumns[k][j].first) < 0
+				|| msg->writeUint16(lcall->rets.size()) < 0)
+				return -1;
+
+			for (StatMergedLcall::const_iterator iter = lcall->rets.begin(); iter != lcall->rets.end(); ++iter) {
+				if (msg->writeInt32(iter->first) < 0
+					|| msg->writeUint32(iter->second.count) < 0
+					|| msg->writeUint32(iter->second.rsptime) < 0
+					|| msg->writeUint32(iter->second.isize) < 0
+						|| msg->writeUint32(iter->second.osize) < 0)
+					return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int StatCombiner::encodeTo(MemoryBuffer *msg)
+{
+	return encodeTo(msg, 0, periodCount, true);
+}
+
+void StatCombiner::clearPeriods(int first, int count)
+{
+	for (int i = first; i < first + count && i < periodCount; ++i) {
+		merged_gauge_map_t().swap(mergedGauges[i]);
+		merged_lcall_map_t().swap(mergedLcalls[i]);
+		merged_rcall_map_t().swap(mergedRcalls[i]);
+	}
+}
+
+static int parseKey(local_key_t& key, MemoryBuffer *msg)
+{
+	if (parseFrom(key.hip, msg) < 0 || parseFrom(key.sid, msg) < 0)
+		return -1;
+	return 0;
+}
+
+//
+// periods of the frame are added into this one by their timestamps,
+// so the frame and this one may start at different periods
+//
+int StatCombiner::parseFrom(MemoryBuffer *msg)
+{
+	uint8_t flags, frameFtype, frameFreqs;
+	int64_t frameStart;
+	uint32_t frameCount, first, n;
+	uint16_t count, present;
+
+	if (msg->readUint8(flags) < 0 || msg->readUint8(frameFtype) < 0 || msg->readUint8(frameFreqs) < 0
+		|| msg->readInt64(frameStart) < 0 || msg->readUint32(frameCount) < 0
+			|| msg->readUint32(first) < 0 || msg->readUint16(count) < 0)
+		return -1;
+
+	int64_t length = periodLength();
+	if (frameFtype != ftype || frameFreqs != freqs || length <= 0)
+		return -1;
+
+	if (flags & COMBINER_FRAME_INCOMPLETE) incomplete = true;
+
+	// no more keys than bytes left for them
+	std::vector<local_key_t> keys;
+	if (msg->readUint32(n) < 0 || n > (uint32_t)(msg->getWptr() - msg->getRptr()) / FRAME_KEY_SIZE)
+		return -1;
+
+	keys.resize(n);
+	for (uint32_t k = 0; k < n; ++k) {
+		if (parseKey(keys[k], msg) < 0) return -1;
+	}
+
+	for (uint32_t k = 0; k < n; ++k) {
+		uint8_t gtype;
+		if (msg->readUint8(gtype) < 0 || msg->readUint16(present) < 0)
+			return -1;
+
+		for (int j = 0; j < present; ++j) {
+			uint16_t offset;
+			int64_t gval;
+			if (msg->readUint16(offset) < 0 || msg->readInt64(gval) < 0 || offset >= count)
+				return -1;
+
+			StatMergedGauge gauge(frameStart + (first + offset) * length, keys[k].hip, keys[k].sid,
+					ftype, freqs, gtype, gval);
+			addMergedGauge(keys[k], gauge);
+		}
+	}
+
+	if (msg->readUint32(n) < 0 || n > (uint32_t)(msg->getWptr() - msg->getRptr()) / FRAME_KEY_SIZE)
+		return -1;
+
+	keys.resize(n);
+	for (uint32_t k = 0; k < n; ++k) {
+		if (parseKey(keys[k], msg) < 0) return -1;
+	}
+
+	for (uint32_t k = 0; k < n; ++k) {
+		if (msg->readUint16(present) < 0)
+			return -1;
+
+		for (int j = 0; j < present; ++j) {
+			uint16_t offset, nrets;
+			if (msg->readUint16(offset) < 0 || msg->readUint16(nrets) < 0 || offset >= count)
+				return -1;
+
+			StatMergedLcall lcall;
+			lcall.timestamp = frameStart + (first + offset) * length;
+			lcall.hip = keys[k].hip;
+			lcall.sid = keys[k].sid;
+			lcall.ftype = ftype;
+			lcall.freqs = freqs;
+
+			for (int r = 0; r < nrets; ++r) {
+				int32_t retcode;
+				stat_mresult_t mresult;
+				if (msg->readInt32(retcode) < 0
+					|| msg->readUint32(mresult.count) < 0
+					|| msg->readUint32(mresult.rsptime) < 0
+					|| msg->readUint32(mresult.isize) < 0
+						|| msg->readUint32(mresult.osize) < 0)
+					return -1;
+				lcall.rets[retcode] = mresult;
+			}
+
+			addMergedLcall(keys[k], lcall);
+		}
+	}
+
+	return (flags & COMBINER_FRAME_LAST) ? 1 : 0;
+}
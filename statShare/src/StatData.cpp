@@ -84,6 +84,12 @@ static inline int encodeTo(MemoryBuffer *msg, const stat_mresult_t& mresult)
 //
 }; /* helper */
 
+// the ones declared in StatData.h, for the users out of this file
+int parseFrom(stat_ip_t& hip, MemoryBuffer *msg) { return helper::parseFrom(hip, msg); }
+int encodeTo(MemoryBuffer *msg, const stat_ip_t& hip) { return helper::encodeTo(msg, hip); }
+int parseFrom(stat_id_t& sid, MemoryBuffer *msg) { return helper::parseFrom(sid, msg); }
+int encodeTo(MemoryBuffer *msg, const stat_id_t& sid) { return helper::encodeTo(msg, sid); }
+
 int StatItemGauge::parseFrom(MemoryBuffer *msg)
 {
 	long savedRptr = msg->getRptr();
@@ -14,7 +14,7 @@ StatMerger::StatMerger(void *_data, int (*_saveG)(void *, const merged_gauge_map
 		       int _ftype, int _freqs, int _n)
 	: data(_data), saveMergedGauges(_saveG), saveMergedLcalls(_saveL), saveMergedRcalls(_saveR),
 	  ftype(_ftype), freqs(_freqs), periodStartTime(0), latestTimestamp(0),
-	  periodCount(_n), mergedGauges(0), mergedLcalls(0), mergedRcalls(0)
+	  periodCount(_n), mergedGauges(0), mergedLcalls(0), mergedRcalls(0), incomplete(false)
 {
 	if (periodCount < PERIOD_MAX) periodCount = PERIOD_MAX;
 	
@@ -26,7 +26,7 @@ StatMerger::StatMerger(void *_data, int (*_saveG)(void *, const merged_gauge_map
 StatMerger::StatMerger(int _ftype, int _freqs, int64_t _periodStartTime, int _n)
 	: data(NULL), saveMergedGauges(NULL), saveMergedLcalls(NULL), saveMergedRcalls(NULL),
 	  ftype(_ftype), freqs(_freqs), periodStartTime(_periodStartTime), latestTimestamp(0),
-	  periodCount(_n), mergedGauges(0), mergedLcalls(0), mergedRcalls(0)
+	  periodCount(_n), mergedGauges(0), mergedLcalls(0), mergedRcalls(0), incomplete(false)
 {
 	if (periodCount < PERIOD_MAX) periodCount = PERIOD_MAX;
 
@@ -53,6 +53,15 @@ int64_t StatMerger::periodStart(int64_t time)
 		return time / 60000 / freqs * freqs * 60000;
 	}
 
+	// hours and days are aligned with UTC like minutes
+	if (ftype == FT_HOUR) {
+		return time / 3600000 / freqs * freqs * 3600000;
+	}
+
+	if (ftype == FT_DAY) {
+		return time / 86400000 / freqs * freqs * 86400000;
+	}
+
 	assert("TODO" == NULL);
 	return time;
 }
@@ -61,6 +70,8 @@ int64_t StatMerger::periodAdd(int64_t timestamp, int  count)
 {
 	if (ftype == FT_SECOND) return timestamp + count * 1000;
 	if (ftype == FT_MINUTE) return timestamp + count * 60000;
+	if (ftype == FT_HOUR) return timestamp + count * 3600000LL;
+	if (ftype == FT_DAY) return timestamp + count * 86400000LL;
 
 	assert("TODO" == NULL);
 	return timestamp;
@@ -71,6 +82,8 @@ int StatMerger::periodIndex(int64_t timestamp)
 	int64_t delta = timestamp - periodStartTime;
 	if (ftype == FT_SECOND) return delta / (freqs * 1000);
 	if (ftype == FT_MINUTE) return delta / (freqs * 60000);
+	if (ftype == FT_HOUR) return delta / (freqs * 3600000LL);
+	if (ftype == FT_DAY) return delta / (freqs * 86400000LL);
 
 	assert("TODO" == NULL);
 	return 0;
@@ -141,12 +154,15 @@ void StatMerger::moveAhead(int n)
 	}
 
 	// clear the rest
-	for (int i = n; i < periodCount; ++i) {
+	for (int i = periodCount - n; i < periodCount; ++i) {
+		if (i < 0) continue;
 		mergedGauges[i].clear();
 		mergedLcalls[i].clear();
 		mergedRcalls[i].clear();
 	}
 
+	if (periodStartTime != 0)
+		periodStartTime = periodAdd(periodStartTime, n);
 	return;
 }
 
@@ -276,11 +292,11 @@ int StatMerger::addMergedLcall(const StatMergedLcall& lcall)
 		for (StatMergedLcall::const_iterator iter2 = lcall.rets.begin(); iter2 != lcall.rets.end(); ++iter2) {
 			StatMergedLcall::iterator iter3 = mcalls.rets.find(iter2->first);
 			if (iter3 == mcalls.rets.end()) {
-				MRESULT_FIRST(iter3->second, iter2->second);
+				mcalls.rets.insert(*iter2);
 			}
 			else {
 				stat_mresult_t& mresult = iter3->second;
-				MRESULT_AVG(mresult, iter2->second);
+				MRESULT_MERGE(mresult, iter2->second);
 			}
 		}
 	}
@@ -351,11 +367,11 @@ int StatMerger::addMergedRcall(const StatMergedRcall& rcall)
 		for (StatMergedRcall::const_iterator iter2 = rcall.rets.begin(); iter2 != rcall.rets.end(); ++iter2) {
 			StatMergedRcall::iterator iter3 = mcalls.rets.find(iter2->first);
 			if (iter3 == mcalls.rets.end()) {
-				MRESULT_FIRST(iter3->second, iter2->second);
+				mcalls.rets.insert(*iter2);
 			}
 			else {
 				stat_mresult_t& mresult = iter3->second;
-				MRESULT_AVG(mresult, iter2->second);
+				MRESULT_MERGE(mresult, iter2->second);
 			}
 		}
 	}
@@ -363,3 +379,33 @@ int StatMerger::addMergedRcall(const StatMergedRcall& rcall)
 	return 0;
 }
 
+int StatMerger::addMerger(const StatMerger& other)
+{
+	if (other.ftype != ftype || other.freqs != freqs || other.periodStartTime != periodStartTime) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < other.periodCount; ++i) {
+		for (merged_gauge_map_t::const_iterator iter = other.mergedGauges[i].begin();
+			iter != other.mergedGauges[i].end();
+				++iter) {
+			addMergedGauge(iter->second);
+		}
+
+		for (merged_lcall_map_t::const_iterator iter = other.mergedLcalls[i].begin();
+			iter != other.mergedLcalls[i].end();
+				++iter) {
+			addMergedLcall(iter->second);
+		}
+
+		for (merged_rcall_map_t::const_iterator iter = other.mergedRcalls[i].begin();
+			iter != other.mergedRcalls[i].end();
+				++iter) {
+			addMergedRcall(iter->second);
+		}
+	}
+
+	if (other.incomplete) incomplete = true;
+	return 0;
+}
@@ -0,0 +1,105 @@
+/* Compactor.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "Log.h"
+#include "FileStorage.h"
+#include "Compactor.h"
+
+int SeriesRewriteItem::save(FileStorage& storage, int partition)
+{
+	int64_t bytes = 0;
+	int retval = storage.rewriteSeriesFile(path.c_str(), dropBefore, insert, bytes);
+	if (retval == 0 && reclaimed != NULL)
+		__sync_add_and_fetch(reclaimed, bytes);
+
+	if (group != NULL) group->done();
+	return retval;
+}
+
+Compactor::Compactor(FileStorage& _storage, ingest_dispatch_t _dispatch, void *_arg)
+	: storage(_storage), dispatch(_dispatch), arg(_arg), tid(0), isRunning(false), totalReclaimed(0)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Compactor::~Compactor()
+{
+	stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int Compactor::start(const compact_policy_t& _policy)
+{
+	policy = _policy;
+	if (policy.interval <= 0) policy.interval = 3600;
+
+	isRunning = true;
+	errno = pthread_create(&tid, NULL, __compactorEntry, (void *)this);
+	if (errno != 0) {
+		APPLOG_ERROR("create compactor thread failed: %m");
+		isRunning = false;
+		tid = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// a running compaction is finished first, it waits for the writers
+//
+void Compactor::stop()
+{
+	if (tid == 0) return;
+
+	pthread_mutex_lock(&lock);
+	isRunning = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(tid, NULL);
+	tid = 0;
+}
+
+void *Compactor::__compactorEntry(void *p)
+{
+	Compactor *compactor = (Compactor *)p;
+	compactor->compactorLoop();
+	return NULL;
+}
+
+void Compactor::compactorLoop()
+{
+	while (1) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		struct timespec ts;
+		ts.tv_sec = tv.tv_sec + policy.interval;
+		ts.tv_nsec = tv.tv_usec * 1000;
+
+		pthread_mutex_lock(&lock);
+		while (isRunning && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT)
+			;
+		bool running = isRunning;
+		pthread_mutex_unlock(&lock);
+
+		if (!running) break;
+
+		compact_stats_t stats;
+		int retval = storage.compact(policy, dispatch, arg, stats);
+		totalReclaimed += stats.bytesReclaimed;
+
+		APPLOG_INFO("compaction %s: %ld years and %ld files removed, %ld files rewritten, "
+			"%ld rollup buckets backfilled, %lld bytes reclaimed (%lld in total)",
+			retval < 0 ? "partly failed" : "done", stats.yearsRemoved, stats.filesRemoved,
+			stats.filesRewritten, stats.bucketsBackfilled, (long long)stats.bytesReclaimed,
+			(long long)totalReclaimed);
+	}
+}
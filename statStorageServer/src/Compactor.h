@@ -0,0 +1,88 @@
+/* Compactor.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __COMPACTOR__H
+#define __COMPACTOR__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#include "IngestWriter.h"
+#include "WorkerPool.h"
+
+class FileStorage;
+
+typedef struct compact_policy_tag {
+	int minuteDays;		// minute data older than it is dropped after rollups, 0 to keep
+	int retainYears;	// years kept including this one, 0 to keep all
+	int maxDays;		// days backfilled into rollups at most per run
+	int interval;		// seconds between runs
+} compact_policy_t;
+
+typedef struct compact_stats_tag {
+	long yearsRemoved;
+	long filesRemoved;
+	long filesRewritten;
+	long bucketsBackfilled;
+	int64_t bytesReclaimed;	// rewritten files' shrink included
+} compact_stats_t;
+
+// hands an item to the writer of the partition, or saves it in place
+typedef void (*ingest_dispatch_t)(void *arg, int partition, IngestItem *item);
+
+//
+// rewrite a series file on the writer owning it, so no one appends
+// to it meanwhile: drop items before dropBefore and merge in insert
+// (items in the file format, in time order)
+//
+class SeriesRewriteItem : public IngestItem {
+public:
+	SeriesRewriteItem(const std::string& _path, int64_t _dropBefore, TaskGroup *_group, int64_t *_reclaimed)
+		: path(_path), dropBefore(_dropBefore), group(_group), reclaimed(_reclaimed) { /* nothing */ }
+public:
+	virtual int save(FileStorage& storage, int partition);
+public:
+	std::string path;
+	int64_t dropBefore;
+	std::string insert;
+private:
+	TaskGroup *group;
+	int64_t *reclaimed;
+};
+
+//
+// runs FileStorage::compact() by the policy now and then on its own
+// thread, reads like a query and writes old data nobody else does,
+// or on the writers through dispatch
+//
+class Compactor {
+public:
+	Compactor(FileStorage& _storage, ingest_dispatch_t _dispatch, void *_arg);
+	~Compactor();
+private:
+	Compactor(const Compactor&);
+	Compactor& operator=(const Compactor&);
+public:
+	int start(const compact_policy_t& _policy);
+	void stop();
+
+	int64_t getReclaimedBytes() const { return totalReclaimed; }
+private:
+	static void *__compactorEntry(void *p);
+	void compactorLoop();
+private:
+	FileStorage& storage;
+	ingest_dispatch_t dispatch;
+	void *arg;
+	compact_policy_t policy;
+
+	pthread_t tid;
+	volatile bool isRunning;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	int64_t totalReclaimed;
+};
+
+#endif /* __COMPACTOR__H */
@@ -0,0 +1,185 @@
+/* Downsample.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "Log.h"
+#include "StatData.h"
+#include "StatCombiner.h"
+#include "StatSystemIids.h"
+#include "Downsample.h"
+
+typedef struct series_range_tag {
+	double low;
+	double high;
+} series_range_t;
+
+typedef std::tr1::unordered_map<local_key_t, series_range_t, LocalKeyHash> series_range_map_t;
+
+typedef struct series_mean_tag {
+	double sum;
+	int count;
+	series_mean_tag() : sum(0), count(0) {}
+} series_mean_t;
+
+typedef std::tr1::unordered_map<local_key_t, series_mean_t, LocalKeyHash> series_mean_map_t;
+
+// periods of a series in a bucket farthest above and below its mean
+typedef struct series_extreme_tag {
+	int highest;
+	int lowest;
+	double highDeviation;
+	double lowDeviation;
+	series_extreme_tag() : highest(-1), lowest(-1), highDeviation(0), lowDeviation(0) {}
+} series_extreme_t;
+
+typedef std::tr1::unordered_map<local_key_t, series_extreme_t, LocalKeyHash> series_extreme_map_t;
+
+// periods where a series keeps its points
+typedef std::tr1::unordered_map<local_key_t, std::vector<bool>, LocalKeyHash> series_keep_map_t;
+
+// cumulative values, their points are increases over a period
+static bool isCounter(int iid)
+{
+	if (IID_IS4CPU(iid) || IID_IS4DISK(iid))
+		return true;
+
+	if (IID_IS4NET(iid)) {
+		int type = (iid - IID_NET(0, 0)) % 10;
+		return type != NET_T_CONN_ESTABLISHED && type != NET_T_CONN_WAIT;
+	}
+
+	return false;
+}
+
+// the point of a series at period i, false if it has none there
+static bool pointOf(const StatCombiner& combiner, int i, const_gauge_iterator iter, double& value)
+{
+	if (!isCounter(iter->first.sid.iid)) {
+		value = (double)iter->second.gval;
+		return true;
+	}
+
+	const merged_gauge_map_t& prev = combiner.mergedGauges[i - 1];
+	const_gauge_iterator piter = prev.find(iter->first);
+	if (piter == prev.end())
+		return false;
+
+	value = (double)(iter->second.gval - piter->second.gval);
+	return true;
+}
+
+int downsampleSystemStats(StatCombiner& combiner, int maxPoints)
+{
+	int points = combiner.periodCount - 1;
+	if (maxPoints <= 0 || points <= maxPoints)
+		return combiner.periodCount;
+
+	// pass 1: range of each series over the whole query
+	series_range_map_t ranges;
+	bool counters = false;
+	for (int i = 1; i < combiner.periodCount; ++i) {
+		const merged_gauge_map_t& gauges = combiner.mergedGauges[i];
+		for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+			double value;
+			if (!pointOf(combiner, i, iter, value))
+				continue;
+
+			if (!counters && isCounter(iter->first.sid.iid))
+				counters = true;
+
+			series_range_map_t::iterator riter = ranges.find(iter->first);
+			if (riter == ranges.end()) {
+				series_range_t range = { value, value };
+				ranges.insert(std::make_pair(iter->first, range));
+			}
+			else if (value < riter->second.low) {
+				riter->second.low = value;
+			}
+			else if (value > riter->second.high) {
+				riter->second.high = value;
+			}
+		}
+	}
+
+	// pass 2: periods of a bucket where each series is the farthest
+	// above or below its mean in the bucket, scaled by its range in
+	// the query. two of them, with the ones before for counters, so
+	// no series has more than maxPoints points
+	int buckets = maxPoints / (counters ? 4 : 2);
+	if (buckets < 1) buckets = 1;
+
+	series_keep_map_t keeps;
+	for (int b = 0; b < buckets; ++b) {
+		int first = 1 + (int)((int64_t)b * points / buckets);
+		int last = 1 + (int)((int64_t)(b + 1) * points / buckets);
+
+		series_mean_map_t means;
+		for (int i = first; i < last; ++i) {
+			const merged_gauge_map_t& gauges = combiner.mergedGauges[i];
+			for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+				double value;
+				if (!pointOf(combiner, i, iter, value))
+					continue;
+
+				series_mean_t& mean = means[iter->first];
+				mean.sum += value;
+				++mean.count;
+			}
+		}
+
+		series_extreme_map_t extremes;
+		for (int i = first; i < last; ++i) {
+			const merged_gauge_map_t& gauges = combiner.mergedGauges[i];
+			for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+				double value;
+				if (!pointOf(combiner, i, iter, value))
+					continue;
+
+				const series_range_t& range = ranges[iter->first];
+				const series_mean_t& mean = means[iter->first];
+				double deviation = range.high > range.low
+					? (value - mean.sum / mean.count) / (range.high - range.low) : 0;
+
+				series_extreme_t& extreme = extremes[iter->first];
+				if (extreme.highest < 0 || deviation > extreme.highDeviation) {
+					extreme.highest = i;
+					extreme.highDeviation = deviation;
+				}
+				if (extreme.lowest < 0 || deviation < extreme.lowDeviation) {
+					extreme.lowest = i;
+					extreme.lowDeviation = deviation;
+				}
+			}
+		}
+
+		for (series_extreme_map_t::const_iterator iter = extremes.begin(); iter != extremes.end(); ++iter) {
+			std::vector<bool>& keep = keeps[iter->first];
+			if (keep.empty()) keep.resize(combiner.periodCount, false);
+
+			keep[iter->second.highest] = keep[iter->second.lowest] = true;
+			if (isCounter(iter->first.sid.iid))
+				keep[iter->second.highest - 1] = keep[iter->second.lowest - 1] = true;
+		}
+	}
+
+	// pass 3: drop the other points of each series, period 0 is kept
+	// as the one before the first for counters
+	int kept = 1;
+	for (int i = 1; i < combiner.periodCount; ++i) {
+		merged_gauge_map_t& gauges = combiner.mergedGauges[i];
+		for (gauge_iterator iter = gauges.begin(); iter != gauges.end(); ) {
+			series_keep_map_t::const_iterator kiter = keeps.find(iter->first);
+			if (kiter == keeps.end() || !kiter->second[i]) gauges.erase(iter++);
+			else ++iter;
+		}
+
+		if (gauges.empty()) combiner.clearPeriods(i, 1);
+		else ++kept;
+	}
+
+	APPLOG_DEBUG("downsampled %d periods of %d series to %d for %d points",
+		combiner.periodCount, (int)ranges.size(), kept, maxPoints);
+	return kept;
+}
@@ -0,0 +1,22 @@
+/* Downsample.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __DOWNSAMPLE__H
+#define __DOWNSAMPLE__H
+
+class StatCombiner;
+
+//
+// system stats of a query thinned to at most maxPoints points per
+// series, after merging. periods [1, periodCount) are the points,
+// period 0 is the one before the range asked for. the periods are
+// cut into buckets, and in each a series keeps its points at the two
+// periods where it is farthest above or below its mean there,
+// relative to its range in the whole query, so its peaks survive;
+// its other points are dropped. counters (cpu, net, disk) are taken
+// by their increase since the period before, whose point is kept
+// too. returns the number of periods with points left.
+//
+int downsampleSystemStats(StatCombiner& combiner, int maxPoints);
+
+#endif /* __DOWNSAMPLE__H */
@@ -13,6 +13,8 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <algorithm>
+#include <queue>
 
 #include "utils.h"
 #include "Log.h"
@@ -22,6 +24,8 @@
 #include "StatMerger.h"
 #include "StatCombiner.h"
 #include "StatSystemIids.h"
+#include "QueryProfile.h"
+#include "WorkerPool.h"
 #include "FileStorage.h"
 
 char *FileStorage::frq2str(char *buf, size_t size, uint8_t ftype, uint8_t freqs)
@@ -74,7 +78,7 @@ char *FileStorage::makePath(char *path, size_t size, const char *typeString, int
 		typeString, sid.pid, sid.mid, sid.iid,
 		hip2str(buf1, sizeof buf1, hip),
 		frq2str(buf2, sizeof buf2, ftype, freqs));
-	path[sizeof path - 1] = 0;
+	path[size - 1] = 0;
 
 	return path;
 }
@@ -94,12 +98,115 @@ char *FileStorage::makePath(char *path, size_t size, const char *typeString, int
 		dst_sid.pid, dst_sid.mid, dst_sid.iid,
 		hip2str(buf2, sizeof buf2, dst_hip),
 		frq2str(buf3, sizeof buf3, ftype, freqs));
-	path[sizeof path - 1] = 0;
+	path[size - 1] = 0;
 
 	return path;
 }
 
-int FileStorage::saveStatData(char *path, unsigned char *data, size_t size)
+//
+// a segment holds a day of minute data, a month of hourly or a year
+// of daily rollups, named by the first day of it
+//
+char *FileStorage::makeSegmentPath(char *path, size_t size, const char *typeString, int64_t timestamp,
+				   const stat_id_t& sid, uint8_t ftype, uint8_t freqs)
+{
+	time_t tsecs = timestamp / 1000;
+	struct tm tmbuf, *ptm = localtime_r(&tsecs, &tmbuf);
+	int mon = ptm->tm_mon + 1, mday = ptm->tm_mday;
+
+	if (ftype == FT_HOUR || ftype == FT_DAY) mday = 1;
+	if (ftype == FT_DAY) mon = 1;
+
+	if (ftype == FT_MINUTE && freqs == 1) {
+		/* DIR/YEAR/PID/MID/SEG_TYPE_PID_MID_YYYYMMDD.seg */
+		snprintf(path, size, "%s%04d/%04x/%04x/SEG_%s_%04x_%04x_%04d%02d%02d.seg",
+			baseDir.c_str(), ptm->tm_year + 1900, sid.pid, sid.mid,
+			typeString, sid.pid, sid.mid,
+			ptm->tm_year + 1900, mon, mday);
+	}
+	else {
+		/* DIR/YEAR/PID/MID/SEG_TYPE_PID_MID_FREQ_YYYYMMDD.seg */
+		char buf[32];
+		snprintf(path, size, "%s%04d/%04x/%04x/SEG_%s_%04x_%04x_%s_%04d%02d%02d.seg",
+			baseDir.c_str(), ptm->tm_year + 1900, sid.pid, sid.mid,
+			typeString, sid.pid, sid.mid, frq2str(buf, sizeof buf, ftype, freqs),
+			ptm->tm_year + 1900, mon, mday);
+	}
+	path[size - 1] = 0;
+
+	return path;
+}
+
+// local start times of the segments of ftype in [start, end)
+void FileStorage::segmentChunks(std::vector<int64_t>& chunks, uint8_t ftype, int64_t start, int64_t end)
+{
+	time_t tsecs = start / 1000;
+	struct tm tmbuf;
+	localtime_r(&tsecs, &tmbuf);
+	tmbuf.tm_hour = tmbuf.tm_min = tmbuf.tm_sec = 0;
+	if (ftype == FT_HOUR || ftype == FT_DAY) tmbuf.tm_mday = 1;
+	if (ftype == FT_DAY) tmbuf.tm_mon = 0;
+	tmbuf.tm_isdst = -1;
+
+	for (time_t chunk = mktime(&tmbuf); (int64_t)chunk * 1000 < end; chunk = mktime(&tmbuf)) {
+		chunks.push_back((int64_t)chunk * 1000);
+		if (ftype == FT_DAY) tmbuf.tm_year += 1;
+		else if (ftype == FT_HOUR) tmbuf.tm_mon += 1;
+		else tmbuf.tm_mday += 1;
+		tmbuf.tm_isdst = -1;
+	}
+}
+
+// memtable key of a series in a segment, sorted after its segment
+void FileStorage::makeMemKey(std::string& memKey, const char *segmentPath, const local_key_t& key)
+{
+	char buf1[128], buf2[256];
+	xsnprintf(buf2, sizeof buf2, "#%04x_%s", key.sid.iid, hip2str(buf1, sizeof buf1, key.hip));
+
+	memKey = segmentPath;
+	memKey += buf2;
+}
+
+int FileStorage::appendSegment(const char *path, const segment_series_list_t& series)
+{
+	int fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0664);
+	if (fd < 0) {
+		char dpath[PATH_MAX];
+		xsnprintf(dpath, sizeof dpath, "%s", path);
+		makeDirectory(dpath);
+		fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0664);
+	}
+
+	if (fd < 0) {
+		APPLOG_WARN("open segment(%s) failed: %m, give up", path);
+		return -1;
+	}
+
+	int retval = SegmentFile::append(fd, path, series);
+	close(fd);
+	return retval;
+}
+
+//
+// ..._5m.bin -> ..._5m.late, items appended in any time order, so
+// never time indexed but read all
+//
+char *FileStorage::makeLatePath(char *late, size_t size, const char *path)
+{
+	size_t len = strlen(path);
+	if (len > 4 && strcmp(path + len - 4, ".bin") == 0)
+		len -= 4;
+	xsnprintf(late, size, "%.*s.late", (int)len, path);
+	return late;
+}
+
+static bool isLatePath(const char *path)
+{
+	size_t len = strlen(path);
+	return len > 5 && strcmp(path + len - 5, ".late") == 0;
+}
+
+int FileStorage::saveStatData(char *path, int64_t timestamp, unsigned char *data, size_t size)
 {
 	int fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0664);
 	if (fd < 0 /*&& errno == ENOENT*/) {
@@ -114,11 +221,15 @@ int FileStorage::saveStatData(char *path, unsigned char *data, size_t size)
 		return -1;
 	}
 
-	int retval = 0;
+	// where this append starts, for the time index
+	off_t offset = lseek(fd, 0, SEEK_END);
+
+	int retval = -1;
 	for (int i = 0; i < 5; ++i) {
 		ssize_t wlen = write(fd, data, size);
 		if (wlen == (ssize_t)size) {
 			// in most cases, should OK
+			retval = 0;
 			break;	
 		}
 
@@ -132,29 +243,76 @@ int FileStorage::saveStatData(char *path, unsigned char *data, size_t size)
 		if (wlen > 0) {
 			APPLOG_FATAL("write into %s just finished partially, in-size=%ld, done-size=%ld",
 					path, (long)size, (long)wlen);
-			retval = -1;
 			break;
 		}
 	}
 
 	close(fd);
+
+	if (retval == 0 && offset >= 0 && !isLatePath(path))
+		timeIndex.onAppend(path, timestamp, offset, size);
 	return retval;
 }
 
-int FileStorage::saveStatData(const char *typeString, int64_t timestamp, const stat_ip_t& hip, 
+int FileStorage::saveStatData(int partition, const char *typeString, int64_t timestamp, const stat_ip_t& hip, 
 			      const stat_id_t& sid, uint8_t ftype, uint8_t freqs,
-			      unsigned char *data, size_t size)
+			      unsigned char *data, size_t size, bool late)
 {
 	// TODO: use GM?
 	time_t tsecs = timestamp / 1000;
 	struct tm tmbuf, *ptm = localtime_r(&tsecs, &tmbuf);
 	char path[PATH_MAX];
 
-	makePath(path, sizeof path, typeString, ptm->tm_year + 1900, sid, hip, ftype, freqs);
-	return saveStatData(path, data, size);
+	if (layout == LAYOUT_SEGMENT) {
+		local_key_t key(hip, sid);
+		std::string memKey;
+		makeSegmentPath(path, sizeof path, typeString, timestamp, sid, ftype, freqs);
+		makeMemKey(memKey, path, key);
+
+		if (partition >= 0 && partition < (int)memtables.size()) {
+			if (memtables[partition]->append(memKey.c_str(), timestamp, data, size, path, &key) < 0)
+				return -1;
+		}
+		else if (partition >= 0 && partition < (int)segmentBatches.size()) {
+			// in one group with the rest of the writer's items
+			addPending(segmentBatches[partition], typeString, timestamp, key, ftype, freqs, data, size);
+		}
+		else {
+			std::string bytes((const char *)data, size);
+			segment_series_t one;
+			one.key = key;
+			one.firstTimestamp = one.lastTimestamp = timestamp;
+			one.data = &bytes;
+
+			if (appendSegment(path, segment_series_list_t(1, one)) < 0)
+				return -1;
+		}
+	}
+	else {
+		makePath(path, sizeof path, typeString, ptm->tm_year + 1900, sid, hip, ftype, freqs);
+		if (late) {
+			char bin[PATH_MAX];
+			xsnprintf(bin, sizeof bin, "%s", path);
+			makeLatePath(path, sizeof path, bin);
+		}
+
+		if (partition >= 0 && partition < (int)memtables.size()) {
+			if (memtables[partition]->append(path, timestamp, data, size) < 0)
+				return -1;
+		}
+		else if (saveStatData(path, timestamp, data, size) < 0) {
+			return -1;
+		}
+	}
+
+	if (!strcmp(typeString, "MG"))
+		gaugeCatalog.add(sid, hip, ptm->tm_year + 1900);
+	else if (!strcmp(typeString, "ML"))
+		lcallCatalog.add(sid, hip, ptm->tm_year + 1900);
+	return 0;
 }
 
-int FileStorage::saveStatData(const char *typeString, int64_t timestamp, const stat_ip_t& src_hip,
+int FileStorage::saveStatData(int partition, const char *typeString, int64_t timestamp, const stat_ip_t& src_hip,
 			      const stat_id_t& src_sid, const stat_ip_t& dst_hip, 
 			      const stat_id_t& dst_sid, uint8_t ftype, uint8_t freqs,
 			      unsigned char *data, size_t dsize)
@@ -166,10 +324,21 @@ int FileStorage::saveStatData(const char *typeString, int64_t timestamp, const s
 
 	makePath(path, sizeof path, typeString, ptm->tm_year + 1900,
 		 src_sid, src_hip, dst_sid, dst_hip, ftype, freqs);
-	return saveStatData(path, data, dsize);
+	if (partition >= 0 && partition < (int)memtables.size()) {
+		if (memtables[partition]->append(path, timestamp, data, dsize) < 0)
+			return -1;
+	}
+	else if (saveStatData(path, timestamp, data, dsize) < 0) {
+		return -1;
+	}
+
+	// queries read minute rcalls only
+	if (ftype == FT_MINUTE && freqs == 1)
+		rcallCatalog.add(rcall_key_t(src_hip, src_sid, dst_hip, dst_sid), ptm->tm_year + 1900);
+	return 0;
 }
 
-int FileStorage::saveMergedGauge(const StatMergedGauge& gauge)
+int FileStorage::saveMergedGauge(const StatMergedGauge& gauge, int partition, bool late)
 {
 	unsigned char data[512];
 	MemoryBuffer msg(data, sizeof data, false);
@@ -180,12 +349,20 @@ int FileStorage::saveMergedGauge(const StatMergedGauge& gauge)
 		return -1;
 	}
 
-	int retval = saveStatData("MG", gauge.timestamp, gauge.hip, gauge.sid, 
-			gauge.ftype, gauge.freqs, msg.data(), msg.getWptr());
+	int retval = saveStatData(partition, "MG", gauge.timestamp, gauge.hip, gauge.sid, 
+			gauge.ftype, gauge.freqs, msg.data(), msg.getWptr(), late);
+	if (retval == 0 && gauge.ftype == FT_MINUTE && gauge.freqs == 1) {
+		hotTier.add(partition, STAT_MERGED_GAUGE, local_key_t(gauge.hip, gauge.sid), gauge.timestamp,
+			msg.data(), msg.getWptr());
+		queryCache.invalidate(gauge.sid.pid, gauge.sid.mid, gauge.timestamp);
+		if (partition >= 0 && partition < (int)rollups.size())
+			rollups[partition]->addGauge(gauge);
+	}
+
 	return retval;
 }
 
-int FileStorage::saveMergedLcall(const StatMergedLcall& lcall)
+int FileStorage::saveMergedLcall(const StatMergedLcall& lcall, int partition, bool late)
 {
 	unsigned char data[8192];
 	MemoryBuffer msg(data, sizeof data, false);
@@ -196,13 +373,21 @@ int FileStorage::saveMergedLcall(const StatMergedLcall& lcall)
 		return -1;
 	}
 
-	int retval = saveStatData("ML", lcall.timestamp, lcall.hip, lcall.sid, 
-			lcall.ftype, lcall.freqs, msg.data(), msg.getWptr());
+	int retval = saveStatData(partition, "ML", lcall.timestamp, lcall.hip, lcall.sid, 
+			lcall.ftype, lcall.freqs, msg.data(), msg.getWptr(), late);
+	if (retval == 0 && lcall.ftype == FT_MINUTE && lcall.freqs == 1) {
+		hotTier.add(partition, STAT_MERGED_LCALL, local_key_t(lcall.hip, lcall.sid), lcall.timestamp,
+			msg.data(), msg.getWptr());
+		queryCache.invalidate(lcall.sid.pid, lcall.sid.mid, lcall.timestamp);
+		if (partition >= 0 && partition < (int)rollups.size())
+			rollups[partition]->addLcall(lcall);
+	}
+
 	return retval;
 }
 
 
-int FileStorage::saveMergedRcall(const StatMergedRcall& rcall)
+int FileStorage::saveMergedRcall(const StatMergedRcall& rcall, int partition)
 {
 	unsigned char data[8192];
 	MemoryBuffer msg(data, sizeof data, false);
@@ -213,269 +398,1141 @@ int FileStorage::saveMergedRcall(const StatMergedRcall& rcall)
 		return -1;
 	}
 
-	int retval = saveStatData("MR", rcall.timestamp, rcall.src_hip, rcall.src_sid, rcall.dst_hip,
+	int retval = saveStatData(partition, "MR", rcall.timestamp, rcall.src_hip, rcall.src_sid, rcall.dst_hip,
 			rcall.dst_sid, rcall.ftype, rcall.freqs, msg.data(), msg.getWptr());
 	return retval;
 }
 
+int FileStorage::partitionOf(const local_key_t& key) const
+{
+	if (partitionCount <= 0) return -1;
+	return LocalKeyHash()(key) % partitionCount;
+}
 
-#define CT_BUSINESS	0
-#define CT_RESOURCE	1
-
-#define GT_DEPARTMENT	0
-#define GT_PRODUCT	1
-#define GT_MODULE	2
-#define GT_HOST		3
+int FileStorage::partitionOf(const rcall_key_t& key) const
+{
+	if (partitionCount <= 0) return -1;
+	return RcallKeyHash()(key) % partitionCount;
+}
 
-#define CEIL(x,u)	(((x) + (u) - 1) / (u) * (u))
-#define FLOOR(x,u)	((x) / (u) * (u))
+char *FileStorage::makeWalPath(char *path, size_t size, int partition)
+{
+	return xsnprintf(path, size, "%swal_%d.log", baseDir.c_str(), partition);
+}
 
-#define MULTIVAL_SEPARATORS	", \t"
+int FileStorage::__replayItem(void *p, const unsigned char *data, size_t size)
+{
+	return ((FileStorage *)p)->replayItem(data, size);
+}
 
-// return -1 when data is not enough
-// return -2 when file content is corrupted (unknown data)
-int FileStorage::parseStatsItem(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger)
+int FileStorage::replayItem(const unsigned char *data, size_t size)
 {
+	MemoryBuffer msg((void *)data, size, false);
+	msg.setWptr(size);
+
 	uint8_t type;
-	if (msg->readUint8(type) < 0) return -1;
+	if (msg.readUint8(type) < 0) return -1;
 
 	switch (type) {
 	case STAT_MERGED_GAUGE: {
 		StatMergedGauge gauge;
-		if (gauge.parseFrom(msg) < 0) return -1;
-		if (gauge.timestamp >= start && gauge.timestamp < end) {
-			merger.addMergedGauge(gauge);
-		}
-
-		break;
+		if (gauge.parseFrom(&msg) < 0) return -1;
+		return saveMergedGauge(gauge);
 	}
 	case STAT_MERGED_LCALL: {
 		StatMergedLcall lcall;
-		if (lcall.parseFrom(msg) < 0) return -1;
-		if (lcall.timestamp >= start && lcall.timestamp < end) {
-			merger.addMergedLcall(lcall);
-		}
-
-		break;
+		if (lcall.parseFrom(&msg) < 0) return -1;
+		return saveMergedLcall(lcall);
 	}
 	case STAT_MERGED_RCALL: {
 		StatMergedRcall rcall;
-		if (rcall.parseFrom(msg) < 0) return -1;
-		if (rcall.timestamp >= start && rcall.timestamp < end) {
-			merger.addMergedRcall(rcall);
-		}
-
-		break;
+		if (rcall.parseFrom(&msg) < 0) return -1;
+		return saveMergedRcall(rcall);
 	}
 	default:
-		APPLOG_FATAL("unknown stat type: %d", (int)type);
-		return -2;
+		APPLOG_ERROR("unknown stat type %d in wal", (int)type);
+		return -1;
 	}
-
-	return 0;
 }
 
-int FileStorage::parseStatsData(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger)
+//
+// items left in logs by the last run are saved into files first,
+// at least once: a crash in the middle of flushing saves some
+// items twice.
+//
+int FileStorage::openMemTables(int count, size_t maxBytes, int64_t maxAge)
 {
-	while (msg->getRptr() + 4 < msg->getWptr()) {
-		long savedRptr = msg->getRptr();
-		int retval;
+	char path[PATH_MAX];
 
-		if ((retval = parseStatsItem(msg, start, end, merger)) == -2) {
-			// unknown data, discard the rest
+	for (int i = 0; i < count || access(makeWalPath(path, sizeof path, i), F_OK) == 0; ++i) {
+		int replayed = MemTable::replay(makeWalPath(path, sizeof path, i), __replayItem, this);
+		if (replayed < 0) {
+			// not to append to it nor rotate over it
+			APPLOG_ERROR("replay %s failed, it is kept for the next start", path);
 			return -1;
 		}
-		else if (retval == -1) {
-			// not a full item, read more and parse again
-			msg->setRptr(savedRptr);
-			break;
+
+		if (replayed > 0) {
+			APPLOG_INFO("%d items replayed from %s", replayed, path);
+		}
+	}
+
+	partitionCount = count;
+	memtableMaxBytes = maxBytes;
+	memtableMaxAge = maxAge;
+	if (maxBytes == 0) {
+		if (layout == LAYOUT_SEGMENT) segmentBatches.resize(count);
+		return 0;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		MemTable *memtable = new MemTable;
+		if (memtable->open(makeWalPath(path, sizeof path, i)) < 0) {
+			delete memtable;
+			closeMemTables();
+			return -1;
 		}
+
+		memtables.push_back(memtable);
 	}
 
 	return 0;
 }
 
-void FileStorage::loadStatsForYear(const stat_id_t& sid, const stat_ip_t& hip, int year, int64_t start, int64_t end, StatMerger& merger)
+void FileStorage::closeMemTables()
 {
-	char path[PATH_MAX];
-	makePath(path, sizeof path, "MG_", year, sid, hip, FT_MINUTE, 1);
-
-	int fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		APPLOG_ERROR("open(%s) failed: %m", path);
-		return;
+	for (size_t i = 0; i < memtables.size(); ++i) {
+		delete memtables[i];
 	}
 
-	unsigned char buf[8192];
-	size_t left = 0;
+	memtables.clear();
+	segmentBatches.clear();
+}
+
+//
+// series files get one append per series, series of the same segment
+// are adjacent (keyed by the segment path first) and get one group.
+// the ones flushed are dropped from memtable, the failed ones stay.
+//
+int FileStorage::flushSeries(memtable_map_t& series, MemTable *memtable)
+{
+	char path[PATH_MAX];
+	int retval = 0;
+	std::vector<std::string> flushed;
 
-	// TODO: narrow down 
+	memtable_map_t::iterator iter = series.begin();
+	while (iter != series.end()) {
+		std::vector<memtable_series_t *> flushing;
 
-	while (1) {
-		ssize_t rlen = read(fd, buf + left, sizeof buf - left);
-		if (rlen > 0) {
-			left += rlen;
-			MemoryBuffer msg(buf, left, false);
-			msg.setWptr(left);
+		if (iter->second.target.empty()) {
+			xsnprintf(path, sizeof path, "%s", iter->first.c_str());
+			flushing.push_back(&iter->second);
+			if (memtable != NULL) memtable->markFlushing(flushing, path);
 
-			if (parseStatsData(&msg, start, end, merger) < 0) {
-				APPLOG_ERROR("parse stats from %s failed", path);
-				break;
+			if (saveStatData(path, iter->second.firstTimestamp,
+					(unsigned char *)iter->second.data.data(), iter->second.data.size()) < 0) {
+				APPLOG_ERROR("flush %ld bytes into %s failed", (long)iter->second.data.size(), path);
+				retval = -1;
+			}
+			else {
+				flushed.push_back(iter->first);
 			}
 
-			left = msg.getWptr() - msg.getRptr();
-			memcpy(buf, buf + msg.getRptr(), left);
+			++iter;
+			continue;
 		}
-		else if (rlen == 0) {
-			if (left > 0) {
-				perror("why left > 0");
-				break;
-			}
 
-			break;
+		std::string target = iter->second.target;
+		segment_series_list_t group;
+		std::vector<std::string> keys;
+		for (; iter != series.end() && iter->second.target == target; ++iter) {
+			segment_series_t one;
+			one.key = iter->second.key;
+			one.firstTimestamp = iter->second.firstTimestamp;
+			one.lastTimestamp = iter->second.lastTimestamp;
+			one.data = &iter->second.data;
+
+			group.push_back(one);
+			flushing.push_back(&iter->second);
+			keys.push_back(iter->first);
 		}
-		else if (rlen < 0 && errno == EINTR) {
-			continue;
+
+		if (memtable != NULL) memtable->markFlushing(flushing, target.c_str());
+		if (appendSegment(target.c_str(), group) < 0) {
+			APPLOG_ERROR("flush %ld series into %s failed", (long)group.size(), target.c_str());
+			retval = -1;
 		}
 		else {
-			perror("read failed");
-			break;
+			flushed.insert(flushed.end(), keys.begin(), keys.end());
 		}
 	}
 
-	return;
+	if (memtable != NULL) memtable->dropFlushed(flushed);
+	return retval;
+}
+
+//
+// items batched since the last flush, by the partition's writer
+//
+int FileStorage::flushSegmentBatch(int partition)
+{
+	memtable_map_t& batch = segmentBatches[partition];
+	if (batch.empty()) return 0;
+
+	int retval = flushSeries(batch, NULL);
+	batch.clear();
+	return retval;
 }
 
-void FileStorage::loadStatsForPeriod(const stat_id_t& sid, const stat_ip_t& hip, int64_t start, int64_t end, StatMerger& merger)
+//
+// called by the partition's writer only, in path order.
+//
+int FileStorage::flushMemTable(int partition, bool force)
 {
-	for (int64_t i = start; i < end; /* next year */) {
-		time_t tsecs = i / 1000;
-		struct tm tmbuf, *ptm = localtime_r(&tsecs, &tmbuf);
-		int year = ptm->tm_year + 1900;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	int64_t now = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
-		loadStatsForYear(sid, hip, year, start, end, merger);
+	hotTier.expire(partition, now);
 
-		// goto next year
-		ptm->tm_year += 1;
-		ptm->tm_mon = 0; ptm->tm_mday = 1;
-		ptm->tm_hour = ptm->tm_min = ptm->tm_sec = 0;
-		ptm->tm_isdst = -1;
-		i = mktime(ptm) * 1000; // how?
+	// closed rollup buckets go with this flush
+	if (partition >= 0 && partition < (int)rollups.size()) {
+		if (force) rollups[partition]->flush();
+		else rollups[partition]->expire(now);
 	}
-} 
 
-int64_t FileStorage::spanLength(int unit, int count)
-{
-	switch (unit) {
-	case FT_SECOND: return count * 1000;
-	case FT_MINUTE: return count * 60 * 1000;
-	case FT_HOUR: return count * 3600 * 1000;
-	case FT_DAY: return count * 24 * 3600 * 1000;
-//	case FT_MONTH: // TODO:
-//	case FT_YEAR:
-	default:
+	if (partition >= 0 && partition < (int)segmentBatches.size())
+		return flushSegmentBatch(partition);
+
+	if (partition < 0 || partition >= (int)memtables.size())
 		return 0;
+
+	MemTable *memtable = memtables[partition];
+	memtable_map_t& frozen = memtable->getFrozen();
+
+	// left by a failed flush, they go before any newer ones
+	if (!frozen.empty()) {
+		long count = frozen.size();
+		if (flushSeries(frozen, memtable) < 0) {
+			APPLOG_ERROR("memtable #%d: %ld of %ld frozen series failed to flush again", partition,
+				(long)frozen.size(), count);
+			return -1;
+		}
+
+		APPLOG_INFO("memtable #%d: %ld frozen series flushed at last", partition, count);
+		memtable->dropFrozen();
 	}
-}
 
-class LocalKeyScanFilter : public ScanFilter {
-public:
-	LocalKeyScanFilter(const char *_prefix, int _pid, int _mid, int _iid, const host_set_t* _hosts)
-		: prefix(_prefix), plen(strlen(_prefix)), pid(_pid), mid(_mid), iid(_iid), hosts(_hosts)
-	{ /* nothing */ }
-public:
-	virtual bool acceptYear(const char *name) { return true; }
-	virtual bool acceptProduct(const char *name) { return pid == 0 || strtol(name, NULL, 16) == pid; }
-	virtual bool acceptModule(const char *name) { return mid == 0 || strtol(name, NULL, 16) == mid; }
-	virtual bool accept(const char *name) {
-		if (strncmp(name, prefix, plen) ) return false;
-	
-		// MG_PID_MID_IID_HOST-IP_1m.bin		
-		char ip[128], *vptr, *eptr;
-		int pid, mid, iid;
-		stat_ip_t hip;
+	if (memtable->size() == 0 || (!force && !memtable->needFlush(memtableMaxBytes, memtableMaxAge, now)))
+		return 0;
 
-		pid = strtol(name + plen, &eptr, 16);
-		if (*eptr != '_') return false;
-		
-		mid = strtol(eptr + 1, &eptr, 16);
-		if (*eptr != '_') return false;
+	long bytes = memtable->size();
+	if (memtable->freeze() < 0) {
+		APPLOG_ERROR("memtable #%d can not be frozen, it goes on with its wal", partition);
+		return -1;
+	}
 
-		iid = strtol(eptr + 1, &eptr, 16);
-		if (*eptr != '_') return false;
-		
-		vptr = eptr + 1;
-		eptr = strchr(vptr, '_');
+	long count = frozen.size();
+	if (flushSeries(frozen, memtable) < 0) {
+		// kept with their log, tried again by the next flush
+		APPLOG_ERROR("memtable #%d: %ld of %ld series failed to flush, keep them", partition,
+			(long)frozen.size(), count);
+		return -1;
+	}
 
-		if (eptr == NULL || eptr - vptr > (int)sizeof(ip) - 1)
-			return false;	// ignore it
-		memcpy(ip, vptr, eptr - vptr);
-		ip[eptr - vptr] = 0;
+	APPLOG_DEBUG("memtable #%d flushed: %ld series, %ld bytes", partition, count, bytes);
+	memtable->dropFrozen();
 
-		if (inet_pton(AF_INET, ip, &hip.ip.ip4) == 1) {
-			hip.ver = 4;
-		}
-		else if (inet_pton(AF_INET6, ip, &hip.ip.ip6[0]) == 1) {
-			hip.ver = 6;
-		}
-		else {
-			APPLOG_ERROR("invlaid ip(%s) in the name component", ip);
-			return false;
+	// what a crash from now on would lose of rollups
+	if (!rollups.empty()) {
+		int64_t openSince = now;
+		for (size_t i = 0; i < rollups.size(); ++i) {
+			int64_t since = rollups[i]->getOpenSince(now);
+			if (since < openSince) openSince = since;
 		}
 
-		if (hosts != NULL && hosts->find(hip) == hosts->end())
-			return false;
-
-		ids.insert(local_key_t(hip, stat_id_t(pid, mid, iid)));
-		return true;
+		saveRollupState(openSince, false);
 	}
 
-public:
-	local_key_set_t ids;
-private:
-	const char *prefix;
-	size_t plen;
-	int pid, mid, iid;
-	const host_set_t *hosts;
-};
+	return 0;
+}
 
-// TODO:
-//class RcallKeyScanFilter : public ScanFilter {
-//};
+char *FileStorage::makeRollupPath(char *path, size_t size, const char *name)
+{
+	return xsnprintf(path, size, "%srollup.%s", baseDir.c_str(), name);
+}
 
-int FileStorage::scanDirectoryModule(ScanFilter *filter, const char *dname)
+//
+// "openSince clean": rollup buckets after openSince may be only in
+// memory, unless the last stop was a clean one
+//
+int FileStorage::saveRollupState(int64_t openSince, bool clean)
 {
-	char path[PATH_MAX];
-	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	makeRollupPath(path, sizeof path, "state");
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.%lx.tmp", path, (unsigned long)pthread_self());
+
+	pthread_mutex_lock(&rollupLock);
+
+	int retval = -1;
+	FILE *fp = fopen(tmpPath, "w");
+	if (fp != NULL) {
+		fprintf(fp, "%lld %d\n", (long long)openSince, clean ? 1 : 0);
+		if (fclose(fp) == 0 && rename(tmpPath, path) == 0)
+			retval = 0;
+	}
 
-	DIR *dir = opendir(path);
-	if (dir == NULL) return -1;
+	pthread_mutex_unlock(&rollupLock);
 
-	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
-	struct dirent *pe;
+	if (retval < 0) {
+		APPLOG_ERROR("save rollup state into %s failed: %m", path);
+		unlink(tmpPath);
+	}
 
-	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
-		if (pe == NULL) break;
-		//if (pe->d_type != DT_REG) continue;
-		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
+	return retval;
+}
 
-		if (!filter->accept(pe->d_name)) continue;
+void FileStorage::addDirtyRollup(int64_t start, int64_t end)
+{
+	dirtyRollups.push_back(rollup_range_t(start, end));
+	std::sort(dirtyRollups.begin(), dirtyRollups.end());
+
+	// merge overlapped ones
+	size_t n = 0;
+	for (size_t i = 1; i < dirtyRollups.size(); ++i) {
+		if (dirtyRollups[i].first <= dirtyRollups[n].second) {
+			if (dirtyRollups[i].second > dirtyRollups[n].second)
+				dirtyRollups[n].second = dirtyRollups[i].second;
+		}
+		else {
+			dirtyRollups[++n] = dirtyRollups[i];
+		}
 	}
 
-	closedir(dir);
-	return 0;
+	dirtyRollups.resize(n + 1);
 }
 
-int FileStorage::scanDirectoryProduct(ScanFilter *filter, const char *dname)
+int FileStorage::loadDirtyRollups()
 {
 	char path[PATH_MAX];
-	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
-
-	DIR *dir = opendir(path);
-	if (dir == NULL) return -1;
+	FILE *fp = fopen(makeRollupPath(path, sizeof path, "dirty"), "r");
+	if (fp == NULL) return errno == ENOENT ? 0 : -1;
 
-	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
-	struct dirent *pe;
+	long long start, end;
+	while (fscanf(fp, "%lld %lld", &start, &end) == 2) {
+		addDirtyRollup(start, end);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+//
+// rollups are only kept while enabled and lose their open buckets
+// at a crash, both are remembered as dirty ranges read from minute
+// data by queries. a missing state means no rollups at all before.
+//
+int FileStorage::openRollups(bool enable)
+{
+	char path[PATH_MAX];
+	int64_t now = (int64_t)time(NULL) * 1000;
+	int64_t openSince = now;
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		int64_t since = RollupSet::windowStart(i, now);
+		if (since < openSince) openSince = since;
+	}
+
+	long long lastSince = 0;
+	int lastClean = 0;
+	bool hasState = false;
+
+	FILE *fp = fopen(makeRollupPath(path, sizeof path, "state"), "r");
+	if (fp != NULL) {
+		hasState = fscanf(fp, "%lld %d", &lastSince, &lastClean) == 2;
+		fclose(fp);
+	}
+
+	if (!enable) {
+		// rollups stop here until enabled again
+		if (hasState && lastClean)
+			saveRollupState(openSince, false);
+		return 0;
+	}
+
+	if (loadDirtyRollups() < 0) {
+		APPLOG_ERROR("load dirty rollups failed: %m, no rollups for queries");
+		return -1;
+	}
+
+	fp = fopen(makeRollupPath(path, sizeof path, "horizon"), "r");
+	if (fp != NULL) {
+		long long horizon;
+		if (fscanf(fp, "%lld", &horizon) == 1) minuteHorizon = horizon;
+		fclose(fp);
+	}
+
+	if (!hasState || !lastClean) {
+		int64_t dirtyStart = hasState ? lastSince : 0;
+		addDirtyRollup(dirtyStart, now);
+
+		fp = fopen(makeRollupPath(path, sizeof path, "dirty"), "a");
+		if (fp == NULL || fprintf(fp, "%lld %lld\n", (long long)dirtyStart, (long long)now) < 0) {
+			APPLOG_ERROR("append dirty rollups into %s failed: %m", path);
+			if (fp != NULL) fclose(fp);
+			return -1;
+		}
+
+		fclose(fp);
+		APPLOG_INFO("rollups in [%lld, %lld) are incomplete, read minute data there",
+			(long long)dirtyStart, (long long)now);
+	}
+
+	if (saveRollupState(openSince, false) < 0)
+		return -1;
+
+	for (int i = 0; i < partitionCount; ++i) {
+		rollups.push_back(new RollupSet(*this, i));
+	}
+
+	return 0;
+}
+
+//
+// writers must be stopped, their open buckets are saved by the last
+// flushMemTable(partition, true)
+//
+void FileStorage::closeRollups()
+{
+	if (rollups.empty()) return;
+
+	for (size_t i = 0; i < rollups.size(); ++i) {
+		rollups[i]->flush();
+		delete rollups[i];
+	}
+
+	rollups.clear();
+	saveRollupState((int64_t)time(NULL) * 1000, true);
+}
+
+
+#define CT_BUSINESS	0
+#define CT_RESOURCE	1
+
+#define GT_DEPARTMENT	0
+#define GT_PRODUCT	1
+#define GT_MODULE	2
+#define GT_HOST		3
+
+#define CEIL(x,u)	(((x) + (u) - 1) / (u) * (u))
+#define FLOOR(x,u)	((x) / (u) * (u))
+
+#define MULTIVAL_SEPARATORS	", \t"
+
+// return -1 when data is not enough
+// return -2 when file content is corrupted (unknown data)
+// return 1 when the item is out of [start, end) and skipped
+int FileStorage::parseStatsItem(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger)
+{
+	uint8_t type;
+	if (msg->readUint8(type) < 0) return -1;
+
+	switch (type) {
+	case STAT_MERGED_GAUGE: {
+		StatMergedGauge gauge;
+		if (gauge.parseFrom(msg) < 0) return -1;
+		if (gauge.timestamp < start || gauge.timestamp >= end)
+			return 1;
+
+		merger.addMergedGauge(gauge);
+		break;
+	}
+	case STAT_MERGED_LCALL: {
+		StatMergedLcall lcall;
+		if (lcall.parseFrom(msg) < 0) return -1;
+		if (lcall.timestamp < start || lcall.timestamp >= end)
+			return 1;
+
+		merger.addMergedLcall(lcall);
+		break;
+	}
+	case STAT_MERGED_RCALL: {
+		StatMergedRcall rcall;
+		if (rcall.parseFrom(msg) < 0) return -1;
+		if (rcall.timestamp < start || rcall.timestamp >= end)
+			return 1;
+
+		merger.addMergedRcall(rcall);
+		break;
+	}
+	default:
+		APPLOG_FATAL("unknown stat type: %d", (int)type);
+		return -2;
+	}
+
+	return 0;
+}
+
+int FileStorage::parseStatsData(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger)
+{
+	int64_t parsed = 0, skipped = 0;
+	int retval = 0;
+
+	while (msg->getRptr() + 4 < msg->getWptr()) {
+		long savedRptr = msg->getRptr();
+		int itemRetval;
+
+		if ((itemRetval = parseStatsItem(msg, start, end, merger)) == -2) {
+			// unknown data, discard the rest
+			retval = -1;
+			break;
+		}
+		else if (itemRetval == -1) {
+			// not a full item, read more and parse again
+			msg->setRptr(savedRptr);
+			break;
+		}
+		else if (itemRetval == 1) {
+			++skipped;
+		}
+		else {
+			++parsed;
+		}
+	}
+
+	QueryProfile::count(PROFILE_RECORDS_PARSED, parsed);
+	QueryProfile::count(PROFILE_RECORDS_SKIPPED, skipped);
+	return retval;
+}
+
+// return -1 when data is not enough
+// return -2 when file content is corrupted (unknown data)
+int FileStorage::parseItemTimestamp(MemoryBuffer *msg, int64_t& timestamp, local_key_t *key, uint8_t *ptype)
+{
+	uint8_t type;
+	if (msg->readUint8(type) < 0) return -1;
+	if (ptype != NULL) *ptype = type;
+
+	switch (type) {
+	case STAT_MERGED_GAUGE: {
+		StatMergedGauge gauge;
+		if (gauge.parseFrom(msg) < 0) return -1;
+		timestamp = gauge.timestamp;
+		if (key != NULL) *key = local_key_t(gauge.hip, gauge.sid);
+		break;
+	}
+	case STAT_MERGED_LCALL: {
+		StatMergedLcall lcall;
+		if (lcall.parseFrom(msg) < 0) return -1;
+		timestamp = lcall.timestamp;
+		if (key != NULL) *key = local_key_t(lcall.hip, lcall.sid);
+		break;
+	}
+	case STAT_MERGED_RCALL: {
+		StatMergedRcall rcall;
+		if (rcall.parseFrom(msg) < 0) return -1;
+		timestamp = rcall.timestamp;
+		if (key != NULL) *key = local_key_t(rcall.src_hip, rcall.src_sid);
+		break;
+	}
+	default:
+		APPLOG_FATAL("unknown stat type: %d", (int)type);
+		return -2;
+	}
+
+	return 0;
+}
+
+//
+// scan the whole file and make the same entries as appending does,
+// taking every item as one append
+//
+int FileStorage::rebuildTimeIndex(const char *path, int fd, time_index_t& entries)
+{
+	unsigned char buf[8192];
+	size_t left = 0;
+	int64_t offset = 0;	// file offset of buf[0]
+
+	entries.clear();
+	if (lseek(fd, 0, SEEK_SET) < 0) return -1;
+
+	while (1) {
+		ssize_t rlen = read(fd, buf + left, sizeof buf - left);
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen < 0) {
+			APPLOG_ERROR("read(%s) for time index failed: %m", path);
+			return -1;
+		}
+		if (rlen == 0)
+			break;
+
+		left += rlen;
+		MemoryBuffer msg(buf, left, false);
+		msg.setWptr(left);
+
+		while (msg.getRptr() < msg.getWptr()) {
+			long savedRptr = msg.getRptr();
+			int64_t timestamp;
+			int retval = parseItemTimestamp(&msg, timestamp);
+
+			if (retval == -2) {
+				APPLOG_ERROR("%s is corrupted at %ld, no time index", path, (long)(offset + savedRptr));
+				return -1;
+			}
+			else if (retval == -1) {
+				msg.setRptr(savedRptr);
+				break;
+			}
+
+			if (timeIndex.needEntry(offset + savedRptr, msg.getRptr() - savedRptr))
+				entries.push_back(time_index_entry_t(timestamp, offset + savedRptr));
+		}
+
+		offset += msg.getRptr();
+		left = msg.getWptr() - msg.getRptr();
+		memmove(buf, buf + msg.getRptr(), left);
+	}
+
+	if (timeIndex.save(path, entries) < 0)
+		return -1;
+
+	APPLOG_INFO("time index of %s rebuilt: %ld entries", path, (long)entries.size());
+	return 0;
+}
+
+// the item at the entry's offset has its timestamp
+bool FileStorage::checkTimeIndexEntry(int fd, int64_t size, const time_index_entry_t& entry)
+{
+	if (entry.offset < 0 || entry.offset >= size)
+		return false;
+
+	unsigned char buf[8192];
+	ssize_t rlen;
+	while ((rlen = pread(fd, buf, sizeof buf, entry.offset)) < 0 && errno == EINTR)
+		/* nothing */;
+	if (rlen <= 0)
+		return false;
+
+	MemoryBuffer msg(buf, rlen, false);
+	msg.setWptr(rlen);
+
+	int64_t timestamp;
+	return parseItemTimestamp(&msg, timestamp) == 0 && timestamp == entry.timestamp;
+}
+
+//
+// an index saved for another version of the file, like one loaded
+// or rebuilt around a compaction rewrite, fails on its first or
+// last entry
+//
+bool FileStorage::checkTimeIndex(int fd, const time_index_t& entries)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return false;
+	if (entries.empty())
+		return st.st_size == 0;
+
+	return checkTimeIndexEntry(fd, st.st_size, entries.front())
+		&& (entries.size() == 1 || checkTimeIndexEntry(fd, st.st_size, entries.back()));
+}
+
+void FileStorage::loadStatsFile(const char *path, int64_t start, int64_t end, StatMerger& merger, int64_t fileLimit)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		// a rollup may be missing where there is minute data
+		if (errno != ENOENT) {
+			APPLOG_ERROR("open(%s) failed: %m", path);
+			merger.incomplete = true;
+		}
+		return;
+	}
+
+	QueryProfile::count(PROFILE_FILES_OPENED, 1);
+
+	// narrow down by the time index, read it all if no index
+	int64_t offset = 0, endOffset = -1;
+	time_index_t entries;
+	bool late = isLatePath(path), indexed = false;
+	if (!late) {
+		// a stale one is rebuilt as well
+		indexed = timeIndex.load(path, entries) == 0 && checkTimeIndex(fd, entries);
+		if (!indexed) indexed = rebuildTimeIndex(path, fd, entries) == 0;
+	}
+
+	if (indexed) {
+		timeIndex.locate(entries, start, end, offset, endOffset);
+	}
+	else if (!late) {
+		APPLOG_WARN("no time index for %s, read it all", path);
+	}
+
+	// the rest is being flushed from memtable, read there
+	if (fileLimit >= 0 && (endOffset < 0 || endOffset > fileLimit))
+		endOffset = fileLimit;
+
+	if (endOffset >= 0 && endOffset <= offset) {
+		close(fd);
+		return;
+	}
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		APPLOG_ERROR("lseek(%s, %ld) failed: %m", path, (long)offset);
+		merger.incomplete = true;
+		close(fd);
+		return;
+	}
+
+	unsigned char buf[8192];
+	size_t left = 0;
+	int64_t startOffset = offset;
+
+	while (endOffset < 0 || offset < endOffset) {
+		size_t size = sizeof buf - left;
+		if (endOffset >= 0 && (int64_t)size > endOffset - offset)
+			size = endOffset - offset;
+
+		ssize_t rlen = read(fd, buf + left, size);
+		if (rlen > 0) {
+			offset += rlen;
+			left += rlen;
+			MemoryBuffer msg(buf, left, false);
+			msg.setWptr(left);
+
+			if (parseStatsData(&msg, start, end, merger) < 0) {
+				APPLOG_ERROR("parse stats from %s failed", path);
+				merger.incomplete = true;
+				break;
+			}
+
+			left = msg.getWptr() - msg.getRptr();
+			memmove(buf, buf + msg.getRptr(), left);
+		}
+		else if (rlen == 0) {
+			break;
+		}
+		else if (rlen < 0 && errno == EINTR) {
+			continue;
+		}
+		else {
+			APPLOG_ERROR("read(%s) failed: %m", path);
+			merger.incomplete = true;
+			break;
+		}
+	}
+
+	if (left > 0) {
+		APPLOG_WARN("%s: %ld bytes left unparsed", path, (long)left);
+	}
+
+	QueryProfile::count(PROFILE_BYTES_READ, offset - startOffset);
+	close(fd);
+	return;
+}
+
+//
+// the file, then its recent items still in memtable, and the same
+// for its late file if a rollup
+//
+void FileStorage::loadSeriesFile(const series_file_t& file, int64_t start, int64_t end, StatMerger& merger)
+{
+	char late[PATH_MAX];
+	const char *paths[2] = { file.path.c_str(), NULL };
+	if (file.withLate)
+		paths[1] = makeLatePath(late, sizeof late, file.path.c_str());
+
+	int partition = file.partition >= 0 ? file.partition : partitionOf(file.key);
+	for (int i = 0; i < 2 && paths[i] != NULL; ++i) {
+		std::string recent;
+		int64_t fileLimit = -1;
+
+		if (partition >= 0 && partition < (int)memtables.size())
+			memtables[partition]->read(paths[i], recent, fileLimit);
+
+		if (fileLimit != 0)
+			loadStatsFile(paths[i], start, end, merger, fileLimit);
+
+		if (!recent.empty()) {
+			MemoryBuffer msg(&recent[0], recent.size(), false);
+			msg.setWptr(recent.size());
+
+			// not on disk yet, may not be the same after a restart
+			merger.incomplete = true;
+			if (parseStatsData(&msg, start, end, merger) < 0) {
+				APPLOG_ERROR("parse stats from memtable of %s failed", paths[i]);
+			}
+		}
+	}
+}
+
+typedef struct segment_load_tag {
+	FileStorage *storage;
+	const char *path;
+	int64_t start;
+	int64_t end;
+	StatMerger *merger;
+} segment_load_t;
+
+int FileStorage::__applySegmentData(void *p, size_t index, const unsigned char *data, size_t size)
+{
+	segment_load_t *load = (segment_load_t *)p;
+	MemoryBuffer msg((void *)data, size, false);
+	msg.setWptr(size);
+
+	QueryProfile::count(PROFILE_BYTES_READ, size);
+
+	if (load->storage->parseStatsData(&msg, load->start, load->end, *load->merger) < 0) {
+		APPLOG_ERROR("parse stats from %s failed", load->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// series [first, last) are in the same segment, walk it once for
+// all of them, then their recent items still in memtables
+//
+void FileStorage::loadSegmentSeries(const series_file_list_t& files, size_t first, size_t last,
+				    int64_t start, int64_t end, StatMerger& merger)
+{
+	const char *path = files[first].path.c_str();
+	segment_read_list_t series(last - first);
+	std::vector<std::string> recents(last - first);
+	std::string memKey;
+
+	for (size_t i = first; i < last; ++i) {
+		segment_read_t& one = series[i - first];
+		one.key = files[i].key;
+		one.fileLimit = -1;
+
+		int partition = partitionOf(one.key);
+		if (partition >= 0 && partition < (int)memtables.size()) {
+			makeMemKey(memKey, path, one.key);
+			memtables[partition]->read(memKey.c_str(), recents[i - first], one.fileLimit);
+		}
+	}
+
+	segment_load_t load;
+	load.storage = this;
+	load.path = path;
+	load.start = start;
+	load.end = end;
+	load.merger = &merger;
+
+	QueryProfile::count(PROFILE_FILES_OPENED, 1);
+	if (SegmentFile::read(path, series, start, end, __applySegmentData, &load) < 0) {
+		APPLOG_WARN("read segment %s failed, some series may be missing", path);
+		merger.incomplete = true;
+	}
+
+	for (size_t i = 0; i < recents.size(); ++i) {
+		if (recents[i].empty()) continue;
+
+		MemoryBuffer msg(&recents[i][0], recents[i].size(), false);
+		msg.setWptr(recents[i].size());
+		merger.incomplete = true;
+		if (parseStatsData(&msg, start, end, merger) < 0) {
+			APPLOG_ERROR("parse stats from memtable of %s failed", path);
+		}
+	}
+}
+
+void FileStorage::loadSeriesRange(const series_file_list_t& files, size_t first, size_t last,
+				  int64_t start, int64_t end, StatMerger& merger)
+{
+	size_t i = first;
+	while (i < last) {
+		if (files[i].layout != LAYOUT_SEGMENT) {
+			loadSeriesFile(files[i], start, end, merger);
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		while (j < last && files[j].layout == LAYOUT_SEGMENT && files[j].path == files[i].path)
+			++j;
+
+		loadSegmentSeries(files, i, j, start, end, merger);
+		i = j;
+	}
+}
+
+int64_t FileStorage::spanLength(int unit, int count)
+{
+	switch (unit) {
+	case FT_SECOND: return count * 1000;
+	case FT_MINUTE: return count * 60 * 1000;
+	case FT_HOUR: return count * 3600 * 1000LL;
+	case FT_DAY: return count * 24 * 3600 * 1000LL;
+//	case FT_MONTH: // TODO:
+//	case FT_YEAR:
+	default:
+		return 0;
+	}
+}
+
+//
+// PID_MID_IID_HOST-IP_ of a file name into key, returns where the
+// rest starts or NULL
+//
+static const char *parseSeriesKey(const char *name, local_key_t& key)
+{
+	char ip[128], *vptr, *eptr;
+	int pid, mid, iid;
+	stat_ip_t hip;
+
+	pid = strtol(name, &eptr, 16);
+	if (*eptr != '_') return NULL;
+	
+	mid = strtol(eptr + 1, &eptr, 16);
+	if (*eptr != '_') return NULL;
+
+	iid = strtol(eptr + 1, &eptr, 16);
+	if (*eptr != '_') return NULL;
+	
+	vptr = eptr + 1;
+	eptr = strchr(vptr, '_');
+
+	if (eptr == NULL || eptr - vptr > (int)sizeof(ip) - 1)
+		return NULL;	// ignore it
+	memcpy(ip, vptr, eptr - vptr);
+	ip[eptr - vptr] = 0;
+
+	if (inet_pton(AF_INET, ip, &hip.ip.ip4) == 1) {
+		hip.ver = 4;
+	}
+	else if (inet_pton(AF_INET6, ip, &hip.ip.ip6[0]) == 1) {
+		hip.ver = 6;
+	}
+	else {
+		APPLOG_ERROR("invlaid ip(%s) in the name component", ip);
+		return NULL;
+	}
+
+	key = local_key_t(hip, stat_id_t(pid, mid, iid));
+	return eptr + 1;
+}
+
+//
+// the series of a series file named like MG_PID_MID_IID_HOST-IP_1m.bin
+//
+static bool parseSeriesName(const char *name, local_key_t& key)
+{
+	return parseSeriesKey(name + 3, key) != NULL;
+}
+
+//
+// the caller and callee of MR_PID_MID_IID_HOST-IP_PID_MID_IID_HOST-IP_1m.bin
+//
+static bool parseRcallName(const char *name, rcall_key_t& key)
+{
+	local_key_t src, dst;
+	const char *ptr = parseSeriesKey(name + 3, src);
+	if (ptr == NULL || parseSeriesKey(ptr, dst) == NULL)
+		return false;
+
+	key = rcall_key_t(src.hip, src.sid, dst.hip, dst.sid);
+	return true;
+}
+
+//
+// collect series of MG_/ML_ files, SEG_MG_/SEG_ML_ segments and
+// minute MR_ files into catalogs
+//
+class CatalogScanFilter : public ScanFilter {
+public:
+	CatalogScanFilter(SeriesCatalog *_gauges, SeriesCatalog *_lcalls, RcallCatalog *_rcalls)
+		: gauges(_gauges), lcalls(_lcalls), rcalls(_rcalls), year(0), count(0)
+	{ /* nothing */ }
+public:
+	virtual bool acceptYear(const char *name) {
+		char *eptr;
+		year = strtol(name, &eptr, 10);
+		return *eptr == 0 && year >= CATALOG_YEAR_BASE && year <= CATALOG_YEAR_MAX;
+	}
+	virtual bool acceptProduct(const char *name) { return true; }
+	virtual bool acceptModule(const char *name) { return true; }
+	virtual bool accept(const char *name) {
+		if (strncmp(name, "MR_", 3) == 0)
+			return acceptRcall(name);
+
+		SeriesCatalog *catalog;
+		if (strncmp(name, "MG_", 3) == 0) catalog = gauges;
+		else if (strncmp(name, "ML_", 3) == 0) catalog = lcalls;
+		else return false;
+
+		local_key_t key;
+		if (!parseSeriesName(name, key))
+			return false;
+
+		if (catalog->add(key.sid, key.hip, year) > 0)
+			++count;
+		return true;
+	}
+	virtual bool acceptFile(const char *dir, const char *name) {
+		if (strncmp(name, "SEG_", 4) != 0)
+			return accept(name);
+
+		SeriesCatalog *catalog;
+		if (strncmp(name + 4, "MG_", 3) == 0) catalog = gauges;
+		else if (strncmp(name + 4, "ML_", 3) == 0) catalog = lcalls;
+		else return false;
+
+		// SEG_MG_PID_MID_YYYYMMDD.seg
+		char *eptr;
+		int pid, mid;
+
+		pid = strtol(name + 7, &eptr, 16);
+		if (*eptr != '_') return false;
+
+		mid = strtol(eptr + 1, &eptr, 16);
+		if (*eptr != '_') return false;
+
+		char path[PATH_MAX];
+		std::vector<local_key_t> keys;
+		xsnprintf(path, sizeof path, "%s/%s", dir, name);
+		if (SegmentFile::listKeys(path, pid, mid, keys) < 0) {
+			APPLOG_WARN("list series of segment %s failed, some may be missing", path);
+		}
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			if (catalog->add(keys[i].sid, keys[i].hip, year) > 0)
+				++count;
+		}
+
+		return true;
+	}
+private:
+	bool acceptRcall(const char *name) {
+		size_t len = strlen(name);
+		rcall_key_t key;
+		if (len <= 7 || strcmp(name + len - 7, "_1m.bin") != 0 || !parseRcallName(name, key))
+			return false;
+
+		if (rcalls->add(key, year) > 0)
+			++count;
+		return true;
+	}
+private:
+	SeriesCatalog *gauges;
+	SeriesCatalog *lcalls;
+	RcallCatalog *rcalls;
+	int year;
+public:
+	long count;
+};
+
+//
+// collect MG_/ML_ series files, to convert them into segments
+//
+class LegacyFileCollector : public ScanFilter {
+public:
+	LegacyFileCollector(std::vector<std::string>& _paths) : paths(_paths)
+	{ /* nothing */ }
+public:
+	virtual bool acceptYear(const char *name) {
+		char *eptr;
+		int year = strtol(name, &eptr, 10);
+		return *eptr == 0 && year >= CATALOG_YEAR_BASE && year <= CATALOG_YEAR_MAX;
+	}
+	virtual bool acceptProduct(const char *name) { return true; }
+	virtual bool acceptModule(const char *name) { return true; }
+	virtual bool accept(const char *name) {
+		size_t len = strlen(name);
+		return (strncmp(name, "MG_", 3) == 0 || strncmp(name, "ML_", 3) == 0)
+			&& ((len > 4 && strcmp(name + len - 4, ".bin") == 0)
+				|| (len > 5 && strcmp(name + len - 5, ".late") == 0));
+	}
+	virtual bool acceptFile(const char *dir, const char *name) {
+		if (!accept(name)) return false;
+
+		std::string path(dir);
+		path += "/";
+		path += name;
+		paths.push_back(path);
+		return true;
+	}
+private:
+	std::vector<std::string>& paths;
+};
+
+//
+// collect minute series files and minute segments, to drop
+// minute data before the horizon
+//
+class MinuteFileCollector : public ScanFilter {
+public:
+	MinuteFileCollector(std::vector<std::string>& _paths) : paths(_paths)
+	{ /* nothing */ }
+public:
+	virtual bool acceptYear(const char *name) {
+		char *eptr;
+		int year = strtol(name, &eptr, 10);
+		return *eptr == 0 && year >= CATALOG_YEAR_BASE && year <= CATALOG_YEAR_MAX;
+	}
+	virtual bool acceptProduct(const char *name) { return true; }
+	virtual bool acceptModule(const char *name) { return true; }
+	virtual bool accept(const char *name) {
+		size_t len = strlen(name);
+		if (strncmp(name, "SEG_MG_", 7) == 0 || strncmp(name, "SEG_ML_", 7) == 0) {
+			// SEG_MG_PID_MID_YYYYMMDD.seg, rollups have a FREQ more
+			int count = 0;
+			for (const char *ptr = name; (ptr = strchr(ptr, '_')) != NULL; ++ptr)
+				++count;
+			return count == 4;
+		}
+
+		return (strncmp(name, "MG_", 3) == 0 || strncmp(name, "ML_", 3) == 0)
+			&& len > 7 && strcmp(name + len - 7, "_1m.bin") == 0;
+	}
+	virtual bool acceptFile(const char *dir, const char *name) {
+		if (!accept(name)) return false;
+
+		std::string path(dir);
+		path += "/";
+		path += name;
+		paths.push_back(path);
+		return true;
+	}
+private:
+	std::vector<std::string>& paths;
+};
+
+int FileStorage::scanDirectoryModule(ScanFilter *filter, const char *dname)
+{
+	char path[PATH_MAX];
+	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) return -1;
+
+	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
+	struct dirent *pe;
+
+	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
+		if (pe == NULL) break;
+		//if (pe->d_type != DT_REG) continue;
+		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
+
+		if (!filter->acceptFile(path, pe->d_name)) continue;
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+int FileStorage::scanDirectoryProduct(ScanFilter *filter, const char *dname)
+{
+	char path[PATH_MAX];
+	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) return -1;
+
+	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
+	struct dirent *pe;
 
 	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
 		if (pe == NULL) break;
@@ -488,76 +1545,1088 @@ int FileStorage::scanDirectoryProduct(ScanFilter *filter, const char *dname)
 		scanDirectoryModule(filter, buf);
 	}
 
-	closedir(dir);
-	return 0;
+	closedir(dir);
+	return 0;
+}
+
+int FileStorage::scanDirectoryYear(ScanFilter *filter, const char *dname)
+{
+	char path[PATH_MAX];
+	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) return -1;
+
+	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
+	struct dirent *pe;
+
+	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
+		if (pe == NULL) break;
+		//if (pe->d_type != DT_DIR) continue;	
+		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
+		if (!filter->acceptProduct(pe->d_name)) continue;
+		
+		char buf[256];
+		snprintf(buf, sizeof buf, "%s/%s", dname, pe->d_name); buf[sizeof(buf) - 1] = 0;
+		scanDirectoryProduct(filter, buf);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+int FileStorage::scanDirectoryRoot(ScanFilter *filter)
+{
+	DIR *dir = opendir(baseDir.c_str());
+	if (dir == NULL) return -1;
+
+	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
+	struct dirent *pe;
+
+	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
+		if (pe == NULL) break;
+		//if (pe->d_type != DT_DIR) continue;
+		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
+		if (!filter->acceptYear(pe->d_name)) continue;
+
+		scanDirectoryYear(filter, pe->d_name);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+char *FileStorage::makeCatalogPath(char *path, size_t size, const char *typeString)
+{
+	return xsnprintf(path, size, "%scatalog_%s.snap", baseDir.c_str(), typeString);
+}
+
+//
+// the snapshot is removed once loaded, so that a crash before the
+// next saveCatalog() makes a full directory scan at next startup
+//
+int FileStorage::loadCatalog()
+{
+	char path1[PATH_MAX], path2[PATH_MAX], path3[PATH_MAX];
+	makeCatalogPath(path1, sizeof path1, "MG");
+	makeCatalogPath(path2, sizeof path2, "ML");
+	makeCatalogPath(path3, sizeof path3, "MR");
+
+	if (gaugeCatalog.load(path1) == 0 && lcallCatalog.load(path2) == 0 && rcallCatalog.load(path3) == 0) {
+		APPLOG_INFO("catalog loaded from snapshot: %ld gauges, %ld lcalls, %ld rcalls",
+			(long)gaugeCatalog.size(), (long)lcallCatalog.size(), (long)rcallCatalog.size());
+		unlink(path1);
+		unlink(path2);
+		unlink(path3);
+		return 0;
+	}
+
+	gaugeCatalog.clear();
+	lcallCatalog.clear();
+	rcallCatalog.clear();
+
+	CatalogScanFilter filter(&gaugeCatalog, &lcallCatalog, &rcallCatalog);
+	if (scanDirectoryRoot(&filter) < 0) {
+		APPLOG_WARN("scan %s for catalog failed: %m", baseDir.c_str());
+		return -1;
+	}
+
+	APPLOG_INFO("catalog built from %s: %ld series", baseDir.c_str(), filter.count);
+	return 0;
+}
+
+int FileStorage::saveCatalog()
+{
+	char path[PATH_MAX];
+	int retval = 0;
+
+	if (gaugeCatalog.save(makeCatalogPath(path, sizeof path, "MG")) < 0)
+		retval = -1;
+	if (lcallCatalog.save(makeCatalogPath(path, sizeof path, "ML")) < 0)
+		retval = -1;
+	if (rcallCatalog.save(makeCatalogPath(path, sizeof path, "MR")) < 0)
+		retval = -1;
+
+	return retval;
+}
+
+//
+// move the items of a series file into pending, grouped by the
+// segment of their days
+//
+int FileStorage::convertFile(const char *path, memtable_map_t& pending, size_t& pendingBytes)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		APPLOG_ERROR("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	const char *name = strrchr(path, '/');
+	const char *typeString = (name != NULL && strncmp(name + 1, "ML_", 3) == 0) ? "ML" : "MG";
+
+	// ..._1m.bin, or a rollup like ..._5m.bin
+	uint8_t ftype = FT_MINUTE, freqs = 1;
+	const char *fptr = strrchr(path, '_');
+	if (fptr != NULL) {
+		char *eptr;
+		long n = strtol(fptr + 1, &eptr, 10);
+		if (n > 0 && n < 256) {
+			freqs = n;
+			switch (*eptr) {
+			case 's': ftype = FT_SECOND; break;
+			case 'h': ftype = FT_HOUR; break;
+			case 'd': ftype = FT_DAY; break;
+			default: ftype = FT_MINUTE; break;
+			}
+		}
+	}
+
+	unsigned char buf[8192];
+	size_t left = 0;
+	int64_t offset = 0;
+	char segPath[PATH_MAX];
+	std::string memKey;
+	int retval = 0;
+
+	while (1) {
+		ssize_t rlen = read(fd, buf + left, sizeof buf - left);
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen < 0) {
+			APPLOG_ERROR("read(%s) for converting failed: %m", path);
+			retval = -1;
+			break;
+		}
+		if (rlen == 0)
+			break;
+
+		left += rlen;
+		MemoryBuffer msg(buf, left, false);
+		msg.setWptr(left);
+
+		while (msg.getRptr() < msg.getWptr()) {
+			long savedRptr = msg.getRptr();
+			int64_t timestamp;
+			local_key_t key;
+			int rv = parseItemTimestamp(&msg, timestamp, &key);
+
+			if (rv == -2) {
+				APPLOG_ERROR("%s is corrupted at %ld, the rest is not converted", path, (long)(offset + savedRptr));
+				retval = -1;
+				break;
+			}
+			else if (rv == -1) {
+				msg.setRptr(savedRptr);
+				break;
+			}
+
+			makeSegmentPath(segPath, sizeof segPath, typeString, timestamp, key.sid, ftype, freqs);
+			makeMemKey(memKey, segPath, key);
+
+			memtable_map_t::iterator iter = pending.find(memKey);
+			if (iter == pending.end()) {
+				memtable_series_t& series = pending[memKey];
+				series.firstTimestamp = series.lastTimestamp = timestamp;
+				series.flushedAt = -1;
+				series.target = segPath;
+				series.key = key;
+				iter = pending.find(memKey);
+			}
+			else if (timestamp > iter->second.lastTimestamp) {
+				iter->second.lastTimestamp = timestamp;
+			}
+
+			iter->second.data.append((const char *)buf + savedRptr, msg.getRptr() - savedRptr);
+			pendingBytes += msg.getRptr() - savedRptr;
+		}
+
+		if (retval < 0) break;
+
+		offset += msg.getRptr();
+		left = msg.getWptr() - msg.getRptr();
+		memmove(buf, buf + msg.getRptr(), left);
+	}
+
+	if (left > 0 && retval == 0) {
+		APPLOG_WARN("%s has a partial item of %ld bytes at the end, dropped", path, (long)left);
+	}
+
+	close(fd);
+	return retval;
+}
+
+//
+// offline: rewrite all MG_/ML_ series files (and late files of rollups)
+// into segments and remove them (with their time index) unless keepOld.
+// the server must not be running, and kept files are read again if
+// segmentReadSeriesFiles.
+//
+int FileStorage::convertToSegments(bool keepOld, size_t maxBuffer)
+{
+	std::vector<std::string> paths;
+	LegacyFileCollector collector(paths);
+	if (scanDirectoryRoot(&collector) < 0) {
+		APPLOG_ERROR("scan %s for series files failed: %m", baseDir.c_str());
+		return -1;
+	}
+
+	// files of a module are adjacent, so are their segments
+	std::sort(paths.begin(), paths.end());
+
+	memtable_map_t pending;
+	std::vector<bool> failed(paths.size(), false);
+	size_t pendingBytes = 0, first = 0;
+	long removed = 0;
+	int retval = 0;
+
+	for (size_t i = 0; i <= paths.size(); ++i) {
+		bool flush = i == paths.size() || pendingBytes >= maxBuffer;
+		if (!flush && i > first) {
+			size_t slash1 = paths[i].rfind('/'), slash2 = paths[i - 1].rfind('/');
+			flush = paths[i].compare(0, slash1, paths[i - 1], 0, slash2) != 0;
+		}
+
+		if (flush) {
+			if (!pending.empty() && flushSeries(pending, NULL) < 0) {
+				APPLOG_ERROR("write segments for %ld files failed, keep them", (long)(i - first));
+				retval = -1;
+			}
+			else if (!keepOld) {
+				// a failed file may be partly in segments, keep it to check by hand
+				char ipath[PATH_MAX];
+				for (size_t j = first; j < i; ++j) {
+					if (failed[j]) continue;
+					unlink(paths[j].c_str());
+					unlink(timeIndex.makeIndexPath(ipath, sizeof ipath, paths[j].c_str()));
+					++removed;
+				}
+			}
+
+			pending.clear();
+			pendingBytes = 0;
+			first = i;
+		}
+
+		if (i == paths.size()) break;
+
+		if (convertFile(paths[i].c_str(), pending, pendingBytes) < 0) {
+			APPLOG_WARN("convert %s failed, part of it may be in segments", paths[i].c_str());
+			failed[i] = true;
+			retval = -1;
+		}
+	}
+
+	APPLOG_INFO("%ld series files converted into segments under %s, %ld removed",
+		(long)paths.size(), baseDir.c_str(), removed);
+	return retval;
+}
+
+static int yearOf(int64_t timestamp)
+{
+	time_t tsecs = timestamp / 1000;
+	struct tm tmbuf, *ptm = localtime_r(&tsecs, &tmbuf);
+	return ptm->tm_year + 1900;
+}
+
+#define DAY_MSECS	(86400 * 1000LL)
+
+class AllSeriesSelector : public SeriesSelector {
+public:
+	virtual bool accept(int iid) const { return true; }
+};
+
+static bool localKeyLess(const local_key_t& x, const local_key_t& y)
+{
+	if (x.sid.pid != y.sid.pid) return x.sid.pid < y.sid.pid;
+	if (x.sid.mid != y.sid.mid) return x.sid.mid < y.sid.mid;
+	if (x.sid.iid != y.sid.iid) return x.sid.iid < y.sid.iid;
+	if (x.hip.ver != y.hip.ver) return x.hip.ver < y.hip.ver;
+	return memcmp(&x.hip.ip, &y.hip.ip, sizeof x.hip.ip) < 0;
+}
+
+// an item of the old file (source 0) or inserted ones (source 1)
+typedef struct rewrite_item_tag {
+	int64_t timestamp;
+	int source;
+	size_t offset;
+	size_t size;
+} rewrite_item_t;
+
+static bool rewriteItemLess(const rewrite_item_t& x, const rewrite_item_t& y)
+{
+	return x.timestamp < y.timestamp;
+}
+
+static int64_t fileSize(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) return 0;
+	return st.st_size;
+}
+
+// remove a directory tree, returns bytes of files removed
+static int64_t removeTree(const char *dname)
+{
+	DIR *dir = opendir(dname);
+	if (dir == NULL) return 0;
+
+	// one DIR per call, readdir() is safe here
+	struct dirent *pe;
+	int64_t bytes = 0;
+
+	while ((pe = readdir(dir)) != NULL) {
+		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
+
+		char path[PATH_MAX];
+		struct stat st;
+		xsnprintf(path, sizeof path, "%s/%s", dname, pe->d_name);
+		if (lstat(path, &st) < 0) continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			bytes += removeTree(path);
+		}
+		else if (unlink(path) == 0) {
+			bytes += st.st_size;
+		}
+	}
+
+	closedir(dir);
+	if (rmdir(dname) < 0) {
+		APPLOG_WARN("rmdir(%s) failed: %m", dname);
+	}
+
+	return bytes;
+}
+
+int FileStorage::saveDirtyRollups()
+{
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	makeRollupPath(path, sizeof path, "dirty");
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.tmp", path);
+
+	FILE *fp = fopen(tmpPath, "w");
+	if (fp == NULL) return -1;
+
+	for (size_t i = 0; i < dirtyRollups.size(); ++i) {
+		fprintf(fp, "%lld %lld\n", (long long)dirtyRollups[i].first, (long long)dirtyRollups[i].second);
+	}
+
+	if (fclose(fp) != 0 || rename(tmpPath, path) < 0) {
+		unlink(tmpPath);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// rollups before it are backfilled, and minute data there will be
+// dropped by the caller, queries use rollups there from now on
+//
+void FileStorage::clearDirtyRollups(int64_t before)
+{
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	pthread_mutex_lock(&rollupLock);
+
+	rollup_range_list_t::iterator iter = dirtyRollups.begin();
+	while (iter != dirtyRollups.end() && iter->second <= before)
+		++iter;
+	dirtyRollups.erase(dirtyRollups.begin(), iter);
+	if (!dirtyRollups.empty() && dirtyRollups[0].first < before)
+		dirtyRollups[0].first = before;
+
+	if (saveDirtyRollups() < 0) {
+		APPLOG_ERROR("save dirty rollups failed: %m");
+	}
+
+	if (before > minuteHorizon) {
+		minuteHorizon = before;
+
+		makeRollupPath(path, sizeof path, "horizon");
+		xsnprintf(tmpPath, sizeof tmpPath, "%s.tmp", path);
+		FILE *fp = fopen(tmpPath, "w");
+		if (fp == NULL || fprintf(fp, "%lld\n", (long long)before) < 0
+			|| fclose(fp) != 0 || rename(tmpPath, path) < 0) {
+			APPLOG_ERROR("save minute horizon into %s failed: %m", path);
+			unlink(tmpPath);
+		}
+	}
+
+	pthread_mutex_unlock(&rollupLock);
+}
+
+int FileStorage::removeExpiredYears(int retainYears, compact_stats_t& stats)
+{
+	time_t now = time(NULL);
+	struct tm tmbuf, *ptm = localtime_r(&now, &tmbuf);
+	int firstYear = ptm->tm_year + 1900 - retainYears + 1;
+
+	DIR *dir = opendir(baseDir.c_str());
+	if (dir == NULL) return -1;
+
+	struct dirent *pe;
+	std::vector<int> years;
+
+	while ((pe = readdir(dir)) != NULL) {
+		char *eptr;
+		int year = strtol(pe->d_name, &eptr, 10);
+		if (*eptr == 0 && eptr != pe->d_name && year < firstYear)
+			years.push_back(year);
+	}
+
+	closedir(dir);
+
+	for (size_t i = 0; i < years.size(); ++i) {
+		char path[PATH_MAX];
+		xsnprintf(path, sizeof path, "%s%04d", baseDir.c_str(), years[i]);
+
+		// out of queries first, then out of disk
+		gaugeCatalog.dropYear(years[i]);
+		lcallCatalog.dropYear(years[i]);
+		rcallCatalog.dropYear(years[i]);
+
+		stats.bytesReclaimed += removeTree(path);
+		++stats.yearsRemoved;
+		queryCache.clear();
+		APPLOG_INFO("year %d expired, %s removed", years[i], path);
+	}
+
+	return 0;
+}
+
+void FileStorage::addPending(memtable_map_t& pending, const char *typeString, int64_t timestamp,
+			     const local_key_t& key, uint8_t ftype, uint8_t freqs, const unsigned char *data, size_t size)
+{
+	char path[PATH_MAX];
+	std::string memKey, target;
+
+	if (layout == LAYOUT_SEGMENT) {
+		makeSegmentPath(path, sizeof path, typeString, timestamp, key.sid, ftype, freqs);
+		makeMemKey(memKey, path, key);
+		target = path;
+	}
+	else {
+		memKey = makePath(path, sizeof path, typeString, yearOf(timestamp), key.sid, key.hip, ftype, freqs);
+	}
+
+	memtable_map_t::iterator iter = pending.find(memKey);
+	if (iter == pending.end()) {
+		memtable_series_t& series = pending[memKey];
+		series.firstTimestamp = series.lastTimestamp = timestamp;
+		series.flushedAt = -1;
+		series.target = target;
+		series.key = key;
+		iter = pending.find(memKey);
+	}
+	else if (timestamp > iter->second.lastTimestamp) {
+		iter->second.lastTimestamp = timestamp;
+	}
+
+	iter->second.data.append((const char *)data, size);
+}
+
+//
+// segments take new groups from any thread, series files are
+// rewritten in time order by their writers
+//
+int FileStorage::savePending(memtable_map_t& pending, ingest_dispatch_t dispatch, void *arg,
+			     TaskGroup& group, compact_stats_t& stats)
+{
+	if (layout == LAYOUT_SEGMENT)
+		return flushSeries(pending, NULL);
+
+	for (memtable_map_t::iterator iter = pending.begin(); iter != pending.end(); ++iter) {
+		SeriesRewriteItem *item = new SeriesRewriteItem(iter->first, -1, &group, &stats.bytesReclaimed);
+		item->insert.swap(iter->second.data);
+
+		group.add(1);
+		(*dispatch)(arg, partitionOf(iter->second.key), item);
+		++stats.filesRewritten;
+	}
+
+	return 0;
+}
+
+//
+// rollup buckets of the days from minute data, only for buckets
+// without any record yet: a bucket closed before a crash is whole,
+// only the few open at a crash could be partial and stay so
+//
+void FileStorage::backfillSeries(const std::vector<local_key_t>& keys, const char *typeString,
+				 const std::vector<int64_t>& days, memtable_map_t& pending, compact_stats_t& stats)
+{
+	AllSeriesSelector all;
+	local_key_set_t ids(keys.begin(), keys.end());
+	unsigned char data[8192];
+
+	for (size_t d = 0; d < days.size(); ++d) {
+		int64_t day = days[d], dayEnd = days[d] + DAY_MSECS;
+		series_file_list_t files;
+		StatMerger minutes(FT_MINUTE, 1, day, DAY_MSECS / 60000);
+
+		planSeriesFiles(files, ids, all, day, dayEnd, FT_MINUTE, 1, typeString);
+		loadSeriesFiles(files, day, dayEnd, minutes);
+
+		for (int level = 0; level < ROLLUP_LEVELS; ++level) {
+			const rollup_level_t& rl = rollupLevels[level];
+			int64_t length = rollupLength(level);
+			int count = DAY_MSECS / length;
+			StatMerger existing(rl.ftype, rl.freqs, day, count), fresh(rl.ftype, rl.freqs, day, count);
+
+			files.clear();
+			planSeriesFiles(files, ids, all, day, dayEnd, rl.ftype, rl.freqs, typeString);
+			loadSeriesFiles(files, day, dayEnd, existing);
+
+			for (int i = 0; i < minutes.periodCount; ++i) {
+				for (const_gauge_iterator iter = minutes.mergedGauges[i].begin();
+					iter != minutes.mergedGauges[i].end(); ++iter) {
+					int index = (iter->second.timestamp - day) / length;
+					if (existing.mergedGauges[index].find(iter->first) == existing.mergedGauges[index].end())
+						fresh.addMergedGauge(iter->second);
+				}
+
+				for (const_lcall_iterator iter = minutes.mergedLcalls[i].begin();
+					iter != minutes.mergedLcalls[i].end(); ++iter) {
+					int index = (iter->second.timestamp - day) / length;
+					if (existing.mergedLcalls[index].find(iter->first) == existing.mergedLcalls[index].end())
+						fresh.addMergedLcall(iter->second);
+				}
+			}
+
+			for (int i = 0; i < fresh.periodCount; ++i) {
+				for (const_gauge_iterator iter = fresh.mergedGauges[i].begin();
+					iter != fresh.mergedGauges[i].end(); ++iter) {
+					MemoryBuffer msg(data, sizeof data, false);
+					msg.writeUint8(STAT_MERGED_GAUGE);
+					if (iter->second.encodeTo(&msg) < 0) continue;
+
+					addPending(pending, typeString, iter->second.timestamp, iter->first,
+						rl.ftype, rl.freqs, msg.data(), msg.getWptr());
+					++stats.bucketsBackfilled;
+				}
+
+				for (const_lcall_iterator iter = fresh.mergedLcalls[i].begin();
+					iter != fresh.mergedLcalls[i].end(); ++iter) {
+					MemoryBuffer msg(data, sizeof data, false);
+					msg.writeUint8(STAT_MERGED_LCALL);
+					if (iter->second.encodeTo(&msg) < 0) continue;
+
+					addPending(pending, typeString, iter->second.timestamp, iter->first,
+						rl.ftype, rl.freqs, msg.data(), msg.getWptr());
+					++stats.bucketsBackfilled;
+				}
+			}
+		}
+	}
+}
+
+//
+// backfill the oldest dirty days before cutoff, maxDays at most,
+// returns the time before which nothing is dirty any more
+//
+int64_t FileStorage::backfillRollups(int64_t cutoff, int maxDays, ingest_dispatch_t dispatch, void *arg,
+				     TaskGroup& group, compact_stats_t& stats)
+{
+	pthread_mutex_lock(&rollupLock);
+	rollup_range_list_t dirty(dirtyRollups);
+	pthread_mutex_unlock(&rollupLock);
+
+	local_key_set_t gaugeIds, lcallIds;
+	gaugeCatalog.expand(gaugeIds, 0, 0, 0, NULL);
+	lcallCatalog.expand(lcallIds, 0, 0, 0, NULL);
+
+	// no data before the first year of any series
+	uint64_t years = 0;
+	for (local_key_set_t::const_iterator iter = gaugeIds.begin(); iter != gaugeIds.end(); ++iter)
+		years |= gaugeCatalog.getYears(iter->sid, iter->hip);
+	for (local_key_set_t::const_iterator iter = lcallIds.begin(); iter != lcallIds.end(); ++iter)
+		years |= lcallCatalog.getYears(iter->sid, iter->hip);
+
+	int64_t firstDay = cutoff;
+	for (int year = CATALOG_YEAR_BASE; year <= CATALOG_YEAR_MAX; ++year) {
+		if ((years & CATALOG_YEAR_BIT(year)) == 0) continue;
+
+		struct tm tmbuf;
+		memset(&tmbuf, 0, sizeof tmbuf);
+		tmbuf.tm_year = year - 1900;
+		tmbuf.tm_mday = 1;
+		tmbuf.tm_isdst = -1;
+		firstDay = (int64_t)mktime(&tmbuf) * 1000 / DAY_MSECS * DAY_MSECS;
+		break;
+	}
+
+	std::vector<int64_t> days;
+	int64_t clean = cutoff;
+	for (size_t i = 0; i < dirty.size() && dirty[i].first < cutoff; ++i) {
+		int64_t day = std::max(dirty[i].first, firstDay) / DAY_MSECS * DAY_MSECS;
+		int64_t end = std::min(dirty[i].second, cutoff);
+
+		for (; day < end; day += DAY_MSECS) {
+			if ((int)days.size() >= maxDays) {
+				clean = day;
+				break;
+			}
+
+			if (days.empty() || days.back() < day)
+				days.push_back(day);
+		}
+
+		if (clean < cutoff) break;
+	}
+
+	if (days.empty())
+		return clean;
+
+	// a batch of series, sorted to share segments, at a time
+	const size_t batchSize = 64;
+	for (int t = 0; t < 2; ++t) {
+		const char *typeString = t == 0 ? "MG" : "ML";
+		local_key_set_t& ids = t == 0 ? gaugeIds : lcallIds;
+		std::vector<local_key_t> keys(ids.begin(), ids.end());
+		std::sort(keys.begin(), keys.end(), localKeyLess);
+
+		for (size_t i = 0; i < keys.size(); i += batchSize) {
+			std::vector<local_key_t> batch(keys.begin() + i, keys.begin() + std::min(i + batchSize, keys.size()));
+			memtable_map_t pending;
+
+			backfillSeries(batch, typeString, days, pending, stats);
+			if (savePending(pending, dispatch, arg, group, stats) < 0) {
+				APPLOG_ERROR("save backfilled rollups failed, try it next time");
+				return days.front();
+			}
+		}
+	}
+
+	APPLOG_INFO("rollups of %ld days backfilled, clean before %lld", (long)days.size(), (long long)clean);
+	return clean;
 }
 
-int FileStorage::scanDirectoryYear(ScanFilter *filter, const char *dname)
+//
+// minute files and segments before it go, whole or trimmed on the
+// owning writer if a quarter of a file at least can go
+//
+int FileStorage::dropMinuteData(int64_t before, ingest_dispatch_t dispatch, void *arg,
+				TaskGroup& group, compact_stats_t& stats)
 {
-	char path[PATH_MAX];
-	xsnprintf(path, sizeof path, "%s%s", baseDir.c_str(), dname);
+	std::vector<std::string> paths;
+	MinuteFileCollector collector(paths);
+	if (scanDirectoryRoot(&collector) < 0) {
+		APPLOG_ERROR("scan %s for minute data failed: %m", baseDir.c_str());
+		return -1;
+	}
 
-	DIR *dir = opendir(path);
-	if (dir == NULL) return -1;
+	char ipath[PATH_MAX];
+	for (size_t i = 0; i < paths.size(); ++i) {
+		const char *path = paths[i].c_str();
+		const char *name = strrchr(path, '/') + 1;
+
+		if (strncmp(name, "SEG_", 4) == 0) {
+			// SEG_MG_PID_MID_YYYYMMDD.seg, a local day
+			const char *dptr = strrchr(name, '_') + 1;
+			struct tm tmbuf;
+			memset(&tmbuf, 0, sizeof tmbuf);
+			if (sscanf(dptr, "%4d%2d%2d", &tmbuf.tm_year, &tmbuf.tm_mon, &tmbuf.tm_mday) != 3)
+				continue;
+
+			tmbuf.tm_year -= 1900;
+			tmbuf.tm_mon -= 1;
+			tmbuf.tm_mday += 1;
+			tmbuf.tm_isdst = -1;
+			if ((int64_t)mktime(&tmbuf) * 1000 > before)
+				continue;
+
+			int64_t size = fileSize(path);
+			if (unlink(path) == 0) {
+				stats.bytesReclaimed += size;
+				++stats.filesRemoved;
+			}
 
-	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
-	struct dirent *pe;
+			continue;
+		}
 
-	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
-		if (pe == NULL) break;
-		//if (pe->d_type != DT_DIR) continue;	
-		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
-		if (!filter->acceptProduct(pe->d_name)) continue;
-		
-		char buf[256];
-		snprintf(buf, sizeof buf, "%s/%s", dname, pe->d_name); buf[sizeof(buf) - 1] = 0;
-		scanDirectoryProduct(filter, buf);
+		// DIR/YEAR/PID/MID/MG_..._1m.bin, a local year
+		local_key_t key;
+		int year = atoi(path + baseDir.size());
+		if (!parseSeriesName(name, key))
+			continue;
+
+		struct tm tmbuf;
+		memset(&tmbuf, 0, sizeof tmbuf);
+		tmbuf.tm_year = year + 1 - 1900;
+		tmbuf.tm_mday = 1;
+		tmbuf.tm_isdst = -1;
+		if ((int64_t)mktime(&tmbuf) * 1000 <= before) {
+			int64_t size = fileSize(path);
+			if (unlink(path) == 0) {
+				unlink(timeIndex.makeIndexPath(ipath, sizeof ipath, path));
+				stats.bytesReclaimed += size;
+				++stats.filesRemoved;
+			}
+
+			continue;
+		}
+
+		time_index_t entries;
+		int64_t offset = 0, endOffset = -1, size = fileSize(path);
+		if (timeIndex.load(path, entries) < 0)
+			continue;	// not read by any query yet, next time
+		timeIndex.locate(entries, before, INT64_MAX, offset, endOffset);
+		if (offset * 4 < size)
+			continue;
+
+		group.add(1);
+		(*dispatch)(arg, partitionOf(key), new SeriesRewriteItem(paths[i], before, &group, &stats.bytesReclaimed));
+		++stats.filesRewritten;
 	}
 
-	closedir(dir);
 	return 0;
 }
 
-int FileStorage::scanDirectoryRoot(ScanFilter *filter)
+//
+// one run of compaction: expired years go, then old minute data is
+// turned into rollups (where ingest did not) and goes
+//
+int FileStorage::compact(const compact_policy_t& policy, ingest_dispatch_t dispatch, void *arg, compact_stats_t& stats)
 {
-	DIR *dir = opendir(baseDir.c_str());
-	if (dir == NULL) return -1;
+	memset(&stats, 0, sizeof stats);
+	int retval = 0;
 
-	unsigned long long buf[PATH_MAX/sizeof(unsigned long long)];
-	struct dirent *pe;
+	if (policy.retainYears > 0 && removeExpiredYears(policy.retainYears, stats) < 0) {
+		APPLOG_ERROR("remove expired years failed: %m");
+		retval = -1;
+	}
 
-	while (readdir_r(dir, (struct dirent *)buf, &pe) == 0) {
-		if (pe == NULL) break;
-		//if (pe->d_type != DT_DIR) continue;
-		if (!strcmp(pe->d_name, ".") || !strcmp(pe->d_name, "..")) continue;
-		if (!filter->acceptYear(pe->d_name)) continue;
+	if (policy.minuteDays <= 0)
+		return retval;
+	if (rollups.empty()) {
+		APPLOG_WARN("minute data is kept for rollups are disabled");
+		return retval;
+	}
 
-		scanDirectoryYear(filter, pe->d_name);
+	// sealed buckets only, a day for the latest ones
+	int minuteDays = policy.minuteDays < 2 ? 2 : policy.minuteDays;
+	int64_t now = (int64_t)time(NULL) * 1000;
+	int64_t cutoff = (now - minuteDays * DAY_MSECS) / DAY_MSECS * DAY_MSECS;
+
+	TaskGroup group;
+	int64_t clean = backfillRollups(cutoff, policy.maxDays > 0 ? policy.maxDays : 1, dispatch, arg, group, stats);
+
+	// saved by writers before minute data goes
+	while (!group.finished())
+		group.waitFor(1000);
+
+	if (clean > minuteHorizon) {
+		clearDirtyRollups(clean);
+		if (dropMinuteData(clean, dispatch, arg, group, stats) < 0)
+			retval = -1;
+
+		while (!group.finished())
+			group.waitFor(1000);
 	}
 
-	closedir(dir);
+	return retval;
+}
+
+//
+// on the writer of the series only. the old index is removed before
+// the new file replaces the old one by rename, then the new index is
+// saved, so the new file is never read by the old index
+//
+int FileStorage::rewriteSeriesFile(const char *path, int64_t dropBefore, const std::string& insert, int64_t& reclaimed)
+{
+	std::string old;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 && errno != ENOENT) {
+		APPLOG_ERROR("open(%s) for rewriting failed: %m", path);
+		return -1;
+	}
+
+	if (fd >= 0) {
+		char buf[65536];
+		ssize_t rlen;
+		while ((rlen = read(fd, buf, sizeof buf)) > 0 || (rlen < 0 && errno == EINTR)) {
+			if (rlen > 0) old.append(buf, rlen);
+		}
+
+		close(fd);
+		if (rlen < 0) {
+			APPLOG_ERROR("read(%s) for rewriting failed: %m", path);
+			return -1;
+		}
+	}
+
+	std::vector<rewrite_item_t> items;
+	const std::string *sources[2] = { &old, &insert };
+
+	for (int i = 0; i < 2; ++i) {
+		if (sources[i]->empty()) continue;
+
+		MemoryBuffer msg((void *)sources[i]->data(), sources[i]->size(), false);
+		msg.setWptr(sources[i]->size());
+		while (msg.getRptr() < msg.getWptr()) {
+			rewrite_item_t item;
+			item.source = i;
+			item.offset = msg.getRptr();
+			if (parseItemTimestamp(&msg, item.timestamp) < 0) {
+				APPLOG_ERROR("%s is corrupted at %ld, not rewritten", i == 0 ? path : "insert", (long)item.offset);
+				return -1;
+			}
+
+			item.size = msg.getRptr() - item.offset;
+			if (i == 1 || dropBefore < 0 || item.timestamp >= dropBefore)
+				items.push_back(item);
+		}
+	}
+
+	// the file's items before inserted ones of the same time
+	std::stable_sort(items.begin(), items.end(), rewriteItemLess);
+
+	std::string data;
+	time_index_t entries;
+	data.reserve(old.size() + insert.size());
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (timeIndex.needEntry(data.size(), items[i].size))
+			entries.push_back(time_index_entry_t(items[i].timestamp, data.size()));
+		data.append(*sources[items[i].source], items[i].offset, items[i].size);
+	}
+
+	char tmpPath[PATH_MAX];
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.compact.tmp", path);
+	fd = open(tmpPath, O_CREAT|O_WRONLY|O_TRUNC, 0664);
+	if (fd < 0) {
+		char dpath[PATH_MAX];
+		xsnprintf(dpath, sizeof dpath, "%s", path);
+		makeDirectory(dpath);
+		fd = open(tmpPath, O_CREAT|O_WRONLY|O_TRUNC, 0664);
+	}
+
+	if (fd < 0) {
+		APPLOG_ERROR("open(%s) for rewriting failed: %m", tmpPath);
+		return -1;
+	}
+
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t wlen = write(fd, data.data() + done, data.size() - done);
+		if (wlen < 0 && errno == EINTR) continue;
+		if (wlen <= 0) break;
+		done += wlen;
+	}
+
+	close(fd);
+	if (done != data.size()) {
+		APPLOG_ERROR("write(%s) for rewriting failed: %m", tmpPath);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	// no index of the old file for the new one, a query in between
+	// rebuilds it, and one still on the old file checks what it loads
+	char ipath[PATH_MAX];
+	timeIndex.makeIndexPath(ipath, sizeof ipath, path);
+	if (unlink(ipath) < 0 && errno != ENOENT) {
+		APPLOG_ERROR("unlink(%s) for rewriting failed: %m", ipath);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	if (rename(tmpPath, path) < 0) {
+		APPLOG_ERROR("rename(%s) for rewriting failed: %m", tmpPath);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	timeIndex.save(path, entries);
+
+	reclaimed = (int64_t)old.size() - (int64_t)data.size();
 	return 0;
 }
 
 int FileStorage::expandIds(local_key_set_t& ids, int pid, int mid, int iid, const host_set_t *hosts)
 {
-	LocalKeyScanFilter filter("MG_", pid, mid, iid, hosts);
-	if (scanDirectoryRoot(&filter) < 0) return -1;
+	return gaugeCatalog.expand(ids, pid, mid, iid, hosts);
+}
 
-	ids.swap(filter.ids);
-	return 0;
+static bool seriesFileLess(const series_file_t& x, const series_file_t& y)
+{
+	return x.path < y.path;
 }
 
-int FileStorage::loadStatsForIdsHosts(const local_key_set_t& ids, int64_t start, int64_t end,
-			StatMerger& merger, const std::tr1::unordered_set<int>& validIds)
+//
+// one file per (series, year) which has data in [start, end), or
+// one (segment, series) per segment chunk in segment layout, of the
+// minute data or a rollup level by ftype/freqs, sorted by path
+// for better disk locality and to keep series of a segment together
+//
+int FileStorage::planSeriesFiles(series_file_list_t& files, const local_key_set_t& ids,
+				const SeriesSelector& selector, int64_t start, int64_t end,
+				uint8_t ftype, uint8_t freqs, const char *typeString)
 {
+	const SeriesCatalog& catalog = strcmp(typeString, "ML") == 0 ? lcallCatalog : gaugeCatalog;
+	int startYear = yearOf(start), endYear = yearOf(end - 1);
+	bool layoutFiles = layout == LAYOUT_SERIES_FILE || readSeriesFiles;
+	char path[PATH_MAX];
+
+	std::vector<int64_t> chunks;
+	if (layout == LAYOUT_SEGMENT)
+		segmentChunks(chunks, ftype, start, end);
+
 	for (local_key_set_t::const_iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-		if (validIds.find(iter->sid.iid) == validIds.end())
+		if (!selector.accept(iter->sid.iid))
 			continue;
 
-		loadStatsForPeriod(iter->sid, iter->hip, start, end, merger);
+		uint64_t years = catalog.getYears(iter->sid, iter->hip);
+		for (int year = startYear; layoutFiles && year <= endYear; ++year) {
+			if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX
+				|| (years & CATALOG_YEAR_BIT(year)) == 0)
+				continue;
+
+			series_file_t file;
+			file.path = makePath(path, sizeof path, typeString, year, iter->sid, iter->hip, ftype, freqs);
+			file.key = *iter;
+			file.layout = LAYOUT_SERIES_FILE;
+			file.partition = -1;
+			file.withLate = ftype != FT_MINUTE || freqs != 1;
+			files.push_back(file);
+		}
+
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			int year = yearOf(chunks[i]);
+			if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX
+				|| (years & CATALOG_YEAR_BIT(year)) == 0)
+				continue;
+
+			series_file_t file;
+			file.path = makeSegmentPath(path, sizeof path, typeString, chunks[i], iter->sid, ftype, freqs);
+			file.key = *iter;
+			file.layout = LAYOUT_SEGMENT;
+			file.partition = -1;
+			file.withLate = false;
+			files.push_back(file);
+		}
+	}
+
+	std::sort(files.begin(), files.end(), seriesFileLess);
+	return 0;
+}
+
+// files less than this are not worth another task
+#define SERIES_FILES_PER_TASK	8
+
+class SeriesLoadTask : public WorkerTask {
+public:
+	SeriesLoadTask(FileStorage *_storage, TaskGroup& _group, const series_file_list_t& _files,
+			size_t _first, size_t _last, int64_t _start, int64_t _end, StatMerger *_merger)
+		: storage(_storage), group(_group), files(_files), first(_first), last(_last),
+		  start(_start), end(_end), merger(_merger), profile(QueryProfile::current())
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		QueryProfile::setCurrent(profile);
+		storage->loadSeriesRange(files, first, last, start, end, *merger);
+		QueryProfile::setCurrent(NULL);
+		group.done();
+	}
+private:
+	FileStorage *storage;
+	TaskGroup& group;
+	const series_file_list_t& files;
+	size_t first, last;
+	int64_t start, end;
+	StatMerger *merger;
+	QueryProfile *profile;	// of the query
+};
+
+class MergerReduceTask : public WorkerTask {
+public:
+	MergerReduceTask(TaskGroup& _group, StatMerger *_dst, const StatMerger *_src)
+		: group(_group), dst(_dst), src(_src)
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		dst->addMerger(*src);
+		group.done();
+	}
+private:
+	TaskGroup& group;
+	StatMerger *dst;
+	const StatMerger *src;
+};
+
+static void runTasks(WorkerPool *pool, TaskGroup& group, std::vector<WorkerTask *>& tasks)
+{
+	group.add((int)tasks.size());
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		pool->submit(tasks[i]);
+	}
+
+	pool->wait(group);
+
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		delete tasks[i];
+	}
+	tasks.clear();
+}
+
+//
+// load files in chunks on the query pool, each chunk into its own
+// partial merger, then merge partials pairwise until one is left:
+// (0,1) (2,3) ... then (0,2) ... and so on, the result is in partial
+// #0 which is the caller's merger.
+//
+int FileStorage::loadSeriesFiles(const series_file_list_t& files, int64_t start, int64_t end, StatMerger& merger)
+{
+	int chunks = 1;
+	if (queryPool != NULL && queryPool->size() > 0) {
+		chunks = (files.size() + SERIES_FILES_PER_TASK - 1) / SERIES_FILES_PER_TASK;
+		if (chunks > queryParallelism) chunks = queryParallelism;
+	}
+
+	if (chunks <= 1) {
+		ProfileStage stage(PROFILE_LOAD);
+		loadSeriesRange(files, 0, files.size(), start, end, merger);
+		return 0;
+	}
+
+	std::vector<StatMerger *> partials;
+	partials.push_back(&merger);
+	for (int i = 1; i < chunks; ++i) {
+		partials.push_back(new StatMerger(merger.ftype, merger.freqs, merger.periodStartTime, merger.periodCount));
+	}
+
+	// files are sorted by path, so a chunk is a directory run
+	std::vector<WorkerTask *> tasks;
+	size_t step = (files.size() + chunks - 1) / chunks;
+
+	TaskGroup loadGroup;
+	for (int i = 0; i < chunks; ++i) {
+		size_t first = i * step, last = std::min(first + step, files.size());
+		if (first >= last) break;
+
+		tasks.push_back(new SeriesLoadTask(this, loadGroup, files, first, last, start, end, partials[i]));
+	}
+
+	{
+		ProfileStage stage(PROFILE_LOAD);
+		runTasks(queryPool, loadGroup, tasks);
+	}
+
+	ProfileStage stage(PROFILE_MERGE);
+	for (int stride = 1; stride < chunks; stride *= 2) {
+		TaskGroup reduceGroup;
+		for (int i = 0; i + stride < chunks; i += 2 * stride) {
+			tasks.push_back(new MergerReduceTask(reduceGroup, partials[i], partials[i + stride]));
+		}
+
+		runTasks(queryPool, reduceGroup, tasks);
+	}
+
+	for (int i = 1; i < chunks; ++i) {
+		delete partials[i];
 	}
 
+	APPLOG_DEBUG("loaded %ld series files in %d tasks", (long)files.size(), chunks);
 	return 0;
 }
 
@@ -571,33 +2640,178 @@ public:
 	std::tr1::unordered_set<int> pids;
 };
 
-class ProductMapper : public GroupMapper {
-public:
-	void map(local_key_t& newKey, const local_key_t& key) {
-		newKey.sid = stat_id_t(key.sid.pid, 0, key.sid.iid);
-		newKey.hip = 0;
+//
+// the coarsest rollup level whose buckets nest in the spans, or -1
+//
+int FileStorage::rollupLevelOf(int spanUnit, int spanCount)
+{
+	if (rollups.empty()) return -1;
+
+	int64_t span = spanLength(spanUnit, spanCount);
+	for (int level = ROLLUP_LEVELS - 1; level >= 0; --level) {
+		if (span > 0 && span % rollupLength(level) == 0)
+			return level;
 	}
 
-	std::tr1::unordered_set<int> mids;
-};
+	return -1;
+}
 
-class ModuleMapper : public GroupMapper {
-public:
-	void map(local_key_t& newKey, const local_key_t& key) {
-		newKey.sid = stat_id_t(key.sid.pid, key.sid.mid, key.sid.iid);
-		newKey.hip = 0;
+//
+// whole rollup buckets which are sealed and not dirty are read from
+// the level, the head, the tail and the rest from minute data
+//
+void FileStorage::planStatsRanges(stats_range_list_t& ranges, int level, int64_t start, int64_t end)
+{
+	ranges.clear();
+
+	pthread_mutex_lock(&rollupLock);
+	rollup_range_list_t dirty(dirtyRollups);
+	int64_t horizon = minuteHorizon;
+	pthread_mutex_unlock(&rollupLock);
+
+	int64_t length = level >= 0 ? rollupLength(level) : 0;
+	int64_t first = 0, last = 0;
+	if (length > 0) {
+		first = (start + length - 1) / length * length;
+		last = end / length * length;
+
+		for (size_t i = 0; i < rollups.size(); ++i) {
+			int64_t sealed = rollups[i]->getSealedUntil(level);
+			if (sealed < last) last = sealed / length * length;
+		}
+	}
+
+	int64_t pos = start, gstart = first;
+	for (size_t i = 0; first < last && i <= dirty.size(); ++i) {
+		int64_t gend = last;
+		int64_t next = last;
+		if (i < dirty.size()) {
+			gend = dirty[i].first / length * length;
+			next = (dirty[i].second + length - 1) / length * length;
+		}
+
+		if (gend > last) gend = last;
+		if (gend > gstart) {
+			if (pos < gstart) {
+				stats_range_t minutes = { pos, gstart, -1 };
+				ranges.push_back(minutes);
+			}
+
+			stats_range_t rollup = { gstart, gend, level };
+			ranges.push_back(rollup);
+			pos = gend;
+		}
+
+		if (next > gstart) gstart = next;
+		if (gstart >= last) break;
+	}
+
+	if (pos < end) {
+		stats_range_t minutes = { pos, end, -1 };
+		ranges.push_back(minutes);
+	}
+
+	// minute data before the horizon is compacted, the finest
+	// rollup is the best there is
+	for (size_t i = 0; horizon > 0 && !rollups.empty() && i < ranges.size(); ++i) {
+		if (ranges[i].level >= 0 || ranges[i].start >= horizon)
+			continue;
+
+		if (ranges[i].end > horizon) {
+			stats_range_t rest = { horizon, ranges[i].end, -1 };
+			ranges.insert(ranges.begin() + i + 1, rest);
+			ranges[i].end = horizon;
+		}
+
+		ranges[i].level = 0;
+	}
+}
+
+//
+// gauges (or lcalls by type) in [start, end) from the hot tier only
+//
+void FileStorage::loadHotStats(const local_key_set_t& ids, const SeriesSelector& selector, int64_t start, int64_t end,
+			       StatMerger& merger, uint8_t type)
+{
+	std::string data;
+	for (local_key_set_t::const_iterator iter = ids.begin(); iter != ids.end(); ++iter) {
+		if (!selector.accept(iter->sid.iid))
+			continue;
+
+		data.clear();
+		hotTier.read(partitionOf(*iter), type, *iter, start, end, data);
+		if (data.empty())
+			continue;
+
+		MemoryBuffer msg((void *)data.data(), data.size(), false);
+		msg.setWptr(data.size());
+		if (parseStatsData(&msg, start, end, merger) < 0 || msg.getRptr() != msg.getWptr()) {
+			APPLOG_ERROR("parse hot stats of %04x/%04x/%04x failed", iter->sid.pid, iter->sid.mid, iter->sid.iid);
+		}
+	}
+}
+
+//
+// the recent part inside the hot window from memory, the rest from
+// rollups and minute data on disk
+//
+int FileStorage::loadStats(const local_key_set_t& ids, const SeriesSelector& selector, int64_t start, int64_t end,
+			   int spanUnit, int spanCount, StatMerger& merger, const char *typeString)
+{
+	int64_t hotSince = hotTier.getHotSince((int64_t)time(NULL) * 1000);
+	if (hotSince < end) {
+		uint8_t type = strcmp(typeString, "ML") == 0 ? STAT_MERGED_LCALL : STAT_MERGED_GAUGE;
+		ProfileStage stage(PROFILE_LOAD);
+		loadHotStats(ids, selector, start > hotSince ? start : hotSince, end, merger, type);
+		if (start >= hotSince)
+			return 0;
+		end = hotSince;
+	}
+
+	stats_range_list_t ranges;
+	planStatsRanges(ranges, rollupLevelOf(spanUnit, spanCount), start, end);
+
+	for (stats_range_list_t::const_iterator iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		series_file_list_t files;
+		if (iter->level >= 0) {
+			const rollup_level_t& level = rollupLevels[iter->level];
+			ProfileStage stage(PROFILE_LOAD);
+			planSeriesFiles(files, ids, selector, iter->start, iter->end, level.ftype, level.freqs, typeString);
+		}
+		else {
+			ProfileStage stage(PROFILE_LOAD);
+			planSeriesFiles(files, ids, selector, iter->start, iter->end, FT_MINUTE, 1, typeString);
+		}
+
+		loadSeriesFiles(files, iter->start, iter->end, merger);
 	}
 
-	std::tr1::unordered_set<stat_ip_t> hosts;
-};
+	return 0;
+}
+
+//
+// gauges of the series in ids and accepted by selector only, out of
+// a merger loaded for several queries
+//
+int FileStorage::combineSelected(StatCombiner& combiner, const StatMerger& src, const local_key_set_t& ids,
+				 const SeriesSelector& selector, GroupMapper& groupMapper)
+{
+	for (int i = 0; i < src.periodCount; ++i) {
+		for (merged_gauge_map_t::const_iterator iter = src.mergedGauges[i].begin();
+			iter != src.mergedGauges[i].end();
+				++iter) {
+			if (!selector.accept(iter->first.sid.iid) || ids.find(iter->first) == ids.end())
+				continue;
+
+			local_key_t newKey;
+			groupMapper.map(newKey, iter->first);
 
-class HostMapper : public GroupMapper {
-public:
-	void map(local_key_t& newKey, const local_key_t& key) {
-		newKey.sid = stat_id_t(0, 0, key.sid.iid);
-		newKey.hip = key.hip;
+			combiner.addMergedGauge(newKey, iter->second);
+		}
 	}
-};
+
+	return 0;
+}
 
 int FileStorage::combineStats(StatCombiner& combiner, const StatMerger& src, GroupMapper& groupMapper)
 {
@@ -623,10 +2837,11 @@ int FileStorage::combineStats(StatCombiner& combiner, const StatMerger& src, Gro
 		for (merged_rcall_map_t::const_iterator iter = src.mergedRcalls[i].begin();
 			iter != src.mergedRcalls[i].end();
 				++iter) {
-		// TODO:
-		//	rcall_key_t newKey;
-		//	groupMapper.map(newKey, iter->first);
-		//	combiner.addMergedRcall(newKey, iter->second);
+			local_key_t newSrc, newDst;
+			groupMapper.map(newSrc, local_key_t(iter->first.src_hip, iter->first.src_sid));
+			groupMapper.map(newDst, local_key_t(iter->first.dst_hip, iter->first.dst_sid));
+
+			combiner.addMergedRcall(rcall_key_t(newSrc.hip, newSrc.sid, newDst.hip, newDst.sid), iter->second);
 		}
 	}
 
@@ -650,12 +2865,13 @@ int FileStorage::combineStats(StatCombiner& combiner, const StatMerger& src, Gro
 //	pid,mid,iid as in [0-2] (no case #3)
 //	host=[auto]
 //
-int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalView, int64_t startDtime, int64_t endDtime, 
+int FileStorage::querySystemStats(StatCombiner& combiner, int context, int totalView, int64_t startDtime, int64_t endDtime, 
 				int spanUnit, int spanCount, int pid, int mid,
-				const std::vector<int> iids,
+				const std::vector<int>& iids,
 				const host_set_t& hosts)
 {
-	int mergeCount = (endDtime - startDtime) / spanLength(spanUnit, spanCount);
+	int64_t span = spanLength(spanUnit, spanCount);
+	int mergeCount = (endDtime - startDtime + span - 1) / span;
 	StatMerger merger(spanUnit, spanCount, startDtime, mergeCount);
 	
 	if (pid == 0) {
@@ -663,45 +2879,18 @@ int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalVi
 		return -1;
 	}
 
-	int cpuTotal = 0, cpuCores = 0; std::tr1::unordered_set<int> cpuIds;
-	int memory = 0;
-	int loadAvg = 0;
-	int netAll = 0; std::tr1::unordered_set<int> netIds;
-	int diskAll = 0; std::tr1::unordered_set<int> diskIds;
-
-	for (std::vector<int>::const_iterator iter = iids.begin();
-		iter != iids.end();
-			++iter) {
-		if (IID_IS4CPU(*iter)) {
-			int id = IID2CPUNO(*iter);
-			if (id == IID_CPU_CORES) cpuCores = 1;
-			else if (id == IID_CPU_TOTAL) cpuTotal = 1;
-			else cpuIds.insert(id);
-		}
-		else if (IID_IS4MEM(*iter)) {
-			memory = 1;
-		}
-		else if (IID_IS4LOADAVG(*iter)) {
-			loadAvg = 1;
-		}
-		else if (IID_IS4NET(*iter)) {
-			int id = IID2NETNO(*iter);
-			if (id == IID_NET_ALL) netAll = 1;
-			else netIds.insert(id);
-		}
-		else if (IID_IS4DISK(*iter)) {
-			int id = IID2DISKNO(*iter);
-			if (id == IID_DISK_ALL) diskAll = 1;
-			else diskIds.insert(id);
-		}
-	}
+	SystemIidSelector selector(iids);
 
 	// get all possible iids first
 	local_key_set_t ids;
-	if (expandIds(ids, pid, mid, 0, NULL) < 0) {
-		APPLOG_WARN("invalid pid/mid/iid parameters: %m");
-		return -1;
+	{
+		ProfileStage stage(PROFILE_EXPAND);
+		if (expandIds(ids, pid, mid, 0, hosts.empty() ? NULL : &hosts) < 0) {
+			APPLOG_WARN("invalid pid/mid/iid parameters: %m");
+			return -1;
+		}
 	}
+	QueryProfile::count(PROFILE_SERIES_MATCHED, ids.size());
 
 	// TODO: mapping business-{pid,mid} => hosts => resource-{pid,mid}
 	if (context == CT_BUSINESS) {
@@ -709,86 +2898,10 @@ int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalVi
 		// mapBusiness2ResourceIds(ids, id2Map);
 	}
 
-	// step 5: load data and merge into bigger span
-	if (cpuTotal || cpuCores || !cpuIds.empty()) {
-		std::tr1::unordered_set<int> iids;
-		std::tr1::unordered_set<int> newIds;
-
-		for (local_key_set_t::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-			if (!IID_IS4CPU(iter->sid.iid)) continue;
-
-			int cpuId = IID2CPUNO(iter->sid.iid);
-			if ((cpuTotal && cpuId == IID_CPU_TOTAL)
-				|| (cpuCores && cpuId != IID_CPU_TOTAL)
-					|| cpuIds.find(cpuId) != cpuIds.end()) {
-				iids.insert(iter->sid.iid);
-				newIds.insert(cpuId);	
-			}
-		}
-		
-		cpuIds.swap(newIds);
-		loadStatsForIdsHosts(ids, startDtime, endDtime, merger, iids);
-	}
-
-	if (memory) {
-		std::tr1::unordered_set<int> iids;
-		for (local_key_set_t::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-			if (IID_IS4MEM(iter->sid.iid)) {
-				iids.insert(iter->sid.iid);
-			}
-		}
-
-		loadStatsForIdsHosts(ids, startDtime, endDtime, merger, iids);
-	}
-
-	
-	if (loadAvg) {
-		std::tr1::unordered_set<int> iids;
-
-		for (local_key_set_t::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-			if (IID_IS4LOADAVG(iter->sid.iid)) {
-				iids.insert(iter->sid.iid);
-			}
-		}
-
-		loadStatsForIdsHosts(ids, startDtime, endDtime, merger, iids);
-	}
-
-	if (netAll || !netIds.empty()) {
-		std::tr1::unordered_set<int> iids;
-		std::tr1::unordered_set<int> newIds;
-
-		for (local_key_set_t::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-			if (!IID_IS4NET(iter->sid.iid)) continue;
-
-			int netId = IID2NETNO(iter->sid.iid);
-			if (netAll || netIds.find(netId) != netIds.end()) {
-				iids.insert(iter->sid.iid);
-				newIds.insert(netId);
-			}
-		}
-		
-		netIds.swap(newIds);
-		loadStatsForIdsHosts(ids, startDtime, endDtime, merger, iids);
-	}
-
-	if (diskAll || !diskIds.empty()) {
-		std::tr1::unordered_set<int> iids;
-		std::tr1::unordered_set<int> newIds;
-
-		for (local_key_set_t::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
-			if (!IID_IS4DISK(iter->sid.iid)) continue;
-
-			int diskId = IID2DISKNO(iter->sid.iid);
-			if (diskAll || diskIds.find(diskId) != diskIds.end()) {
-				iids.insert(iter->sid.iid);
-				newIds.insert(diskId);
-			}
-		}
-
-		diskIds.swap(newIds);
-		loadStatsForIdsHosts(ids, startDtime, endDtime, merger, iids);
-	}
+	// step 5: plan files of all requested iids in one pass, from
+	// the coarsest rollups fitting the span, then load data and
+	// merge into bigger span in one sweep
+	loadStats(ids, selector, startDtime, endDtime, spanUnit, spanCount, merger);
 
 	// further merge
 	//StatCombiner combiner(spanUnit, spanCount, startDtime, mergeCount);
@@ -807,6 +2920,7 @@ int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalVi
 			}
 	}
 **/
+	ProfileStage stage(PROFILE_COMBINE);
 	int gtype;
 	if (pid == 0 || (mid == 0 && totalView)) {
 		// department-level/product-level: merge by pid
@@ -827,6 +2941,551 @@ int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalVi
 		combineStats(combiner, merger, mapper);
 	}
 
+	if (merger.incomplete) combiner.incomplete = true;
+	return 0;
+}
+
+//
+// periods cached of the same query are taken from the cache, runs
+// of the others (the new tail mostly) are queried and spliced in.
+// periods must be aligned by start for that, or it is all queried
+//
+int FileStorage::getSystemStats(StatCombiner& combiner, int context, int totalView, int64_t startDtime, int64_t endDtime, 
+				int spanUnit, int spanCount, int pid, int mid,
+				const std::vector<int> iids,
+				const host_set_t& hosts)
+{
+	int64_t span = spanLength(spanUnit, spanCount);
+	if (!queryCache.isEnabled() || span <= 0 || startDtime % span != 0 || endDtime <= startDtime)
+		return querySystemStats(combiner, context, totalView, startDtime, endDtime,
+				spanUnit, spanCount, pid, mid, iids, hosts);
+
+	std::string key;
+	QueryCache::makeKey(key, context, totalView, spanUnit, spanCount, pid, mid, iids, hosts);
+
+	uint64_t seq = queryCache.getSequence(pid);
+	period_run_list_t missing;
+	queryCache.lookup(key, startDtime, endDtime, span, combiner, missing);
+
+	for (size_t i = 0; i < missing.size(); ++i) {
+		int64_t start = missing[i].first, end = missing[i].second;
+		int count = (end - start + span - 1) / span;
+		StatCombiner part(spanUnit, spanCount, start, count);
+
+		if (querySystemStats(part, context, totalView, start, end, spanUnit, spanCount,
+				pid, mid, iids, hosts) < 0)
+			return -1;
+
+		int first = (start - startDtime) / span;
+		for (int j = 0; j < count && first + j < combiner.periodCount; ++j) {
+			combiner.mergedGauges[first + j] = part.mergedGauges[j];
+			combiner.mergedLcalls[first + j] = part.mergedLcalls[j];
+		}
+		if (part.incomplete) combiner.incomplete = true;
+
+		queryCache.store(key, pid, mid, span, part, start, end, seq);
+	}
+
+	return 0;
+}
+
+// periods of a query in a batch not in the cache, [start, end)
+struct FileStorage::BatchLoad {
+	size_t query;
+	int64_t start;
+	int64_t end;
+	std::string cacheKey;		// empty if not cached
+	uint64_t seq;			// of the cache, before it is looked up
+};
+
+//
+// the cached periods of each query are taken as getSystemStats does,
+// then the queries with periods to load are grouped by their range
+// and span, and each group is loaded in one pass
+//
+int FileStorage::getSystemStatsBatch(system_query_list_t& queries)
+{
+	std::vector<BatchLoad> loads;
+
+	for (size_t q = 0; q < queries.size(); ++q) {
+		system_query_t& query = queries[q];
+		int64_t span = spanLength(query.spanUnit, query.spanCount);
+		if (query.pid == 0 || span <= 0 || query.end <= query.start) {
+			APPLOG_ERROR("invalid query %d of the batch", (int)q);
+			return -1;
+		}
+
+		BatchLoad load;
+		load.query = q;
+		load.start = query.start;
+		load.end = query.end;
+		load.seq = queryCache.getSequence(query.pid);
+
+		if (queryCache.isEnabled() && query.start % span == 0) {
+			QueryCache::makeKey(load.cacheKey, query.context, query.totalView, query.spanUnit, query.spanCount,
+				query.pid, query.mid, query.iids, query.hosts);
+
+			period_run_list_t missing;
+			queryCache.lookup(load.cacheKey, query.start, query.end, span, *query.combiner, missing);
+			if (missing.empty())
+				continue;
+
+			// the runs missing in one, mostly it is the new tail
+			load.start = missing.front().first;
+			load.end = missing.back().second;
+		}
+
+		loads.push_back(load);
+	}
+
+	std::vector<bool> grouped(loads.size(), false);
+	for (size_t i = 0; i < loads.size(); ++i) {
+		if (grouped[i]) continue;
+
+		const system_query_t& first = queries[loads[i].query];
+		std::vector<size_t> group;
+		for (size_t j = i; j < loads.size(); ++j) {
+			const system_query_t& query = queries[loads[j].query];
+			if (grouped[j] || loads[j].start != loads[i].start || loads[j].end != loads[i].end
+					|| query.spanUnit != first.spanUnit || query.spanCount != first.spanCount)
+				continue;
+
+			grouped[j] = true;
+			group.push_back(j);
+		}
+
+		if (loadBatch(queries, loads, group) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+//
+// series of all queries of a group loaded into one merger, each of
+// them once, then each query combines the ones of its own
+//
+int FileStorage::loadBatch(system_query_list_t& queries, const std::vector<BatchLoad>& loads,
+			   const std::vector<size_t>& group)
+{
+	const BatchLoad& first = loads[group[0]];
+	int spanUnit = queries[first.query].spanUnit, spanCount = queries[first.query].spanCount;
+	int64_t span = spanLength(spanUnit, spanCount);
+	int count = (first.end - first.start + span - 1) / span;
+
+	std::vector<local_key_set_t> ids(group.size());
+	local_key_set_t allIds;
+	std::vector<int> allIids;
+	{
+		ProfileStage stage(PROFILE_EXPAND);
+		for (size_t g = 0; g < group.size(); ++g) {
+			const system_query_t& query = queries[loads[group[g]].query];
+			if (expandIds(ids[g], query.pid, query.mid, 0, query.hosts.empty() ? NULL : &query.hosts) < 0) {
+				APPLOG_WARN("invalid pid/mid/iid parameters: %m");
+				return -1;
+			}
+
+			allIds.insert(ids[g].begin(), ids[g].end());
+			allIids.insert(allIids.end(), query.iids.begin(), query.iids.end());
+		}
+	}
+	QueryProfile::count(PROFILE_SERIES_MATCHED, allIds.size());
+
+	StatMerger merger(spanUnit, spanCount, first.start, count);
+	SystemIidSelector allSelector(allIids);
+	loadStats(allIds, allSelector, first.start, first.end, spanUnit, spanCount, merger);
+
+	ProfileStage stage(PROFILE_COMBINE);
+	for (size_t g = 0; g < group.size(); ++g) {
+		const BatchLoad& load = loads[group[g]];
+		system_query_t& query = queries[load.query];
+
+		// combined as querySystemStats does
+		ProductMapper productMapper;
+		ModuleMapper moduleMapper;
+		HostMapper hostMapper;
+		GroupMapper *mapper;
+		if (query.mid == 0 && query.totalView) mapper = &productMapper;
+		else if (query.mid == 0 || query.totalView) mapper = &moduleMapper;
+		else mapper = &hostMapper;
+
+		StatCombiner part(spanUnit, spanCount, load.start, count);
+		SystemIidSelector selector(query.iids);
+		combineSelected(part, merger, ids[g], selector, *mapper);
+		// of any series of the group, it can not tell whose
+		part.incomplete = merger.incomplete;
+		if (part.incomplete) query.combiner->incomplete = true;
+
+		if (!load.cacheKey.empty())
+			queryCache.store(load.cacheKey, query.pid, query.mid, span, part, load.start, load.end, load.seq);
+
+		int firstPeriod = (load.start - query.start) / span;
+		for (int j = 0; j < count && firstPeriod + j < query.combiner->periodCount; ++j)
+			query.combiner->mergedGauges[firstPeriod + j].swap(part.mergedGauges[j]);
+	}
+
+	return 0;
+}
+
+// series of a user stats query loaded and folded at a time
+#define USER_STATS_BATCH	64
+
+static void addCalls(call_stats_t& stats, const StatMergedLcall::mresult_map_t& rets)
+{
+	for (StatMergedLcall::const_iterator iter = rets.begin(); iter != rets.end(); ++iter) {
+		stats.count += iter->second.count;
+		stats.rsptime += (uint64_t)iter->second.rsptime * iter->second.count;
+		if (iter->first != 0) stats.errors += iter->second.count;
+	}
+}
+
+//
+// minute MR_ files of the catalog's series in the years of
+// [start, end) they have data in
+//
+void FileStorage::planRcallKeys(series_file_list_t& files, const rcall_key_list_t& keys, int64_t start, int64_t end)
+{
+	int startYear = yearOf(start), endYear = yearOf(end - 1);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		const rcall_key_t& key = keys[i].first;
+		for (int year = startYear; year <= endYear; ++year) {
+			if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX
+				|| (keys[i].second & CATALOG_YEAR_BIT(year)) == 0)
+				continue;
+
+			char path[PATH_MAX];
+			makePath(path, sizeof path, "MR", year, key.src_sid, key.src_hip,
+				key.dst_sid, key.dst_hip, FT_MINUTE, 1);
+
+			series_file_t file;
+			file.path = path;
+			file.key = local_key_t(key.src_hip, key.src_sid);
+			file.layout = LAYOUT_SERIES_FILE;
+			file.partition = partitionOf(key);
+			file.withLate = false;
+			files.push_back(file);
+		}
+	}
+
+	std::sort(files.begin(), files.end(), seriesFileLess);
+}
+
+// MR_ files of callers in pid/mid/iid/hosts
+int FileStorage::planRcallFiles(series_file_list_t& files, int64_t start, int64_t end,
+				int pid, int mid, int iid, const host_set_t& hosts)
+{
+	rcall_key_list_t keys;
+	if (rcallCatalog.expand(keys, pid, mid, iid, hosts.empty() ? NULL : &hosts, false) < 0)
+		return -1;
+
+	planRcallKeys(files, keys, start, end);
+	return 0;
+}
+
+//
+// series are loaded USER_STATS_BATCH at a time into a merger of
+// their own and given to the sink, which keeps what it needs only,
+// so memory is bound by a batch whatever the selection is. lcalls
+// are by the series, rcalls by the callee
+//
+int FileStorage::scanUserStats(CallStatsSink& sink, int type, int64_t start, int64_t end,
+			       int spanUnit, int spanCount, int pid, int mid, int iid, const host_set_t& hosts)
+{
+	int64_t span = spanLength(spanUnit, spanCount);
+	if (pid == 0 || span <= 0 || end <= start) {
+		APPLOG_ERROR("invalid pid(%d) or span or range of user stats", pid);
+		return -1;
+	}
+
+	int periodCount = (end - start + span - 1) / span;
+
+	if (type == USER_STATS_LCALL) {
+		local_key_set_t ids;
+		{
+			ProfileStage stage(PROFILE_EXPAND);
+			if (lcallCatalog.expand(ids, pid, mid, iid, hosts.empty() ? NULL : &hosts) < 0) {
+				APPLOG_WARN("invalid pid/mid/iid parameters: %m");
+				return -1;
+			}
+		}
+		QueryProfile::count(PROFILE_SERIES_MATCHED, ids.size());
+
+		AllSeriesSelector selector;
+		local_key_set_t::const_iterator iter = ids.begin();
+		while (iter != ids.end()) {
+			local_key_set_t batch;
+			for (; iter != ids.end() && batch.size() < USER_STATS_BATCH; ++iter)
+				batch.insert(*iter);
+
+			StatMerger merger(spanUnit, spanCount, start, periodCount);
+			loadStats(batch, selector, start, end, spanUnit, spanCount, merger, "ML");
+
+			for (int i = 0; i < merger.periodCount; ++i) {
+				for (const_lcall_iterator lcall = merger.mergedLcalls[i].begin();
+					lcall != merger.mergedLcalls[i].end();
+						++lcall) {
+					sink.add(i, lcall->first, lcall->second.rets);
+				}
+			}
+		}
+	}
+	else if (type == USER_STATS_RCALL) {
+		series_file_list_t files;
+		{
+			ProfileStage stage(PROFILE_EXPAND);
+			planRcallFiles(files, start, end, pid, mid, iid, hosts);
+		}
+		QueryProfile::count(PROFILE_SERIES_MATCHED, files.size());
+
+		for (size_t first = 0; first < files.size(); first += USER_STATS_BATCH) {
+			size_t last = std::min(first + USER_STATS_BATCH, files.size());
+			series_file_list_t batch(files.begin() + first, files.begin() + last);
+
+			StatMerger merger(spanUnit, spanCount, start, periodCount);
+			loadSeriesFiles(batch, start, end, merger);
+
+			for (int i = 0; i < merger.periodCount; ++i) {
+				for (const_rcall_iterator rcall = merger.mergedRcalls[i].begin();
+					rcall != merger.mergedRcalls[i].end();
+						++rcall) {
+					sink.add(i, local_key_t(rcall->first.dst_hip, rcall->first.dst_sid), rcall->second.rets);
+				}
+			}
+		}
+	}
+	else {
+		APPLOG_ERROR("unknown user stats type: %d", type);
+		return -1;
+	}
+
+	return 0;
+}
+
+class PeriodCallSink : public CallStatsSink {
+public:
+	PeriodCallSink(call_stats_list_t& _periods) : periods(_periods) {}
+public:
+	virtual void add(int period, const local_key_t& key, const StatMergedLcall::mresult_map_t& rets) {
+		if (period >= 0 && period < (int)periods.size())
+			addCalls(periods[period], rets);
+	}
+private:
+	call_stats_list_t& periods;
+};
+
+int FileStorage::getUserStats(call_stats_list_t& periods, int type, int64_t start, int64_t end,
+			      int spanUnit, int spanCount, int pid, int mid, int iid, const host_set_t& hosts)
+{
+	int64_t span = spanLength(spanUnit, spanCount);
+	if (span <= 0 || end <= start) {
+		APPLOG_ERROR("invalid span or range of user stats");
+		return -1;
+	}
+
+	periods.assign((end - start + span - 1) / span, call_stats_t());
+
+	PeriodCallSink sink(periods);
+	return scanUserStats(sink, type, start, end, spanUnit, spanCount, pid, mid, iid, hosts);
+}
+
+typedef std::tr1::unordered_map<local_key_t, call_stats_t, LocalKeyHash> call_stats_map_t;
+
+class GroupCallSink : public CallStatsSink {
+public:
+	GroupCallSink(int _groupBy) : groupBy(_groupBy) {}
+public:
+	virtual void add(int period, const local_key_t& key, const StatMergedLcall::mresult_map_t& rets) {
+		local_key_t group;
+		if (groupBy == TOPK_BY_HOST) group = local_key_t(key.hip, stat_id_t(0, 0, 0));
+		else group = local_key_t(stat_ip_t(0), key.sid);
+
+		addCalls(groups[group], rets);
+	}
+private:
+	int groupBy;
+public:
+	call_stats_map_t groups;
+};
+
+//
+// x ranks before y, by average rsptime or error ratio (then errors)
+//
+class TopCallsBefore {
+public:
+	TopCallsBefore(int _orderBy) : orderBy(_orderBy) {}
+public:
+	bool operator()(const top_calls_t& x, const top_calls_t& y) const {
+		const call_stats_t& a = x.stats, & b = y.stats;
+		if (orderBy == TOPK_ERRORS) {
+			double ra = (double)a.errors / a.count, rb = (double)b.errors / b.count;
+			if (ra != rb) return ra > rb;
+			return a.errors > b.errors;
+		}
+
+		return (double)a.rsptime / a.count > (double)b.rsptime / b.count;
+	}
+private:
+	int orderBy;
+};
+
+//
+// groups are partial sums of the batches, and the top k of them
+// are kept in a heap of k, whose top is the last of the k
+//
+int FileStorage::getTopUserStats(top_calls_list_t& top, int type, int64_t start, int64_t end,
+				 int pid, int mid, int iid, const host_set_t& hosts, int orderBy, int groupBy, size_t k)
+{
+	top.clear();
+	if (k == 0) return 0;
+
+	// hourly periods, to read hourly rollups of lcalls if any
+	GroupCallSink sink(groupBy);
+	if (scanUserStats(sink, type, start, end, FT_HOUR, 1, pid, mid, iid, hosts) < 0)
+		return -1;
+
+	std::priority_queue<top_calls_t, top_calls_list_t, TopCallsBefore> heap((TopCallsBefore(orderBy)));
+	for (call_stats_map_t::const_iterator iter = sink.groups.begin(); iter != sink.groups.end(); ++iter) {
+		if (iter->second.count == 0)
+			continue;
+
+		top_calls_t one;
+		one.key = iter->first;
+		one.stats = iter->second;
+
+		heap.push(one);
+		if (heap.size() > k) heap.pop();
+	}
+
+	top.resize(heap.size());
+	for (size_t i = top.size(); i > 0; --i) {
+		top[i - 1] = heap.top();
+		heap.pop();
+	}
+
 	return 0;
 }
 
+class CallGraphTask : public WorkerTask {
+public:
+	CallGraphTask(FileStorage *_storage, TaskGroup& _group, const series_file_list_t& _files,
+		      size_t _first, size_t _last, int64_t _start, int64_t _end, int _level, call_edge_map_t *_edges)
+		: storage(_storage), group(_group), files(_files), first(_first), last(_last),
+		  start(_start), end(_end), level(_level), edges(_edges), profile(QueryProfile::current())
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		QueryProfile::setCurrent(profile);
+		storage->loadCallEdges(files, first, last, start, end, level, *edges);
+		QueryProfile::setCurrent(NULL);
+		group.done();
+	}
+private:
+	FileStorage *storage;
+	TaskGroup& group;
+	const series_file_list_t& files;
+	size_t first, last;
+	int64_t start, end;
+	int level;
+	call_edge_map_t *edges;
+	QueryProfile *profile;	// of the query
+};
+
+//
+// items of each file in [start, end) are summed by days and then
+// into the edge of the file, the key of which is the file's rcall
+// key at the level
+//
+void FileStorage::loadCallEdges(const series_file_list_t& files, size_t first, size_t last,
+				int64_t start, int64_t end, int level, call_edge_map_t& edges)
+{
+	int dayCount = (end - start + DAY_MSECS - 1) / DAY_MSECS;
+
+	for (size_t i = first; i < last; ++i) {
+		StatMerger merger(FT_DAY, 1, start, dayCount);
+		loadSeriesFile(files[i], start, end, merger);
+
+		for (int j = 0; j < merger.periodCount; ++j) {
+			for (const_rcall_iterator iter = merger.mergedRcalls[j].begin();
+				iter != merger.mergedRcalls[j].end();
+					++iter) {
+				rcall_key_t key = iter->first;
+				if (level == CALL_GRAPH_MODULE) {
+					key.src_hip = key.dst_hip = stat_ip_t(0);
+					key.src_sid.iid = key.dst_sid.iid = 0;
+				}
+				else {
+					key.src_sid.iid = key.dst_sid.iid = 0;
+				}
+
+				addCalls(edges[key], iter->second.rets);
+			}
+		}
+	}
+}
+
+//
+// edges between modules (or hosts of them) of calls from or to pid
+// (0 for all) in [start, end), from the catalog's MR_ files of the
+// years in one pass: a task per run of files sums into its own flat edge map
+// and the maps are added up at last
+//
+int FileStorage::getCallGraph(call_edge_map_t& edges, int64_t start, int64_t end, int pid, int level)
+{
+	if (end <= start) {
+		APPLOG_ERROR("invalid range of call graph");
+		return -1;
+	}
+
+	series_file_list_t files;
+	{
+		ProfileStage stage(PROFILE_EXPAND);
+		rcall_key_list_t keys;
+		if (rcallCatalog.expand(keys, pid, 0, 0, NULL, true) < 0)
+			return -1;
+
+		planRcallKeys(files, keys, start, end);
+	}
+	QueryProfile::count(PROFILE_SERIES_MATCHED, files.size());
+
+	int chunks = 1;
+	if (queryPool != NULL && queryPool->size() > 0) {
+		chunks = (files.size() + SERIES_FILES_PER_TASK - 1) / SERIES_FILES_PER_TASK;
+		if (chunks > queryParallelism) chunks = queryParallelism;
+	}
+
+	if (chunks <= 1) {
+		ProfileStage stage(PROFILE_LOAD);
+		loadCallEdges(files, 0, files.size(), start, end, level, edges);
+		return 0;
+	}
+
+	std::vector<call_edge_map_t> partials(chunks);
+	std::vector<WorkerTask *> tasks;
+	size_t step = (files.size() + chunks - 1) / chunks;
+
+	TaskGroup group;
+	for (int i = 0; i < chunks; ++i) {
+		size_t first = i * step, last = std::min(first + step, files.size());
+		if (first >= last) break;
+
+		tasks.push_back(new CallGraphTask(this, group, files, first, last, start, end, level, &partials[i]));
+	}
+
+	{
+		ProfileStage stage(PROFILE_LOAD);
+		runTasks(queryPool, group, tasks);
+	}
+
+	ProfileStage stage(PROFILE_MERGE);
+	for (int i = 0; i < chunks; ++i) {
+		for (call_edge_map_t::const_iterator iter = partials[i].begin(); iter != partials[i].end(); ++iter) {
+			call_stats_t& stats = edges[iter->first];
+			stats.count += iter->second.count;
+			stats.errors += iter->second.errors;
+			stats.rsptime += iter->second.rsptime;
+		}
+	}
+
+	APPLOG_DEBUG("call graph of %ld edges from %ld files in %d tasks", (long)edges.size(), (long)files.size(), chunks);
+	return 0;
+}
@@ -4,20 +4,120 @@
 #ifndef __FILE_STORAGE__H
 #define __FILE_STORAGE__H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string>
 #include <vector>
 #include <tr1/unordered_set>
+#include <tr1/unordered_map>
 
 #include "StatData.h"
+#include "StatSystemIids.h"
+#include "TimeIndex.h"
+#include "SeriesCatalog.h"
+#include "MemTable.h"
+#include "SegmentFile.h"
+#include "Rollup.h"
+#include "HotTier.h"
+#include "QueryCache.h"
+#include "Compactor.h"
 
 class StatMerger;
 class StatCombiner;
+class WorkerPool;
 
-typedef std::tr1::unordered_set<local_key_t, LocalKeyHash> local_key_set_t;
-typedef std::tr1::unordered_set<rcall_key_t, LocalKeyHash> rcall_key_set_t;
-typedef std::tr1::unordered_set<stat_ip_t, HipHash> host_set_t;
+typedef std::tr1::unordered_set<rcall_key_t, RcallKeyHash> rcall_key_set_t;
+
+// how series are laid out in files
+#define LAYOUT_SERIES_FILE	0	/* one file per series and year */
+#define LAYOUT_SEGMENT		1	/* gauges/lcalls of a module and day in one segment */
+
+// one series file (or one series in a segment) to be loaded by a query
+typedef struct series_file_tag {
+	std::string path;
+	local_key_t key;
+	int layout;
+	int partition;	// of its memtable items, -1 for partitionOf(key)
+	bool withLate;	// a rollup, its late items are in a .late file beside it
+} series_file_t;
+
+typedef std::vector<series_file_t> series_file_list_t;
+
+// a piece of a query range, read from minute data or a rollup level
+typedef struct stats_range_tag {
+	int64_t start;
+	int64_t end;
+	int level;	// -1 for minute data
+} stats_range_t;
+
+typedef std::vector<stats_range_t> stats_range_list_t;
+
+// what user stats are about
+#define USER_STATS_LCALL	0	/* ML: calls served by the selection */
+#define USER_STATS_RCALL	1	/* MR: calls made by the selection */
+
+// what user stats queries return
+#define USER_STATS_PERIODS	0	/* calls of each period */
+#define USER_STATS_TOP		1	/* the top groups of the range */
+
+// count, errors and avg rsptime of a period or group in responses
+#define USER_STATS_ENTRY_SIZE	(8 + 8 + 4)
+
+// how top user stats are ranked and grouped
+#define TOPK_SLOWEST		0
+#define TOPK_ERRORS		1
+
+#define TOPK_BY_IID		0
+#define TOPK_BY_HOST		1
+
+// calls of a period or a group, errors are the ones of non-zero
+// retcodes, rsptime is the total for averaging
+typedef struct call_stats_tag {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t rsptime;
+
+	call_stats_tag() : count(0), errors(0), rsptime(0) {}
+} call_stats_t;
+
+typedef std::vector<call_stats_t> call_stats_list_t;
+
+// one group of top user stats, by iid (host 0) or by host (sid 0)
+typedef struct top_calls_tag {
+	local_key_t key;
+	call_stats_t stats;
+} top_calls_t;
+
+typedef std::vector<top_calls_t> top_calls_list_t;
+
+// what the nodes of a call graph are
+#define CALL_GRAPH_MODULE	0	/* pid/mid, iid and host are 0 */
+#define CALL_GRAPH_HOST		1	/* pid/mid/host, iid is 0 */
+
+// src sid, src hip, dst sid, dst hip and stats of an edge in responses
+#define CALL_EDGE_SIZE		(6 + 5 + 6 + 5 + USER_STATS_ENTRY_SIZE)
+
+// calls of each edge (src => dst) of a call graph
+typedef std::tr1::unordered_map<rcall_key_t, call_stats_t, RcallKeyHash> call_edge_map_t;
+
+// a system stats query of a batch, combined into combiner which has
+// the periods of [start, end)
+typedef struct system_query_tag {
+	int context;
+	int totalView;
+	int64_t start;
+	int64_t end;
+	int spanUnit;
+	int spanCount;
+	int pid;
+	int mid;
+	std::vector<int> iids;
+	host_set_t hosts;
+	StatCombiner *combiner;
+} system_query_t;
+
+typedef std::vector<system_query_t> system_query_list_t;
 
 class ScanFilter {
 public:
@@ -25,16 +125,129 @@ public:
 	virtual bool acceptProduct(const char *name) = 0;
 	virtual bool acceptModule(const char *name) = 0;
 	virtual bool accept(const char *name) = 0;
+	virtual bool acceptFile(const char *dir, const char *name) { return accept(name); }
+};
+
+class SeriesSelector {
+public:
+	virtual bool accept(int iid) const = 0;
 };
 
 class GroupMapper {
 public:
+	virtual ~GroupMapper() { /* nothing */ }
 	virtual void map(local_key_t& newKey, const local_key_t& key) = 0;
 };
 
+//
+// which system iids are requested: cpu-total, cpu-cores, cpu-N,
+// mem, load-avg, net-all, net-N, disk-all, disk-N
+//
+class SystemIidSelector : public SeriesSelector {
+public:
+	SystemIidSelector(const std::vector<int>& iids)
+		: cpuTotal(false), cpuCores(false), memory(false), loadAvg(false),
+		  netAll(false), diskAll(false) {
+		for (std::vector<int>::const_iterator iter = iids.begin();
+			iter != iids.end();
+				++iter) {
+			if (IID_IS4CPU(*iter)) {
+				int id = IID2CPUNO(*iter);
+				if (id == IID_CPU_CORES) cpuCores = true;
+				else if (id == IID_CPU_TOTAL) cpuTotal = true;
+				else cpuIds.insert(id);
+			}
+			else if (IID_IS4MEM(*iter)) {
+				memory = true;
+			}
+			else if (IID_IS4LOADAVG(*iter)) {
+				loadAvg = true;
+			}
+			else if (IID_IS4NET(*iter)) {
+				int id = IID2NETNO(*iter);
+				if (id == IID_NET_ALL) netAll = true;
+				else netIds.insert(id);
+			}
+			else if (IID_IS4DISK(*iter)) {
+				int id = IID2DISKNO(*iter);
+				if (id == IID_DISK_ALL) diskAll = true;
+				else diskIds.insert(id);
+			}
+		}
+	}
+public:
+	virtual bool accept(int iid) const {
+		if (IID_IS4CPU(iid)) {
+			int cpuId = IID2CPUNO(iid);
+			return (cpuTotal && cpuId == IID_CPU_TOTAL)
+				|| (cpuCores && cpuId != IID_CPU_TOTAL)
+					|| cpuIds.find(cpuId) != cpuIds.end();
+		}
+
+		if (IID_IS4MEM(iid)) return memory;
+		if (IID_IS4LOADAVG(iid)) return loadAvg;
+		if (IID_IS4NET(iid)) return netAll || netIds.find(IID2NETNO(iid)) != netIds.end();
+		if (IID_IS4DISK(iid)) return diskAll || diskIds.find(IID2DISKNO(iid)) != diskIds.end();
+
+		return false;
+	}
+private:
+	bool cpuTotal, cpuCores; std::tr1::unordered_set<int> cpuIds;
+	bool memory;
+	bool loadAvg;
+	bool netAll; std::tr1::unordered_set<int> netIds;
+	bool diskAll; std::tr1::unordered_set<int> diskIds;
+};
+
+// system stats combined by pid, by pid/mid or by host
+class ProductMapper : public GroupMapper {
+public:
+	void map(local_key_t& newKey, const local_key_t& key) {
+		newKey.sid = stat_id_t(key.sid.pid, 0, key.sid.iid);
+		newKey.hip = 0;
+	}
+
+	std::tr1::unordered_set<int> mids;
+};
+
+class ModuleMapper : public GroupMapper {
+public:
+	void map(local_key_t& newKey, const local_key_t& key) {
+		newKey.sid = stat_id_t(key.sid.pid, key.sid.mid, key.sid.iid);
+		newKey.hip = 0;
+	}
+
+	std::tr1::unordered_set<stat_ip_t> hosts;
+};
+
+class HostMapper : public GroupMapper {
+public:
+	void map(local_key_t& newKey, const local_key_t& key) {
+		newKey.sid = stat_id_t(0, 0, key.sid.iid);
+		newKey.hip = key.hip;
+	}
+};
+
+// takes calls of user stats queries batch by batch
+class CallStatsSink {
+public:
+	virtual void add(int period, const local_key_t& key, const StatMergedLcall::mresult_map_t& rets) = 0;
+};
+
 class FileStorage {
+	friend class SeriesLoadTask;
+	friend class CallGraphTask;
 public:
-	FileStorage() { /* nothing */ }
+	FileStorage() : layout(LAYOUT_SERIES_FILE), readSeriesFiles(true),
+			partitionCount(0), memtableMaxBytes(0), memtableMaxAge(0),
+			queryPool(NULL), queryParallelism(1), minuteHorizon(0) {
+		pthread_mutex_init(&rollupLock, NULL);
+	}
+	~FileStorage() {
+		closeRollups();
+		closeMemTables();
+		pthread_mutex_destroy(&rollupLock);
+	}
 private:
 	FileStorage(const FileStorage&);
 	FileStorage& operator=(const FileStorage&);
@@ -49,47 +262,190 @@ private:
 		       const stat_id_t& src_sid, const stat_ip_t& src_hip,
 		       const stat_id_t& dst_sid, const stat_ip_t& dst_hip,
 		       uint8_t ftype, uint8_t freqs);
-	int saveStatData(char *path, unsigned char *data, size_t size);
-	int saveStatData(const char *typeString, int64_t timestamp, const stat_ip_t& hip,
+	int saveStatData(char *path, int64_t timestamp, unsigned char *data, size_t size);
+	char *makeLatePath(char *late, size_t size, const char *path);
+	int saveStatData(int partition, const char *typeString, int64_t timestamp, const stat_ip_t& hip,
 			 const stat_id_t& sid, uint8_t ftype, uint8_t freqs,
-			 unsigned char *data, size_t size);
-	int saveStatData(const char *typeString, int64_t timestamp, const stat_ip_t& src_hip,
+			 unsigned char *data, size_t size, bool late = false);
+	int saveStatData(int partition, const char *typeString, int64_t timestamp, const stat_ip_t& src_hip,
 			 const stat_id_t& src_sid, const stat_ip_t& dst_hip,
 			 const stat_id_t& dst_sid, uint8_t ftype, uint8_t freqs,
 			 unsigned char *data, size_t dsize);
+	char *makeSegmentPath(char *path, size_t size, const char *typeString, int64_t timestamp,
+			      const stat_id_t& sid, uint8_t ftype = FT_MINUTE, uint8_t freqs = 1);
+	void segmentChunks(std::vector<int64_t>& chunks, uint8_t ftype, int64_t start, int64_t end);
+	void makeMemKey(std::string& memKey, const char *segmentPath, const local_key_t& key);
+	int appendSegment(const char *path, const segment_series_list_t& series);
+	int flushSeries(memtable_map_t& series, MemTable *memtable);
+	int flushSegmentBatch(int partition);
+	char *makeWalPath(char *path, size_t size, int partition);
+	static int __replayItem(void *p, const unsigned char *data, size_t size);
+	int replayItem(const unsigned char *data, size_t size);
 public:
+	static int64_t spanLength(int unit, int count);
+
 	void setDirectory(const std::string& _baseDir) { baseDir = _baseDir; }
 	std::string getDirectory() const { return baseDir; }
+	void setTimeIndexStep(long step) { timeIndex.setStep(step); }
+	// series files are still read in segment layout if readOld
+	void setLayout(int _layout, bool readOld) { layout = _layout; readSeriesFiles = readOld; }
+	void setQueryPool(WorkerPool *pool, int parallelism) {
+		queryPool = pool;
+		queryParallelism = parallelism < 1 ? 1 : parallelism;
+	}
 
-	int saveMergedGauge(const StatMergedGauge& guage);
-	int saveMergedLcall(const StatMergedLcall& lcall);
-	int saveMergedRcall(const StatMergedRcall& rcall);
+	// finished periods of system stats queries, 0 entries for none
+	void setQueryCache(size_t entries, size_t periods) { queryCache.setCapacity(entries, periods); }
+
+	int loadCatalog();
+	int saveCatalog();
+
+	// ingest partitions, each saved by one thread only. items of
+	// a partition go into its memtable if maxBytes > 0, or are
+	// batched till flushMemTable() in segment layout
+	int openMemTables(int count, size_t maxBytes, int64_t maxAge);
+	void closeMemTables();
+	int flushMemTable(int partition, bool force);
+	int getPartitionCount() const { return partitionCount; }
+	int partitionOf(const local_key_t& key) const;
+	int partitionOf(const rcall_key_t& key) const;
+
+	// 5m/1h/1d rollups of minute gauges and lcalls, per partition,
+	// open them after memtables
+	int openRollups(bool enable);
+	void closeRollups();
+
+	// the last hours of minute gauges and lcalls in memory, open
+	// it after memtables, 0 hours for none
+	int openHotTier(int hours) { return hotTier.open(partitionCount, hours); }
+
+	// retention and downsampling by the policy, see Compactor
+	int compact(const compact_policy_t& policy, ingest_dispatch_t dispatch, void *arg, compact_stats_t& stats);
+	int rewriteSeriesFile(const char *path, int64_t dropBefore, const std::string& insert, int64_t& reclaimed);
+
+	// partition -1 means to save into files directly. late ones are rollup
+	// buckets closed already, kept apart out of the time-indexed files
+	int saveMergedGauge(const StatMergedGauge& guage, int partition = -1, bool late = false);
+	int saveMergedLcall(const StatMergedLcall& lcall, int partition = -1, bool late = false);
+	int saveMergedRcall(const StatMergedRcall& rcall, int partition = -1);
+
+	// offline only: pack all gauge/lcall series files into segments
+	int convertToSegments(bool keepOld, size_t maxBuffer);
 private:
 	std::string baseDir;
+	int layout;
+	bool readSeriesFiles;
+	TimeIndex timeIndex;
+	SeriesCatalog gaugeCatalog;
+	SeriesCatalog lcallCatalog;
+	RcallCatalog rcallCatalog;	// minute MR series only
+
+	int partitionCount;
+	std::vector<MemTable *> memtables;
+	// segment items of a partition without memtables, gathered by
+	// its writer for one group per segment at its next flush
+	std::vector<memtable_map_t> segmentBatches;
+	size_t memtableMaxBytes;
+	int64_t memtableMaxAge;
 
+	// loading files of one query fans out on it, at most
+	// queryParallelism tasks per query
+	WorkerPool *queryPool;
+	int queryParallelism;
+
+	HotTier hotTier;
+	QueryCache queryCache;
+
+	// ranges with incomplete rollups, only changed by openRollups()
+	std::vector<RollupSet *> rollups;
+	rollup_range_list_t dirtyRollups;
+	volatile int64_t minuteHorizon;	// minute data before it is dropped
+	pthread_mutex_t rollupLock;	// for the two above and the files
 private:
 	int parseStatsItem(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger);
 	int parseStatsData(MemoryBuffer *msg, int64_t start, int64_t end, StatMerger& merger);
-	void loadStatsForYear(const stat_id_t& sid, const stat_ip_t& hip, int year, 
-		int64_t start, int64_t end, StatMerger& merger);
-	void loadStatsForPeriod(const stat_id_t& sid, const stat_ip_t& hip, 
-		int64_t start, int64_t end, StatMerger& merger);
-	int64_t spanLength(int unit, int count);
+	int parseItemTimestamp(MemoryBuffer *msg, int64_t& timestamp, local_key_t *key = NULL, uint8_t *type = NULL);
+	int rebuildTimeIndex(const char *path, int fd, time_index_t& entries);
+	bool checkTimeIndexEntry(int fd, int64_t size, const time_index_entry_t& entry);
+	bool checkTimeIndex(int fd, const time_index_t& entries);
+	void loadStatsFile(const char *path, int64_t start, int64_t end, StatMerger& merger, int64_t fileLimit = -1);
+	void loadSeriesFile(const series_file_t& file, int64_t start, int64_t end, StatMerger& merger);
+	void loadSegmentSeries(const series_file_list_t& files, size_t first, size_t last,
+			int64_t start, int64_t end, StatMerger& merger);
+	void loadSeriesRange(const series_file_list_t& files, size_t first, size_t last,
+			int64_t start, int64_t end, StatMerger& merger);
+	static int __applySegmentData(void *p, size_t index, const unsigned char *data, size_t size);
+	int convertFile(const char *path, memtable_map_t& pending, size_t& pendingBytes);
+	char *makeRollupPath(char *path, size_t size, const char *name);
+	int saveRollupState(int64_t openSince, bool clean);
+	int loadDirtyRollups();
+	void addDirtyRollup(int64_t start, int64_t end);
+	int saveDirtyRollups();
+	void clearDirtyRollups(int64_t before);
+	int removeExpiredYears(int retainYears, compact_stats_t& stats);
+	int64_t backfillRollups(int64_t cutoff, int maxDays, ingest_dispatch_t dispatch, void *arg,
+		TaskGroup& group, compact_stats_t& stats);
+	void backfillSeries(const std::vector<local_key_t>& keys, const char *typeString,
+		const std::vector<int64_t>& days, memtable_map_t& pending, compact_stats_t& stats);
+	void addPending(memtable_map_t& pending, const char *typeString, int64_t timestamp,
+		const local_key_t& key, uint8_t ftype, uint8_t freqs, const unsigned char *data, size_t size);
+	int savePending(memtable_map_t& pending, ingest_dispatch_t dispatch, void *arg,
+		TaskGroup& group, compact_stats_t& stats);
+	int dropMinuteData(int64_t before, ingest_dispatch_t dispatch, void *arg,
+		TaskGroup& group, compact_stats_t& stats);
+	int rollupLevelOf(int spanUnit, int spanCount);
+	void planStatsRanges(stats_range_list_t& ranges, int level, int64_t start, int64_t end);
+	void loadHotStats(const local_key_set_t& ids, const SeriesSelector& selector, int64_t start, int64_t end,
+		StatMerger& merger, uint8_t type = STAT_MERGED_GAUGE);
+	int loadStats(const local_key_set_t& ids, const SeriesSelector& selector, int64_t start, int64_t end,
+		int spanUnit, int spanCount, StatMerger& merger, const char *typeString = "MG");
 	int scanDirectoryModule(ScanFilter *filter, const char *dname);
 	int scanDirectoryProduct(ScanFilter *filter, const char *dname);
 	int scanDirectoryYear(ScanFilter *filter, const char *dname);
 	int scanDirectoryRoot(ScanFilter *filter);
-	int loadStatsForIdsHosts(const local_key_set_t& ids, int64_t start, int64_t end, 
-		StatMerger& merger, const std::tr1::unordered_set<int>& validIds);
+	char *makeCatalogPath(char *path, size_t size, const char *typeString);
+	int planSeriesFiles(series_file_list_t& files, const local_key_set_t& ids,
+		const SeriesSelector& selector, int64_t start, int64_t end,
+		uint8_t ftype = FT_MINUTE, uint8_t freqs = 1, const char *typeString = "MG");
+	int loadSeriesFiles(const series_file_list_t& files, int64_t start, int64_t end, StatMerger& merger);
 	int combineStats(StatCombiner& combiner, const StatMerger& src, GroupMapper& groupMapper);
+	int combineSelected(StatCombiner& combiner, const StatMerger& src, const local_key_set_t& ids,
+		const SeriesSelector& selector, GroupMapper& groupMapper);
 	int expandIds(local_key_set_t& ids, int pid, int mid, int iid, const host_set_t *hosts);
+	int querySystemStats(StatCombiner& combiner, int context, int totalView, int64_t start, int64_t end,
+		int spanUnit, int spanCount, int pid, int mid,
+		const std::vector<int>& iids, const host_set_t& hosts);
 public:
 	int getSystemStats(StatCombiner& combiner, int context, int totalView, int64_t start, int64_t end,
 		int spanUnit, int spanCount, int pid, int mid, 
 		const std::vector<int> iids, const host_set_t& hosts);
-	int getUserStats(int totalView, int64_t start, int64_t end, int spanUnit, int spanCount,
-		int type, int pid, int mid, int iid, const host_set_t& hosts);
 
+	// queries of a dashboard at once, a series several of them have
+	// in the same range and span is loaded only once
+	int getSystemStatsBatch(system_query_list_t& queries);
+private:
+	struct BatchLoad;
+	int loadBatch(system_query_list_t& queries, const std::vector<BatchLoad>& loads,
+		const std::vector<size_t>& group);
+public:
+
+	// calls of ML/MR files, per period or the top k groups of
+	// the whole range
+	int getUserStats(call_stats_list_t& periods, int type, int64_t start, int64_t end,
+		int spanUnit, int spanCount, int pid, int mid, int iid, const host_set_t& hosts);
+	int getTopUserStats(top_calls_list_t& top, int type, int64_t start, int64_t end,
+		int pid, int mid, int iid, const host_set_t& hosts, int orderBy, int groupBy, size_t k);
+private:
+	void planRcallKeys(series_file_list_t& files, const rcall_key_list_t& keys, int64_t start, int64_t end);
+	int planRcallFiles(series_file_list_t& files, int64_t start, int64_t end,
+		int pid, int mid, int iid, const host_set_t& hosts);
+	int scanUserStats(CallStatsSink& sink, int type, int64_t start, int64_t end,
+		int spanUnit, int spanCount, int pid, int mid, int iid, const host_set_t& hosts);
+	void loadCallEdges(const series_file_list_t& files, size_t first, size_t last,
+		int64_t start, int64_t end, int level, call_edge_map_t& edges);
+public:
+	// edges of calls from or to pid (0 for all) in [start, end) by level
+	int getCallGraph(call_edge_map_t& edges, int64_t start, int64_t end, int pid, int level);
 };
 
 #endif /* __FILE_STORAGE__H */
@@ -0,0 +1,171 @@
+/* HotTier.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "Log.h"
+#include "HotTier.h"
+
+#define MINUTE_MSECS	(60 * 1000LL)
+
+HotTier::HotTier() : window(0), slotCount(0), openedAt(0)
+{
+	/* nothing */
+}
+
+HotTier::~HotTier()
+{
+	close();
+}
+
+int HotTier::open(int partitions, int hours)
+{
+	close();
+	if (hours <= 0 || partitions <= 0)
+		return 0;
+
+	window = hours * 60 * MINUTE_MSECS;
+	slotCount = hours * 60 + HOT_AHEAD_MINUTES;
+
+	// the minute being saved may be on disk partly
+	int64_t now = (int64_t)time(NULL) * 1000;
+	openedAt = (now / MINUTE_MSECS + 1) * MINUTE_MSECS;
+
+	for (int i = 0; i < partitions; ++i) {
+		hot_shard_t *shard = new hot_shard_t;
+		shard->expiredAt = now;
+		pthread_rwlock_init(&shard->lock, NULL);
+		shards.push_back(shard);
+	}
+
+	APPLOG_INFO("hot tier of %d hours opened in %d shards", hours, partitions);
+	return 0;
+}
+
+void HotTier::close()
+{
+	for (size_t i = 0; i < shards.size(); ++i) {
+		pthread_rwlock_destroy(&shards[i]->lock);
+		delete shards[i];
+	}
+
+	shards.clear();
+}
+
+HotTier::hot_series_map_t *HotTier::seriesOf(hot_shard_t *shard, uint8_t type) const
+{
+	if (type == STAT_MERGED_GAUGE) return &shard->gauges;
+	if (type == STAT_MERGED_LCALL) return &shard->lcalls;
+	return NULL;
+}
+
+int HotTier::add(int partition, uint8_t type, const local_key_t& key, int64_t timestamp,
+		 const unsigned char *data, size_t size)
+{
+	if (partition < 0 || partition >= (int)shards.size())
+		return -1;
+
+	int64_t now = (int64_t)time(NULL) * 1000;
+	if (timestamp < now - window || timestamp >= now + HOT_AHEAD_MINUTES * MINUTE_MSECS)
+		return -1;
+
+	hot_shard_t *shard = shards[partition];
+	hot_series_map_t *series = seriesOf(shard, type);
+	if (series == NULL)
+		return -1;
+
+	int64_t minute = timestamp / MINUTE_MSECS * MINUTE_MSECS;
+	pthread_rwlock_wrlock(&shard->lock);
+
+	hot_series_t& one = (*series)[key];
+	if (one.slots.empty()) {
+		one.slots.resize(slotCount);
+		for (size_t i = 0; i < slotCount; ++i) one.slots[i].timestamp = -1;
+		one.lastTimestamp = timestamp;
+	}
+
+	hot_slot_t& slot = one.slots[(minute / MINUTE_MSECS) % slotCount];
+	if (slot.timestamp != minute) {
+		slot.timestamp = minute;
+		slot.data.assign((const char *)data, size);
+	}
+	else {
+		slot.data.append((const char *)data, size);
+	}
+
+	if (timestamp > one.lastTimestamp) one.lastTimestamp = timestamp;
+
+	pthread_rwlock_unlock(&shard->lock);
+	return 0;
+}
+
+void HotTier::expireSeries(hot_series_map_t& series, int64_t before)
+{
+	hot_series_map_t::iterator iter = series.begin();
+	while (iter != series.end()) {
+		if (iter->second.lastTimestamp < before) series.erase(iter++);
+		else ++iter;
+	}
+}
+
+void HotTier::expire(int partition, int64_t now)
+{
+	if (partition < 0 || partition >= (int)shards.size())
+		return;
+
+	// a walk over the shard at most every minute
+	hot_shard_t *shard = shards[partition];
+	if (now - shard->expiredAt < MINUTE_MSECS)
+		return;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	expireSeries(shard->gauges, now - window);
+	expireSeries(shard->lcalls, now - window);
+	shard->expiredAt = now;
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+int64_t HotTier::getHotSince(int64_t now) const
+{
+	if (shards.empty()) return INT64_MAX;
+
+	// whole minutes only, the oldest one may be overwritten soon
+	int64_t since = (now - window) / MINUTE_MSECS * MINUTE_MSECS + MINUTE_MSECS;
+	return since > openedAt ? since : openedAt;
+}
+
+//
+// items of the series in [start, end) minutes, in time order
+//
+int HotTier::read(int partition, uint8_t type, const local_key_t& key, int64_t start, int64_t end,
+		  std::string& data) const
+{
+	if (partition < 0 || partition >= (int)shards.size())
+		return -1;
+
+	hot_shard_t *shard = shards[partition];
+	hot_series_map_t *series = seriesOf(shard, type);
+	if (series == NULL)
+		return -1;
+
+	int64_t first = start / MINUTE_MSECS * MINUTE_MSECS;
+	if (end > first + (int64_t)slotCount * MINUTE_MSECS)
+		end = first + (int64_t)slotCount * MINUTE_MSECS;
+
+	pthread_rwlock_rdlock(&shard->lock);
+
+	hot_series_map_t::const_iterator iter = series->find(key);
+	if (iter != series->end()) {
+		const hot_series_t& one = iter->second;
+		for (int64_t minute = first; minute < end; minute += MINUTE_MSECS) {
+			const hot_slot_t& slot = one.slots[(minute / MINUTE_MSECS) % slotCount];
+			if (slot.timestamp == minute)
+				data.append(slot.data);
+		}
+	}
+
+	pthread_rwlock_unlock(&shard->lock);
+	return 0;
+}
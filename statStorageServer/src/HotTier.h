@@ -0,0 +1,78 @@
+/* HotTier.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __HOT_TIER__H
+#define __HOT_TIER__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "StatData.h"
+
+// minutes accepted ahead of now, for agents with a fast clock
+#define HOT_AHEAD_MINUTES	10
+
+// items of one series and minute, in the file format
+typedef struct hot_slot_tag {
+	int64_t timestamp;	// -1 for empty
+	std::string data;
+} hot_slot_t;
+
+// a ring of slots indexed by minute, an item overwrites an older one
+typedef struct hot_series_tag {
+	std::vector<hot_slot_t> slots;
+	int64_t lastTimestamp;
+} hot_series_t;
+
+//
+// the last hours of minute gauges and lcalls of every series in
+// memory, so queries of recent ranges never go to disk. sharded by
+// ingest partition: a shard is added to by its writer only and read
+// by query threads. it holds all items since the later of open()
+// and the window start, see getHotSince().
+//
+class HotTier {
+public:
+	HotTier();
+	~HotTier();
+private:
+	HotTier(const HotTier&);
+	HotTier& operator=(const HotTier&);
+public:
+	int open(int partitions, int hours);
+	void close();
+	bool isEnabled() const { return !shards.empty(); }
+
+	int add(int partition, uint8_t type, const local_key_t& key, int64_t timestamp,
+		const unsigned char *data, size_t size);
+	// drop series not added to in the window, by the writer
+	void expire(int partition, int64_t now);
+
+	// [result, now) is all in memory
+	int64_t getHotSince(int64_t now) const;
+	int read(int partition, uint8_t type, const local_key_t& key, int64_t start, int64_t end,
+		std::string& data) const;
+private:
+	typedef std::tr1::unordered_map<local_key_t, hot_series_t, LocalKeyHash> hot_series_map_t;
+
+	typedef struct hot_shard_tag {
+		hot_series_map_t gauges;
+		hot_series_map_t lcalls;
+		int64_t expiredAt;
+		pthread_rwlock_t lock;
+	} hot_shard_t;
+
+	hot_series_map_t *seriesOf(hot_shard_t *shard, uint8_t type) const;
+	void expireSeries(hot_series_map_t& series, int64_t before);
+private:
+	std::vector<hot_shard_t *> shards;
+	int64_t window;		// msecs
+	size_t slotCount;
+	int64_t openedAt;	// first whole minute after open()
+};
+
+#endif /* __HOT_TIER__H */
@@ -0,0 +1,193 @@
+/* IngestWriter.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "Log.h"
+#include "FileStorage.h"
+#include "IngestWriter.h"
+
+MpscQueue::MpscQueue()
+{
+	stub.next = NULL;
+	head = &stub;
+	tail = &stub;
+}
+
+void MpscQueue::push(mpsc_node_t *node)
+{
+	node->next = NULL;
+	__sync_synchronize();
+
+	mpsc_node_t *prev = __sync_lock_test_and_set(&head, node);
+	// the queue is broken here until the link is set, pop() sees
+	// nothing after prev meanwhile
+	prev->next = node;
+}
+
+mpsc_node_t *MpscQueue::pop()
+{
+	mpsc_node_t *node = tail, *next = node->next;
+
+	if (node == &stub) {
+		if (next == NULL) return NULL;
+		tail = next;
+		node = next;
+		next = next->next;
+	}
+
+	if (next != NULL) {
+		tail = next;
+		return node;
+	}
+
+	if (node != head) {
+		// a producer is linking, try again later
+		return NULL;
+	}
+
+	// node is the last one, put the stub behind it to take it
+	push(&stub);
+
+	next = node->next;
+	if (next != NULL) {
+		tail = next;
+		return node;
+	}
+
+	return NULL;
+}
+
+int GaugeIngestItem::save(FileStorage& storage, int partition)
+{
+	return storage.saveMergedGauge(gauge, partition);
+}
+
+int LcallIngestItem::save(FileStorage& storage, int partition)
+{
+	return storage.saveMergedLcall(lcall, partition);
+}
+
+int RcallIngestItem::save(FileStorage& storage, int partition)
+{
+	return storage.saveMergedRcall(rcall, partition);
+}
+
+IngestWriter::IngestWriter(FileStorage& _storage, int _index, long _maxQueued)
+	: storage(_storage), index(_index), tid(0), sleeping(0), isRunning(false), savedCount(0),
+	  queuedCount(0), maxQueued(_maxQueued)
+{
+	sem_init(&wakeup, 0, 0);
+}
+
+IngestWriter::~IngestWriter()
+{
+	stop();
+	sem_destroy(&wakeup);
+}
+
+int IngestWriter::start()
+{
+	isRunning = true;
+	errno = pthread_create(&tid, NULL, __writerEntry, (void *)this);
+	if (errno != 0) {
+		APPLOG_ERROR("create writer thread #%d failed: %m", index);
+		isRunning = false;
+		tid = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void IngestWriter::stop()
+{
+	if (tid == 0) return;
+
+	isRunning = false;
+	sem_post(&wakeup);
+	pthread_join(tid, NULL);
+	tid = 0;
+
+	// anything pushed after the thread's last drain
+	drain();
+	storage.flushMemTable(index, true);
+}
+
+void IngestWriter::push(IngestItem *item)
+{
+	__sync_add_and_fetch(&queuedCount, 1);
+	queue.push(item);
+
+	// the link must be seen before the flag is read, as the writer
+	// sets the flag before it looks at the queue again; or both miss
+	// each other and the item waits for the next timeout
+	__sync_synchronize();
+
+	// only the one who clears the flag wakes it up
+	if (sleeping && __sync_bool_compare_and_swap(&sleeping, 1, 0))
+		sem_post(&wakeup);
+}
+
+int IngestWriter::drain()
+{
+	int count = 0;
+	mpsc_node_t *node;
+
+	while ((node = queue.pop()) != NULL) {
+		IngestItem *item = static_cast<IngestItem *>(node);
+		item->save(storage, index);
+		delete item;
+		++count;
+	}
+
+	if (count > 0) {
+		__sync_sub_and_fetch(&queuedCount, count);
+		__sync_add_and_fetch(&savedCount, count);
+	}
+	return count;
+}
+
+void *IngestWriter::__writerEntry(void *p)
+{
+	IngestWriter *writer = (IngestWriter *)p;
+	writer->writerLoop();
+	return NULL;
+}
+
+void IngestWriter::writerLoop()
+{
+	while (isRunning) {
+		if (drain() > 0) {
+			storage.flushMemTable(index, false);
+			continue;
+		}
+
+		// check once more after the flag is set, or a push between
+		// the drain and the flag would never wake us up
+		sleeping = 1;
+		__sync_synchronize();
+		if (drain() > 0) {
+			sleeping = 0;
+			continue;
+		}
+
+		// wake up now and then to flush an old memtable
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		struct timespec ts;
+		ts.tv_sec = tv.tv_sec + 1;
+		ts.tv_nsec = tv.tv_usec * 1000;
+
+		while (sem_timedwait(&wakeup, &ts) < 0 && errno == EINTR)
+			;
+		sleeping = 0;
+
+		storage.flushMemTable(index, false);
+	}
+
+	drain();
+}
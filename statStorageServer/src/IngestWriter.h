@@ -0,0 +1,105 @@
+/* IngestWriter.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __INGEST_WRITER__H
+#define __INGEST_WRITER__H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+
+#include "StatData.h"
+
+class FileStorage;
+
+typedef struct mpsc_node_tag {
+	struct mpsc_node_tag *volatile next;
+} mpsc_node_t;
+
+//
+// intrusive multi-producer single-consumer queue, push() from any
+// thread without lock, pop() only from the consumer thread
+//
+class MpscQueue {
+public:
+	MpscQueue();
+private:
+	MpscQueue(const MpscQueue&);
+	MpscQueue& operator=(const MpscQueue&);
+public:
+	void push(mpsc_node_t *node);
+	mpsc_node_t *pop();
+private:
+	mpsc_node_t *volatile head;	// producers' end
+	mpsc_node_t *tail;		// consumer's end
+	mpsc_node_t stub;
+};
+
+//
+// one stats item to be saved, parsed on the processor thread
+//
+class IngestItem : public mpsc_node_t {
+public:
+	virtual ~IngestItem() { /* nothing */ }
+	virtual int save(FileStorage& storage, int partition) = 0;
+};
+
+class GaugeIngestItem : public IngestItem {
+public:
+	virtual int save(FileStorage& storage, int partition);
+	StatMergedGauge gauge;
+};
+
+class LcallIngestItem : public IngestItem {
+public:
+	virtual int save(FileStorage& storage, int partition);
+	StatMergedLcall lcall;
+};
+
+class RcallIngestItem : public IngestItem {
+public:
+	virtual int save(FileStorage& storage, int partition);
+	StatMergedRcall rcall;
+};
+
+//
+// one writer thread saves all items of its partition, so a series
+// file is never written by two threads. it also flushes the
+// partition's memtable when it is full or old enough.
+//
+class IngestWriter {
+public:
+	IngestWriter(FileStorage& _storage, int _index, long _maxQueued);
+	~IngestWriter();
+private:
+	IngestWriter(const IngestWriter&);
+	IngestWriter& operator=(const IngestWriter&);
+public:
+	int start();
+	void stop();
+
+	// the writer owns item after push. it never fails, callers not
+	// to block ask isFull() before and back off
+	void push(IngestItem *item);
+	bool isFull() const { return maxQueued > 0 && queuedCount >= maxQueued; }
+	long getSavedCount() const { return savedCount; }
+private:
+	static void *__writerEntry(void *p);
+	void writerLoop();
+	int drain();
+private:
+	FileStorage& storage;
+	int index;
+	pthread_t tid;
+
+	MpscQueue queue;
+	sem_t wakeup;
+	volatile int sleeping;
+	volatile bool isRunning;
+
+	volatile long savedCount;
+	volatile long queuedCount;
+	long maxQueued;		// 0 for no limit
+};
+
+#endif /* __INGEST_WRITER__H */
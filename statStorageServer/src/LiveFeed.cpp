@@ -0,0 +1,365 @@
+/* LiveFeed.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <map>
+#include <new>
+
+#include "Log.h"
+#include "proto_h16.h"
+#include "Message.h"
+#include "StatCommand.h"
+#include "StatCombiner.h"
+#include "LiveFeed.h"
+
+// a period open for gauges yet
+typedef struct live_period_tag {
+	StatCombiner *combiner;
+	time_t lastAdded;
+} live_period_t;
+
+typedef std::map<int64_t, live_period_t> live_period_map_t;
+
+struct LiveFeed::Subscription {
+	Subscription(const live_selection_t& _selection)
+		: selection(_selection), selector(_selection.iids), mapper(NULL) { /* nothing */ }
+	~Subscription() {
+		for (live_period_map_t::iterator iter = periods.begin(); iter != periods.end(); ++iter)
+			delete iter->second.combiner;
+		delete mapper;
+	}
+
+	uint64_t id;
+	int fd;
+	int flow;
+	uint32_t syn;		// of the subscribe request, the ack of all frames
+
+	live_selection_t selection;
+	SystemIidSelector selector;
+	GroupMapper *mapper;
+	int64_t span;
+
+	int64_t lastPeriod;	// the last one sent, earlier gauges are late
+	time_t lastSent;
+	live_period_map_t periods;
+};
+
+LiveFeed::LiveFeed(live_send_t _send, void *_arg)
+	: send(_send), arg(_arg), grace(5), heartbeat(5), maxSubscriptions(256),
+	  tid(0), isRunning(false), nextId(1), pendingCount(0), subscriptionCount(0)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+LiveFeed::~LiveFeed()
+{
+	stop();
+
+	for (std::tr1::unordered_map<uint64_t, Subscription *>::iterator iter = subscriptions.begin();
+			iter != subscriptions.end(); ++iter)
+		delete iter->second;
+	subscriptions.clear();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int LiveFeed::start(int _grace, int _heartbeat, int _maxSubscriptions)
+{
+	grace = _grace >= 0 ? _grace : 5;
+	heartbeat = _heartbeat > 0 ? _heartbeat : 5;
+	maxSubscriptions = _maxSubscriptions;
+
+	// ids go on from the time, not to be taken for ones before a restart
+	nextId = (uint64_t)time(NULL) << 20;
+
+	isRunning = true;
+	errno = pthread_create(&tid, NULL, __feedEntry, (void *)this);
+	if (errno != 0) {
+		APPLOG_ERROR("create live feed thread failed: %m");
+		isRunning = false;
+		tid = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void LiveFeed::stop()
+{
+	if (tid == 0) return;
+
+	pthread_mutex_lock(&lock);
+	isRunning = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(tid, NULL);
+	tid = 0;
+}
+
+//
+// the header of a frame and its kind, room for bodySize more
+//
+beyondy::Async::Message *LiveFeed::createFrame(const Subscription *sub, int kind, size_t bodySize)
+{
+	beyondy::Async::Message *msg = beyondy::Async::Message::create(sizeof(struct proto_h16_res) + 1 + bodySize,
+			sub->fd, sub->flow);
+	if (msg == NULL) {
+		APPLOG_ERROR("create live frame of %ld bytes failed", (long)bodySize);
+		return NULL;
+	}
+
+	struct proto_h16_res *h = (struct proto_h16_res *)msg->data();
+	memset(h, 0, sizeof *h);
+	h->cmd = CMD_STAT_SUBSCRIBE_RSP;
+	h->ack = sub->syn;
+
+	msg->setWptr(sizeof *h);
+	msg->writeUint8(kind);
+	return msg;
+}
+
+uint64_t LiveFeed::subscribe(int fd, int flow, uint32_t syn, const live_selection_t& selection)
+{
+	int64_t span = FileStorage::spanLength(selection.ftype, selection.freqs);
+	if (selection.pid == 0 || span <= 0) {
+		APPLOG_WARN("invalid subscription of pid=%d, span=%d/%d", selection.pid, selection.ftype, selection.freqs);
+		return 0;
+	}
+
+	Subscription *sub = new (std::nothrow) Subscription(selection);
+	if (sub == NULL) return 0;
+
+	sub->fd = fd;
+	sub->flow = flow;
+	sub->syn = syn;
+	sub->span = span;
+	sub->lastPeriod = 0;
+	sub->lastSent = time(NULL);
+
+	// combined as querySystemStats does
+	if (selection.mid == 0 && selection.totalView) sub->mapper = new ProductMapper;
+	else if (selection.mid == 0 || selection.totalView) sub->mapper = new ModuleMapper;
+	else sub->mapper = new HostMapper;
+
+	// a place is taken till the ack is sent or not
+	pthread_mutex_lock(&lock);
+	bool full = maxSubscriptions > 0 && (int)subscriptions.size() + pendingCount >= maxSubscriptions;
+	if (!full) {
+		sub->id = nextId++;
+		++pendingCount;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (full) {
+		APPLOG_WARN("too many subscriptions, refuse the one from fd=%d", fd);
+		delete sub;
+		return 0;
+	}
+
+	// the ack goes before any frame of stats can
+	beyondy::Async::Message *msg = createFrame(sub, LIVE_FRAME_ACK, sizeof(uint64_t));
+	bool sent = msg != NULL;
+	if (sent) {
+		msg->writeUint64(sub->id);
+		((struct proto_h16_res *)msg->data())->len = msg->getWptr();
+		sent = (*send)(arg, msg) == 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	--pendingCount;
+	if (sent) {
+		subscriptions[sub->id] = sub;
+		__sync_add_and_fetch(&subscriptionCount, 1);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (!sent) {
+		delete sub;
+		return 0;
+	}
+
+	APPLOG_INFO("subscription %llu of pid=%d, mid=%d, %d iids, %d hosts from fd=%d",
+		(unsigned long long)sub->id, selection.pid, selection.mid, (int)selection.iids.size(),
+		(int)selection.hosts.size(), fd);
+	return sub->id;
+}
+
+void LiveFeed::removeSubscription(uint64_t id)
+{
+	std::tr1::unordered_map<uint64_t, Subscription *>::iterator iter = subscriptions.find(id);
+	if (iter == subscriptions.end()) return;
+
+	delete iter->second;
+	subscriptions.erase(iter);
+	__sync_sub_and_fetch(&subscriptionCount, 1);
+}
+
+int LiveFeed::unsubscribe(uint64_t id)
+{
+	pthread_mutex_lock(&lock);
+	bool found = subscriptions.find(id) != subscriptions.end();
+	removeSubscription(id);
+	pthread_mutex_unlock(&lock);
+
+	if (!found) return -1;
+
+	APPLOG_INFO("subscription %llu is over", (unsigned long long)id);
+	return 0;
+}
+
+void LiveFeed::unsubscribeAll(int fd, int flow)
+{
+	std::vector<uint64_t> ids;
+
+	pthread_mutex_lock(&lock);
+	for (std::tr1::unordered_map<uint64_t, Subscription *>::iterator iter = subscriptions.begin();
+			iter != subscriptions.end(); ++iter) {
+		if (iter->second->fd == fd && iter->second->flow == flow)
+			ids.push_back(iter->first);
+	}
+
+	for (size_t i = 0; i < ids.size(); ++i)
+		removeSubscription(ids[i]);
+	pthread_mutex_unlock(&lock);
+
+	if (!ids.empty())
+		APPLOG_INFO("%d subscriptions of fd=%d are dropped", (int)ids.size(), fd);
+}
+
+void LiveFeed::add(const StatMergedGauge& gauge)
+{
+	if (isEmpty()) return;
+
+	time_t now = time(NULL);
+	local_key_t key(gauge.hip, gauge.sid);
+
+	pthread_mutex_lock(&lock);
+	for (std::tr1::unordered_map<uint64_t, Subscription *>::iterator iter = subscriptions.begin();
+			iter != subscriptions.end(); ++iter) {
+		Subscription *sub = iter->second;
+		const live_selection_t& selection = sub->selection;
+
+		if (gauge.sid.pid != selection.pid || (selection.mid != 0 && gauge.sid.mid != selection.mid)
+				|| (!selection.hosts.empty() && selection.hosts.find(gauge.hip) == selection.hosts.end())
+					|| !sub->selector.accept(gauge.sid.iid))
+			continue;
+
+		int64_t start = gauge.timestamp / sub->span * sub->span;
+		if (start <= sub->lastPeriod) {
+			APPLOG_DEBUG("late gauge of %lld for subscription %llu", (long long)start,
+				(unsigned long long)sub->id);
+			continue;
+		}
+
+		live_period_map_t::iterator piter = sub->periods.find(start);
+		if (piter == sub->periods.end()) {
+			live_period_t period;
+			period.combiner = new (std::nothrow) StatCombiner(selection.ftype, selection.freqs, start, 1);
+			if (period.combiner == NULL) continue;
+			piter = sub->periods.insert(std::make_pair(start, period)).first;
+		}
+
+		local_key_t newKey;
+		sub->mapper->map(newKey, key);
+		piter->second.combiner->addMergedGauge(newKey, gauge);
+		piter->second.lastAdded = now;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//
+// frames of periods over and quiet for grace seconds, oldest first,
+// and heartbeats
+//
+void LiveFeed::flushPeriods(time_t now, std::vector<std::pair<uint64_t, beyondy::Async::Message *> >& frames)
+{
+	for (std::tr1::unordered_map<uint64_t, Subscription *>::iterator iter = subscriptions.begin();
+			iter != subscriptions.end(); ++iter) {
+		Subscription *sub = iter->second;
+
+		while (!sub->periods.empty()) {
+			live_period_map_t::iterator piter = sub->periods.begin();
+			if ((piter->first + sub->span) / 1000 > now || now - piter->second.lastAdded < grace)
+				break;
+
+			StatCombiner *combiner = piter->second.combiner;
+			beyondy::Async::Message *msg = createFrame(sub, LIVE_FRAME_STATS, combiner->frameSize(0, 1));
+			if (msg != NULL && combiner->encodeTo(msg, 0, 1, true) < 0) {
+				APPLOG_ERROR("encode period %lld of subscription %llu failed", (long long)piter->first,
+					(unsigned long long)sub->id);
+				beyondy::Async::Message::destroy(msg);
+				msg = NULL;
+			}
+
+			if (msg != NULL) {
+				((struct proto_h16_res *)msg->data())->len = msg->getWptr();
+				frames.push_back(std::make_pair(sub->id, msg));
+				sub->lastSent = now;
+			}
+
+			sub->lastPeriod = piter->first;
+			delete combiner;
+			sub->periods.erase(piter);
+		}
+
+		if (now - sub->lastSent >= heartbeat) {
+			beyondy::Async::Message *msg = createFrame(sub, LIVE_FRAME_HEARTBEAT, 0);
+			if (msg != NULL) {
+				((struct proto_h16_res *)msg->data())->len = msg->getWptr();
+				frames.push_back(std::make_pair(sub->id, msg));
+				sub->lastSent = now;
+			}
+		}
+	}
+}
+
+void *LiveFeed::__feedEntry(void *p)
+{
+	LiveFeed *feed = (LiveFeed *)p;
+	feed->feedLoop();
+	return NULL;
+}
+
+void LiveFeed::feedLoop()
+{
+	std::vector<std::pair<uint64_t, beyondy::Async::Message *> > frames;
+
+	while (1) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		struct timespec ts;
+		ts.tv_sec = tv.tv_sec + 1;
+		ts.tv_nsec = tv.tv_usec * 1000;
+
+		pthread_mutex_lock(&lock);
+		while (isRunning && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT)
+			;
+		if (!isRunning) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+
+		frames.clear();
+		flushPeriods(time(NULL), frames);
+		pthread_mutex_unlock(&lock);
+
+		// sent out of the lock, through the processor thread. a
+		// subscription whose frame can not go is dropped
+		for (size_t i = 0; i < frames.size(); ++i) {
+			if ((*send)(arg, frames[i].second) < 0) {
+				APPLOG_WARN("send frame of subscription %llu failed, drop it",
+					(unsigned long long)frames[i].first);
+
+				pthread_mutex_lock(&lock);
+				removeSubscription(frames[i].first);
+				pthread_mutex_unlock(&lock);
+			}
+		}
+	}
+}
@@ -0,0 +1,93 @@
+/* LiveFeed.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __LIVE_FEED__H
+#define __LIVE_FEED__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "StatData.h"
+#include "FileStorage.h"
+
+namespace beyondy { namespace Async { class Message; } }
+
+// sends a frame made by the feed and owns it from then on, -1 if it
+// can not go, the subscription is dropped then. it may only queue the
+// frame for another thread, which must be woken for it rather than
+// find it at its next event, or heartbeats come late. a failure to
+// send it is for that thread to take care of, by unsubscribeAll()
+typedef int (*live_send_t)(void *arg, beyondy::Async::Message *msg);
+
+// what a subscription asks for, as a system stats query does
+typedef struct live_selection_tag {
+	int totalView;
+	int ftype;
+	int freqs;
+	int pid;
+	int mid;
+	std::vector<int> iids;
+	host_set_t hosts;
+} live_selection_t;
+
+//
+// subscriptions to system stats as they are saved. gauges matching
+// one are combined into its periods the way a query combines them,
+// and a period goes as a frame of the subscribe response once it is
+// over and no gauge has come for it in grace seconds. gauges of a
+// period already sent are dropped. a heartbeat frame goes when
+// nothing else did for heartbeat seconds, so the subscriber knows
+// the feed is alive and a broken connection is found out.
+//
+class LiveFeed {
+public:
+	LiveFeed(live_send_t _send, void *_arg);
+	~LiveFeed();
+private:
+	LiveFeed(const LiveFeed&);
+	LiveFeed& operator=(const LiveFeed&);
+public:
+	int start(int _grace, int _heartbeat, int _maxSubscriptions);
+	void stop();
+
+	// the id of a new subscription once its ack frame is sent, 0 if
+	// it is refused or the ack can not go
+	uint64_t subscribe(int fd, int flow, uint32_t syn, const live_selection_t& selection);
+	int unsubscribe(uint64_t id);
+	// all of a connection which is gone
+	void unsubscribeAll(int fd, int flow);
+
+	// a gauge on its way to be saved, by the processor thread
+	void add(const StatMergedGauge& gauge);
+	// a hint out of the lock, add() checks again under it
+	bool isEmpty() { return __sync_fetch_and_add(&subscriptionCount, 0) == 0; }
+private:
+	struct Subscription;
+
+	static void *__feedEntry(void *p);
+	void feedLoop();
+	void flushPeriods(time_t now, std::vector<std::pair<uint64_t, beyondy::Async::Message *> >& frames);
+	beyondy::Async::Message *createFrame(const Subscription *sub, int kind, size_t bodySize);
+	void removeSubscription(uint64_t id);
+private:
+	live_send_t send;
+	void *arg;
+	int grace;
+	int heartbeat;
+	int maxSubscriptions;
+
+	pthread_t tid;
+	volatile bool isRunning;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	uint64_t nextId;
+	int pendingCount;		// subscribed, the ack not sent yet
+	volatile int subscriptionCount;
+	std::tr1::unordered_map<uint64_t, Subscription *> subscriptions;
+};
+
+#endif /* __LIVE_FEED__H */
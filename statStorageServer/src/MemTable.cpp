@@ -0,0 +1,279 @@
+/* MemTable.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "Log.h"
+#include "MemTable.h"
+
+// a log record: uint32 size + item in the file format
+#define WAL_RECORD_MAX	(1024 * 1024)
+
+static int64_t fileSize(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) return 0;
+	return st.st_size;
+}
+
+MemTable::MemTable() : walFd(-1), activeBytes(0), activeSince(0)
+{
+	pthread_rwlock_init(&lock, NULL);
+}
+
+MemTable::~MemTable()
+{
+	close();
+	pthread_rwlock_destroy(&lock);
+}
+
+int MemTable::open(const char *_walPath)
+{
+	walPath = _walPath;
+	walFd = ::open(walPath.c_str(), O_CREAT|O_WRONLY|O_APPEND, 0664);
+	if (walFd < 0) {
+		APPLOG_ERROR("open wal(%s) failed: %m", walPath.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+void MemTable::close()
+{
+	if (walFd >= 0) {
+		::close(walFd);
+		walFd = -1;
+	}
+}
+
+char *MemTable::makeFrozenPath(char *path, size_t size) const
+{
+	return xsnprintf(path, size, "%s.flushing", walPath.c_str());
+}
+
+int MemTable::writeLog(const unsigned char *data, size_t size)
+{
+	if (walFd < 0) return -1;
+
+	uint32_t len = size;
+	struct iovec iov[2];
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof len;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = size;
+
+	ssize_t wlen;
+	while ((wlen = writev(walFd, iov, 2)) < 0 && errno == EINTR)
+		;
+
+	if (wlen != (ssize_t)(sizeof len + size)) {
+		APPLOG_ERROR("write wal(%s) failed: wlen=%ld, size=%ld: %m", walPath.c_str(),
+				(long)wlen, (long)(sizeof len + size));
+		return -1;
+	}
+
+	return 0;
+}
+
+int MemTable::append(const char *path, int64_t timestamp, const unsigned char *data, size_t size,
+		     const char *target, const local_key_t *key)
+{
+	if (writeLog(data, size) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&lock);
+
+	memtable_map_t::iterator iter = active.find(path);
+	if (iter == active.end()) {
+		memtable_series_t& series = active[path];
+		series.firstTimestamp = timestamp;
+		series.lastTimestamp = timestamp;
+		series.flushedAt = -1;
+		if (target != NULL) series.target = target;
+		if (key != NULL) series.key = *key;
+		iter = active.find(path);
+	}
+	else if (timestamp > iter->second.lastTimestamp) {
+		iter->second.lastTimestamp = timestamp;
+	}
+
+	iter->second.data.append((const char *)data, size);
+	activeBytes += size;
+	if (activeSince == 0) activeSince = (int64_t)time(NULL) * 1000;
+
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+bool MemTable::needFlush(size_t maxBytes, int64_t maxAge, int64_t now) const
+{
+	if (activeBytes == 0) return false;
+	return activeBytes >= maxBytes || now - activeSince >= maxAge;
+}
+
+//
+// move active items to frozen ones and log the coming items into
+// a new log, the frozen ones must be flushed before next freeze().
+// all or nothing: the active items and their log stay as they are
+// if the new log can not be opened
+//
+int MemTable::freeze()
+{
+	if (!frozen.empty()) {
+		APPLOG_ERROR("freeze wal(%s) before the frozen items are flushed", walPath.c_str());
+		return -1;
+	}
+
+	char frozenPath[PATH_MAX];
+	makeFrozenPath(frozenPath, sizeof frozenPath);
+
+	if (rename(walPath.c_str(), frozenPath) < 0) {
+		APPLOG_ERROR("rename wal %s to %s failed: %m", walPath.c_str(), frozenPath);
+		return -1;
+	}
+
+	int fd = ::open(walPath.c_str(), O_CREAT|O_WRONLY|O_APPEND, 0664);
+	if (fd < 0) {
+		APPLOG_ERROR("open new wal(%s) failed, keep the old one: %m", walPath.c_str());
+		if (rename(frozenPath, walPath.c_str()) < 0) {
+			APPLOG_ERROR("rename %s back to %s failed: %m", frozenPath, walPath.c_str());
+		}
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&lock);
+	frozen.swap(active);
+	active.clear();
+	activeBytes = 0;
+	activeSince = 0;
+	pthread_rwlock_unlock(&lock);
+
+	// the old one is the frozen log now
+	close();
+	walFd = fd;
+
+	return 0;
+}
+
+//
+// remember where the items go in the file before appending, queries
+// read the file up to there and the rest from memory
+//
+int64_t MemTable::markFlushing(const std::vector<memtable_series_t *>& series, const char *path)
+{
+	pthread_rwlock_wrlock(&lock);
+
+	int64_t size = fileSize(path);
+	for (size_t i = 0; i < series.size(); ++i) {
+		series[i]->flushedAt = size;
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return size;
+}
+
+//
+// frozen series which are in their files now
+//
+void MemTable::dropFlushed(const std::vector<std::string>& paths)
+{
+	pthread_rwlock_wrlock(&lock);
+	for (size_t i = 0; i < paths.size(); ++i)
+		frozen.erase(paths[i]);
+	pthread_rwlock_unlock(&lock);
+}
+
+void MemTable::dropFrozen()
+{
+	pthread_rwlock_wrlock(&lock);
+	frozen.clear();
+	pthread_rwlock_unlock(&lock);
+
+	char frozenPath[PATH_MAX];
+	unlink(makeFrozenPath(frozenPath, sizeof frozenPath));
+}
+
+//
+// items of the path in memory, and how many bytes of the file (or
+// the segment) should be read with them (-1 for all of it)
+//
+int MemTable::read(const char *path, std::string& data, int64_t& fileLimit) const
+{
+	fileLimit = -1;
+	pthread_rwlock_rdlock(&lock);
+
+	memtable_map_t::const_iterator iter = frozen.find(path);
+	if (iter != frozen.end()) {
+		const char *target = iter->second.target.empty() ? path : iter->second.target.c_str();
+		data.append(iter->second.data);
+		fileLimit = iter->second.flushedAt >= 0 ? iter->second.flushedAt : fileSize(target);
+	}
+
+	iter = active.find(path);
+	if (iter != active.end()) {
+		const char *target = iter->second.target.empty() ? path : iter->second.target.c_str();
+		data.append(iter->second.data);
+		if (fileLimit < 0) fileLimit = fileSize(target);
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+//
+// apply records of a log, the frozen one first, and remove them.
+// a log any record of which fails is kept and -1 returned, it is
+// replayed again by the next start
+//
+int MemTable::replay(const char *walPath, int (*apply)(void *, const unsigned char *, size_t), void *arg)
+{
+	char paths[2][PATH_MAX];
+	xsnprintf(paths[0], sizeof paths[0], "%s.flushing", walPath);
+	xsnprintf(paths[1], sizeof paths[1], "%s", walPath);
+
+	int count = 0, failed = 0;
+	unsigned char *buf = (unsigned char *)malloc(WAL_RECORD_MAX);
+	if (buf == NULL) return -1;
+
+	for (int i = 0; i < 2; ++i) {
+		FILE *fp = fopen(paths[i], "rb");
+		if (fp == NULL) continue;
+
+		int fileFailed = 0;
+		uint32_t len;
+		while (fread(&len, sizeof len, 1, fp) == 1) {
+			if (len > WAL_RECORD_MAX || fread(buf, len, 1, fp) != 1) {
+				APPLOG_WARN("wal %s is truncated or corrupted after %d records", paths[i], count);
+				break;
+			}
+
+			if ((*apply)(arg, buf, len) < 0) ++fileFailed;
+			++count;
+		}
+
+		fclose(fp);
+		if (fileFailed > 0) {
+			APPLOG_ERROR("%d records of wal %s failed to replay, keep it", fileFailed, paths[i]);
+			failed += fileFailed;
+			// the log after it would be renamed over it
+			break;
+		}
+
+		unlink(paths[i]);
+	}
+
+	free(buf);
+	return failed > 0 ? -1 : count;
+}
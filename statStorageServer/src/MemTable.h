@@ -0,0 +1,81 @@
+/* MemTable.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __MEM_TABLE__H
+#define __MEM_TABLE__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "StatData.h"
+
+// recent items of one series file, in the file format
+typedef struct memtable_series_tag {
+	std::string data;
+	int64_t firstTimestamp;
+	int64_t lastTimestamp;
+	int64_t flushedAt;	// target size before flushing, -1 for not yet
+
+	// the segment file flushed into, or the series file itself
+	// named by the memtable key if it is empty
+	std::string target;
+	local_key_t key;
+} memtable_series_t;
+
+// sorted by path, so flushing walks the directories in order
+typedef std::map<std::string, memtable_series_t> memtable_map_t;
+
+//
+// recent items of one ingest partition, appended by its writer
+// thread only and read by query threads. every item is logged into
+// a write-ahead log before it is buffered, the log is rotated at
+// freeze() and removed when the frozen items are all flushed. the
+// ones failing to flush stay frozen, and in the rotated log, till a
+// later flush or the replay of the next start.
+//
+class MemTable {
+public:
+	MemTable();
+	~MemTable();
+private:
+	MemTable(const MemTable&);
+	MemTable& operator=(const MemTable&);
+public:
+	int open(const char *_walPath);
+	void close();
+
+	int append(const char *path, int64_t timestamp, const unsigned char *data, size_t size,
+		const char *target = NULL, const local_key_t *key = NULL);
+	bool needFlush(size_t maxBytes, int64_t maxAge, int64_t now) const;
+
+	// writer side of flushing
+	int freeze();
+	memtable_map_t& getFrozen() { return frozen; }
+	int64_t markFlushing(const std::vector<memtable_series_t *>& series, const char *path);
+	void dropFlushed(const std::vector<std::string>& paths);
+	void dropFrozen();
+
+	int read(const char *path, std::string& data, int64_t& fileLimit) const;
+	size_t size() const { return activeBytes; }
+
+	static int replay(const char *walPath, int (*apply)(void *, const unsigned char *, size_t), void *arg);
+private:
+	int writeLog(const unsigned char *data, size_t size);
+	char *makeFrozenPath(char *path, size_t size) const;
+private:
+	std::string walPath;
+	int walFd;
+
+	memtable_map_t active;
+	memtable_map_t frozen;
+	size_t activeBytes;
+	int64_t activeSince;
+
+	mutable pthread_rwlock_t lock;
+};
+
+#endif /* __MEM_TABLE__H */
@@ -0,0 +1,212 @@
+/* QueryCache.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "Log.h"
+#include "StatCombiner.h"
+#include "QueryCache.h"
+
+QueryCache::QueryCache() : maxEntries(0), maxPeriods(0), clock(0), cleared(0), hits(0), misses(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+QueryCache::~QueryCache()
+{
+	APPLOG_INFO("query cache: %ld periods hit, %ld missed", hits, misses);
+	pthread_mutex_destroy(&lock);
+}
+
+void QueryCache::setCapacity(size_t _maxEntries, size_t _maxPeriods)
+{
+	pthread_mutex_lock(&lock);
+	maxEntries = _maxEntries;
+	maxPeriods = _maxPeriods > 0 ? _maxPeriods : 1;
+	evict();
+	pthread_mutex_unlock(&lock);
+}
+
+// both only grow, so does their sum, with lock held
+uint64_t QueryCache::sequenceOf(int pid) const
+{
+	std::map<int, uint64_t>::const_iterator iter = sequences.find(pid);
+	return cleared + (iter == sequences.end() ? 0 : iter->second);
+}
+
+uint64_t QueryCache::getSequence(int pid)
+{
+	pthread_mutex_lock(&lock);
+	uint64_t seq = sequenceOf(pid);
+	pthread_mutex_unlock(&lock);
+	return seq;
+}
+
+//
+// context/totalView/span/pid/mid, then iids and hosts sorted
+//
+void QueryCache::makeKey(std::string& key, int context, int totalView, int spanUnit, int spanCount,
+			 int pid, int mid, const std::vector<int>& iids, const host_set_t& hosts)
+{
+	char buf[128];
+	snprintf(buf, sizeof buf, "%d:%d:%d:%d:%04x:%04x", context, totalView, spanUnit, spanCount, pid, mid);
+	key = buf;
+
+	std::vector<int> sortedIids(iids);
+	std::sort(sortedIids.begin(), sortedIids.end());
+	sortedIids.erase(std::unique(sortedIids.begin(), sortedIids.end()), sortedIids.end());
+	for (size_t i = 0; i < sortedIids.size(); ++i) {
+		snprintf(buf, sizeof buf, "%c%x", i == 0 ? '/' : ',', sortedIids[i]);
+		key += buf;
+	}
+
+	std::vector<std::string> sortedHosts;
+	for (host_set_t::const_iterator iter = hosts.begin(); iter != hosts.end(); ++iter) {
+		if (iter->ver == 4) {
+			snprintf(buf, sizeof buf, "4-%08x", iter->ip.ip4);
+		}
+		else {
+			snprintf(buf, sizeof buf, "%d-%08x%08x%08x%08x", iter->ver,
+				iter->ip.ip6[0], iter->ip.ip6[1], iter->ip.ip6[2], iter->ip.ip6[3]);
+		}
+		sortedHosts.push_back(buf);
+	}
+
+	std::sort(sortedHosts.begin(), sortedHosts.end());
+	for (size_t i = 0; i < sortedHosts.size(); ++i) {
+		key += i == 0 ? "/" : ",";
+		key += sortedHosts[i];
+	}
+}
+
+//
+// copy cached periods of [start, end) into combiner, whose first
+// period is start, and give runs of the rest
+//
+int QueryCache::lookup(const std::string& key, int64_t start, int64_t end, int64_t span,
+		       StatCombiner& combiner, period_run_list_t& missing)
+{
+	int found = 0;
+	missing.clear();
+
+	pthread_mutex_lock(&lock);
+
+	cache_map_t::iterator entry = entries.find(key);
+	if (entry != entries.end()) entry->second.lastUsed = ++clock;
+
+	for (int64_t period = start; period < end; period += span) {
+		int index = (period - start) / span;
+		if (entry != entries.end() && index < combiner.periodCount) {
+			std::map<int64_t, cached_period_t>::const_iterator iter = entry->second.periods.find(period);
+			if (iter != entry->second.periods.end()) {
+				combiner.mergedGauges[index] = iter->second.gauges;
+				combiner.mergedLcalls[index] = iter->second.lcalls;
+				++found;
+				continue;
+			}
+		}
+
+		int64_t periodEnd = period + span < end ? period + span : end;
+		if (!missing.empty() && missing.back().second == period) missing.back().second = periodEnd;
+		else missing.push_back(period_run_t(period, periodEnd));
+	}
+
+	hits += found;
+	misses += (end - start + span - 1) / span - found;
+
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+//
+// periods of src (starting at start) in [start, end) which are
+// finished by now, unless anything of pid has been invalidated since seq
+//
+void QueryCache::store(const std::string& key, int pid, int mid, int64_t span, const StatCombiner& src,
+		       int64_t start, int64_t end, uint64_t seq)
+{
+	int64_t now = (int64_t)time(NULL) * 1000;
+	int64_t finished = (now - QUERY_CACHE_SETTLE) / span * span;
+	if (end > finished) end = finished;
+	// loaded again next time, it may be all there by then
+	if (end <= start || src.incomplete) return;
+
+	pthread_mutex_lock(&lock);
+	if (maxEntries == 0 || seq != sequenceOf(pid)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	cache_entry_t& entry = entries[key];
+	if (entry.periods.empty()) {
+		entry.pid = pid;
+		entry.mid = mid;
+		entry.span = span;
+	}
+	entry.lastUsed = ++clock;
+
+	for (int64_t period = start; period + span <= end; period += span) {
+		int index = (period - start) / span;
+		if (index >= src.periodCount) break;
+
+		cached_period_t& cached = entry.periods[period];
+		cached.gauges = src.mergedGauges[index];
+		cached.lcalls = src.mergedLcalls[index];
+	}
+
+	// the oldest periods go first, queries move forward
+	while (entry.periods.size() > maxPeriods)
+		entry.periods.erase(entry.periods.begin());
+
+	evict();
+	pthread_mutex_unlock(&lock);
+}
+
+// least recently used entries go, with lock held
+void QueryCache::evict()
+{
+	while (entries.size() > maxEntries) {
+		cache_map_t::iterator victim = entries.begin();
+		for (cache_map_t::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+			if (iter->second.lastUsed < victim->second.lastUsed) victim = iter;
+		}
+
+		entries.erase(victim);
+	}
+}
+
+//
+// an item saved for timestamp, only items older than the settle
+// time may fall into cached periods
+//
+void QueryCache::invalidate(int pid, int mid, int64_t timestamp)
+{
+	if (maxEntries == 0) return;
+
+	int64_t now = (int64_t)time(NULL) * 1000;
+	if (timestamp >= now - QUERY_CACHE_SETTLE)
+		return;
+
+	pthread_mutex_lock(&lock);
+	++sequences[pid];
+
+	for (cache_map_t::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+		cache_entry_t& entry = iter->second;
+		if (entry.pid != pid || (entry.mid != 0 && entry.mid != mid))
+			continue;
+
+		entry.periods.erase(timestamp / entry.span * entry.span);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QueryCache::clear()
+{
+	pthread_mutex_lock(&lock);
+	++cleared;
+	entries.clear();
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,92 @@
+/* QueryCache.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __QUERY_CACHE__H
+#define __QUERY_CACHE__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "StatData.h"
+#include "SeriesCatalog.h"
+
+class StatCombiner;
+
+// periods ending this long ago are taken as finished
+#define QUERY_CACHE_SETTLE	(2 * 60 * 1000LL)
+
+// combined result of one finished period
+typedef struct cached_period_tag {
+	merged_gauge_map_t gauges;
+	merged_lcall_map_t lcalls;
+} cached_period_t;
+
+// periods not cached, [start, end) runs of them
+typedef std::pair<int64_t, int64_t> period_run_t;
+typedef std::vector<period_run_t> period_run_list_t;
+
+//
+// finished periods of recent system stats queries, keyed by the
+// normalized query. a repeated query takes the periods it has from
+// here and computes only the rest, mostly the new tail. late items
+// of a finished period drop it from all queries of their pid/mid,
+// and keep queries of that pid in flight from storing.
+//
+class QueryCache {
+public:
+	QueryCache();
+	~QueryCache();
+private:
+	QueryCache(const QueryCache&);
+	QueryCache& operator=(const QueryCache&);
+public:
+	// 0 entries to disable it
+	void setCapacity(size_t _maxEntries, size_t _maxPeriods);
+	bool isEnabled() const { return maxEntries > 0; }
+
+	static void makeKey(std::string& key, int context, int totalView, int spanUnit, int spanCount,
+		int pid, int mid, const std::vector<int>& iids, const host_set_t& hosts);
+
+	// taken before computing, what is stored after is dropped if
+	// anything of pid is invalidated in between
+	uint64_t getSequence(int pid);
+
+	int lookup(const std::string& key, int64_t start, int64_t end, int64_t span,
+		StatCombiner& combiner, period_run_list_t& missing);
+	void store(const std::string& key, int pid, int mid, int64_t span, const StatCombiner& src,
+		int64_t start, int64_t end, uint64_t seq);
+
+	void invalidate(int pid, int mid, int64_t timestamp);
+	void clear();
+private:
+	typedef struct cache_entry_tag {
+		int pid;
+		int mid;
+		int64_t span;
+		uint64_t lastUsed;
+		std::map<int64_t, cached_period_t> periods;
+	} cache_entry_t;
+
+	typedef std::map<std::string, cache_entry_t> cache_map_t;
+
+	void evict();
+	uint64_t sequenceOf(int pid) const;
+private:
+	cache_map_t entries;
+	size_t maxEntries;
+	size_t maxPeriods;
+
+	uint64_t clock;
+	uint64_t cleared;			// clear() calls
+	std::map<int, uint64_t> sequences;	// invalidations by pid
+
+	long hits;
+	long misses;
+	pthread_mutex_t lock;
+};
+
+#endif /* __QUERY_CACHE__H */
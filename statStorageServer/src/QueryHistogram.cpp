@@ -0,0 +1,88 @@
+/* QueryHistogram.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "Log.h"
+#include "QueryHistogram.h"
+
+QueryHistogram::QueryHistogram() : queries(0), interval(300), lastDump(time(NULL))
+{
+	for (int i = 0; i < HISTOGRAM_SERIES; ++i) {
+		for (int j = 0; j < HISTOGRAM_BUCKETS; ++j)
+			buckets[i][j] = 0;
+	}
+
+	for (int i = 0; i < PROFILE_COUNTERS; ++i)
+		counters[i] = 0;
+}
+
+int QueryHistogram::bucketOf(int64_t usec)
+{
+	int bucket = 0;
+	while (usec > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+		usec >>= 1;
+		++bucket;
+	}
+
+	return bucket;
+}
+
+void QueryHistogram::add(const QueryProfile& profile)
+{
+	for (int i = 0; i < PROFILE_STAGES; ++i) {
+		__sync_add_and_fetch(&buckets[i][bucketOf(profile.getTime(i))], 1);
+	}
+	__sync_add_and_fetch(&buckets[PROFILE_STAGES][bucketOf(profile.getTotal())], 1);
+
+	for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+		__sync_add_and_fetch(&counters[i], profile.getCount(i));
+	}
+	__sync_add_and_fetch(&queries, 1);
+
+	int64_t now = time(NULL), last = lastDump;
+	if (interval > 0 && now - last >= interval && __sync_bool_compare_and_swap(&lastDump, last, now))
+		dump();
+}
+
+//
+// the upper bound of the bucket where percent of the total falls
+//
+int64_t QueryHistogram::percentile(const volatile int64_t *series, int64_t total, int percent) const
+{
+	int64_t wanted = (total * percent + 99) / 100, sum = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		sum += series[i];
+		if (sum >= wanted) return (int64_t)1 << (i + 1);
+	}
+
+	return (int64_t)1 << HISTOGRAM_BUCKETS;
+}
+
+//
+// p50/p90/p99 (usec, upper bounds) of each stage and average
+// counters per query since start
+//
+void QueryHistogram::dump()
+{
+	int64_t total = queries;
+	if (total <= 0) return;
+
+	for (int i = 0; i < HISTOGRAM_SERIES; ++i) {
+		APPLOG_INFO("query %s: queries=%ld, p50<%ldus, p90<%ldus, p99<%ldus",
+			i < PROFILE_STAGES ? QueryProfile::stageName(i) : "total", (long)total,
+			(long)percentile(buckets[i], total, 50), (long)percentile(buckets[i], total, 90),
+			(long)percentile(buckets[i], total, 99));
+	}
+
+	char buf[512];
+	size_t len = 0;
+	for (int i = 0; i < PROFILE_COUNTERS && len < sizeof buf; ++i) {
+		len += snprintf(buf + len, sizeof buf - len, "%s%s=%ld", i == 0 ? "" : ", ",
+				QueryProfile::counterName(i), (long)(counters[i] / total));
+	}
+
+	APPLOG_INFO("query counters per query: %s", buf);
+}
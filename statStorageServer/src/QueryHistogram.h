@@ -0,0 +1,41 @@
+/* QueryHistogram.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __QUERY_HISTOGRAM__H
+#define __QUERY_HISTOGRAM__H
+
+#include <stdint.h>
+
+#include "QueryProfile.h"
+
+// log2 buckets of usec, the last one takes all above
+#define HISTOGRAM_BUCKETS	32
+
+// the stages, and the total as the last one
+#define HISTOGRAM_SERIES	(PROFILE_STAGES + 1)
+
+//
+// stage times and counters of all queries, added by query threads
+// without locking and logged every interval seconds by the one
+// which finds it due
+//
+class QueryHistogram {
+public:
+	QueryHistogram();
+public:
+	void setInterval(int seconds) { interval = seconds; }
+	void add(const QueryProfile& profile);
+	void dump();
+private:
+	static int bucketOf(int64_t usec);
+	int64_t percentile(const volatile int64_t *buckets, int64_t total, int percent) const;
+private:
+	volatile int64_t buckets[HISTOGRAM_SERIES][HISTOGRAM_BUCKETS];
+	volatile int64_t counters[PROFILE_COUNTERS];
+	volatile int64_t queries;
+
+	int interval;
+	volatile int64_t lastDump;
+};
+
+#endif /* __QUERY_HISTOGRAM__H */
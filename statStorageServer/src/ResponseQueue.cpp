@@ -0,0 +1,159 @@
+/* ResponseQueue.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <proto_h16.h>
+#include <beyondy/xbs_naddr.h>
+#include <beyondy/xbs_socket.h>
+
+#include "Log.h"
+#include "Message.h"
+#include "StatCommand.h"
+#include "ResponseQueue.h"
+
+// ms to connect to our own listener
+#define WAKE_CONNECT_TIMEOUT	1000
+
+// the frame closes connections idle for connectionIdleTimeout(30s),
+// one not used for this long is replaced before it may be
+#define WAKE_IDLE_SECONDS	10
+
+ResponseQueue::ResponseQueue() : woken(false), wakeFd(-1), lastWake(0)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&wakeLock, NULL);
+}
+
+ResponseQueue::~ResponseQueue()
+{
+	close();
+	pthread_mutex_destroy(&wakeLock);
+	pthread_mutex_destroy(&lock);
+}
+
+// the ones never sent are dropped
+void ResponseQueue::close()
+{
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < queued.size(); ++i)
+		beyondy::Async::Message::destroy(queued[i]);
+	queued.clear();
+	woken = false;
+	pthread_mutex_unlock(&lock);
+
+	pthread_mutex_lock(&wakeLock);
+	if (wakeFd >= 0) {
+		::close(wakeFd);
+		wakeFd = -1;
+	}
+	pthread_mutex_unlock(&wakeLock);
+}
+
+void ResponseQueue::push(beyondy::Async::Message *msg)
+{
+	pthread_mutex_lock(&lock);
+	queued.push_back(msg);
+	bool needWake = !woken;
+	woken = true;
+	pthread_mutex_unlock(&lock);
+
+	// once per batch, takeAll() takes all queued so far. if it can not
+	// go the next push tries again
+	if (needWake && wake() < 0) {
+		pthread_mutex_lock(&lock);
+		woken = false;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void ResponseQueue::takeAll(std::deque<beyondy::Async::Message *>& msgs)
+{
+	pthread_mutex_lock(&lock);
+	// under the lock, a push after it wakes again
+	msgs.swap(queued);
+	woken = false;
+	pthread_mutex_unlock(&lock);
+}
+
+bool ResponseQueue::canWake()
+{
+	pthread_mutex_lock(&wakeLock);
+	int retval = connectWake();
+	pthread_mutex_unlock(&wakeLock);
+
+	return retval == 0;
+}
+
+//
+// under wakeLock. the connection is replaced once the frame closed it
+// or it may close it soon
+//
+int ResponseQueue::connectWake()
+{
+	if (wakeAddress.empty()) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (wakeFd >= 0) {
+		char c;
+		if (time(NULL) - lastWake < WAKE_IDLE_SECONDS
+			&& (recv(wakeFd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN))
+			return 0;
+
+		::close(wakeFd);
+		wakeFd = -1;
+	}
+
+	if ((wakeFd = beyondy::XbsClient(wakeAddress.c_str(), 0, WAKE_CONNECT_TIMEOUT)) < 0) {
+		APPLOG_ERROR("connect to %s for wakeup failed: %m", wakeAddress.c_str());
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(wakeFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	lastWake = time(NULL);
+
+	return 0;
+}
+
+int ResponseQueue::wake()
+{
+	struct proto_h16_head h;
+	memset(&h, 0, sizeof h);
+	h.len = sizeof h;
+	h.cmd = CMD_STAT_WAKEUP_REQ;
+	h.ver = 1;
+
+	int retval = -1;
+	pthread_mutex_lock(&wakeLock);
+	for (int retry = 0; retry < 2 && retval < 0; ++retry) {
+		if (connectWake() < 0)
+			break;
+
+		// full means the processor has plenty to read, one of them
+		// takes the queued ones anyway
+		ssize_t sent = send(wakeFd, &h, sizeof h, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent == (ssize_t)sizeof h || (sent < 0 && errno == EAGAIN)) {
+			lastWake = time(NULL);
+			retval = 0;
+		}
+		else {
+			APPLOG_WARN("send wakeup to %s failed: %m", wakeAddress.c_str());
+			::close(wakeFd);
+			wakeFd = -1;
+		}
+	}
+	pthread_mutex_unlock(&wakeLock);
+
+	return retval;
+}
@@ -0,0 +1,54 @@
+/* ResponseQueue.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __RESPONSE_QUEUE__H
+#define __RESPONSE_QUEUE__H
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <deque>
+
+namespace beyondy { namespace Async { class Message; } }
+
+//
+// messages built on other threads for the processor thread to send,
+// the only one allowed to call sendMessage(). the frame only calls
+// the processor for messages, so a CMD_STAT_WAKEUP_REQ goes to our
+// own listener over a loopback connection once the queue has some,
+// and the processor takes them all when it comes in.
+//
+class ResponseQueue {
+public:
+	ResponseQueue();
+	~ResponseQueue();
+private:
+	ResponseQueue(const ResponseQueue&);
+	ResponseQueue& operator=(const ResponseQueue&);
+public:
+	// tcp://ip:port the server listens on
+	void open(const std::string& _wakeAddress) { wakeAddress = _wakeAddress; }
+	void close();
+
+	// from any thread, the queue owns msg after it
+	void push(beyondy::Async::Message *msg);
+	// on the processor thread, all queued in the order pushed
+	void takeAll(std::deque<beyondy::Async::Message *>& msgs);
+
+	// if pushed ones will wake the processor, connects if not yet
+	bool canWake();
+private:
+	int connectWake();
+	int wake();
+private:
+	pthread_mutex_t lock;
+	std::deque<beyondy::Async::Message *> queued;
+	bool woken;		// a wakeup is on its way for the queued
+
+	std::string wakeAddress;
+	pthread_mutex_t wakeLock;
+	int wakeFd;
+	time_t lastWake;
+};
+
+#endif /* __RESPONSE_QUEUE__H */
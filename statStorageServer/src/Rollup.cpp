@@ -0,0 +1,174 @@
+/* Rollup.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "Log.h"
+#include "FileStorage.h"
+#include "Rollup.h"
+
+#ifndef INT64_MAX
+#define INT64_MAX	0x7fffffffffffffffLL
+#endif
+
+const rollup_level_t rollupLevels[ROLLUP_LEVELS] = {
+	{ FT_MINUTE, 5, 3 },
+	{ FT_HOUR, 1, 2 },
+	{ FT_DAY, 1, 2 },
+};
+
+int64_t rollupLength(int level)
+{
+	switch (rollupLevels[level].ftype) {
+	case FT_MINUTE: return rollupLevels[level].freqs * 60000LL;
+	case FT_HOUR: return rollupLevels[level].freqs * 3600000LL;
+	case FT_DAY: return rollupLevels[level].freqs * 86400000LL;
+	default:
+		return 0;
+	}
+}
+
+RollupSet::RollupSet(FileStorage& _storage, int _partition)
+	: storage(_storage), partition(_partition)
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		mergers[i] = new StatMerger(this, __saveGauges, __saveLcalls, NULL,
+				rollupLevels[i].ftype, rollupLevels[i].freqs, rollupLevels[i].periods);
+		sealedUntil[i] = INT64_MAX;
+	}
+}
+
+RollupSet::~RollupSet()
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		delete mergers[i];
+	}
+}
+
+int RollupSet::__saveGauges(void *p, const merged_gauge_map_t *gauges)
+{
+	RollupSet *rollups = (RollupSet *)p;
+	int retval = 0;
+
+	for (const_gauge_iterator iter = gauges->begin(); iter != gauges->end(); ++iter) {
+		if (rollups->storage.saveMergedGauge(iter->second, rollups->partition) < 0)
+			retval = -1;
+	}
+
+	return retval;
+}
+
+int RollupSet::__saveLcalls(void *p, const merged_lcall_map_t *lcalls)
+{
+	RollupSet *rollups = (RollupSet *)p;
+	int retval = 0;
+
+	for (const_lcall_iterator iter = lcalls->begin(); iter != lcalls->end(); ++iter) {
+		if (rollups->storage.saveMergedLcall(iter->second, rollups->partition) < 0)
+			retval = -1;
+	}
+
+	return retval;
+}
+
+void RollupSet::updateSealed(int level)
+{
+	int64_t start = mergers[level]->periodStartTime;
+	sealedUntil[level] = start == 0 ? INT64_MAX : start;
+}
+
+//
+// the first item of a level opens buckets around it, an old one
+// would open buckets no crash recovery knows about, take it as late
+//
+bool RollupSet::isLate(int level, int64_t timestamp) const
+{
+	if (mergers[level]->periodStartTime != 0) return false;
+	return timestamp < windowStart(level, (int64_t)time(NULL) * 1000);
+}
+
+void RollupSet::addGauge(const StatMergedGauge& gauge)
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		StatMerger *merger = mergers[i];
+		if (isLate(i, gauge.timestamp) || merger->addMergedGauge(gauge) < 0) {
+			StatMergedGauge late(gauge);
+			late.timestamp = merger->periodStart(gauge.timestamp);
+			late.ftype = merger->ftype;
+			late.freqs = merger->freqs;
+			storage.saveMergedGauge(late, partition, true);
+		}
+
+		updateSealed(i);
+	}
+}
+
+void RollupSet::addLcall(const StatMergedLcall& lcall)
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		StatMerger *merger = mergers[i];
+		if (isLate(i, lcall.timestamp) || merger->addMergedLcall(lcall) < 0) {
+			StatMergedLcall late(lcall);
+			late.timestamp = merger->periodStart(lcall.timestamp);
+			late.ftype = merger->ftype;
+			late.freqs = merger->freqs;
+			storage.saveMergedLcall(late, partition, true);
+		}
+
+		updateSealed(i);
+	}
+}
+
+void RollupSet::flush()
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		if (mergers[i]->periodStartTime == 0) continue;
+		mergers[i]->moveAhead(mergers[i]->periodCount);
+		updateSealed(i);
+	}
+}
+
+//
+// the newest bucket is pushed out one bucket after its end, so
+// items a bit late still make it
+//
+void RollupSet::expire(int64_t now)
+{
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		StatMerger *merger = mergers[i];
+		if (merger->periodStartTime == 0) continue;
+
+		int64_t length = rollupLength(i);
+		int64_t openEnd = merger->periodStartTime + merger->periodCount * length;
+		if (now < openEnd + length) continue;
+
+		int n = (now - openEnd) / length;
+		merger->moveAhead(n < merger->periodCount ? n : merger->periodCount);
+		updateSealed(i);
+	}
+}
+
+int64_t RollupSet::windowStart(int level, int64_t now)
+{
+	int64_t length = rollupLength(level);
+	return now / length * length - (rollupLevels[level].periods - 1) * length;
+}
+
+//
+// called by any thread, so only sealedUntil of the writer is used
+//
+int64_t RollupSet::getOpenSince(int64_t now) const
+{
+	int64_t since = now;
+	for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+		int64_t start = windowStart(i, now);
+		if (sealedUntil[i] < start)
+			start = sealedUntil[i];
+		if (start < since)
+			since = start;
+	}
+
+	return since;
+}
@@ -0,0 +1,73 @@
+/* Rollup.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __ROLLUP__H
+#define __ROLLUP__H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "StatData.h"
+#include "StatMerger.h"
+
+// coarser copies of the minute data, finest first
+#define ROLLUP_LEVELS	3
+
+typedef struct rollup_level_tag {
+	uint8_t ftype;
+	uint8_t freqs;
+	int periods;	// buckets kept open for late items
+} rollup_level_t;
+
+extern const rollup_level_t rollupLevels[ROLLUP_LEVELS];
+
+int64_t rollupLength(int level);
+
+// [start, end) whose rollups are incomplete, read minutes there
+typedef std::pair<int64_t, int64_t> rollup_range_t;
+typedef std::vector<rollup_range_t> rollup_range_list_t;
+
+class FileStorage;
+
+//
+// open rollup buckets of one ingest partition, fed with its minute
+// gauges and lcalls by its writer only. a bucket is saved like any
+// item of the partition when a later bucket pushes it out, items too
+// late for the open buckets are saved as their own bucket records
+// and merged with the others by queries.
+//
+class RollupSet {
+public:
+	RollupSet(FileStorage& _storage, int _partition);
+	~RollupSet();
+private:
+	RollupSet(const RollupSet&);
+	RollupSet& operator=(const RollupSet&);
+public:
+	void addGauge(const StatMergedGauge& gauge);
+	void addLcall(const StatMergedLcall& lcall);
+
+	// save all open buckets, partly or not
+	void flush();
+	// push out buckets nobody adds to anymore
+	void expire(int64_t now);
+
+	// buckets before it are all saved, for query threads
+	int64_t getSealedUntil(int level) const { return sealedUntil[level]; }
+	// the oldest bucket which may be in memory
+	int64_t getOpenSince(int64_t now) const;
+	static int64_t windowStart(int level, int64_t now);
+private:
+	bool isLate(int level, int64_t timestamp) const;
+	void updateSealed(int level);
+	static int __saveGauges(void *p, const merged_gauge_map_t *gauges);
+	static int __saveLcalls(void *p, const merged_lcall_map_t *lcalls);
+private:
+	FileStorage& storage;
+	int partition;
+	StatMerger *mergers[ROLLUP_LEVELS];
+	volatile int64_t sealedUntil[ROLLUP_LEVELS];
+};
+
+#endif /* __ROLLUP__H */
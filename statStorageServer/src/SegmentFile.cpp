@@ -0,0 +1,231 @@
+/* SegmentFile.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "Log.h"
+#include "SegmentFile.h"
+
+// a group larger than this is taken as corrupted
+#define SEGMENT_GROUP_MAX	(1024L * 1024 * 1024)
+
+typedef std::pair<segment_entry_t, size_t> wanted_entry_t;
+
+void SegmentFile::makeEntry(segment_entry_t& entry, const local_key_t& key)
+{
+	memset(&entry, 0, sizeof entry);
+	entry.iid = key.sid.iid;
+	entry.ver = key.hip.ver;
+	if (key.hip.ver == 4) entry.ip[0] = key.hip.ip.ip4;
+	else memcpy(entry.ip, key.hip.ip.ip6, sizeof entry.ip);
+}
+
+bool SegmentFile::entryLess(const segment_entry_t& x, const segment_entry_t& y)
+{
+	if (x.iid != y.iid) return x.iid < y.iid;
+	if (x.ver != y.ver) return x.ver < y.ver;
+	return memcmp(x.ip, y.ip, sizeof x.ip) < 0;
+}
+
+static bool wantedLess(const wanted_entry_t& x, const wanted_entry_t& y)
+{
+	if (x.first.iid != y.first.iid) return x.first.iid < y.first.iid;
+	if (x.first.ver != y.first.ver) return x.first.ver < y.first.ver;
+	return memcmp(x.first.ip, y.first.ip, sizeof x.first.ip) < 0;
+}
+
+int SegmentFile::readAll(int fd, void *buf, size_t size, off_t offset)
+{
+	char *ptr = (char *)buf;
+	while (size > 0) {
+		ssize_t rlen = pread(fd, ptr, size, offset);
+		if (rlen < 0 && errno == EINTR) continue;
+		if (rlen <= 0) return -1;
+
+		ptr += rlen;
+		offset += rlen;
+		size -= rlen;
+	}
+
+	return 0;
+}
+
+//
+// the whole group in one write, so groups appended by different
+// writers to the same segment never interleave
+//
+int SegmentFile::append(int fd, const char *path, const segment_series_list_t& series)
+{
+	if (series.empty()) return 0;
+
+	std::vector<segment_entry_t> entries(series.size());
+	segment_group_t group;
+	group.magic = SEGMENT_GROUP_MAGIC;
+	group.count = series.size();
+	group.dataSize = 0;
+	group.minTimestamp = series[0].firstTimestamp;
+	group.maxTimestamp = series[0].lastTimestamp;
+
+	for (size_t i = 0; i < series.size(); ++i) {
+		makeEntry(entries[i], series[i].key);
+		entries[i].timestamp = series[i].firstTimestamp;
+		entries[i].offset = group.dataSize;
+		entries[i].size = series[i].data->size();
+
+		group.dataSize += series[i].data->size();
+		if (series[i].firstTimestamp < group.minTimestamp) group.minTimestamp = series[i].firstTimestamp;
+		if (series[i].lastTimestamp > group.maxTimestamp) group.maxTimestamp = series[i].lastTimestamp;
+	}
+
+	std::sort(entries.begin(), entries.end(), entryLess);
+
+	std::string buf;
+	buf.reserve(sizeof group + entries.size() * sizeof(segment_entry_t) + group.dataSize);
+	buf.append((const char *)&group, sizeof group);
+	buf.append((const char *)&entries[0], entries.size() * sizeof(segment_entry_t));
+	for (size_t i = 0; i < series.size(); ++i) {
+		buf.append(*series[i].data);
+	}
+
+	ssize_t wlen;
+	while ((wlen = write(fd, buf.data(), buf.size())) < 0 && errno == EINTR)
+		;
+
+	if (wlen != (ssize_t)buf.size()) {
+		APPLOG_ERROR("append group of %ld series into %s failed: wlen=%ld, size=%ld: %m",
+				(long)series.size(), path, (long)wlen, (long)buf.size());
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// walk the groups and give every wanted series' items in [start, end)
+// groups to apply(arg, index-in-series, data, size)
+//
+int SegmentFile::read(const char *path, const segment_read_list_t& series, int64_t start, int64_t end,
+		      int (*apply)(void *, size_t, const unsigned char *, size_t), void *arg)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		APPLOG_ERROR("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	std::vector<wanted_entry_t> wanted(series.size());
+	for (size_t i = 0; i < series.size(); ++i) {
+		makeEntry(wanted[i].first, series[i].key);
+		wanted[i].second = i;
+	}
+	std::sort(wanted.begin(), wanted.end(), wantedLess);
+
+	std::vector<segment_entry_t> entries;
+	std::string data;
+	off_t offset = 0;
+	int retval = 0;
+
+	while (1) {
+		segment_group_t group;
+		ssize_t rlen = pread(fd, &group, sizeof group, offset);
+		if (rlen == 0) break;
+		if (rlen != (ssize_t)sizeof group || group.magic != SEGMENT_GROUP_MAGIC
+			|| group.dataSize > SEGMENT_GROUP_MAX || group.count > SEGMENT_GROUP_MAX / sizeof(segment_entry_t)) {
+			APPLOG_ERROR("%s is truncated or corrupted at %ld", path, (long)offset);
+			retval = -1;
+			break;
+		}
+
+		off_t tableOffset = offset + sizeof group;
+		off_t dataOffset = tableOffset + group.count * sizeof(segment_entry_t);
+		off_t groupOffset = offset;
+		offset = dataOffset + group.dataSize;
+
+		if (group.maxTimestamp < start || group.minTimestamp >= end)
+			continue;
+
+		entries.resize(group.count);
+		if (group.count > 0 && readAll(fd, &entries[0], group.count * sizeof(segment_entry_t), tableOffset) < 0) {
+			APPLOG_ERROR("read table of %s at %ld failed: %m", path, (long)groupOffset);
+			retval = -1;
+			break;
+		}
+
+		for (size_t i = 0; i < wanted.size(); ++i) {
+			const segment_read_t& one = series[wanted[i].second];
+			if (one.fileLimit >= 0 && groupOffset >= one.fileLimit)
+				continue;
+
+			std::vector<segment_entry_t>::const_iterator iter =
+				std::lower_bound(entries.begin(), entries.end(), wanted[i].first, entryLess);
+			if (iter == entries.end() || entryLess(wanted[i].first, *iter) || iter->size == 0)
+				continue;
+			if (iter->offset + (uint64_t)iter->size > group.dataSize) {
+				APPLOG_ERROR("%s has a bad entry in group at %ld", path, (long)groupOffset);
+				continue;
+			}
+
+			data.resize(iter->size);
+			if (readAll(fd, &data[0], iter->size, dataOffset + iter->offset) < 0) {
+				APPLOG_ERROR("read %s at %ld failed: %m", path, (long)(dataOffset + iter->offset));
+				continue;
+			}
+
+			(*apply)(arg, wanted[i].second, (const unsigned char *)data.data(), data.size());
+		}
+	}
+
+	close(fd);
+	return retval;
+}
+
+int SegmentFile::listKeys(const char *path, uint16_t pid, uint16_t mid, std::vector<local_key_t>& keys)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	std::vector<segment_entry_t> entries;
+	off_t offset = 0;
+	int retval = 0;
+
+	while (1) {
+		segment_group_t group;
+		ssize_t rlen = pread(fd, &group, sizeof group, offset);
+		if (rlen == 0) break;
+		if (rlen != (ssize_t)sizeof group || group.magic != SEGMENT_GROUP_MAGIC
+			|| group.count > SEGMENT_GROUP_MAX / sizeof(segment_entry_t)) {
+			APPLOG_ERROR("%s is truncated or corrupted at %ld", path, (long)offset);
+			retval = -1;
+			break;
+		}
+
+		entries.resize(group.count);
+		if (group.count > 0 && readAll(fd, &entries[0], group.count * sizeof(segment_entry_t), offset + sizeof group) < 0) {
+			retval = -1;
+			break;
+		}
+
+		for (size_t i = 0; i < entries.size(); ++i) {
+			local_key_t key;
+			key.sid = stat_id_t(pid, mid, entries[i].iid);
+			key.hip.ver = entries[i].ver;
+			if (entries[i].ver == 4) key.hip.ip.ip4 = entries[i].ip[0];
+			else memcpy(key.hip.ip.ip6, entries[i].ip, sizeof entries[i].ip);
+
+			keys.push_back(key);
+		}
+
+		offset += sizeof group + group.count * sizeof(segment_entry_t) + group.dataSize;
+	}
+
+	close(fd);
+	return retval;
+}
@@ -0,0 +1,71 @@
+/* SegmentFile.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __SEGMENT_FILE__H
+#define __SEGMENT_FILE__H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "StatData.h"
+
+//
+// a segment file holds series of one (type, year, pid, mid, day) and
+// is a chain of groups, each written by one append:
+//	group header | entry * count (sorted by series) | data
+// an entry is the per-series offset of its items in the group data,
+// items are in the same format as in a series file.
+//
+#define SEGMENT_GROUP_MAGIC	0x53475250	/* SGRP */
+
+typedef struct segment_group_tag {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t dataSize;
+	int64_t minTimestamp;
+	int64_t maxTimestamp;
+} segment_group_t;
+
+typedef struct segment_entry_tag {
+	uint16_t iid;
+	uint8_t ver;
+	uint8_t pad;
+	uint32_t ip[4];
+	int64_t timestamp;	// of the first item
+	uint32_t offset;	// in the group data
+	uint32_t size;
+} segment_entry_t;
+
+// one series of a group to append
+typedef struct segment_series_tag {
+	local_key_t key;
+	int64_t firstTimestamp;
+	int64_t lastTimestamp;
+	const std::string *data;
+} segment_series_t;
+
+typedef std::vector<segment_series_t> segment_series_list_t;
+
+// one series to read, from groups before fileLimit (-1 for all)
+typedef struct segment_read_tag {
+	local_key_t key;
+	int64_t fileLimit;
+} segment_read_t;
+
+typedef std::vector<segment_read_t> segment_read_list_t;
+
+class SegmentFile {
+public:
+	static int append(int fd, const char *path, const segment_series_list_t& series);
+	static int read(const char *path, const segment_read_list_t& series, int64_t start, int64_t end,
+			int (*apply)(void *, size_t, const unsigned char *, size_t), void *arg);
+	static int listKeys(const char *path, uint16_t pid, uint16_t mid, std::vector<local_key_t>& keys);
+private:
+	static void makeEntry(segment_entry_t& entry, const local_key_t& key);
+	static bool entryLess(const segment_entry_t& x, const segment_entry_t& y);
+	static int readAll(int fd, void *buf, size_t size, off_t offset);
+};
+
+#endif /* __SEGMENT_FILE__H */
@@ -0,0 +1,470 @@
+/* SeriesCatalog.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "Log.h"
+#include "SeriesCatalog.h"
+
+#define CATALOG_MAGIC		0x53434154	/* SCAT */
+#define CATALOG_VERSION		1
+
+typedef struct catalog_record_tag {
+	uint16_t pid;
+	uint16_t mid;
+	uint16_t iid;
+	uint8_t ver;
+	uint8_t pad;
+	uint32_t ip[4];
+	uint64_t years;
+} catalog_record_t;
+
+#define RCALL_CATALOG_MAGIC	0x52434154	/* RCAT */
+
+typedef struct rcall_record_tag {
+	uint16_t src_pid;
+	uint16_t src_mid;
+	uint16_t src_iid;
+	uint8_t src_ver;
+	uint8_t dst_ver;
+	uint32_t src_ip[4];
+	uint16_t dst_pid;
+	uint16_t dst_mid;
+	uint16_t dst_iid;
+	uint16_t pad;
+	uint32_t dst_ip[4];
+	uint64_t years;
+} rcall_record_t;
+
+int SeriesCatalog::add(const stat_id_t& sid, const stat_ip_t& hip, int year)
+{
+	if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX) {
+		APPLOG_WARN("year %d is out of catalog range, ignore it", year);
+		return -1;
+	}
+
+	// known in most cases, do not block queries for them
+	if ((getYears(sid, hip) & CATALOG_YEAR_BIT(year)) != 0)
+		return 0;
+
+	pthread_rwlock_wrlock(&lock);
+
+	int retval = 0;
+	host_map_t& hosts = pids[sid.pid][sid.mid][sid.iid];
+	host_map_t::iterator iter = hosts.find(hip);
+	if (iter == hosts.end()) {
+		hosts.insert(std::make_pair(hip, CATALOG_YEAR_BIT(year)));
+		++count;
+		retval = 1;
+	}
+	else {
+		iter->second |= CATALOG_YEAR_BIT(year);
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return retval;
+}
+
+//
+// the year is removed, series with no year left are kept, so they
+// are still listed but have no files planned
+//
+int SeriesCatalog::dropYear(int year)
+{
+	if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX)
+		return 0;
+
+	int dropped = 0;
+	pthread_rwlock_wrlock(&lock);
+
+	for (pid_map_t::iterator iter1 = pids.begin(); iter1 != pids.end(); ++iter1) {
+		for (mid_map_t::iterator iter2 = iter1->second.begin(); iter2 != iter1->second.end(); ++iter2) {
+			for (iid_map_t::iterator iter3 = iter2->second.begin(); iter3 != iter2->second.end(); ++iter3) {
+				for (host_map_t::iterator iter4 = iter3->second.begin(); iter4 != iter3->second.end(); ++iter4) {
+					if ((iter4->second & CATALOG_YEAR_BIT(year)) == 0) continue;
+					iter4->second &= ~CATALOG_YEAR_BIT(year);
+					++dropped;
+				}
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return dropped;
+}
+
+void SeriesCatalog::clear()
+{
+	pthread_rwlock_wrlock(&lock);
+	pids.clear();
+	count = 0;
+	pthread_rwlock_unlock(&lock);
+}
+
+void SeriesCatalog::expandIids(local_key_set_t& ids, uint16_t pid, uint16_t mid, const iid_map_t& iids,
+				int iid, const host_set_t *hosts) const
+{
+	for (iid_map_t::const_iterator iter = iids.begin(); iter != iids.end(); ++iter) {
+		if (iid != 0 && iter->first != iid) continue;
+
+		const host_map_t& hmap = iter->second;
+		for (host_map_t::const_iterator iter2 = hmap.begin(); iter2 != hmap.end(); ++iter2) {
+			if (hosts != NULL && hosts->find(iter2->first) == hosts->end())
+				continue;
+			ids.insert(local_key_t(iter2->first, stat_id_t(pid, mid, iter->first)));
+		}
+	}
+}
+
+// 0 of pid/mid/iid means any
+int SeriesCatalog::expand(local_key_set_t& ids, int pid, int mid, int iid, const host_set_t *hosts) const
+{
+	pthread_rwlock_rdlock(&lock);
+
+	for (pid_map_t::const_iterator iter = pids.begin(); iter != pids.end(); ++iter) {
+		if (pid != 0 && iter->first != pid) continue;
+
+		const mid_map_t& mids = iter->second;
+		if (mid != 0) {
+			mid_map_t::const_iterator iter2 = mids.find(mid);
+			if (iter2 != mids.end())
+				expandIids(ids, iter->first, iter2->first, iter2->second, iid, hosts);
+			continue;
+		}
+
+		for (mid_map_t::const_iterator iter2 = mids.begin(); iter2 != mids.end(); ++iter2) {
+			expandIids(ids, iter->first, iter2->first, iter2->second, iid, hosts);
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+uint64_t SeriesCatalog::getYears(const stat_id_t& sid, const stat_ip_t& hip) const
+{
+	uint64_t years = 0;
+	pthread_rwlock_rdlock(&lock);
+
+	pid_map_t::const_iterator iter1 = pids.find(sid.pid);
+	if (iter1 != pids.end()) {
+		mid_map_t::const_iterator iter2 = iter1->second.find(sid.mid);
+		if (iter2 != iter1->second.end()) {
+			iid_map_t::const_iterator iter3 = iter2->second.find(sid.iid);
+			if (iter3 != iter2->second.end()) {
+				host_map_t::const_iterator iter4 = iter3->second.find(hip);
+				if (iter4 != iter3->second.end())
+					years = iter4->second;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return years;
+}
+
+int SeriesCatalog::load(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return -1;
+
+	uint32_t header[3];
+	if (fread(header, sizeof header, 1, fp) != 1
+		|| header[0] != CATALOG_MAGIC || header[1] != CATALOG_VERSION) {
+		APPLOG_WARN("catalog snapshot %s is invalid, ignore it", path);
+		fclose(fp);
+		return -1;
+	}
+
+	pid_map_t loaded;
+	size_t loadedCount = 0;
+
+	catalog_record_t rec;
+	for (uint32_t i = 0; i < header[2]; ++i) {
+		if (fread(&rec, sizeof rec, 1, fp) != 1) {
+			APPLOG_WARN("catalog snapshot %s is truncated at %u, ignore it", path, i);
+			fclose(fp);
+			return -1;
+		}
+
+		stat_ip_t hip;
+		hip.ver = rec.ver;
+		memcpy(&hip.ip, rec.ip, sizeof hip.ip);
+
+		loaded[rec.pid][rec.mid][rec.iid][hip] = rec.years;
+		++loadedCount;
+	}
+
+	fclose(fp);
+
+	pthread_rwlock_wrlock(&lock);
+	pids.swap(loaded);
+	count = loadedCount;
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+int SeriesCatalog::save(const char *path) const
+{
+	char tmpPath[PATH_MAX];
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.tmp", path);
+
+	FILE *fp = fopen(tmpPath, "wb");
+	if (fp == NULL) {
+		APPLOG_ERROR("create catalog snapshot %s failed: %m", tmpPath);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&lock);
+
+	uint32_t header[3] = { CATALOG_MAGIC, CATALOG_VERSION, (uint32_t)count };
+	bool ok = fwrite(header, sizeof header, 1, fp) == 1;
+
+	for (pid_map_t::const_iterator iter1 = pids.begin(); ok && iter1 != pids.end(); ++iter1) {
+		for (mid_map_t::const_iterator iter2 = iter1->second.begin(); ok && iter2 != iter1->second.end(); ++iter2) {
+			for (iid_map_t::const_iterator iter3 = iter2->second.begin(); ok && iter3 != iter2->second.end(); ++iter3) {
+				for (host_map_t::const_iterator iter4 = iter3->second.begin(); ok && iter4 != iter3->second.end(); ++iter4) {
+					catalog_record_t rec;
+					memset(&rec, 0, sizeof rec);
+
+					rec.pid = iter1->first;
+					rec.mid = iter2->first;
+					rec.iid = iter3->first;
+					rec.ver = iter4->first.ver;
+					memcpy(rec.ip, &iter4->first.ip, sizeof iter4->first.ip);
+					rec.years = iter4->second;
+
+					ok = fwrite(&rec, sizeof rec, 1, fp) == 1;
+				}
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+
+	if (fclose(fp) != 0) ok = false;
+	if (!ok || rename(tmpPath, path) < 0) {
+		APPLOG_ERROR("save catalog snapshot %s failed: %m", path);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	return 0;
+}
+
+int RcallCatalog::add(const rcall_key_t& key, int year)
+{
+	if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX) {
+		APPLOG_WARN("year %d is out of catalog range, ignore it", year);
+		return -1;
+	}
+
+	// known in most cases, do not block queries for them
+	pthread_rwlock_rdlock(&lock);
+	bool known = false;
+	pid_map_t::const_iterator iter1 = pids.find(key.src_sid.pid);
+	if (iter1 != pids.end()) {
+		key_map_t::const_iterator iter2 = iter1->second.find(key);
+		known = iter2 != iter1->second.end() && (iter2->second & CATALOG_YEAR_BIT(year)) != 0;
+	}
+	pthread_rwlock_unlock(&lock);
+	if (known) return 0;
+
+	pthread_rwlock_wrlock(&lock);
+
+	int retval = 0;
+	key_map_t& keys = pids[key.src_sid.pid];
+	key_map_t::iterator iter = keys.find(key);
+	if (iter == keys.end()) {
+		keys.insert(std::make_pair(key, CATALOG_YEAR_BIT(year)));
+		callers[key.dst_sid.pid].insert(key.src_sid.pid);
+		++count;
+		retval = 1;
+	}
+	else {
+		iter->second |= CATALOG_YEAR_BIT(year);
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return retval;
+}
+
+// as SeriesCatalog::dropYear(), series with no year left are kept
+int RcallCatalog::dropYear(int year)
+{
+	if (year < CATALOG_YEAR_BASE || year > CATALOG_YEAR_MAX)
+		return 0;
+
+	int dropped = 0;
+	pthread_rwlock_wrlock(&lock);
+
+	for (pid_map_t::iterator iter1 = pids.begin(); iter1 != pids.end(); ++iter1) {
+		for (key_map_t::iterator iter2 = iter1->second.begin(); iter2 != iter1->second.end(); ++iter2) {
+			if ((iter2->second & CATALOG_YEAR_BIT(year)) == 0) continue;
+			iter2->second &= ~CATALOG_YEAR_BIT(year);
+			++dropped;
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return dropped;
+}
+
+void RcallCatalog::clear()
+{
+	pthread_rwlock_wrlock(&lock);
+	pids.clear();
+	callers.clear();
+	count = 0;
+	pthread_rwlock_unlock(&lock);
+}
+
+// callers in mid/iid/hosts, pid is the callee's if not the caller's
+void RcallCatalog::expandKeys(rcall_key_list_t& keys, const key_map_t& kmap, int pid, int mid, int iid,
+				const host_set_t *hosts) const
+{
+	for (key_map_t::const_iterator iter = kmap.begin(); iter != kmap.end(); ++iter) {
+		const rcall_key_t& key = iter->first;
+		if (pid != 0 && key.src_sid.pid != pid && key.dst_sid.pid != pid) continue;
+		if (mid != 0 && key.src_sid.mid != mid) continue;
+		if (iid != 0 && key.src_sid.iid != iid) continue;
+		if (hosts != NULL && hosts->find(key.src_hip) == hosts->end()) continue;
+
+		keys.push_back(*iter);
+	}
+}
+
+//
+// calls from pid/mid/iid/hosts, 0 for any. with callees calls to
+// pid from any other product as well
+//
+int RcallCatalog::expand(rcall_key_list_t& keys, int pid, int mid, int iid, const host_set_t *hosts, bool callees) const
+{
+	pthread_rwlock_rdlock(&lock);
+
+	if (pid == 0) {
+		for (pid_map_t::const_iterator iter = pids.begin(); iter != pids.end(); ++iter)
+			expandKeys(keys, iter->second, 0, mid, iid, hosts);
+	}
+	else {
+		pid_map_t::const_iterator iter = pids.find(pid);
+		if (iter != pids.end())
+			expandKeys(keys, iter->second, pid, mid, iid, hosts);
+
+		caller_map_t::const_iterator iter2 = callees ? callers.find(pid) : callers.end();
+		if (iter2 != callers.end()) {
+			for (pid_set_t::const_iterator iter3 = iter2->second.begin(); iter3 != iter2->second.end(); ++iter3) {
+				if (*iter3 == pid || (iter = pids.find(*iter3)) == pids.end()) continue;
+				expandKeys(keys, iter->second, pid, mid, iid, hosts);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+int RcallCatalog::load(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return -1;
+
+	uint32_t header[3];
+	if (fread(header, sizeof header, 1, fp) != 1
+		|| header[0] != RCALL_CATALOG_MAGIC || header[1] != CATALOG_VERSION) {
+		APPLOG_WARN("catalog snapshot %s is invalid, ignore it", path);
+		fclose(fp);
+		return -1;
+	}
+
+	pid_map_t loaded;
+	caller_map_t loadedCallers;
+	size_t loadedCount = 0;
+
+	rcall_record_t rec;
+	for (uint32_t i = 0; i < header[2]; ++i) {
+		if (fread(&rec, sizeof rec, 1, fp) != 1) {
+			APPLOG_WARN("catalog snapshot %s is truncated at %u, ignore it", path, i);
+			fclose(fp);
+			return -1;
+		}
+
+		rcall_key_t key;
+		key.src_hip.ver = rec.src_ver;
+		memcpy(&key.src_hip.ip, rec.src_ip, sizeof key.src_hip.ip);
+		key.src_sid = stat_id_t(rec.src_pid, rec.src_mid, rec.src_iid);
+		key.dst_hip.ver = rec.dst_ver;
+		memcpy(&key.dst_hip.ip, rec.dst_ip, sizeof key.dst_hip.ip);
+		key.dst_sid = stat_id_t(rec.dst_pid, rec.dst_mid, rec.dst_iid);
+
+		loaded[rec.src_pid][key] = rec.years;
+		loadedCallers[rec.dst_pid].insert(rec.src_pid);
+		++loadedCount;
+	}
+
+	fclose(fp);
+
+	pthread_rwlock_wrlock(&lock);
+	pids.swap(loaded);
+	callers.swap(loadedCallers);
+	count = loadedCount;
+	pthread_rwlock_unlock(&lock);
+	return 0;
+}
+
+int RcallCatalog::save(const char *path) const
+{
+	char tmpPath[PATH_MAX];
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.tmp", path);
+
+	FILE *fp = fopen(tmpPath, "wb");
+	if (fp == NULL) {
+		APPLOG_ERROR("create catalog snapshot %s failed: %m", tmpPath);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&lock);
+
+	uint32_t header[3] = { RCALL_CATALOG_MAGIC, CATALOG_VERSION, (uint32_t)count };
+	bool ok = fwrite(header, sizeof header, 1, fp) == 1;
+
+	for (pid_map_t::const_iterator iter1 = pids.begin(); ok && iter1 != pids.end(); ++iter1) {
+		for (key_map_t::const_iterator iter2 = iter1->second.begin(); ok && iter2 != iter1->second.end(); ++iter2) {
+			const rcall_key_t& key = iter2->first;
+			rcall_record_t rec;
+			memset(&rec, 0, sizeof rec);
+
+			rec.src_pid = key.src_sid.pid;
+			rec.src_mid = key.src_sid.mid;
+			rec.src_iid = key.src_sid.iid;
+			rec.src_ver = key.src_hip.ver;
+			memcpy(rec.src_ip, &key.src_hip.ip, sizeof key.src_hip.ip);
+			rec.dst_pid = key.dst_sid.pid;
+			rec.dst_mid = key.dst_sid.mid;
+			rec.dst_iid = key.dst_sid.iid;
+			rec.dst_ver = key.dst_hip.ver;
+			memcpy(rec.dst_ip, &key.dst_hip.ip, sizeof key.dst_hip.ip);
+			rec.years = iter2->second;
+
+			ok = fwrite(&rec, sizeof rec, 1, fp) == 1;
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+
+	if (fclose(fp) != 0) ok = false;
+	if (!ok || rename(tmpPath, path) < 0) {
+		APPLOG_ERROR("save catalog snapshot %s failed: %m", path);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	return 0;
+}
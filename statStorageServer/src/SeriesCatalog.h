@@ -0,0 +1,108 @@
+/* SeriesCatalog.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __SERIES_CATALOG__H
+#define __SERIES_CATALOG__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <utility>
+#include <tr1/unordered_map>
+#include <tr1/unordered_set>
+
+#include "StatData.h"
+
+typedef std::tr1::unordered_set<local_key_t, LocalKeyHash> local_key_set_t;
+typedef std::tr1::unordered_set<stat_ip_t, HipHash> host_set_t;
+
+//
+// years a series has data in, one bit per year from
+// CATALOG_YEAR_BASE on
+//
+#define CATALOG_YEAR_BASE	2000
+#define CATALOG_YEAR_MAX	(CATALOG_YEAR_BASE + 63)
+#define CATALOG_YEAR_BIT(y)	((uint64_t)1 << ((y) - CATALOG_YEAR_BASE))
+
+//
+// in-memory inverted index of all series of one type:
+// pid => mid => iid => host => years
+// added by ingest and read by query threads at the same time
+//
+class SeriesCatalog {
+public:
+	SeriesCatalog() : count(0) { pthread_rwlock_init(&lock, NULL); }
+	~SeriesCatalog() { pthread_rwlock_destroy(&lock); }
+private:
+	SeriesCatalog(const SeriesCatalog&);
+	SeriesCatalog& operator=(const SeriesCatalog&);
+public:
+	int add(const stat_id_t& sid, const stat_ip_t& hip, int year);
+	int expand(local_key_set_t& ids, int pid, int mid, int iid, const host_set_t *hosts) const;
+	uint64_t getYears(const stat_id_t& sid, const stat_ip_t& hip) const;
+
+	int dropYear(int year);
+
+	size_t size() const { return count; }
+	void clear();
+
+	int load(const char *path);
+	int save(const char *path) const;
+private:
+	typedef std::tr1::unordered_map<stat_ip_t, uint64_t, HipHash> host_map_t;
+	typedef std::tr1::unordered_map<uint16_t, host_map_t> iid_map_t;
+	typedef std::tr1::unordered_map<uint16_t, iid_map_t> mid_map_t;
+	typedef std::tr1::unordered_map<uint16_t, mid_map_t> pid_map_t;
+
+	void expandIids(local_key_set_t& ids, uint16_t pid, uint16_t mid, const iid_map_t& iids,
+		int iid, const host_set_t *hosts) const;
+private:
+	pid_map_t pids;
+	size_t count;
+	mutable pthread_rwlock_t lock;
+};
+
+// rcall series and the years they have data in
+typedef std::vector<std::pair<rcall_key_t, uint64_t> > rcall_key_list_t;
+
+//
+// in-memory index of all rcall series by the caller:
+// src pid => rcall key => years
+// and the products calling each product, for calls to it. added by
+// ingest and read by query threads at the same time
+//
+class RcallCatalog {
+public:
+	RcallCatalog() : count(0) { pthread_rwlock_init(&lock, NULL); }
+	~RcallCatalog() { pthread_rwlock_destroy(&lock); }
+private:
+	RcallCatalog(const RcallCatalog&);
+	RcallCatalog& operator=(const RcallCatalog&);
+public:
+	int add(const rcall_key_t& key, int year);
+	int expand(rcall_key_list_t& keys, int pid, int mid, int iid, const host_set_t *hosts, bool callees) const;
+
+	int dropYear(int year);
+
+	size_t size() const { return count; }
+	void clear();
+
+	int load(const char *path);
+	int save(const char *path) const;
+private:
+	typedef std::tr1::unordered_map<rcall_key_t, uint64_t, RcallKeyHash> key_map_t;
+	typedef std::tr1::unordered_map<uint16_t, key_map_t> pid_map_t;
+	typedef std::tr1::unordered_set<uint16_t> pid_set_t;
+	typedef std::tr1::unordered_map<uint16_t, pid_set_t> caller_map_t;
+
+	void expandKeys(rcall_key_list_t& keys, const key_map_t& kmap, int pid, int mid, int iid,
+		const host_set_t *hosts) const;
+private:
+	pid_map_t pids;
+	caller_map_t callers;	// callee pid => caller pids
+	size_t count;
+	mutable pthread_rwlock_t lock;
+};
+
+#endif /* __SERIES_CATALOG__H */
@@ -0,0 +1,54 @@
+/* StatSegmentConvert.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+
+#include "Log.h"
+#include "FileStorage.h"
+
+//
+// offline converter: rewrite series files of a stats directory into
+// segment files. stop the storage server before running it.
+//
+int main(int argc, char **argv)
+{
+	bool keepOld = false;
+	long maxMBytes = 256;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "km:h")) != -1) {
+		switch (ch) {
+		case 'k':
+			keepOld = true;
+			break;
+		case 'm':
+			maxMBytes = strtol(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-k] [-m buffer-MB] [stats-dir]\n", argv[0]);
+			fprintf(stderr, "       -k ---- keep the series files after converting\n");
+			fprintf(stderr, "       -m ---- MB of items buffered before writing segments, default 256\n");
+			fprintf(stderr, "       stats-dir defaults to ../stats/, the server must be stopped\n");
+			exit(ch == 'h' ? 0 : 1);
+		}
+	}
+
+	std::string baseDir = optind < argc ? argv[optind] : "../stats/";
+	if (baseDir.empty() || baseDir[baseDir.size() - 1] != '/')
+		baseDir += "/";
+	if (maxMBytes <= 0) maxMBytes = 256;
+
+	FileStorage storage;
+	storage.setDirectory(baseDir);
+
+	if (storage.convertToSegments(keepOld, (size_t)maxMBytes * 1024 * 1024) < 0) {
+		fprintf(stderr, "some series files of %s are not converted, see the log above\n", baseDir.c_str());
+		return 1;
+	}
+
+	return 0;
+}
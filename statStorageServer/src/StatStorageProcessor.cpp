@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <stdint.h>
@@ -17,11 +18,33 @@
 #include "StatErrno.h"
 #include "StatCommand.h"
 #include "StatCombiner.h"
+#include "QueryProfile.h"
+#include "Downsample.h"
 #include "StatStorageProcessor.h"
 #include "ConfigProperty.h"
 
+//
+// the frame listens on listenAddress of server.conf, on any address
+// the loopback one takes our own wakeups
+//
+static std::string localAddressOf(const std::string& listenAddress)
+{
+	std::string addr = listenAddress;
+	if (!strncmp(addr.c_str(), "tcp://", 6)) addr = addr.substr(6);
+
+	std::string::size_type colon = addr.rfind(':');
+	if (colon == std::string::npos) return std::string();
+
+	std::string ip = addr.substr(0, colon);
+	if (ip.empty() || ip == "*" || ip == "0.0.0.0") ip = "127.0.0.1";
+
+	return "tcp://" + ip + addr.substr(colon);
+}
+
 int StatStorageProcessor::onInit()
 {
+	processorThread = pthread_self();
+
 	const char *file = "../conf/stat.conf";
 	ConfigProperty cfp;
 	if (cfp.parse(file) < 0) {
@@ -29,8 +52,93 @@ int StatStorageProcessor::onInit()
 		return -1;
 	}
 
+	// responses built on other threads wake the processor through it
+	std::string wakeupAddress = cfp.getString("wakeupAddress", "");
+	if (wakeupAddress.empty()) {
+		ConfigProperty server;
+		if (server.parse("../conf/server.conf") == 0)
+			wakeupAddress = localAddressOf(server.getString("listenAddress", ""));
+	}
+
+	if (wakeupAddress.empty()) {
+		APPLOG_WARN("no address to wake up the processor, queries run on it and live stats are refused");
+	}
+	responses.open(wakeupAddress);
+
 	baseDir = cfp.getString("statsDir", "../stats/");
 	storage.setDirectory(baseDir);
+	storage.setTimeIndexStep(cfp.getInt("timeIndexStep", 64 * 1024));
+	std::string storageLayout = cfp.getString("storageLayout", "file");
+	storage.setLayout(storageLayout == "segment" ? LAYOUT_SEGMENT : LAYOUT_SERIES_FILE,
+			cfp.getInt("segmentReadSeriesFiles", 1) != 0);
+	if (storage.loadCatalog() < 0) {
+		APPLOG_WARN("no series catalog, queries will find nothing before new data comes");
+	}
+
+	int writerCount = cfp.getInt("ingestWriterCount", 4);
+	long writerMaxQueued = cfp.getInt("ingestMaxQueued", 1000000);
+	maxIngestWait = cfp.getInt("ingestMaxWait", 5000);
+	if (storage.openMemTables(writerCount, cfp.getInt("memtableMaxBytes", 16 * 1024 * 1024),
+			(int64_t)cfp.getInt("memtableMaxAge", 300) * 1000) < 0) {
+		APPLOG_ERROR("open memtables failed");
+		return -1;
+	}
+
+	if (storage.openRollups(cfp.getInt("rollupEnabled", 1) != 0) < 0) {
+		APPLOG_ERROR("open rollups failed");
+		return -1;
+	}
+
+	if (storage.openHotTier(cfp.getInt("hotTierHours", 0)) < 0) {
+		APPLOG_ERROR("open hot tier failed");
+		return -1;
+	}
+
+	for (int i = 0; i < writerCount; ++i) {
+		IngestWriter *writer = new IngestWriter(storage, i, writerMaxQueued);
+		if (writer->start() < 0) {
+			delete writer;
+			return -1;
+		}
+
+		writers.push_back(writer);
+	}
+
+	compact_policy_t policy;
+	policy.minuteDays = cfp.getInt("compactMinuteDays", 0);
+	policy.retainYears = cfp.getInt("compactRetainYears", 0);
+	policy.maxDays = cfp.getInt("compactMaxDays", 7);
+	policy.interval = cfp.getInt("compactInterval", 3600);
+
+	compactor = NULL;
+	liveFeed = NULL;
+	if (policy.minuteDays > 0 || policy.retainYears > 0) {
+		compactor = new Compactor(storage, __dispatchIngest, this);
+		if (compactor->start(policy) < 0) {
+			delete compactor;
+			return -1;
+		}
+	}
+
+	int threads = cfp.getInt("queryThreadCount", 4);
+	if (queryPool.start(threads) < 0) {
+		APPLOG_ERROR("start query pool of %d threads failed", threads);
+		return -1;
+	}
+
+	storage.setQueryPool(&queryPool, cfp.getInt("queryParallelism", threads));
+	storage.setQueryCache(cfp.getInt("queryCacheEntries", 0), cfp.getInt("queryCachePeriods", 1440));
+	runningQueries = 0;
+	maxRunningQueries = cfp.getInt("queryMaxRunning", 16);
+	queryHistogram.setInterval(cfp.getInt("queryProfileInterval", 300));
+
+	liveFeed = new LiveFeed(__sendLive, this);
+	if (liveFeed->start(cfp.getInt("liveGrace", 5), cfp.getInt("liveHeartbeat", 5),
+			cfp.getInt("liveMaxSubscriptions", 256)) < 0) {
+		delete liveFeed;
+		liveFeed = NULL;
+		return -1;
+	}
 
 	nextSyn = 0;
 	maxInputSize = 10*1024*1024;
@@ -42,9 +150,95 @@ int StatStorageProcessor::onInit()
 
 void StatStorageProcessor::onExit()
 {
+	if (liveFeed != NULL) {
+		liveFeed->stop();
+		delete liveFeed;
+		liveFeed = NULL;
+	}
+
+	if (compactor != NULL) {
+		compactor->stop();
+		APPLOG_INFO("compactor reclaimed %lld bytes", (long long)compactor->getReclaimedBytes());
+		delete compactor;
+		compactor = NULL;
+	}
+
+	queryPool.stop();
+	queryHistogram.dump();
+
+	for (size_t i = 0; i < writers.size(); ++i) {
+		writers[i]->stop();
+		APPLOG_INFO("writer #%d saved %ld items", (int)i, writers[i]->getSavedCount());
+		delete writers[i];
+	}
+	writers.clear();
+
+	storage.closeRollups();
+	storage.closeMemTables();
+	storage.saveCatalog();
+
+	// no one queues any more, nor is there an event loop to send them
+	responses.close();
 	APPLOG_INFO("StatStorageProcessor exit");
 }
 
+//
+// on the processor thread, syn is counted here only
+//
+int StatStorageProcessor::sendOut(beyondy::Async::Message *msg)
+{
+	struct proto_h16_res *h = (struct proto_h16_res *)msg->data();
+	h->syn = nextSyn++;
+
+	if (sendMessage(msg) < 0) {
+		APPLOG_ERROR("send rsp(cmd=%d, ack=%u, retcode=%d) failed", (int)h->cmd, h->ack, (int)h->ret);
+		// a live frame queued by the feed can not tell it
+		if (h->cmd == CMD_STAT_SUBSCRIBE_RSP && liveFeed != NULL)
+			liveFeed->unsubscribeAll(msg->fd, msg->flow);
+		beyondy::Async::Message::destroy(msg);
+		return -1;
+	}
+
+	return 0;
+}
+
+void StatStorageProcessor::sendQueued()
+{
+	std::deque<beyondy::Async::Message *> msgs;
+	responses.takeAll(msgs);
+
+	for (size_t i = 0; i < msgs.size(); ++i)
+		sendOut(msgs[i]);
+}
+
+//
+// sent right away on the processor thread, after the ones queued
+// before it; queued for it on any other. a queued one which can not
+// go is only logged
+//
+int StatStorageProcessor::postMessage(beyondy::Async::Message *msg)
+{
+	if (!pthread_equal(pthread_self(), processorThread)) {
+		responses.push(msg);
+		return 0;
+	}
+
+	sendQueued();
+	return sendOut(msg);
+}
+
+//
+// queries run on the pool as long as their responses can wake the
+// processor thread, on it otherwise not to wait for the next request
+//
+void StatStorageProcessor::submitQuery(WorkerTask *task)
+{
+	if (responses.canWake())
+		queryPool.submit(task);
+	else
+		task->run();
+}
+
 int StatStorageProcessor::doResponse(beyondy::Async::Message *rsp, int cmd, int retcode, const struct proto_h16_head *h, const beyondy::Async::Message *msg)
 {
 	struct proto_h16_res *h2;
@@ -54,61 +248,110 @@ int StatStorageProcessor::doResponse(beyondy::Async::Message *rsp, int cmd, int
 	}
 
 	h2 = (struct proto_h16_res *)rsp->data();
-	memset(h2, sizeof *h2, 0);
+	if (rsp->getWptr() < (long)sizeof *h2)
+		rsp->setWptr(sizeof *h2);
 
-	h2->len = sizeof *h2;
+	memset(h2, 0, sizeof *h2);
+	h2->len = rsp->getWptr();
 	h2->cmd = cmd;
-	h2->syn = nextSyn;
 	h2->ack = h->syn;
 	h2->ret = retcode;
 
-	rsp->setWptr(sizeof *h2);
-	int retval = sendMessage(rsp);
+	return postMessage(rsp);
+}
 
-	if (retval < 0) {
-		APPLOG_ERROR("send save-stats for rsp(cmd=%d, ack=%d, retcode=%d) failed", cmd, h->syn, retcode);
-		beyondy::Async::Message::destroy(rsp);
-		return -1;
+void StatStorageProcessor::dispatchIngest(int partition, IngestItem *item)
+{
+	if (partition < 0 || partition >= (int)writers.size()) {
+		item->save(storage, -1);
+		delete item;
+		return;
+	}
+
+	writers[partition]->push(item);
+}
+
+void StatStorageProcessor::__dispatchIngest(void *p, int partition, IngestItem *item)
+{
+	StatStorageProcessor *processor = (StatStorageProcessor *)p;
+	processor->dispatchIngest(partition, item);
+}
+
+//
+// parsed here and saved by writers. the response does not wait for
+// the saving, so it is not durable: items queued or in a memtable not
+// yet in its WAL are lost by a crash. while a writer the request goes
+// to has ingestMaxQueued items waiting, the processor waits for it up
+// to ingestMaxWait ms and so stops reading from agents; the items are
+// queued after it anyway, none is dropped for being busy
+//
+int StatStorageProcessor::waitWriters(const std::vector<bool>& touched, uint32_t syn)
+{
+	long waited = 0;
+	for (size_t i = 0; i < writers.size(); ++i) {
+		while (touched[i] && writers[i]->isFull()) {
+			if (waited >= maxIngestWait) {
+				APPLOG_WARN("writer #%d is still behind after %ldms, queue save-stats syn=%u anyway",
+					(int)i, waited, syn);
+				return -1;
+			}
+
+			// what the query threads have is not held up by it
+			sendQueued();
+			usleep(10 * 1000);
+			waited += 10;
+		}
 	}
 
+	if (waited > 0) APPLOG_INFO("waited %ldms for writers to save save-stats syn=%u", waited, syn);
 	return 0;
 }
 
 int StatStorageProcessor::onSaveStatsRequest(struct proto_h16_head *h, beyondy::Async::Message *msg)
 {
+	std::vector<std::pair<int, IngestItem *> > items;
 	int retval = 0, cnt = 0;
 	while (msg->getRptr() + 5 < msg->getWptr()) {
 		uint8_t type = -1;
 		msg->readUint8(type);
 		switch (type) {
 		case STAT_MERGED_GAUGE: {
-			StatMergedGauge gauge;
+			GaugeIngestItem *item = new GaugeIngestItem;
+			StatMergedGauge& gauge = item->gauge;
 			if ((retval = gauge.parseFrom(msg)) < 0) {
 				APPLOG_WARN("parse MergedGauge failed at @%ld", (long)msg->getRptr());
+				delete item;
 				break;	
 			}
 
-			storage.saveMergedGauge(gauge);
+			// before the writer owns it
+			liveFeed->add(gauge);
+			items.push_back(std::make_pair(storage.partitionOf(local_key_t(gauge.hip, gauge.sid)), (IngestItem *)item));
 			break;
 		}
 		case STAT_MERGED_LCALL: {
-			StatMergedLcall lcall;
+			LcallIngestItem *item = new LcallIngestItem;
+			StatMergedLcall& lcall = item->lcall;
 			if ((retval = lcall.parseFrom(msg)) < 0) {
 				APPLOG_WARN("parse MergedLcall failed at @%ld", (long)msg->getRptr());
+				delete item;
 				break;	
 			}
 
-			storage.saveMergedLcall(lcall);
+			items.push_back(std::make_pair(storage.partitionOf(local_key_t(lcall.hip, lcall.sid)), (IngestItem *)item));
 			break;
 		}
 		case STAT_MERGED_RCALL: {
-			StatMergedRcall rcall;
+			RcallIngestItem *item = new RcallIngestItem;
+			StatMergedRcall& rcall = item->rcall;
 			if ((retval = rcall.parseFrom(msg)) < 0) {
 				APPLOG_WARN("parse MergedRcall failed at @%ld", (long)msg->getRptr());
+				delete item;
 				break;	
 			}
 
-			storage.saveMergedRcall(rcall);
+			items.push_back(std::make_pair(storage.partitionOf(rcall_key_t(rcall.src_hip, rcall.src_sid, rcall.dst_hip, rcall.dst_sid)),
+						(IngestItem *)item));
 			break;
 		}
 		default:
@@ -120,7 +363,18 @@ int StatStorageProcessor::onSaveStatsRequest(struct proto_h16_head *h, beyondy::
 		++cnt;
 	}
 
-	APPLOG_DEBUG("saved %d stats-data: size=%u, syn=%u", cnt, h->len, h->syn); 
+	// only the writers of this request hold it up
+	std::vector<bool> touched(writers.size(), false);
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (items[i].first >= 0 && items[i].first < (int)writers.size())
+			touched[items[i].first] = true;
+	}
+
+	waitWriters(touched, h->syn);
+	for (size_t i = 0; i < items.size(); ++i)
+		dispatchIngest(items[i].first, items[i].second);
+
+	APPLOG_DEBUG("queued %d stats-data: size=%u, syn=%u", cnt, h->len, h->syn); 
 
 	if (doResponse(NULL, CMD_STAT_AGENT_SAVE_STATS_RSP, retval, h, msg) < 0) {
 		APPLOG_ERROR("response SaveStats failed");
@@ -131,36 +385,441 @@ int StatStorageProcessor::onSaveStatsRequest(struct proto_h16_head *h, beyondy::
 	return retval;
 }
 
+// from the feed thread, queued as responses are and sent as soon
+// as the wakeup gets to the processor thread
+int StatStorageProcessor::__sendLive(void *p, beyondy::Async::Message *msg)
+{
+	StatStorageProcessor *processor = (StatStorageProcessor *)p;
+	return processor->postMessage(msg);
+}
+
+//
+// frames of the response go on until unsubscribed: the ack with the
+// id of the subscription now, periods and heartbeats by the feed
+//
+int StatStorageProcessor::onSubscribeRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	live_selection_t selection;
+	uint8_t context, totalView, ftype, freqs;
+	uint16_t pid, mid, cnt = 0;
+	bool valid = msg->readUint8(context) >= 0 && msg->readUint8(totalView) >= 0
+		&& msg->readUint8(ftype) >= 0 && msg->readUint8(freqs) >= 0
+			&& msg->readUint16(pid) >= 0 && msg->readUint16(mid) >= 0
+				&& msg->readUint16(cnt) >= 0;
+
+	for (int i = 0; valid && i < cnt; ++i) {
+		uint16_t iid = 0;
+		if (msg->readUint16(iid) < 0) valid = false;
+		else selection.iids.push_back(iid);
+	}
+
+	if (valid && msg->readUint16(cnt) < 0) valid = false;
+	for (int i = 0; valid && i < cnt; ++i) {
+		stat_ip_t hip;
+		if (parseFrom(hip, msg) < 0) valid = false;
+		else selection.hosts.insert(hip);
+	}
+
+	int retval = 0;
+	if (!valid) {
+		APPLOG_ERROR("invalid parameters in onSubscribeRequest");
+		retval = doResponse(NULL, CMD_STAT_SUBSCRIBE_RSP, E_STAT_PARAMETER_MISSING, h, msg);
+	}
+	else if (!responses.canWake()) {
+		// frames and heartbeats would wait for the next request
+		APPLOG_WARN("no wakeup for live frames, refuse subscription syn=%u", h->syn);
+		retval = doResponse(NULL, CMD_STAT_SUBSCRIBE_RSP, E_STAT_SUBSCRIBE_FAILED, h, msg);
+	}
+	else {
+		selection.totalView = totalView;
+		selection.ftype = ftype;
+		selection.freqs = freqs;
+		selection.pid = pid;
+		selection.mid = mid;
+
+		if (liveFeed->subscribe(msg->fd, msg->flow, h->syn, selection) == 0)
+			retval = doResponse(NULL, CMD_STAT_SUBSCRIBE_RSP, E_STAT_SUBSCRIBE_FAILED, h, msg);
+	}
+
+	beyondy::Async::Message::destroy(msg);
+	return retval;
+}
+
+int StatStorageProcessor::onUnsubscribeRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	uint64_t id = 0;
+	int retcode = 0;
+	if (msg->readUint64(id) < 0 || liveFeed->unsubscribe(id) < 0)
+		retcode = E_STAT_PARAMETER_MISSING;
+
+	int retval = doResponse(NULL, CMD_STAT_UNSUBSCRIBE_RSP, retcode, h, msg);
+	beyondy::Async::Message::destroy(msg);
+	return retval;
+}
+
+class SystemStatsQueryTask : public WorkerTask {
+public:
+	SystemStatsQueryTask(StatStorageProcessor *_proc, const struct proto_h16_head *_h, beyondy::Async::Message *_msg)
+		: proc(_proc), h(_h), msg(_msg)
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		proc->doGetSystemStats(h, msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+	virtual void cancel() {
+		beyondy::Async::Message::destroy(msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+private:
+	StatStorageProcessor *proc;
+	const struct proto_h16_head *h;		// inside msg
+	beyondy::Async::Message *msg;
+};
+
 int StatStorageProcessor::onGetSystemStatsRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
 {
-	beyondy::Async::Message *rsp = NULL;
-	int retval = 0, retcode = E_STAT_PARAMETER_MISSING;
+	if (__sync_add_and_fetch(&runningQueries, 1) > maxRunningQueries) {
+		__sync_sub_and_fetch(&runningQueries, 1);
+		APPLOG_WARN("too many queries running, reject syn=%u", h->syn);
+
+		int retval = doResponse(NULL, CMD_STAT_GET_SYSTEM_STATS_RSP, E_STAT_SERVER_BUSY, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return retval;
+	}
 
+	// the task owns msg from now on
+	submitQuery(new SystemStatsQueryTask(this, h, msg));
+	return 0;
+}
+
+//
+// context, totalView, start, end, ftype, freqs, pid, mid, iids and
+// hosts of a system stats query, the span and range checked
+//
+static int parseSystemQuery(system_query_t& query, beyondy::Async::Message *msg)
+{
 	uint8_t context, totalView, ftype, freqs;
-	int64_t start, end;
 	uint16_t pid, mid;
-	std::vector<int> iids;
-	host_set_t hosts;
 
 	if (msg->readUint8(context) < 0 || msg->readUint8(totalView) < 0
-		|| msg->readInt64(start) < 0 || msg->readInt64(end) < 0
+		|| msg->readInt64(query.start) < 0 || msg->readInt64(query.end) < 0
 		|| msg->readUint8(ftype) < 0 || msg->readUint8(freqs) < 0
-			|| msg->readUint16(pid) < 0 || msg->readUint16(mid) < 0) {
+			|| msg->readUint16(pid) < 0 || msg->readUint16(mid) < 0)
+		return -1;
+
+	query.context = context;
+	query.totalView = totalView;
+	query.spanUnit = ftype;
+	query.spanCount = freqs;
+	query.pid = pid;
+	query.mid = mid;
+
+	uint16_t cnt = 0;
+	if (msg->readUint16(cnt) < 0) return -1;
+	for (int i = 0; i < cnt; ++i) {
+		uint16_t iid = 0;
+		if (msg->readUint16(iid) < 0) return -1;
+		query.iids.push_back(iid);
+	}
+
+	if (msg->readUint16(cnt) < 0) return -1;
+	for (int i = 0; i < cnt; ++i) {
+		stat_ip_t hip;
+		if (parseFrom(hip, msg) < 0) return -1;
+		query.hosts.insert(hip);
+	}
+
+	if (FileStorage::spanLength(ftype, freqs) <= 0 || query.end <= query.start) {
+		APPLOG_ERROR("invalid span or range of system stats query");
+		return -1;
+	}
+
+	return 0;
+}
+
+int StatStorageProcessor::doGetSystemStats(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	beyondy::Async::Message *rsp = NULL;
+	int retval = 0, retcode = E_STAT_PARAMETER_MISSING;
+
+	system_query_t query;
+	if (parseSystemQuery(query, msg) < 0) {
 		APPLOG_ERROR("invalid parameters in onGetSystemStatsRequest");
 param_missing:
 		retcode = E_STAT_PARAMETER_MISSING;
 		doResponse(rsp, CMD_STAT_GET_SYSTEM_STATS_RSP, retcode, h, msg);
+		beyondy::Async::Message::destroy(msg);
 		return -1;	
 	}
 
+	// flags are new, older clients do not send them
+	uint8_t flags = 0;
+	if (msg->getRptr() < msg->getWptr() && msg->readUint8(flags) < 0) goto param_missing;
+	// points a series may have at most, 0 for all periods
+	uint16_t maxPoints = 0;
+	if (msg->getRptr() < msg->getWptr() && msg->readUint16(maxPoints) < 0) goto param_missing;
+
+	int64_t span = FileStorage::spanLength(query.spanUnit, query.spanCount);
+	int mergeCount = (query.end - query.start + span - 1) / span;
+	StatCombiner combiner(query.spanUnit, query.spanCount, query.start, mergeCount);
+	QueryProfile profile;
+	QueryProfile::setCurrent(&profile);
+
+	if (storage.getSystemStats(combiner, query.context, query.totalView, query.start, query.end,
+			query.spanUnit, query.spanCount, query.pid, query.mid, query.iids, query.hosts) < 0) {
+		APPLOG_ERROR("getSystemStats failed");
+		retcode = E_STAT_GET_SYSTEM_STATS_FAILED;
+		retval = doResponse(rsp, CMD_STAT_GET_SYSTEM_STATS_RSP, retcode, h, msg);
+	}
+	else {
+		if (maxPoints > 0) {
+			ProfileStage stage(PROFILE_COMBINE);
+			downsampleSystemStats(combiner, maxPoints);
+		}
+
+		retval = sendSystemStats(combiner, h, msg, (flags & QUERY_FLAG_PROFILE) ? &profile : NULL);
+	}
+
+	QueryProfile::setCurrent(NULL);
+	queryHistogram.add(profile);
+
+	if (retval < 0) {
+		APPLOG_ERROR("response for GetSystemStatsRequst failed");
+	}
+	
+	beyondy::Async::Message::destroy(msg);
+	return retval;
+}
+
+//
+// as many frames as it takes, each of maxOutputSize bytes at most.
+// periods are freed once encoded, so the result is in memory once.
+// the profile if any follows the stats in the last frame, it has
+// the encoding time of the frames before. frames of a query in a
+// batch have its index first
+//
+int StatStorageProcessor::sendSystemStats(StatCombiner& combiner, const struct proto_h16_head *h,
+					  const beyondy::Async::Message *msg, const QueryProfile *profile, int index)
+{
+	ProfileStage stage(PROFILE_ENCODE);
+	int cmd = index < 0 ? CMD_STAT_GET_SYSTEM_STATS_RSP : CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP;
+	size_t indexSize = index < 0 ? 0 : sizeof(uint16_t);
+	size_t profileSize = profile != NULL ? profile->encodedSize() : 0;
+	size_t maxSize = maxOutputSize - sizeof(struct proto_h16_res) - indexSize - profileSize;
+	int first = 0;
+
+	do {
+		int retcode = 0;
+		int count = combiner.framePeriods(first, maxSize);
+		bool last = first + count >= combiner.periodCount;
+		beyondy::Async::Message *rsp = NULL;
+
+		if (count <= 0) {
+			APPLOG_ERROR("period %d of stats is larger than %ld bytes", first, (long)maxSize);
+			retcode = E_STAT_ENCODE_FAILED;
+		}
+		else if ((rsp = beyondy::Async::Message::create(sizeof(struct proto_h16_res) + indexSize
+				+ combiner.frameSize(first, count) + profileSize, msg->fd, msg->flow)) == NULL) {
+			APPLOG_ERROR("allocate messge for getSystemStats failed");
+			retcode = E_STAT_OOM;
+		}
+		else {
+			rsp->setWptr(sizeof(struct proto_h16_res));
+			if ((index >= 0 && rsp->writeUint16(index) < 0)
+				|| combiner.encodeTo(rsp, first, count, last) < 0
+				|| (last && profile != NULL && profile->encodeTo(rsp) < 0)) {
+				APPLOG_ERROR("encode periods [%d, %d) of stats failed", first, first + count);
+				beyondy::Async::Message::destroy(rsp);
+				rsp = NULL;
+				retcode = E_STAT_ENCODE_FAILED;
+			}
+		}
+
+		// an error ends the response too
+		if (doResponse(rsp, cmd, retcode, h, msg) < 0 || retcode != 0)
+			return -1;
+
+		combiner.clearPeriods(first, count);
+		first += count;
+	} while (first < combiner.periodCount);
+
+	return 0;
+}
+
+class SystemStatsBatchTask : public WorkerTask {
+public:
+	SystemStatsBatchTask(StatStorageProcessor *_proc, const struct proto_h16_head *_h, beyondy::Async::Message *_msg)
+		: proc(_proc), h(_h), msg(_msg)
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		proc->doGetSystemStatsBatch(h, msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+	virtual void cancel() {
+		beyondy::Async::Message::destroy(msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+private:
+	StatStorageProcessor *proc;
+	const struct proto_h16_head *h;		// inside msg
+	beyondy::Async::Message *msg;
+};
+
+int StatStorageProcessor::onGetSystemStatsBatchRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	if (__sync_add_and_fetch(&runningQueries, 1) > maxRunningQueries) {
+		__sync_sub_and_fetch(&runningQueries, 1);
+		APPLOG_WARN("too many queries running, reject syn=%u", h->syn);
+
+		int retval = doResponse(NULL, CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP, E_STAT_SERVER_BUSY, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return retval;
+	}
+
+	// the task owns msg from now on
+	submitQuery(new SystemStatsBatchTask(this, h, msg));
+	return 0;
+}
+
+//
+// flags, count and the queries, each one as in a system stats request
+// with maxPoints after. all are got before any is sent, the ones of
+// the same range and span sharing their loads, then they go in order
+//
+int StatStorageProcessor::doGetSystemStatsBatch(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	int retval = 0;
+	uint8_t flags = 0;
 	uint16_t cnt = 0;
-	if (msg->readUint16(cnt) < 0) goto param_missing;
+
+	if (msg->readUint8(flags) < 0 || msg->readUint16(cnt) < 0 || cnt == 0 || cnt > SYSTEM_BATCH_MAX_QUERIES) {
+		APPLOG_ERROR("invalid count of queries in onGetSystemStatsBatchRequest");
+		doResponse(NULL, CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP, E_STAT_PARAMETER_MISSING, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return -1;
+	}
+
+	system_query_list_t queries(cnt);
+	std::vector<uint16_t> maxPoints(cnt, 0);
 	for (int i = 0; i < cnt; ++i) {
-		uint16_t iid = 0;
-		if (msg->readUint16(iid) < 0) goto param_missing;
-		iids.push_back(iid);
+		queries[i].combiner = NULL;
+		if (parseSystemQuery(queries[i], msg) < 0 || msg->readUint16(maxPoints[i]) < 0) {
+			APPLOG_ERROR("invalid query %d in onGetSystemStatsBatchRequest", i);
+			doResponse(NULL, CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP, E_STAT_PARAMETER_MISSING, h, msg);
+			beyondy::Async::Message::destroy(msg);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < cnt; ++i) {
+		int64_t span = FileStorage::spanLength(queries[i].spanUnit, queries[i].spanCount);
+		queries[i].combiner = new StatCombiner(queries[i].spanUnit, queries[i].spanCount, queries[i].start,
+				(queries[i].end - queries[i].start + span - 1) / span);
+	}
+
+	QueryProfile profile;
+	QueryProfile::setCurrent(&profile);
+
+	if (storage.getSystemStatsBatch(queries) < 0) {
+		APPLOG_ERROR("getSystemStatsBatch failed");
+		retval = doResponse(NULL, CMD_STAT_GET_SYSTEM_STATS_BATCH_RSP, E_STAT_GET_SYSTEM_STATS_FAILED, h, msg);
+	}
+	else {
+		for (int i = 0; i < cnt && retval >= 0; ++i) {
+			if (maxPoints[i] > 0) {
+				ProfileStage stage(PROFILE_COMBINE);
+				downsampleSystemStats(*queries[i].combiner, maxPoints[i]);
+			}
+
+			// the profile of all goes with the last one
+			const QueryProfile *withProfile = (flags & QUERY_FLAG_PROFILE) && i == cnt - 1 ? &profile : NULL;
+			retval = sendSystemStats(*queries[i].combiner, h, msg, withProfile, i);
+		}
+	}
+
+	QueryProfile::setCurrent(NULL);
+	queryHistogram.add(profile);
+
+	if (retval < 0) {
+		APPLOG_ERROR("response for GetSystemStatsBatchRequst failed");
+	}
+
+	for (int i = 0; i < cnt; ++i)
+		delete queries[i].combiner;
+	beyondy::Async::Message::destroy(msg);
+	return retval;
+}
+
+class UserStatsQueryTask : public WorkerTask {
+public:
+	UserStatsQueryTask(StatStorageProcessor *_proc, const struct proto_h16_head *_h, beyondy::Async::Message *_msg)
+		: proc(_proc), h(_h), msg(_msg)
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		proc->doGetUserStats(h, msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+	virtual void cancel() {
+		beyondy::Async::Message::destroy(msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+private:
+	StatStorageProcessor *proc;
+	const struct proto_h16_head *h;		// inside msg
+	beyondy::Async::Message *msg;
+};
+
+int StatStorageProcessor::onGetUserStatsRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	if (__sync_add_and_fetch(&runningQueries, 1) > maxRunningQueries) {
+		__sync_sub_and_fetch(&runningQueries, 1);
+		APPLOG_WARN("too many queries running, reject syn=%u", h->syn);
+
+		int retval = doResponse(NULL, CMD_STAT_GET_USER_STATS_RSP, E_STAT_SERVER_BUSY, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return retval;
 	}
 
+	// the task owns msg from now on
+	submitQuery(new UserStatsQueryTask(this, h, msg));
+	return 0;
+}
+
+//
+// request: type, mode, start, end, ftype, freqs, pid, mid, iid,
+// hosts, and orderBy, groupBy, k for the top mode
+//
+int StatStorageProcessor::doGetUserStats(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	int retval = 0, retcode = E_STAT_PARAMETER_MISSING;
+
+	uint8_t type, mode, ftype, freqs, orderBy = TOPK_SLOWEST, groupBy = TOPK_BY_IID;
+	int64_t start, end;
+	uint16_t pid, mid, iid, k = 0;
+	host_set_t hosts;
+
+	if (msg->readUint8(type) < 0 || msg->readUint8(mode) < 0
+		|| msg->readInt64(start) < 0 || msg->readInt64(end) < 0
+		|| msg->readUint8(ftype) < 0 || msg->readUint8(freqs) < 0
+			|| msg->readUint16(pid) < 0 || msg->readUint16(mid) < 0 || msg->readUint16(iid) < 0) {
+		APPLOG_ERROR("invalid parameters in onGetUserStatsRequest");
+param_missing:
+		retcode = E_STAT_PARAMETER_MISSING;
+		doResponse(NULL, CMD_STAT_GET_USER_STATS_RSP, retcode, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return -1;	
+	}
+
+	uint16_t cnt = 0;
 	if (msg->readUint16(cnt) < 0) goto param_missing;
 	for (int i = 0; i < cnt; ++i) {
 		stat_ip_t hip;
@@ -168,44 +827,212 @@ param_missing:
 		hosts.insert(hip);
 	}
 
-	int mergeCount = (end - start) / ftype; // TODO:
-	StatCombiner combiner(ftype, freqs, start, mergeCount);
-	if (storage.getSystemStats(combiner, context, totalView, start, end, ftype, freqs, pid, mid, iids, hosts) < 0) {
-		APPLOG_ERROR("getSystemStats failed");
-		retcode = E_STAT_GET_SYSTEM_STATS_FAILED;
-	}
-	else if ((rsp = beyondy::Async::Message::create(4096, msg->fd, msg->flow)) == NULL) {
-		APPLOG_ERROR("allocate messge for getSystemStats failed");
-		retcode = E_STAT_OOM;
-	}
-	else if (combiner.encodeTo(rsp) < 0) {
-		APPLOG_ERROR("encodeMessage failed");
-		retcode = E_STAT_ENCODE_FAILED;
+	if (mode == USER_STATS_TOP && (msg->readUint8(orderBy) < 0
+			|| msg->readUint8(groupBy) < 0 || msg->readUint16(k) < 0))
+		goto param_missing;
+
+	beyondy::Async::Message *rsp = NULL;
+	QueryProfile profile;
+	QueryProfile::setCurrent(&profile);
+
+	if (mode == USER_STATS_TOP) {
+		top_calls_list_t top;
+		if (storage.getTopUserStats(top, type, start, end, pid, mid, iid, hosts, orderBy, groupBy, k) < 0) {
+			APPLOG_ERROR("getTopUserStats failed");
+			retcode = E_STAT_GET_USER_STATS_FAILED;
+		}
+		else {
+			retcode = encodeTopUserStats(rsp, top, msg);
+		}
 	}
 	else {
-		retcode = 0;
+		call_stats_list_t periods;
+		if (storage.getUserStats(periods, type, start, end, ftype, freqs, pid, mid, iid, hosts) < 0) {
+			APPLOG_ERROR("getUserStats failed");
+			retcode = E_STAT_GET_USER_STATS_FAILED;
+		}
+		else {
+			retcode = encodeUserStats(rsp, periods, msg);
+		}
 	}
 
-	if (doResponse(rsp, CMD_STAT_GET_SYSTEM_STATS_RSP, retcode, h, msg) < 0) {
-		APPLOG_ERROR("response for GetSystemStatsRequst failed");
-		retval = -1;
+	QueryProfile::setCurrent(NULL);
+	queryHistogram.add(profile);
+
+	retval = doResponse(rsp, CMD_STAT_GET_USER_STATS_RSP, retcode, h, msg);
+	if (retval < 0) {
+		APPLOG_ERROR("response for GetUserStatsRequst failed");
 	}
 	
 	beyondy::Async::Message::destroy(msg);
 	return retval;
 }
 
-int StatStorageProcessor::onGetUserStatsRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+static void encodeCallStats(beyondy::Async::Message *rsp, const call_stats_t& stats)
 {
-	int retval = 0;
+	rsp->writeUint64(stats.count);
+	rsp->writeUint64(stats.errors);
+	rsp->writeUint32(stats.count > 0 ? (uint32_t)(stats.rsptime / stats.count) : 0);
+}
 
-	// TODO:
+//
+// mode, count, and count, errors, avg rsptime of each period
+//
+int StatStorageProcessor::encodeUserStats(beyondy::Async::Message *& rsp, const call_stats_list_t& periods,
+					  const beyondy::Async::Message *msg)
+{
+	size_t size = sizeof(struct proto_h16_res) + 1 + 4 + periods.size() * USER_STATS_ENTRY_SIZE;
+	if ((long)size > maxOutputSize) {
+		APPLOG_ERROR("%ld periods of user stats are larger than %ld bytes", (long)periods.size(), maxOutputSize);
+		return E_STAT_ENCODE_FAILED;
+	}
 
-	if (doResponse(NULL, CMD_STAT_GET_USER_STATS_RSP, 0, h, msg) < 0) {
-		APPLOG_ERROR("response for GetUserStatsRequst failed");
-		retval = -1;
+	if ((rsp = beyondy::Async::Message::create(size, msg->fd, msg->flow)) == NULL) {
+		APPLOG_ERROR("allocate messge for getUserStats failed");
+		return E_STAT_OOM;
 	}
-	
+
+	rsp->setWptr(sizeof(struct proto_h16_res));
+	rsp->writeUint8(USER_STATS_PERIODS);
+	rsp->writeUint32(periods.size());
+	for (size_t i = 0; i < periods.size(); ++i) {
+		encodeCallStats(rsp, periods[i]);
+	}
+
+	return 0;
+}
+
+//
+// mode, count, and sid, hip, count, errors, avg rsptime of each group
+//
+int StatStorageProcessor::encodeTopUserStats(beyondy::Async::Message *& rsp, const top_calls_list_t& top,
+					     const beyondy::Async::Message *msg)
+{
+	size_t size = sizeof(struct proto_h16_res) + 1 + 2 + top.size() * (6 + 5 + USER_STATS_ENTRY_SIZE);
+	if ((rsp = beyondy::Async::Message::create(size, msg->fd, msg->flow)) == NULL) {
+		APPLOG_ERROR("allocate messge for getTopUserStats failed");
+		return E_STAT_OOM;
+	}
+
+	rsp->setWptr(sizeof(struct proto_h16_res));
+	rsp->writeUint8(USER_STATS_TOP);
+	rsp->writeUint16(top.size());
+	for (size_t i = 0; i < top.size(); ++i) {
+		if (encodeTo(rsp, top[i].key.sid) < 0 || encodeTo(rsp, top[i].key.hip) < 0) {
+			APPLOG_ERROR("encode group %ld of top user stats failed", (long)i);
+			beyondy::Async::Message::destroy(rsp);
+			rsp = NULL;
+			return E_STAT_ENCODE_FAILED;
+		}
+
+		encodeCallStats(rsp, top[i].stats);
+	}
+
+	return 0;
+}
+
+class CallGraphQueryTask : public WorkerTask {
+public:
+	CallGraphQueryTask(StatStorageProcessor *_proc, const struct proto_h16_head *_h, beyondy::Async::Message *_msg)
+		: proc(_proc), h(_h), msg(_msg)
+	{ /* nothing */ }
+public:
+	virtual void run() {
+		proc->doGetCallGraph(h, msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+	virtual void cancel() {
+		beyondy::Async::Message::destroy(msg);
+		__sync_sub_and_fetch(&proc->runningQueries, 1);
+		delete this;
+	}
+private:
+	StatStorageProcessor *proc;
+	const struct proto_h16_head *h;		// inside msg
+	beyondy::Async::Message *msg;
+};
+
+int StatStorageProcessor::onGetCallGraphRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	if (__sync_add_and_fetch(&runningQueries, 1) > maxRunningQueries) {
+		__sync_sub_and_fetch(&runningQueries, 1);
+		APPLOG_WARN("too many queries running, reject syn=%u", h->syn);
+
+		int retval = doResponse(NULL, CMD_STAT_GET_CALL_GRAPH_RSP, E_STAT_SERVER_BUSY, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return retval;
+	}
+
+	// the task owns msg from now on
+	submitQuery(new CallGraphQueryTask(this, h, msg));
+	return 0;
+}
+
+//
+// request: start, end, pid (0 for all), level
+// response: count, and src sid, src hip, dst sid, dst hip, count,
+// errors, avg rsptime of each edge
+//
+int StatStorageProcessor::doGetCallGraph(const struct proto_h16_head *h, beyondy::Async::Message *msg)
+{
+	int retval = 0, retcode = 0;
+
+	int64_t start, end;
+	uint16_t pid;
+	uint8_t level;
+
+	if (msg->readInt64(start) < 0 || msg->readInt64(end) < 0
+		|| msg->readUint16(pid) < 0 || msg->readUint8(level) < 0) {
+		APPLOG_ERROR("invalid parameters in onGetCallGraphRequest");
+		doResponse(NULL, CMD_STAT_GET_CALL_GRAPH_RSP, E_STAT_PARAMETER_MISSING, h, msg);
+		beyondy::Async::Message::destroy(msg);
+		return -1;
+	}
+
+	beyondy::Async::Message *rsp = NULL;
+	call_edge_map_t edges;
+	QueryProfile profile;
+	QueryProfile::setCurrent(&profile);
+
+	if (storage.getCallGraph(edges, start, end, pid, level) < 0) {
+		APPLOG_ERROR("getCallGraph failed");
+		retcode = E_STAT_GET_CALL_GRAPH_FAILED;
+	}
+	else if ((long)(sizeof(struct proto_h16_res) + 4 + edges.size() * CALL_EDGE_SIZE) > maxOutputSize) {
+		APPLOG_ERROR("%ld edges of call graph are larger than %ld bytes", (long)edges.size(), maxOutputSize);
+		retcode = E_STAT_ENCODE_FAILED;
+	}
+	else if ((rsp = beyondy::Async::Message::create(sizeof(struct proto_h16_res)
+			+ 4 + edges.size() * CALL_EDGE_SIZE, msg->fd, msg->flow)) == NULL) {
+		APPLOG_ERROR("allocate messge for getCallGraph failed");
+		retcode = E_STAT_OOM;
+	}
+	else {
+		rsp->setWptr(sizeof(struct proto_h16_res));
+		rsp->writeUint32(edges.size());
+		for (call_edge_map_t::const_iterator iter = edges.begin(); iter != edges.end(); ++iter) {
+			if (encodeTo(rsp, iter->first.src_sid) < 0 || encodeTo(rsp, iter->first.src_hip) < 0
+				|| encodeTo(rsp, iter->first.dst_sid) < 0 || encodeTo(rsp, iter->first.dst_hip) < 0) {
+				APPLOG_ERROR("encode edges of call graph failed");
+				beyondy::Async::Message::destroy(rsp);
+				rsp = NULL;
+				retcode = E_STAT_ENCODE_FAILED;
+				break;
+			}
+
+			encodeCallStats(rsp, iter->second);
+		}
+	}
+
+	QueryProfile::setCurrent(NULL);
+	queryHistogram.add(profile);
+
+	retval = doResponse(rsp, CMD_STAT_GET_CALL_GRAPH_RSP, retcode, h, msg);
+	if (retval < 0) {
+		APPLOG_ERROR("response for GetCallGraphRequst failed");
+	}
+
 	beyondy::Async::Message::destroy(msg);
 	return retval;
 }
@@ -215,6 +1042,10 @@ int StatStorageProcessor::onMessage(beyondy::Async::Message *req)
 	struct proto_h16_head *h = (struct proto_h16_head *)req->data();
 	if (req->getWptr() < (long)sizeof(struct proto_h16_head)) return -1;	// should not have such case!!!
 
+	// responses queued by other threads go first, a
+	// CMD_STAT_WAKEUP_REQ comes for nothing else
+	sendQueued();
+
 	req->incRptr(sizeof(*h));
 	switch (h->cmd) {
 	case CMD_STAT_AGENT_SAVE_STATS_REQ:
@@ -223,9 +1054,28 @@ int StatStorageProcessor::onMessage(beyondy::Async::Message *req)
 	case CMD_STAT_GET_SYSTEM_STATS_REQ:
 		onGetSystemStatsRequest(h, req);
 		break;
+	case CMD_STAT_GET_SYSTEM_STATS_BATCH_REQ:
+		onGetSystemStatsBatchRequest(h, req);
+		break;
 	case CMD_STAT_GET_USER_STATS_REQ:
 		onGetUserStatsRequest(h, req);
 		break;
+	case CMD_STAT_GET_CALL_GRAPH_REQ:
+		onGetCallGraphRequest(h, req);
+		break;
+	case CMD_STAT_SUBSCRIBE_REQ:
+		onSubscribeRequest(h, req);
+		break;
+	case CMD_STAT_UNSUBSCRIBE_REQ:
+		onUnsubscribeRequest(h, req);
+		break;
+	case CMD_STAT_WAKEUP_REQ:
+		beyondy::Async::Message::destroy(req);
+		break;
+	case CMD_STAT_PING_REQ:
+		doResponse(NULL, CMD_STAT_PING_RSP, 0, h, req);
+		beyondy::Async::Message::destroy(req);
+		break;
 	default:
 		APPLOG_WARN("unknown command=%d", h->cmd);
 		beyondy::Async::Message::destroy(req);
@@ -240,7 +1090,12 @@ int StatStorageProcessor::onSent(beyondy::Async::Message *msg, int status)
 	struct proto_h16_head *h = (struct proto_h16_head *)msg->data();
 	APPLOG_DEBUG("msg(cmd=%d, size=%d) sent status: %d", (int)h->cmd, (int)h->len, status);
 
+	// the subscriber is gone with its connection
+	if (status != SS_OK && h->cmd == CMD_STAT_SUBSCRIBE_RSP && liveFeed != NULL)
+		liveFeed->unsubscribeAll(msg->fd, msg->flow);
+
 	beyondy::Async::Message::destroy(msg);
+	sendQueued();
 	return 0;
 }
 
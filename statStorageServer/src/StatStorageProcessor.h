@@ -7,14 +7,29 @@
 #include <stdint.h>
 #include <errno.h>
 #include <string>
+#include <vector>
 
 #include "proto_h16.h"
 #include "FileStorage.h"
+#include "WorkerPool.h"
+#include "IngestWriter.h"
+#include "Compactor.h"
+#include "QueryHistogram.h"
+#include "LiveFeed.h"
+#include "ResponseQueue.h"
 #include "Processor.h"
 
 class Message;
+class StatCombiner;
+
+// queries of a batch at most
+#define SYSTEM_BATCH_MAX_QUERIES	64
 
 class StatStorageProcessor : public beyondy::Async::Processor {
+	friend class SystemStatsQueryTask;
+	friend class SystemStatsBatchTask;
+	friend class UserStatsQueryTask;
+	friend class CallGraphQueryTask;
 public:
 	virtual size_t headerSize() const {
 		return sizeof(struct proto_h16_head);
@@ -40,13 +55,59 @@ public:
 	virtual int onMessage(beyondy::Async::Message *msg);
 	virtual int onSent(beyondy::Async::Message *msg, int status);
 private:
+	int postMessage(beyondy::Async::Message *msg);
+	int sendOut(beyondy::Async::Message *msg);
+	void sendQueued();
+	void submitQuery(WorkerTask *task);
 	int doResponse(beyondy::Async::Message *rsp, int cmd, int retcode, const struct proto_h16_head *h, const beyondy::Async::Message *msg);
+	void dispatchIngest(int partition, IngestItem *item);
+	static void __dispatchIngest(void *p, int partition, IngestItem *item);
+	int waitWriters(const std::vector<bool>& touched, uint32_t syn);
 	int onSaveStatsRequest(struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int onSubscribeRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int onUnsubscribeRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	static int __sendLive(void *p, beyondy::Async::Message *msg);
 	int onGetSystemStatsRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int doGetSystemStats(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int sendSystemStats(StatCombiner& combiner, const struct proto_h16_head *h, const beyondy::Async::Message *msg,
+		const QueryProfile *profile, int index = -1);
+	int onGetSystemStatsBatchRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int doGetSystemStatsBatch(const struct proto_h16_head *h, beyondy::Async::Message *msg);
 	int onGetUserStatsRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int doGetUserStats(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int encodeUserStats(beyondy::Async::Message *& rsp, const call_stats_list_t& periods,
+		const beyondy::Async::Message *msg);
+	int encodeTopUserStats(beyondy::Async::Message *& rsp, const top_calls_list_t& top,
+		const beyondy::Async::Message *msg);
+	int onGetCallGraphRequest(const struct proto_h16_head *h, beyondy::Async::Message *msg);
+	int doGetCallGraph(const struct proto_h16_head *h, beyondy::Async::Message *msg);
 private:
 	std::string baseDir;
 	FileStorage storage;
+
+	// items are partitioned to writers by series hash
+	std::vector<IngestWriter *> writers;
+	long maxIngestWait;		// ms a save waits for a writer behind
+
+	// retention and downsampling of old data, NULL if disabled
+	Compactor *compactor;
+
+	// queries run here, not to block saving on the processor thread
+	WorkerPool queryPool;
+	volatile int runningQueries;
+	int maxRunningQueries;
+
+	// stage times and counters of all queries
+	QueryHistogram queryHistogram;
+
+	// saved gauges pushed to subscribers as their periods close
+	LiveFeed *liveFeed;
+
+	// sendMessage() is on the processor thread only, others build
+	// their messages and queue them here, CMD_STAT_WAKEUP_REQ tells
+	// it to send them
+	pthread_t processorThread;
+	ResponseQueue responses;
 	
 	uint32_t nextSyn;
 	long maxInputSize;
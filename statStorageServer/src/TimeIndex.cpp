@@ -0,0 +1,184 @@
+/* TimeIndex.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "Log.h"
+#include "TimeIndex.h"
+
+static int writeAll(int fd, const void *data, size_t size)
+{
+	const char *ptr = (const char *)data;
+	while (size > 0) {
+		ssize_t wlen = write(fd, ptr, size);
+		if (wlen < 0 && errno == EINTR)
+			continue;
+		if (wlen <= 0)
+			return -1;
+
+		ptr += wlen;
+		size -= wlen;
+	}
+
+	return 0;
+}
+
+char *TimeIndex::makeIndexPath(char *buf, size_t size, const char *dataPath)
+{
+	xsnprintf(buf, size, "%s", dataPath);
+
+	size_t len = strlen(buf);
+	if (len > 4 && strcmp(buf + len - 4, ".bin") == 0) {
+		strcpy(buf + len - 4, ".idx");
+	}
+	else {
+		xsnprintf(buf, size, "%s.idx", dataPath);
+	}
+
+	return buf;
+}
+
+bool TimeIndex::needEntry(int64_t offset, size_t size) const
+{
+	// the first one, or this append crosses a step boundary
+	if (offset == 0) return true;
+	return offset / step != (offset + (int64_t)size) / step;
+}
+
+int TimeIndex::onAppend(const char *dataPath, int64_t timestamp, int64_t offset, size_t size)
+{
+	if (!needEntry(offset, size))
+		return 0;
+
+	char path[PATH_MAX];
+	makeIndexPath(path, sizeof path, dataPath);
+
+	// a new data file starts a new index, otherwise only extend an
+	// existing one. a missing index is rebuilt when it is loaded.
+	int fd = offset == 0 ? open(path, O_CREAT|O_WRONLY|O_TRUNC, 0664)
+			     : open(path, O_WRONLY|O_APPEND);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			APPLOG_WARN("open index(%s) failed: %m", path);
+		return -1;
+	}
+
+	time_index_entry_t entry(timestamp, offset);
+	int retval = writeAll(fd, &entry, sizeof entry);
+	if (retval < 0) {
+		APPLOG_ERROR("write index(%s) failed: %m, drop it", path);
+		unlink(path);
+	}
+
+	close(fd);
+	return retval;
+}
+
+int TimeIndex::load(const char *dataPath, time_index_t& entries)
+{
+	char path[PATH_MAX];
+	makeIndexPath(path, sizeof path, dataPath);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size % sizeof(time_index_entry_t) != 0) {
+		APPLOG_WARN("index(%s) is corrupted, ignore it", path);
+		close(fd);
+		return -1;
+	}
+
+	entries.resize(st.st_size / sizeof(time_index_entry_t));
+
+	char *ptr = (char *)(entries.empty() ? NULL : &entries[0]);
+	size_t left = st.st_size;
+	while (left > 0) {
+		ssize_t rlen = read(fd, ptr, left);
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen <= 0) {
+			APPLOG_ERROR("read index(%s) failed: %m", path);
+			entries.clear();
+			close(fd);
+			return -1;
+		}
+
+		ptr += rlen;
+		left -= rlen;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int TimeIndex::save(const char *dataPath, const time_index_t& entries)
+{
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	makeIndexPath(path, sizeof path, dataPath);
+	// queries may rebuild the same index in parallel
+	xsnprintf(tmpPath, sizeof tmpPath, "%s.%lx.tmp", path, (unsigned long)pthread_self());
+
+	int fd = open(tmpPath, O_CREAT|O_WRONLY|O_TRUNC, 0664);
+	if (fd < 0) {
+		APPLOG_ERROR("create index(%s) failed: %m", tmpPath);
+		return -1;
+	}
+
+	if (!entries.empty() && writeAll(fd, &entries[0], entries.size() * sizeof entries[0]) < 0) {
+		APPLOG_ERROR("write index(%s) failed: %m", tmpPath);
+		close(fd);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	close(fd);
+	if (rename(tmpPath, path) < 0) {
+		APPLOG_ERROR("rename index %s to %s failed: %m", tmpPath, path);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// [startOffset, endOffset) is the range which may hold items
+// in [start, end), endOffset = -1 means till EOF
+//
+void TimeIndex::locate(const time_index_t& entries, int64_t start, int64_t end,
+			int64_t& startOffset, int64_t& endOffset) const
+{
+	startOffset = 0;
+	endOffset = -1;
+
+	// the last entry older than start
+	int lo = 0, hi = (int)entries.size();
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (entries[mid].timestamp < start) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo > 0) startOffset = entries[lo - 1].offset;
+
+	// the first entry not older than end
+	hi = (int)entries.size();
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (entries[mid].timestamp < end) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo < (int)entries.size()) endOffset = entries[lo].offset;
+}
@@ -0,0 +1,56 @@
+/* TimeIndex.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __TIME_INDEX__H
+#define __TIME_INDEX__H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//
+// sparse index of one series file, kept as a sidecar file
+// (same name, .idx instead of .bin). one entry is added when
+// an append crosses a ${step} bytes boundary, it records the
+// timestamp of the first item in that append and its offset.
+//
+// items of one series are appended in time order (merged
+// periods are flushed oldest first), so all items before an
+// entry are not newer than it, all items after are not older.
+// late items of a closed rollup bucket go to a .late file
+// instead, which has no index and is read all.
+//
+typedef struct time_index_entry_tag {
+	int64_t timestamp;
+	int64_t offset;
+
+	time_index_entry_tag() {}
+	time_index_entry_tag(int64_t _timestamp, int64_t _offset)
+		: timestamp(_timestamp), offset(_offset) {}
+} time_index_entry_t;
+
+typedef std::vector<time_index_entry_t> time_index_t;
+
+class TimeIndex {
+public:
+	TimeIndex() : step(64 * 1024) { /* nothing */ }
+private:
+	TimeIndex(const TimeIndex&);
+	TimeIndex& operator=(const TimeIndex&);
+public:
+	void setStep(long _step) { if (_step > 0) step = _step; }
+	long getStep() const { return step; }
+
+	char *makeIndexPath(char *buf, size_t size, const char *dataPath);
+	bool needEntry(int64_t offset, size_t size) const;
+
+	int onAppend(const char *dataPath, int64_t timestamp, int64_t offset, size_t size);
+	int load(const char *dataPath, time_index_t& entries);
+	int save(const char *dataPath, const time_index_t& entries);
+	void locate(const time_index_t& entries, int64_t start, int64_t end,
+		int64_t& startOffset, int64_t& endOffset) const;
+private:
+	long step;
+};
+
+#endif /* __TIME_INDEX__H */
@@ -0,0 +1,284 @@
+/* WorkerPool.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <new>
+
+#include "Log.h"
+#include "WorkerPool.h"
+
+TaskGroup::TaskGroup() : pending(0)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+TaskGroup::~TaskGroup()
+{
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void TaskGroup::add(int n)
+{
+	pthread_mutex_lock(&lock);
+	pending += n;
+	pthread_mutex_unlock(&lock);
+}
+
+//
+// all under the lock, the waiter may destroy the group as soon
+// as it sees the last done()
+//
+void TaskGroup::done()
+{
+	pthread_mutex_lock(&lock);
+	if (--pending == 0) pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+bool TaskGroup::finished()
+{
+	pthread_mutex_lock(&lock);
+	bool retval = pending == 0;
+	pthread_mutex_unlock(&lock);
+
+	return retval;
+}
+
+void TaskGroup::waitFor(long ms)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	struct timespec ts;
+	ts.tv_sec = tv.tv_sec + ms / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) { ts.tv_sec += 1; ts.tv_nsec -= 1000000000; }
+
+	pthread_mutex_lock(&lock);
+	if (pending > 0) pthread_cond_timedwait(&cond, &lock, &ts);
+	pthread_mutex_unlock(&lock);
+}
+
+WorkerPool::WorkerPool() : isRunning(false), pendingCount(0), nextWorker(0), waitingCount(0)
+{
+	pthread_key_create(&workerKey, NULL);
+	pthread_mutex_init(&idleLock, NULL);
+	pthread_cond_init(&idleCond, NULL);
+	pthread_cond_init(&doneCond, NULL);
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+
+	pthread_cond_destroy(&doneCond);
+	pthread_cond_destroy(&idleCond);
+	pthread_mutex_destroy(&idleLock);
+	pthread_key_delete(workerKey);
+}
+
+// index of the worker of this pool running in this thread, -1 if not
+int WorkerPool::currentWorker() const
+{
+	const Worker *worker = (const Worker *)pthread_getspecific(workerKey);
+	return worker != NULL ? worker->index : -1;
+}
+
+int WorkerPool::start(int threadCount)
+{
+	if (threadCount < 1) threadCount = 1;
+	isRunning = true;
+
+	// create all deques first, the threads steal from each other
+	for (int i = 0; i < threadCount; ++i) {
+		Worker *worker = new (std::nothrow) Worker;
+		if (worker == NULL) {
+			APPLOG_ERROR("create worker #%d failed", i);
+			stop();
+			return -1;
+		}
+
+		worker->pool = this;
+		worker->index = i;
+		pthread_mutex_init(&worker->lock, NULL);
+		workers.push_back(worker);
+	}
+
+	for (int i = 0; i < threadCount; ++i) {
+		errno = pthread_create(&workers[i]->tid, NULL, __workerEntry, (void *)workers[i]);
+		if (errno != 0) {
+			APPLOG_ERROR("create worker thread #%d failed: %m", i);
+			// the rest without threads are still stolen from
+			workers[i]->tid = 0;
+		}
+	}
+
+	return 0;
+}
+
+void WorkerPool::stop()
+{
+	if (workers.empty()) return;
+
+	pthread_mutex_lock(&idleLock);
+	isRunning = false;
+	pthread_cond_broadcast(&idleCond);
+	pthread_mutex_unlock(&idleLock);
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (workers[i]->tid != 0) pthread_join(workers[i]->tid, NULL);
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (!workers[i]->tasks.empty()) {
+			APPLOG_WARN("worker #%d exits with %ld tasks left, cancel them", (int)i, (long)workers[i]->tasks.size());
+		}
+
+		// no one waits for them, the workers are all gone
+		for (size_t j = 0; j < workers[i]->tasks.size(); ++j)
+			workers[i]->tasks[j]->cancel();
+		workers[i]->tasks.clear();
+
+		pthread_mutex_destroy(&workers[i]->lock);
+		delete workers[i];
+	}
+
+	workers.clear();
+}
+
+int WorkerPool::submit(WorkerTask *task)
+{
+	if (workers.empty()) {
+		// no pool, just run it here
+		task->run();
+		return 0;
+	}
+
+	// keep it local if submitted by a worker, it will be stolen
+	// by others when they are idle
+	int index = currentWorker();
+	if (index < 0 || index >= (int)workers.size())
+		index = __sync_fetch_and_add(&nextWorker, 1) % workers.size();
+
+	Worker *worker = workers[index];
+	pthread_mutex_lock(&worker->lock);
+	worker->tasks.push_back(task);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&idleLock);
+	++pendingCount;
+	pthread_cond_signal(&idleCond);
+	if (waitingCount > 0) pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&idleLock);
+
+	return 0;
+}
+
+WorkerTask *WorkerPool::takeTask(int self)
+{
+	WorkerTask *task = NULL;
+	int count = (int)workers.size();
+
+	// own tasks first, the latest one which is still hot
+	if (self >= 0 && self < count) {
+		Worker *worker = workers[self];
+		pthread_mutex_lock(&worker->lock);
+		if (!worker->tasks.empty()) {
+			task = worker->tasks.back();
+			worker->tasks.pop_back();
+		}
+		pthread_mutex_unlock(&worker->lock);
+	}
+
+	// steal the oldest one from others
+	for (int i = 1; task == NULL && i <= count; ++i) {
+		Worker *victim = workers[(self + i + count) % count];
+		pthread_mutex_lock(&victim->lock);
+		if (!victim->tasks.empty()) {
+			task = victim->tasks.front();
+			victim->tasks.pop_front();
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	if (task != NULL) {
+		pthread_mutex_lock(&idleLock);
+		--pendingCount;
+		pthread_mutex_unlock(&idleLock);
+	}
+
+	return task;
+}
+
+//
+// a task done may be the last one of a group someone waits for
+//
+void WorkerPool::runTask(WorkerTask *task)
+{
+	task->run();
+
+	pthread_mutex_lock(&idleLock);
+	if (waitingCount > 0) pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&idleLock);
+}
+
+//
+// help running tasks while waiting, so a task of the pool can
+// wait for its sub-tasks without dead lock. sleeps till a task is
+// done or submitted, group.done() is always before runTask() tells
+//
+void WorkerPool::wait(TaskGroup& group)
+{
+	int self = currentWorker();
+
+	while (!group.finished()) {
+		WorkerTask *task = takeTask(self);
+		if (task != NULL) {
+			runTask(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&idleLock);
+		++waitingCount;
+		while (!group.finished() && pendingCount == 0)
+			pthread_cond_wait(&doneCond, &idleLock);
+		--waitingCount;
+		pthread_mutex_unlock(&idleLock);
+	}
+}
+
+void *WorkerPool::__workerEntry(void *p)
+{
+	Worker *worker = (Worker *)p;
+	worker->pool->workerLoop(worker->index);
+	return NULL;
+}
+
+void WorkerPool::workerLoop(int index)
+{
+	pthread_setspecific(workerKey, workers[index]);
+
+	// the ones left once stopped are cancelled by stop()
+	while (isRunning) {
+		WorkerTask *task = takeTask(index);
+		if (task != NULL) {
+			runTask(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&idleLock);
+		while (isRunning && pendingCount == 0)
+			pthread_cond_wait(&idleCond, &idleLock);
+		bool running = isRunning;
+		pthread_mutex_unlock(&idleLock);
+
+		if (!running) break;
+	}
+
+	pthread_setspecific(workerKey, NULL);
+}
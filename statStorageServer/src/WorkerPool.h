@@ -0,0 +1,95 @@
+/* WorkerPool.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __WORKER_POOL__H
+#define __WORKER_POOL__H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+//
+// a task is not touched by the pool after run() returns, so
+// it may delete itself at the end of run()
+//
+class WorkerTask {
+public:
+	virtual ~WorkerTask() {}
+	virtual void run() = 0;
+	// instead of run() if the pool stops before it
+	virtual void cancel() { delete this; }
+};
+
+//
+// count down a group of tasks, wait for all of them by
+// WorkerPool::wait()
+//
+class TaskGroup {
+public:
+	TaskGroup();
+	~TaskGroup();
+private:
+	TaskGroup(const TaskGroup&);
+	TaskGroup& operator=(const TaskGroup&);
+public:
+	void add(int n);
+	void done();
+	bool finished();
+	// a thread out of the pool, see WorkerPool::wait() for the ones in
+	void waitFor(long ms);
+private:
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+//
+// fixed threads, one task deque per thread. a thread takes its
+// own tasks from the back and steals others' from the front.
+//
+class WorkerPool {
+public:
+	WorkerPool();
+	~WorkerPool();
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+public:
+	int start(int threadCount);
+	void stop();
+	int size() const { return (int)workers.size(); }
+
+	int submit(WorkerTask *task);
+	void wait(TaskGroup& group);
+private:
+	struct Worker {
+		WorkerPool *pool;
+		int index;
+		pthread_t tid;
+		pthread_mutex_t lock;
+		std::deque<WorkerTask *> tasks;
+	};
+
+	static void *__workerEntry(void *p);
+	void workerLoop(int index);
+	int currentWorker() const;
+	WorkerTask *takeTask(int self);
+	void runTask(WorkerTask *task);
+private:
+	std::vector<Worker *> workers;
+	volatile bool isRunning;
+	volatile int pendingCount;
+	unsigned int nextWorker;
+
+	// the Worker running in this thread, if it is of this pool
+	pthread_key_t workerKey;
+
+	// idle workers wait on idleCond; wait() on doneCond for a task to
+	// be done or submitted, both under idleLock
+	pthread_mutex_t idleLock;
+	pthread_cond_t idleCond;
+	pthread_cond_t doneCond;
+	int waitingCount;
+};
+
+#endif /* __WORKER_POOL__H */
@@ -0,0 +1,130 @@
+/* TestUtils.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __TEST_UTILS__H
+#define __TEST_UTILS__H
+
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+
+#include "MemoryBuffer.h"
+#include "StatData.h"
+#include "StatCombiner.h"
+#include "StatSystemIids.h"
+#include "FileStorage.h"
+
+// failed checks of a test, main() returns it
+static int testFailures = 0;
+
+#define TEST_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		++testFailures; \
+	} \
+} while (0)
+
+// 2020-06-01 12:00 UTC, the same year in any time zone
+#define TEST_BASE_TIME		1591012800000LL
+#define TEST_MINUTE		60000LL
+
+#define TEST_PID		1
+#define TEST_MID		2
+#define TEST_IID		IID_MEM_USED
+
+// a fresh directory for a FileStorage, ends with '/'
+static inline std::string makeTestDir(const char *name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, "/tmp/%s.XXXXXX", name);
+	if (mkdtemp(path) == NULL) {
+		fprintf(stderr, "mkdtemp(%s) failed: %m\n", path);
+		exit(1);
+	}
+
+	return std::string(path) + "/";
+}
+
+static inline void removeTestDir(const std::string& dir)
+{
+	std::string cmd = "rm -rf '" + dir + "'";
+	if (system(cmd.c_str()) != 0)
+		fprintf(stderr, "remove %s failed\n", dir.c_str());
+}
+
+static inline bool fileExists(const std::string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static inline stat_ip_t testHost()
+{
+	return stat_ip_t(htonl(0x0a000001));
+}
+
+static inline StatMergedGauge testGauge(int64_t timestamp, int64_t gval, uint8_t ftype = FT_MINUTE, uint8_t freqs = 1)
+{
+	return StatMergedGauge(timestamp, testHost(), stat_id_t(TEST_PID, TEST_MID, TEST_IID),
+			ftype, freqs, SGT_SNAPSHOT, gval);
+}
+
+// the series file of testGauge(), see FileStorage::makePath()
+static inline std::string testSeriesPath(const std::string& dir, const char *freqs = "1m")
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, "%s2020/%04x/%04x/MG_%04x_%04x_%04x_10.0.0.1_%s.bin",
+		dir.c_str(), TEST_PID, TEST_MID, TEST_PID, TEST_MID, TEST_IID, freqs);
+	return path;
+}
+
+// the item in the file format, as saveMergedGauge() writes it
+static inline std::string encodeItem(const StatMergedGauge& gauge)
+{
+	unsigned char data[512];
+	MemoryBuffer msg(data, sizeof data, false);
+	msg.writeUint8(STAT_MERGED_GAUGE);
+	gauge.encodeTo(&msg);
+	return std::string((const char *)data, msg.getWptr());
+}
+
+// minute gauges of the test series in [start, end), summed up
+typedef struct query_result_tag {
+	int count;
+	int64_t sum;
+	bool incomplete;
+} query_result_t;
+
+static inline query_result_t querySeries(FileStorage& storage, int64_t start, int64_t end)
+{
+	query_result_t result = { 0, 0, false };
+	int n = (end - start + TEST_MINUTE - 1) / TEST_MINUTE;
+	StatCombiner combiner(FT_MINUTE, 1, start, n);
+
+	std::vector<int> iids(1, TEST_IID);
+	if (storage.getSystemStats(combiner, 1, 0, start, end, FT_MINUTE, 1, TEST_PID, TEST_MID,
+			iids, host_set_t()) < 0) {
+		result.count = -1;
+		return result;
+	}
+
+	for (int i = 0; i < combiner.periodCount; ++i) {
+		for (const_gauge_iterator iter = combiner.mergedGauges[i].begin();
+			iter != combiner.mergedGauges[i].end();
+				++iter) {
+			++result.count;
+			result.sum += iter->second.gval;
+		}
+	}
+
+	result.incomplete = combiner.incomplete;
+	return result;
+}
+
+#endif /* __TEST_UTILS__H */
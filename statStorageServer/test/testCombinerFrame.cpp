@@ -0,0 +1,148 @@
+/* testCombinerFrame.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include "TestUtils.h"
+
+#define FRAME_PERIODS	30
+
+static local_key_t seriesKey(int no, int iid)
+{
+	return local_key_t(stat_ip_t(htonl(0x0a000001 + no)), stat_id_t(TEST_PID, TEST_MID, iid));
+}
+
+// two gauge series with gaps and one lcall series of two retcodes
+static void fillCombiner(StatCombiner& combiner)
+{
+	for (int i = 0; i < combiner.periodCount; ++i) {
+		int64_t timestamp = combiner.periodStartTime + i * TEST_MINUTE;
+		for (int no = 0; no < 2; ++no) {
+			if (i % (no + 2) == 0) continue;
+
+			local_key_t key = seriesKey(no, TEST_IID);
+			combiner.addMergedGauge(key, StatMergedGauge(timestamp, key.hip, key.sid,
+				FT_MINUTE, 1, SGT_SNAPSHOT, i * 100 + no - 1000));
+		}
+
+		local_key_t key = seriesKey(0, 3000);
+		StatMergedLcall lcall;
+		lcall.timestamp = timestamp;
+		lcall.hip = key.hip;
+		lcall.sid = key.sid;
+		lcall.ftype = FT_MINUTE;
+		lcall.freqs = 1;
+		lcall.rets[0] = stat_mresult_t(i + 1, 200, 64, 128);
+		if (i % 3 == 0) lcall.rets[-5] = stat_mresult_t(1, 900, 32, 0);
+		combiner.addMergedLcall(key, lcall);
+	}
+}
+
+static void checkSame(const StatCombiner& x, const StatCombiner& y)
+{
+	TEST_CHECK(x.periodCount == y.periodCount);
+	for (int i = 0; i < x.periodCount && i < y.periodCount; ++i) {
+		TEST_CHECK(x.mergedGauges[i].size() == y.mergedGauges[i].size());
+		for (const_gauge_iterator iter = x.mergedGauges[i].begin(); iter != x.mergedGauges[i].end(); ++iter) {
+			const_gauge_iterator other = y.mergedGauges[i].find(iter->first);
+			TEST_CHECK(other != y.mergedGauges[i].end());
+			if (other == y.mergedGauges[i].end()) continue;
+
+			TEST_CHECK(other->second.timestamp == iter->second.timestamp);
+			TEST_CHECK(other->second.gtype == iter->second.gtype && other->second.gval == iter->second.gval);
+		}
+
+		TEST_CHECK(x.mergedLcalls[i].size() == y.mergedLcalls[i].size());
+		for (const_lcall_iterator iter = x.mergedLcalls[i].begin(); iter != x.mergedLcalls[i].end(); ++iter) {
+			const_lcall_iterator other = y.mergedLcalls[i].find(iter->first);
+			TEST_CHECK(other != y.mergedLcalls[i].end());
+			if (other == y.mergedLcalls[i].end()) continue;
+
+			TEST_CHECK(other->second.rets.size() == iter->second.rets.size());
+			for (StatMergedLcall::const_iterator ret = iter->second.rets.begin(); ret != iter->second.rets.end(); ++ret) {
+				StatMergedLcall::const_iterator oret = other->second.rets.find(ret->first);
+				TEST_CHECK(oret != other->second.rets.end());
+				if (oret == other->second.rets.end()) continue;
+
+				TEST_CHECK(oret->second.count == ret->second.count && oret->second.rsptime == ret->second.rsptime
+					&& oret->second.isize == ret->second.isize && oret->second.osize == ret->second.osize);
+			}
+		}
+	}
+}
+
+static void testOneFrame()
+{
+	StatCombiner combiner(FT_MINUTE, 1, TEST_BASE_TIME, FRAME_PERIODS);
+	fillCombiner(combiner);
+
+	MemoryBuffer msg(combiner.frameSize(0, FRAME_PERIODS));
+	TEST_CHECK(combiner.encodeTo(&msg) == 0);
+	TEST_CHECK((size_t)msg.getWptr() == combiner.frameSize(0, FRAME_PERIODS));
+
+	StatCombiner parsed(FT_MINUTE, 1, TEST_BASE_TIME, FRAME_PERIODS);
+	TEST_CHECK(parsed.parseFrom(&msg) == 1);
+	TEST_CHECK(msg.getRptr() == msg.getWptr());
+	TEST_CHECK(!parsed.incomplete);
+	checkSame(combiner, parsed);
+
+	// of another span, it is not taken
+	StatCombiner other(FT_MINUTE, 5, TEST_BASE_TIME, FRAME_PERIODS);
+	msg.setRptr(0);
+	TEST_CHECK(other.parseFrom(&msg) < 0);
+}
+
+// frames of some periods each, the last one marked, incomplete in all
+static void testFrames()
+{
+	StatCombiner combiner(FT_MINUTE, 1, TEST_BASE_TIME, FRAME_PERIODS);
+	fillCombiner(combiner);
+	combiner.incomplete = true;
+
+	size_t maxSize = combiner.frameSize(0, FRAME_PERIODS) / 3;
+	StatCombiner parsed(FT_MINUTE, 1, TEST_BASE_TIME, FRAME_PERIODS);
+	int first = 0, frames = 0;
+	while (first < FRAME_PERIODS) {
+		int count = combiner.framePeriods(first, maxSize);
+		TEST_CHECK(count > 0);
+		if (count <= 0) break;
+
+		bool last = first + count >= FRAME_PERIODS;
+		MemoryBuffer msg(maxSize);
+		TEST_CHECK(combiner.encodeTo(&msg, first, count, last) == 0);
+		TEST_CHECK((size_t)msg.getWptr() <= maxSize);
+		TEST_CHECK(parsed.parseFrom(&msg) == (last ? 1 : 0));
+
+		first += count;
+		++frames;
+	}
+
+	TEST_CHECK(frames >= 3);
+	TEST_CHECK(parsed.incomplete);
+	checkSame(combiner, parsed);
+}
+
+// a combiner of a later start takes the periods it has only
+static void testShifted()
+{
+	StatCombiner combiner(FT_MINUTE, 1, TEST_BASE_TIME, FRAME_PERIODS);
+	fillCombiner(combiner);
+
+	MemoryBuffer msg(combiner.frameSize(0, FRAME_PERIODS));
+	TEST_CHECK(combiner.encodeTo(&msg) == 0);
+
+	StatCombiner parsed(FT_MINUTE, 1, TEST_BASE_TIME + 10 * TEST_MINUTE, FRAME_PERIODS);
+	TEST_CHECK(parsed.parseFrom(&msg) == 1);
+	for (int i = 0; i < FRAME_PERIODS; ++i) {
+		size_t expected = i + 10 < FRAME_PERIODS ? combiner.mergedGauges[i + 10].size() : 0;
+		TEST_CHECK(parsed.mergedGauges[i].size() == expected);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	testOneFrame();
+	testFrames();
+	testShifted();
+
+	printf("testCombinerFrame: %s\n", testFailures == 0 ? "OK" : "FAILED");
+	return testFailures;
+}
@@ -0,0 +1,104 @@
+/* testCompact.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include "TimeIndex.h"
+#include "Compactor.h"
+#include "TestUtils.h"
+
+// each entry points at an item of its time, in time order
+static void checkIndex(const std::string& path, int64_t firstTimestamp)
+{
+	TimeIndex timeIndex;
+	time_index_t entries;
+	TEST_CHECK(timeIndex.load(path.c_str(), entries) == 0);
+	TEST_CHECK(!entries.empty() && entries[0].offset == 0 && entries[0].timestamp == firstTimestamp);
+
+	FILE *fp = fopen(path.c_str(), "rb");
+	TEST_CHECK(fp != NULL);
+	if (fp == NULL) return;
+
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (i > 0) TEST_CHECK(entries[i - 1].timestamp <= entries[i].timestamp);
+
+		unsigned char data[512];
+		size_t size = 0;
+		if (fseek(fp, entries[i].offset, SEEK_SET) == 0)
+			size = fread(data, 1, sizeof data, fp);
+
+		MemoryBuffer msg(data, size, false);
+		msg.setWptr(size);
+		uint8_t type = 0;
+		StatMergedGauge gauge;
+		TEST_CHECK(msg.readUint8(type) == 0 && type == STAT_MERGED_GAUGE);
+		TEST_CHECK(gauge.parseFrom(&msg) == 0 && gauge.timestamp == entries[i].timestamp);
+	}
+
+	fclose(fp);
+}
+
+//
+// items before dropBefore go and the inserted ones are merged in by
+// time, the file gets an index of its own and no stale one
+//
+static void testRewrite(const std::string& dir)
+{
+	FileStorage storage;
+	storage.setDirectory(dir);
+	storage.setTimeIndexStep(64);
+
+	for (int i = 0; i < 60; ++i)
+		TEST_CHECK(storage.saveMergedGauge(testGauge(TEST_BASE_TIME + i * TEST_MINUTE, i)) == 0);
+
+	std::string path = testSeriesPath(dir);
+	checkIndex(path, TEST_BASE_TIME);
+
+	// one more for 45 and one before all kept, both out of order
+	SeriesRewriteItem item(path, TEST_BASE_TIME + 30 * TEST_MINUTE, NULL, NULL);
+	item.insert = encodeItem(testGauge(TEST_BASE_TIME + 45 * TEST_MINUTE, 1000))
+		+ encodeItem(testGauge(TEST_BASE_TIME + 20 * TEST_MINUTE, 2000));
+	TEST_CHECK(item.save(storage, -1) == 0);
+	checkIndex(path, TEST_BASE_TIME + 20 * TEST_MINUTE);
+
+	// the inserted 45 goes after the file's one, and replaces it
+	query_result_t all = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 60 * TEST_MINUTE);
+	TEST_CHECK(all.count == 31 && all.sum == 1335 - 45 + 1000 + 2000);
+
+	query_result_t part = querySeries(storage, TEST_BASE_TIME + 40 * TEST_MINUTE, TEST_BASE_TIME + 50 * TEST_MINUTE);
+	TEST_CHECK(part.count == 10 && part.sum == 445 - 45 + 1000);
+
+	// appends after it extend the new index
+	for (int i = 60; i < 70; ++i)
+		TEST_CHECK(storage.saveMergedGauge(testGauge(TEST_BASE_TIME + i * TEST_MINUTE, i)) == 0);
+	checkIndex(path, TEST_BASE_TIME + 20 * TEST_MINUTE);
+
+	part = querySeries(storage, TEST_BASE_TIME + 55 * TEST_MINUTE, TEST_BASE_TIME + 70 * TEST_MINUTE);
+	TEST_CHECK(part.count == 15 && part.sum == 930);
+}
+
+// a series with nothing kept is rewritten empty
+static void testRewriteAll(const std::string& dir)
+{
+	FileStorage storage;
+	storage.setDirectory(dir);
+	storage.setTimeIndexStep(64);
+
+	std::string path = testSeriesPath(dir);
+	int64_t reclaimed = 0;
+	TEST_CHECK(storage.rewriteSeriesFile(path.c_str(), TEST_BASE_TIME + 120 * TEST_MINUTE, std::string(), reclaimed) == 0);
+	TEST_CHECK(reclaimed > 0);
+
+	query_result_t all = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 120 * TEST_MINUTE);
+	TEST_CHECK(all.count == 0);
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = makeTestDir("testCompact");
+
+	testRewrite(dir);
+	testRewriteAll(dir);
+
+	removeTestDir(dir);
+	printf("testCompact: %s\n", testFailures == 0 ? "OK" : "FAILED");
+	return testFailures;
+}
@@ -0,0 +1,110 @@
+/* testMemTable.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include "MemTable.h"
+#include "TestUtils.h"
+
+static int countRecord(void *p, const unsigned char *data, size_t size)
+{
+	++*(int *)p;
+	return 0;
+}
+
+static void testFreeze(const std::string& dir)
+{
+	std::string walPath = dir + "wal_test.log";
+	std::string filePath = dir + "series.bin";
+	std::string item = encodeItem(testGauge(TEST_BASE_TIME, 1));
+	std::string data;
+	int64_t fileLimit;
+
+	{
+		MemTable memtable;
+		TEST_CHECK(memtable.open(walPath.c_str()) == 0);
+
+		for (int i = 0; i < 3; ++i)
+			TEST_CHECK(memtable.append(filePath.c_str(), TEST_BASE_TIME + i * TEST_MINUTE,
+				(const unsigned char *)item.data(), item.size()) == 0);
+		TEST_CHECK(memtable.size() == 3 * item.size());
+
+		TEST_CHECK(memtable.freeze() == 0);
+		TEST_CHECK(memtable.size() == 0);
+		TEST_CHECK(memtable.getFrozen().size() == 1);
+		TEST_CHECK(fileExists(walPath + ".flushing"));
+
+		// frozen till flushed, the next freeze must wait
+		TEST_CHECK(memtable.append(filePath.c_str(), TEST_BASE_TIME + 3 * TEST_MINUTE,
+			(const unsigned char *)item.data(), item.size()) == 0);
+		TEST_CHECK(memtable.freeze() < 0);
+		TEST_CHECK(memtable.size() == item.size());
+
+		// the frozen ones first, none of the file yet
+		TEST_CHECK(memtable.read(filePath.c_str(), data, fileLimit) == 0);
+		TEST_CHECK(data.size() == 4 * item.size() && fileLimit == 0);
+	}
+
+	// both logs, not flushed, then they are gone
+	int count = 0;
+	TEST_CHECK(MemTable::replay(walPath.c_str(), countRecord, &count) == 4 && count == 4);
+	TEST_CHECK(!fileExists(walPath) && !fileExists(walPath + ".flushing"));
+}
+
+//
+// a flush failing leaves the items frozen, read by queries from memory,
+// and tried again by the next flush or replayed by the next start
+//
+static void testFlushFailure(const std::string& dir)
+{
+	std::string blocker = dir + "2020";
+	std::string walPath = dir + "wal_0.log";
+
+	{
+		FileStorage storage;
+		storage.setDirectory(dir);
+		TEST_CHECK(storage.openMemTables(1, 1024 * 1024, 3600 * 1000) == 0);
+
+		for (int i = 0; i < 10; ++i)
+			TEST_CHECK(storage.saveMergedGauge(testGauge(TEST_BASE_TIME + i * TEST_MINUTE, i), 0) == 0);
+
+		// no year directory can be made
+		FILE *fp = fopen(blocker.c_str(), "w");
+		TEST_CHECK(fp != NULL);
+		if (fp != NULL) fclose(fp);
+
+		TEST_CHECK(storage.flushMemTable(0, true) < 0);
+		TEST_CHECK(fileExists(walPath + ".flushing"));
+
+		query_result_t result = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 10 * TEST_MINUTE);
+		TEST_CHECK(result.count == 10 && result.sum == 45 && result.incomplete);
+
+		TEST_CHECK(unlink(blocker.c_str()) == 0);
+		TEST_CHECK(storage.flushMemTable(0, false) == 0);
+		TEST_CHECK(!fileExists(walPath + ".flushing"));
+
+		result = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 10 * TEST_MINUTE);
+		TEST_CHECK(result.count == 10 && result.sum == 45 && !result.incomplete);
+
+		// these are lost with the memtable, but for the log
+		for (int i = 10; i < 20; ++i)
+			TEST_CHECK(storage.saveMergedGauge(testGauge(TEST_BASE_TIME + i * TEST_MINUTE, i), 0) == 0);
+	}
+
+	FileStorage storage;
+	storage.setDirectory(dir);
+	TEST_CHECK(storage.openMemTables(1, 1024 * 1024, 3600 * 1000) == 0);
+
+	query_result_t result = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 20 * TEST_MINUTE);
+	TEST_CHECK(result.count == 20 && result.sum == 190 && !result.incomplete);
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = makeTestDir("testMemTable");
+
+	testFreeze(dir);
+	testFlushFailure(dir);
+
+	removeTestDir(dir);
+	printf("testMemTable: %s\n", testFailures == 0 ? "OK" : "FAILED");
+	return testFailures;
+}
@@ -0,0 +1,140 @@
+/* testTimeIndex.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include "TimeIndex.h"
+#include "TestUtils.h"
+
+static void testLocate()
+{
+	TimeIndex timeIndex;
+	time_index_t entries;
+	int64_t startOffset, endOffset;
+
+	// no index, the whole file
+	timeIndex.locate(entries, 1000, 2000, startOffset, endOffset);
+	TEST_CHECK(startOffset == 0 && endOffset == -1);
+
+	// 2000 is in two appends
+	entries.push_back(time_index_entry_t(1000, 0));
+	entries.push_back(time_index_entry_t(2000, 100));
+	entries.push_back(time_index_entry_t(2000, 200));
+	entries.push_back(time_index_entry_t(3000, 300));
+
+	timeIndex.locate(entries, 0, 500, startOffset, endOffset);
+	TEST_CHECK(startOffset == 0 && endOffset == 0);
+
+	// from the block before the first 2000, it may have some
+	timeIndex.locate(entries, 2000, 2001, startOffset, endOffset);
+	TEST_CHECK(startOffset == 0 && endOffset == 300);
+
+	timeIndex.locate(entries, 2500, 3000, startOffset, endOffset);
+	TEST_CHECK(startOffset == 200 && endOffset == 300);
+
+	timeIndex.locate(entries, 3500, 4000, startOffset, endOffset);
+	TEST_CHECK(startOffset == 300 && endOffset == -1);
+}
+
+// entries of a series file are in time order and each points at an item of its time
+static void checkIndex(const std::string& path)
+{
+	TimeIndex timeIndex;
+	time_index_t entries;
+	TEST_CHECK(timeIndex.load(path.c_str(), entries) == 0);
+	TEST_CHECK(!entries.empty());
+
+	FILE *fp = fopen(path.c_str(), "rb");
+	TEST_CHECK(fp != NULL);
+	if (fp == NULL) return;
+
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (i > 0) TEST_CHECK(entries[i - 1].timestamp <= entries[i].timestamp);
+
+		unsigned char data[512];
+		size_t size = 0;
+		if (fseek(fp, entries[i].offset, SEEK_SET) == 0)
+			size = fread(data, 1, sizeof data, fp);
+
+		MemoryBuffer msg(data, size, false);
+		msg.setWptr(size);
+		uint8_t type = 0;
+		StatMergedGauge gauge;
+		TEST_CHECK(msg.readUint8(type) == 0 && type == STAT_MERGED_GAUGE);
+		TEST_CHECK(gauge.parseFrom(&msg) == 0 && gauge.timestamp == entries[i].timestamp);
+	}
+
+	fclose(fp);
+}
+
+//
+// late items of a closed rollup bucket are older than the last one
+// of the rollup file, they must not go into it or its index
+//
+static void testOutOfOrder(FileStorage& storage, const std::string& dir)
+{
+	int64_t sum = 0;
+	for (int i = 0; i < 120; ++i) {
+		TEST_CHECK(storage.saveMergedGauge(testGauge(TEST_BASE_TIME + i * TEST_MINUTE, i)) == 0);
+		sum += i;
+	}
+
+	for (int i = 0; i < 24; ++i) {
+		StatMergedGauge rollup = testGauge(TEST_BASE_TIME + i * 5 * TEST_MINUTE, i, FT_MINUTE, 5);
+		TEST_CHECK(storage.saveMergedGauge(rollup) == 0);
+	}
+
+	StatMergedGauge late = testGauge(TEST_BASE_TIME + 5 * TEST_MINUTE, 1000, FT_MINUTE, 5);
+	TEST_CHECK(storage.saveMergedGauge(late, -1, true) == 0);
+
+	std::string rollupPath = testSeriesPath(dir, "5m");
+	std::string latePath = rollupPath.substr(0, rollupPath.size() - 4) + ".late";
+	checkIndex(testSeriesPath(dir));
+	checkIndex(rollupPath);
+	TEST_CHECK(fileExists(latePath));
+	TEST_CHECK(!fileExists(latePath + ".idx"));
+
+	// each range gets its items only, wherever the index points
+	query_result_t all = querySeries(storage, TEST_BASE_TIME, TEST_BASE_TIME + 120 * TEST_MINUTE);
+	TEST_CHECK(all.count == 120 && all.sum == sum && !all.incomplete);
+
+	for (int i = 0; i + 7 <= 120; i += 7) {
+		query_result_t part = querySeries(storage, TEST_BASE_TIME + i * TEST_MINUTE, TEST_BASE_TIME + (i + 7) * TEST_MINUTE);
+		TEST_CHECK(part.count == 7 && part.sum == 7 * i + 21);
+	}
+}
+
+// a missing index is rebuilt as it was
+static void testRebuild(FileStorage& storage, const std::string& dir)
+{
+	std::string path = testSeriesPath(dir);
+	TimeIndex timeIndex;
+	time_index_t saved, rebuilt;
+	TEST_CHECK(timeIndex.load(path.c_str(), saved) == 0);
+	TEST_CHECK(unlink((path.substr(0, path.size() - 4) + ".idx").c_str()) == 0);
+
+	query_result_t part = querySeries(storage, TEST_BASE_TIME + 50 * TEST_MINUTE, TEST_BASE_TIME + 60 * TEST_MINUTE);
+	TEST_CHECK(part.count == 10 && part.sum == 545);
+
+	TEST_CHECK(timeIndex.load(path.c_str(), rebuilt) == 0);
+	TEST_CHECK(rebuilt.size() == saved.size());
+	for (size_t i = 0; i < rebuilt.size() && i < saved.size(); ++i)
+		TEST_CHECK(rebuilt[i].timestamp == saved[i].timestamp && rebuilt[i].offset == saved[i].offset);
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = makeTestDir("testTimeIndex");
+
+	testLocate();
+	{
+		FileStorage storage;
+		storage.setDirectory(dir);
+		storage.setTimeIndexStep(64);
+
+		testOutOfOrder(storage, dir);
+		testRebuild(storage, dir);
+	}
+
+	removeTestDir(dir);
+	printf("testTimeIndex: %s\n", testFailures == 0 ? "OK" : "FAILED");
+	return testFailures;
+}
@@ -0,0 +1,56 @@
+/* CgiMain.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#include "ClientConnection.h"
+#include "HttpServer.h"
+#include "SystemMetrics.h"
+
+static void printHead(const HttpResponse& rsp)
+{
+	printf("Status: %d %s\r\n", rsp.status, HttpResponse::reasonOf(rsp.status));
+	printf("Content-Type: %s\r\n", rsp.contentType.c_str());
+	for (size_t i = 0; i < rsp.headers.size(); ++i)
+		printf("%s: %s\r\n", rsp.headers[i].first.c_str(), rsp.headers[i].second.c_str());
+	printf("\r\n");
+}
+
+// the web server in front does the chunking, if any
+static int __streamOut(void *arg, const HttpResponse& rsp, const char *data, size_t size, bool first)
+{
+	if (first) printHead(rsp);
+	fwrite(data, 1, size, stdout);
+	return fflush(stdout) == 0 ? 0 : -1;
+}
+
+//
+// the metrics api as a cgi, one request per process
+//
+int main(int argc, char **argv)
+{
+	HttpRequest req;
+	HttpResponse rsp;
+
+	// one request, no pinging
+	ClientConnection storage("tcp://127.0.0.1:6020", 10 * 1000, 2);
+	storage.setPool(1, 1, 0);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	const char *query = argc == 2 ? argv[1] : getenv("QUERY_STRING");
+	req.query = query != NULL ? query : "";
+	const char *ifNoneMatch = getenv("HTTP_IF_NONE_MATCH");
+	if (ifNoneMatch != NULL)
+		req.headers.push_back(std::make_pair(std::string("if-none-match"), std::string(ifNoneMatch)));
+	rsp.setStream(__streamOut, NULL);
+	handleSystemMetrics(&storage, req, rsp);
+
+	// what is left, or all of it if never streamed
+	if (!rsp.isStreamed()) printHead(rsp);
+	fwrite(rsp.body.data(), 1, rsp.body.size(), stdout);
+
+	return 0;
+}
@@ -1,99 +1,520 @@
-/* ClientConnection.h
+/* ClientConnection.cpp
  * Copyright by Beyondy.c.w 2008-2020
 **/
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <new>
 #include <proto_h16.h>
 #include <beyondy/xbs_naddr.h>
 #include <beyondy/xbs_socket.h>
 #include <beyondy/xbs_io.h>
 
+#include "Log.h"
 #include "MemoryBuffer.h"
+#include "StatCommand.h"
 #include "ClientConnection.h"
 
+// a frame larger than this breaks the connection
+#define MAX_FRAME_SIZE		(64 * 1024 * 1024)
+
+struct ClientConnection::Channel {
+	ClientConnection *owner;
+	int fd;
+	pthread_t reader;
+	bool broken;		// no more requests, the reader is leaving
+	bool exited;		// the reader left
+	int refs;		// the reader and senders
+	int inflight;
+	time_t lastActive;
+	uint32_t pingSyn;	// 0 if no ping in flight
+	time_t pingSent;
+	pthread_mutex_t writeLock;
+	std::tr1::unordered_map<uint32_t, Call *> calls;
+};
+
+struct ClientConnection::Call {
+	std::string request;
+	uint32_t syn;
+	Channel *channel;	// NULL if not in flight
+	int retries;
+	bool failed;		// the channel broke under it
+	bool delivered;		// a frame was given to onFrame
+	std::deque<std::string> frames;
+	pthread_cond_t cond;
+};
+
 ClientConnection::ClientConnection(const char *_addr, int _timeout, int _retries)
-	: fd(-1), timeout(_timeout), retires(_retries), addr(_addr)
+	: addr(_addr), timeout(_timeout), retires(_retries), maxChannels(1), maxInflight(16),
+	  healthInterval(10), nextSyn(1), connecting(0), isClosing(false)
 {
-	/* nothing */
+	pthread_mutex_init(&lock, NULL);
 }
 
 ClientConnection::~ClientConnection()
 {
-	if (fd >= 0) ::close(fd);
+	isClosing = true;
+
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < channels.size(); ++i)
+		shutdown(channels[i]);
+	pthread_mutex_unlock(&lock);
+
+	// readers see their sockets shut down and leave
+	while (true) {
+		pthread_mutex_lock(&lock);
+		reapChannels();
+		bool empty = channels.empty();
+		pthread_mutex_unlock(&lock);
+
+		if (empty) break;
+		usleep(10 * 1000);
+	}
+
+	pthread_mutex_destroy(&lock);
 }
 
-int ClientConnection::connect(beyondy::TimedoutCountdown& timerDown)
+void ClientConnection::setPool(int _maxChannels, int _maxInflight, int _healthInterval)
 {
-	if ((fd = beyondy::XbsClient(addr.c_str(), 0, timerDown.Update())) < 0)
-		return -1;
+	maxChannels = _maxChannels < 1 ? 1 : _maxChannels;
+	maxInflight = _maxInflight < 1 ? 1 : _maxInflight;
+	healthInterval = _healthInterval;
+}
 
-	if (errno != 0) {
-		close();
-		return -1;
-	}	
-		
-	return 0;
+static int __lastFrame(void *arg, MemoryBuffer *rsp)
+{
+	return 1;
 }
 
-void ClientConnection::close()
+int ClientConnection::request(MemoryBuffer *req, MemoryBuffer *rsp)
 {
-	::close(fd);
-	fd = -1;
+	return request(req, rsp, __lastFrame, NULL);
 }
 
-int ClientConnection::send(const MemoryBuffer *req, beyondy::TimedoutCountdown& timerDown)
+int ClientConnection::request(MemoryBuffer *req, MemoryBuffer *rsp,
+			      int (*onFrame)(void *arg, MemoryBuffer *rsp), void *arg)
+{
+	Call *call = start(req);
+	if (call == NULL) return -1;
+
+	return wait(call, rsp, onFrame, arg);
+}
+
+ClientConnection::Call *ClientConnection::start(MemoryBuffer *req)
 {
 	const struct proto_h16_head *h = (const struct proto_h16_head *)req->data();
-	if (beyondy::XbsWriteN(fd, req->data(), h->len, timerDown.Update()) < 0)
-		return -1;
-	return 0;
+	Call *call = new (std::nothrow) Call;
+	if (call == NULL) return NULL;
+
+	call->request.assign((const char *)req->data(), h->len);
+	call->syn = 0;
+	call->channel = NULL;
+	call->retries = retires;
+	call->failed = false;
+	call->delivered = false;
+	pthread_cond_init(&call->cond, NULL);
+
+	// wait() tells the failure
+	if (dispatch(call) < 0) call->failed = true;
+	return call;
+}
+
+static void deadlineAfter(int timeout, struct timespec& deadline)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	deadline.tv_sec = tv.tv_sec + timeout / 1000;
+	deadline.tv_nsec = tv.tv_usec * 1000 + (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) { deadline.tv_sec += 1; deadline.tv_nsec -= 1000000000; }
+}
+
+int ClientConnection::wait(Call *call, MemoryBuffer *rsp,
+			   int (*onFrame)(void *arg, MemoryBuffer *rsp), void *arg)
+{
+	struct timespec deadline;
+	deadlineAfter(timeout, deadline);
+
+	int retval = -1;
+	pthread_mutex_lock(&lock);
+	while (true) {
+		if (!call->frames.empty()) {
+			std::string frame;
+			frame.swap(call->frames.front());
+			call->frames.pop_front();
+			pthread_mutex_unlock(&lock);
+
+			int done = -1;
+			if (rsp->ensureCapacity(frame.size()) >= 0) {
+				memcpy(rsp->data(), frame.data(), frame.size());
+				rsp->setRptr(0);
+				rsp->setWptr(frame.size());
+
+				call->delivered = true;
+				done = (*onFrame)(arg, rsp);
+			}
+
+			pthread_mutex_lock(&lock);
+			if (done != 0) {
+				retval = done < 0 ? -1 : 0;
+				break;
+			}
+
+			// timeout is between frames, a long response goes on
+			// as long as they keep coming
+			deadlineAfter(timeout, deadline);
+			continue;
+		}
+
+		if (call->failed) {
+			// frames already handed out can not be taken back
+			if (call->delivered || call->retries-- <= 0) {
+				errno = ECONNRESET;
+				break;
+			}
+
+			call->failed = false;
+			pthread_mutex_unlock(&lock);
+			int sent = dispatch(call);
+			pthread_mutex_lock(&lock);
+
+			if (sent < 0) break;
+			continue;
+		}
+
+		if (pthread_cond_timedwait(&call->cond, &lock, &deadline) == ETIMEDOUT
+				&& call->frames.empty() && !call->failed) {
+			APPLOG_WARN("request syn=%u to %s timed out", call->syn, addr.c_str());
+			errno = ETIMEDOUT;
+			break;
+		}
+	}
+
+	// later frames of it are dropped by the reader
+	unregister(call);
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_destroy(&call->cond);
+	delete call;
+	return retval;
+}
+
+//
+// send the call on a channel under a new syn, another channel if
+// sending fails
+//
+int ClientConnection::dispatch(Call *call)
+{
+	while (true) {
+		Channel *channel = acquire();
+		if (channel == NULL) {
+			APPLOG_ERROR("no connection to %s", addr.c_str());
+			return -1;
+		}
+
+		pthread_mutex_lock(&lock);
+		bool usable = !channel->broken;
+		if (usable) {
+			if ((call->syn = nextSyn++) == 0) call->syn = nextSyn++;
+			((struct proto_h16_head *)&call->request[0])->syn = call->syn;
+
+			call->channel = channel;
+			channel->calls[call->syn] = call;
+			++channel->inflight;
+			channel->lastActive = time(NULL);
+		}
+		pthread_mutex_unlock(&lock);
+
+		if (usable && send(channel, call->request.data(), call->request.size()) == 0) {
+			release(channel);
+			return 0;
+		}
+
+		// the reader may have failed it already, it is sent again anyway
+		pthread_mutex_lock(&lock);
+		unregister(call);
+		call->failed = false;
+		shutdown(channel);
+		pthread_mutex_unlock(&lock);
+		release(channel);
+
+		if (call->retries-- <= 0) return -1;
+	}
+}
+
+//
+// the channel with the least requests in flight, a new one if all
+// are full, with a reference taken for the sender
+//
+ClientConnection::Channel *ClientConnection::acquire()
+{
+	pthread_mutex_lock(&lock);
+	reapChannels();
+
+	Channel *best = NULL;
+	for (size_t i = 0; i < channels.size(); ++i) {
+		if (!channels[i]->broken && (best == NULL || channels[i]->inflight < best->inflight))
+			best = channels[i];
+	}
+
+	if ((best == NULL || best->inflight >= maxInflight)
+			&& (int)channels.size() + connecting < maxChannels && !isClosing) {
+		++connecting;
+		pthread_mutex_unlock(&lock);
+
+		Channel *channel = new (std::nothrow) Channel;
+		if (channel != NULL && connect(channel) < 0) {
+			delete channel;
+			channel = NULL;
+		}
+
+		pthread_mutex_lock(&lock);
+		--connecting;
+		if (channel != NULL) {
+			channels.push_back(channel);
+			best = channel;
+		}
+	}
+
+	if (best != NULL) ++best->refs;
+	pthread_mutex_unlock(&lock);
+
+	return best;
 }
 
-int ClientConnection::recv(MemoryBuffer *rsp, beyondy::TimedoutCountdown& timerDown)
+// under the lock
+void ClientConnection::unregister(Call *call)
 {
-	struct proto_h16_res *h;
-	rsp->ensureCapacity(sizeof(*h));
+	Channel *channel = call->channel;
+	if (channel == NULL) return;
 
-	if (beyondy::XbsReadN(fd, rsp->data(), sizeof(*h), timerDown.Update()) < 0)
+	channel->calls.erase(call->syn);
+	--channel->inflight;
+	call->channel = NULL;
+}
+
+//
+// a connected channel with its reader running, its reference
+// held by the reader
+//
+int ClientConnection::connect(Channel *channel)
+{
+	errno = 0;
+	if ((channel->fd = beyondy::XbsClient(addr.c_str(), 0, timeout)) < 0)
 		return -1;
 
-	h = (struct proto_h16_res *)rsp->data();
-	if (rsp->ensureCapacity(h->len) < 0)
+	if (errno != 0) {
+		::close(channel->fd);
 		return -1;
+	}
+
+	// pipelined requests must not wait for acks of former ones
+	int on = 1;
+	setsockopt(channel->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
 
-	if (beyondy::XbsReadN(fd, rsp->data() + sizeof(*h), h->len - sizeof(*h), timerDown.Update()) < 0)
+	channel->owner = this;
+	channel->broken = false;
+	channel->exited = false;
+	channel->refs = 1;
+	channel->inflight = 0;
+	channel->lastActive = time(NULL);
+	channel->pingSyn = 0;
+	channel->pingSent = 0;
+	pthread_mutex_init(&channel->writeLock, NULL);
+
+	if ((errno = pthread_create(&channel->reader, NULL, __readerEntry, (void *)channel)) != 0) {
+		APPLOG_ERROR("create reader of %s failed: %m", addr.c_str());
+		pthread_mutex_destroy(&channel->writeLock);
+		::close(channel->fd);
 		return -1;
+	}
 
 	return 0;
 }
 
-int ClientConnection::request(const MemoryBuffer *req, MemoryBuffer *rsp)
+int ClientConnection::send(Channel *channel, const char *data, size_t size)
 {
-	beyondy::TimedoutCountdown timerDown(timeout);
-	int retval;
+	pthread_mutex_lock(&channel->writeLock);
+	int retval = beyondy::XbsWriteN(channel->fd, data, size, timeout) < 0 ? -1 : 0;
+	pthread_mutex_unlock(&channel->writeLock);
 
-	if (fd < 0) {
-		if ((retval = connect(timerDown)) < 0) {
-			return retval;
+	return retval;
+}
+
+// under the lock, the reader wakes up and leaves
+void ClientConnection::shutdown(Channel *channel)
+{
+	if (channel->broken) return;
+
+	channel->broken = true;
+	::shutdown(channel->fd, SHUT_RDWR);
+}
+
+void ClientConnection::release(Channel *channel)
+{
+	pthread_mutex_lock(&lock);
+	--channel->refs;
+	pthread_mutex_unlock(&lock);
+}
+
+//
+// under the lock, channels nobody refers to any longer. the fd
+// is closed only here so it is not reused under a sender
+//
+void ClientConnection::reapChannels()
+{
+	for (size_t i = 0; i < channels.size(); ) {
+		Channel *channel = channels[i];
+		if (!channel->exited || channel->refs > 0) {
+			++i;
+			continue;
 		}
 
-		assert(fd >= 0);
+		pthread_join(channel->reader, NULL);
+		::close(channel->fd);
+		pthread_mutex_destroy(&channel->writeLock);
+		delete channel;
+
+		channels[i] = channels.back();
+		channels.pop_back();
 	}
+}
+
+void *ClientConnection::__readerEntry(void *p)
+{
+	Channel *channel = (Channel *)p;
+	channel->owner->readerLoop(channel);
+	return NULL;
+}
 
-	if ((retval = send(req, timerDown)) < 0) {
-		close();
-		return retval;
+void ClientConnection::readerLoop(Channel *channel)
+{
+	std::string frame;
+
+	while (!isClosing) {
+		struct pollfd pfd;
+		pfd.fd = channel->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int n = poll(&pfd, 1, 1000);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) break;
+
+		if (n == 0) {
+			checkHealth(channel);
+
+			pthread_mutex_lock(&lock);
+			bool broken = channel->broken;
+			pthread_mutex_unlock(&lock);
+
+			if (broken) break;
+			continue;
+		}
+
+		if (readFrame(channel, frame) < 0)
+			break;
+
+		const struct proto_h16_res *h = (const struct proto_h16_res *)frame.data();
+		pthread_mutex_lock(&lock);
+		channel->lastActive = time(NULL);
+		if (h->cmd == CMD_STAT_PING_RSP && h->ack == channel->pingSyn) {
+			channel->pingSyn = 0;
+		}
+		else {
+			std::tr1::unordered_map<uint32_t, Call *>::iterator iter = channel->calls.find(h->ack);
+			if (iter != channel->calls.end()) {
+				Call *call = iter->second;
+				call->frames.push_back(std::string());
+				call->frames.back().swap(frame);
+				pthread_cond_signal(&call->cond);
+			}
+			else {
+				// given up by its caller
+				APPLOG_DEBUG("drop frame cmd=%d, ack=%u from %s", (int)h->cmd, h->ack, addr.c_str());
+			}
+		}
+		pthread_mutex_unlock(&lock);
 	}
 
-	if ((retval = recv(rsp, timerDown)) < 0) {
-		close();
-		return retval;
+	// calls in flight on it are sent again or fail
+	pthread_mutex_lock(&lock);
+	shutdown(channel);
+	for (std::tr1::unordered_map<uint32_t, Call *>::iterator iter = channel->calls.begin();
+			iter != channel->calls.end(); ++iter) {
+		Call *call = iter->second;
+		call->channel = NULL;
+		call->failed = true;
+		pthread_cond_signal(&call->cond);
+	}
+
+	channel->calls.clear();
+	channel->inflight = 0;
+	channel->exited = true;
+	--channel->refs;
+	pthread_mutex_unlock(&lock);
+}
+
+int ClientConnection::readFrame(Channel *channel, std::string& frame)
+{
+	struct proto_h16_res h;
+	if (beyondy::XbsReadN(channel->fd, &h, sizeof h, timeout) < 0)
+		return -1;
+
+	if (h.len < sizeof h || h.len > MAX_FRAME_SIZE) {
+		APPLOG_ERROR("invalid frame of %u bytes from %s", h.len, addr.c_str());
+		return -1;
 	}
 
-	close();
+	frame.resize(h.len);
+	memcpy(&frame[0], &h, sizeof h);
+	if (h.len > sizeof h && beyondy::XbsReadN(channel->fd, &frame[sizeof h], h.len - sizeof h, timeout) < 0)
+		return -1;
+
 	return 0;
 }
+
+//
+// ping the channel if idle too long, break it if the last ping got
+// no answer within timeout
+//
+void ClientConnection::checkHealth(Channel *channel)
+{
+	struct proto_h16_head h;
+	bool ping = false;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	if (channel->pingSyn != 0 && (now - channel->pingSent) * 1000 > timeout) {
+		APPLOG_WARN("no pong from %s in %dms, close the connection", addr.c_str(), timeout);
+		shutdown(channel);
+	}
+	else if (channel->pingSyn == 0 && channel->inflight == 0 && healthInterval > 0
+			&& now - channel->lastActive >= healthInterval) {
+		if ((channel->pingSyn = nextSyn++) == 0) channel->pingSyn = nextSyn++;
+		channel->pingSent = now;
+
+		memset(&h, 0, sizeof h);
+		h.len = sizeof h;
+		h.cmd = CMD_STAT_PING_REQ;
+		h.syn = channel->pingSyn;
+		h.ver = 1;
+		ping = true;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (ping && send(channel, (const char *)&h, sizeof h) < 0) {
+		pthread_mutex_lock(&lock);
+		shutdown(channel);
+		pthread_mutex_unlock(&lock);
+	}
+}
@@ -4,29 +4,85 @@
 #ifndef CLIENT_CONNECTION__H
 #define CLIENT_CONNECTION__H
 
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
 #include <string>
-#include <beyondy/timedout_countdown.hpp>
+#include <vector>
+#include <deque>
+#include <tr1/unordered_map>
 
 class MemoryBuffer;
 
+//
+// requests to one server over a pool of kept connections, shared by
+// all threads. a request is stamped with its own syn and several of
+// them may be in flight on one connection; a reader thread per
+// connection hands each response frame to the request whose syn is
+// its ack. a request whose connection breaks before any frame of it
+// is handed out is sent again on another one, up to retires times.
+// a connection idle for healthInterval seconds is pinged, and closed
+// if the pong does not come within timeout.
+//
 class ClientConnection {
 public:
 	ClientConnection(const char *addr, int timeout, int retires);
 	~ClientConnection();
 private:
-	int connect(beyondy::TimedoutCountdown& timerDown);
-	void close();
-	int send(const MemoryBuffer *req, beyondy::TimedoutCountdown& timerDown);
-	int recv(MemoryBuffer *rsp, beyondy::TimedoutCountdown& timerDown);
+	ClientConnection(const ClientConnection&);
+	ClientConnection& operator=(const ClientConnection&);
 public:
-	int request(const MemoryBuffer *req, MemoryBuffer *rsp);
+	// a new connection is opened once all have maxInflight requests
+	// in flight, up to maxChannels of them
+	void setPool(int maxChannels, int maxInflight, int healthInterval);
+	const char *address() const { return addr.c_str(); }
+
+	int request(MemoryBuffer *req, MemoryBuffer *rsp);
+
+	// a response of frames, each received into rsp and given to
+	// onFrame, which returns 1 for the last one, 0 for more or -1.
+	// it times out if no frame comes within timeout, not by the
+	// whole response, so a subscription lasts while frames come
+	int request(MemoryBuffer *req, MemoryBuffer *rsp,
+		    int (*onFrame)(void *arg, MemoryBuffer *rsp), void *arg);
+
+	// several requests in parallel: start all of them, then wait
+	// for each one, which frees it. frames arriving before its
+	// wait are kept until then
+	struct Call;
+	Call *start(MemoryBuffer *req);
+	int wait(Call *call, MemoryBuffer *rsp,
+		 int (*onFrame)(void *arg, MemoryBuffer *rsp), void *arg);
+private:
+	struct Channel;
+
+	int dispatch(Call *call);
+	Channel *acquire();
+	void unregister(Call *call);
+	int connect(Channel *channel);
+	int send(Channel *channel, const char *data, size_t size);
+	void shutdown(Channel *channel);
+	void release(Channel *channel);
+	void reapChannels();
+
+	static void *__readerEntry(void *p);
+	void readerLoop(Channel *channel);
+	int readFrame(Channel *channel, std::string& frame);
+	void checkHealth(Channel *channel);
 private:
-	int fd;
+	std::string addr;
 	int timeout;
 	int retires;
-	std::string addr;
-};
+	int maxChannels;
+	int maxInflight;
+	int healthInterval;
+	uint32_t nextSyn;
 
+	// channels, calls of them and call states
+	pthread_mutex_t lock;
+	std::vector<Channel *> channels;
+	int connecting;
+	volatile bool isClosing;
+};
 
 #endif /* CLIENT_CONNECTION__H */
-
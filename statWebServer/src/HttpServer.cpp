@@ -0,0 +1,866 @@
+/* HttpServer.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <new>
+
+#include "Log.h"
+#include "HttpServer.h"
+
+// a request head larger than this is refused
+#define HTTP_MAX_HEAD_SIZE	(64 * 1024)
+// input pending of a connection, pipelined requests included
+#define HTTP_MAX_INPUT_SIZE	(1024 * 1024)
+
+#define HTTP_MAX_EVENTS		256
+#define HTTP_READ_SIZE		(16 * 1024)
+
+const char *HttpRequest::getHeader(const char *name) const
+{
+	for (size_t i = 0; i < headers.size(); ++i) {
+		if (headers[i].first == name)
+			return headers[i].second.c_str();
+	}
+
+	return NULL;
+}
+
+void HttpResponse::setHeader(const char *name, const char *value)
+{
+	for (size_t i = 0; i < headers.size(); ++i) {
+		if (!strcasecmp(headers[i].first.c_str(), name)) {
+			headers[i].second = value;
+			return;
+		}
+	}
+
+	headers.push_back(std::make_pair(std::string(name), std::string(value)));
+}
+
+void HttpResponse::appendf(const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	if (len < 0) return;
+	if (len < (int)sizeof buf) {
+		body.append(buf, len);
+		return;
+	}
+
+	// too long for the stack one, format it again in place
+	size_t offset = body.size();
+	body.resize(offset + len + 1);
+	va_start(ap, fmt);
+	vsnprintf(&body[offset], len + 1, fmt, ap);
+	va_end(ap);
+	body.resize(offset + len);
+}
+
+const char *HttpResponse::reasonOf(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 204: return "No Content";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Request Entity Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	default:
+		break;
+	}
+
+	return "Unknown";
+}
+
+int HttpResponse::flush()
+{
+	if (gone) return -1;
+	if (stream == NULL || body.empty()) return 0;
+
+	if (copy != NULL) copy->append(body);
+	if ((*stream)(streamArg, *this, body.data(), body.size(), !streamed) < 0)
+		gone = true;
+	streamed = true;
+	body.clear();
+	return gone ? -1 : 0;
+}
+
+void HttpResponse::write(void *rsp, const char *data, size_t size)
+{
+	HttpResponse *self = (HttpResponse *)rsp;
+	self->append(data, size);
+	self->flush();
+}
+
+void HttpResponse::encodeHead(std::string& out, bool keepAlive, bool chunked) const
+{
+	char buf[256];
+	if (chunked) {
+		snprintf(buf, sizeof buf, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\nConnection: %s\r\n",
+			status, reasonOf(status), contentType.c_str(), keepAlive ? "keep-alive" : "close");
+	}
+	else {
+		snprintf(buf, sizeof buf, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: %s\r\n",
+			status, reasonOf(status), contentType.c_str(), (unsigned long)body.size(),
+			keepAlive ? "keep-alive" : "close");
+	}
+	out.append(buf);
+
+	for (size_t i = 0; i < headers.size(); ++i) {
+		out.append(headers[i].first);
+		out.append(": ", 2);
+		out.append(headers[i].second);
+		out.append("\r\n", 2);
+	}
+
+	out.append("\r\n", 2);
+}
+
+void HttpResponse::encodeTo(std::string& out, bool keepAlive, bool headOnly) const
+{
+	encodeHead(out, keepAlive, false);
+	if (!headOnly) out.append(body);
+}
+
+void HttpResponse::encodeChunk(std::string& out, const char *data, size_t size)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof buf, "%lx\r\n", (unsigned long)size);
+	out.append(buf, len);
+	out.append(data, size);
+	out.append("\r\n", 2);
+}
+
+static int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	return 0;
+}
+
+//
+// tcp://ip:port, or just ip:port
+//
+static int parseAddress(const char *addr, struct sockaddr_in *sin)
+{
+	if (!strncmp(addr, "tcp://", 6)) addr += 6;
+
+	const char *colon = strrchr(addr, ':');
+	if (colon == NULL) return -1;
+
+	std::string ip(addr, colon - addr);
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(atoi(colon + 1));
+	if (ip.empty() || ip == "*") sin->sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (inet_pton(AF_INET, ip.c_str(), &sin->sin_addr) != 1) return -1;
+
+	return 0;
+}
+
+HttpServer::HttpServer() : listenFd(-1), epollFd(-1), idleTimeout(30), isRunning(false), threadCount(0)
+{
+	wakeFds[0] = wakeFds[1] = -1;
+	pthread_mutex_init(&jobLock, NULL);
+	pthread_cond_init(&jobCond, NULL);
+}
+
+HttpServer::~HttpServer()
+{
+	for (connection_map_t::iterator iter = connections.begin(); iter != connections.end(); ++iter) {
+		::close(iter->second->fd);
+		delete iter->second;
+	}
+
+	if (listenFd >= 0) ::close(listenFd);
+	if (epollFd >= 0) ::close(epollFd);
+	if (wakeFds[0] >= 0) ::close(wakeFds[0]);
+	if (wakeFds[1] >= 0) ::close(wakeFds[1]);
+
+	pthread_cond_destroy(&jobCond);
+	pthread_mutex_destroy(&jobLock);
+}
+
+int HttpServer::init(const char *addr, int backlog, int workerCount, int _idleTimeout)
+{
+	struct sockaddr_in sin;
+	if (parseAddress(addr, &sin) < 0) {
+		APPLOG_ERROR("invalid listen address: %s", addr);
+		return -1;
+	}
+
+	if ((listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		APPLOG_ERROR("create listen socket failed: %m");
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (bind(listenFd, (struct sockaddr *)&sin, sizeof sin) < 0 || listen(listenFd, backlog) < 0
+			|| setNonBlocking(listenFd) < 0) {
+		APPLOG_ERROR("listen on %s failed: %m", addr);
+		return -1;
+	}
+
+	if ((epollFd = epoll_create(1024)) < 0 || pipe(wakeFds) < 0
+			|| setNonBlocking(wakeFds[0]) < 0 || setNonBlocking(wakeFds[1]) < 0) {
+		APPLOG_ERROR("create epoll or wake pipe failed: %m");
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = listenFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+	ev.data.fd = wakeFds[0];
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFds[0], &ev);
+
+	idleTimeout = _idleTimeout;
+	isRunning = true;
+
+	// no workers, handlers are run in the loop
+	for (int i = 0; i < workerCount; ++i) {
+		pthread_t tid;
+		if ((errno = pthread_create(&tid, NULL, __workerEntry, (void *)this)) != 0) {
+			APPLOG_ERROR("create http worker #%d failed: %m", i);
+			return -1;
+		}
+
+		workers.push_back(tid);
+	}
+
+	return 0;
+}
+
+void HttpServer::addHandler(const char *path, http_handler_t handler, void *arg, int maxThreads)
+{
+	Handler h = { handler, arg, maxThreads, 0 };
+	handlers[path] = h;
+}
+
+void *HttpServer::__workerEntry(void *p)
+{
+	((HttpServer *)p)->workerLoop();
+	return NULL;
+}
+
+void HttpServer::workerLoop()
+{
+	while (true) {
+		pthread_mutex_lock(&jobLock);
+		while (isRunning && pendingJobs.empty())
+			pthread_cond_wait(&jobCond, &jobLock);
+		if (!isRunning) {
+			pthread_mutex_unlock(&jobLock);
+			break;
+		}
+
+		Job *job = pendingJobs.front();
+		pendingJobs.pop_front();
+		pthread_mutex_unlock(&jobLock);
+
+		(*job->handler->handler)(job->handler->arg, job->request, job->response);
+		finishJob(job, false);
+	}
+}
+
+//
+// a thread of its own for the job, -1 if the handler has maxThreads
+// running already or it can not be created
+//
+int HttpServer::startThread(Job *job)
+{
+	pthread_mutex_lock(&jobLock);
+	if (job->handler->threads >= job->handler->maxThreads) {
+		pthread_mutex_unlock(&jobLock);
+		APPLOG_WARN("%d threads of %s are running, refuse one more", job->handler->threads,
+			job->request.path.c_str());
+		return -1;
+	}
+
+	++job->handler->threads;
+	++threadCount;
+	pthread_mutex_unlock(&jobLock);
+
+	pthread_t tid;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	errno = pthread_create(&tid, &attr, __threadEntry, (void *)job);
+	pthread_attr_destroy(&attr);
+
+	if (errno != 0) {
+		APPLOG_ERROR("create thread for %s failed: %m", job->request.path.c_str());
+		pthread_mutex_lock(&jobLock);
+		--job->handler->threads;
+		--threadCount;
+		pthread_mutex_unlock(&jobLock);
+		return -1;
+	}
+
+	return 0;
+}
+
+void *HttpServer::__threadEntry(void *p)
+{
+	Job *job = (Job *)p;
+	(*job->handler->handler)(job->handler->arg, job->request, job->response);
+	job->server->finishJob(job, true);
+	return NULL;
+}
+
+void HttpServer::finishJob(Job *job, bool ownThread)
+{
+	// after the chunks of it, if streamed
+	pthread_mutex_lock(&jobLock);
+	doneJobs.push_back(job);
+	if (ownThread) {
+		--job->handler->threads;
+		--threadCount;
+		pthread_cond_broadcast(&jobCond);
+	}
+	pthread_mutex_unlock(&jobLock);
+
+	char c = 0;
+	if (write(wakeFds[1], &c, 1) < 0 && errno != EAGAIN) {
+		APPLOG_WARN("wake http loop failed: %m");
+	}
+}
+
+//
+// a part of a streamed response, by a worker. it goes to the loop as
+// a chunk, the status and headers before the first one. -1 if the
+// connection is closed or the server stops
+//
+int HttpServer::__streamChunk(void *arg, const HttpResponse& rsp, const char *data, size_t size, bool first)
+{
+	Job *job = (Job *)arg;
+	HttpServer *self = job->server;
+
+	Chunk *chunk = new (std::nothrow) Chunk;
+	if (chunk == NULL) return 0;
+
+	chunk->conn = job->conn;
+	if (first) rsp.encodeHead(chunk->data, job->request.keepAlive, true);
+	HttpResponse::encodeChunk(chunk->data, data, size);
+
+	pthread_mutex_lock(&self->jobLock);
+	if (!self->isRunning || job->conn->closed) {
+		pthread_mutex_unlock(&self->jobLock);
+		delete chunk;
+		return -1;
+	}
+
+	self->chunks.push_back(chunk);
+	pthread_mutex_unlock(&self->jobLock);
+
+	char c = 0;
+	if (write(self->wakeFds[1], &c, 1) < 0 && errno != EAGAIN) {
+		APPLOG_WARN("wake http loop failed: %m");
+	}
+
+	return 0;
+}
+
+int HttpServer::run()
+{
+	struct epoll_event events[HTTP_MAX_EVENTS];
+	time_t lastCheck = time(NULL);
+
+	while (isRunning) {
+		int n = epoll_wait(epollFd, events, HTTP_MAX_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			APPLOG_ERROR("epoll_wait failed: %m");
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == listenFd) {
+				onAccept();
+				continue;
+			}
+			else if (fd == wakeFds[0]) {
+				onJobsDone();
+				continue;
+			}
+
+			// may be closed by a former event of this round
+			connection_map_t::iterator iter = connections.find(fd);
+			if (iter == connections.end()) continue;
+
+			Connection *conn = iter->second;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				closeConnection(conn);
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && flush(conn) < 0)
+				continue;
+			if (events[i].events & EPOLLIN)
+				onReadable(conn);
+		}
+
+		time_t now = time(NULL);
+		if (now != lastCheck) {
+			closeIdleConnections();
+			lastCheck = now;
+		}
+	}
+
+	pthread_mutex_lock(&jobLock);
+	isRunning = false;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&jobLock);
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		pthread_join(workers[i], NULL);
+	workers.clear();
+
+	// handlers on threads of their own leave once their stream fails
+	pthread_mutex_lock(&jobLock);
+	while (threadCount > 0)
+		pthread_cond_wait(&jobCond, &jobLock);
+	pthread_mutex_unlock(&jobLock);
+
+	// jobs never run or never answered
+	for (size_t i = 0; i < pendingJobs.size(); ++i) {
+		if (pendingJobs[i]->conn->fd < 0) delete pendingJobs[i]->conn;
+		delete pendingJobs[i];
+	}
+	for (size_t i = 0; i < doneJobs.size(); ++i) {
+		if (doneJobs[i]->conn->fd < 0) delete doneJobs[i]->conn;
+		delete doneJobs[i];
+	}
+	pendingJobs.clear();
+	doneJobs.clear();
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+		delete chunks[i];
+	chunks.clear();
+
+	return 0;
+}
+
+void HttpServer::onAccept()
+{
+	while (true) {
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				APPLOG_ERROR("accept failed: %m");
+			if (errno != EINTR) break;
+			continue;
+		}
+
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+		Connection *conn = new (std::nothrow) Connection;
+		if (conn == NULL || setNonBlocking(fd) < 0) {
+			APPLOG_ERROR("setup connection #%d failed", fd);
+			::close(fd);
+			delete conn;
+			continue;
+		}
+
+		conn->fd = fd;
+		conn->written = 0;
+		conn->busy = false;
+		conn->closed = false;
+		conn->closing = false;
+		conn->watching = false;
+		conn->lastActive = time(NULL);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			APPLOG_ERROR("add connection #%d into epoll failed: %m", fd);
+			::close(fd);
+			delete conn;
+			continue;
+		}
+
+		connections[fd] = conn;
+	}
+}
+
+void HttpServer::onReadable(Connection *conn)
+{
+	char buf[HTTP_READ_SIZE];
+
+	while (true) {
+		ssize_t n = read(conn->fd, buf, sizeof buf);
+		if (n > 0) {
+			conn->input.append(buf, n);
+			if (conn->input.size() > HTTP_MAX_INPUT_SIZE) {
+				APPLOG_WARN("connection #%d has too much input, closed", conn->fd);
+				closeConnection(conn);
+				return;
+			}
+			continue;
+		}
+		else if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		else if (n < 0 && errno == EAGAIN) {
+			break;
+		}
+
+		// closed by the peer, or failed
+		closeConnection(conn);
+		return;
+	}
+
+	conn->lastActive = time(NULL);
+	processInput(conn);
+}
+
+//
+// 1 for a request taken out of input, 0 for more input needed, -1
+// for a bad one
+//
+int HttpServer::parseRequest(Connection *conn, HttpRequest& req)
+{
+	size_t headEnd = conn->input.find("\r\n\r\n");
+	if (headEnd == std::string::npos)
+		return conn->input.size() > HTTP_MAX_HEAD_SIZE ? -1 : 0;
+
+	// a NUL would end the C strings made of it
+	const char *head = conn->input.data();
+	if (memchr(head, '\0', headEnd) != NULL) return -1;
+
+	// request line: method uri version. each line ends before
+	// headEnd + 2, the "\r\n" found from it is never past headEnd
+	size_t eolPos = conn->input.find("\r\n");
+	const char *eol = head + eolPos;
+	const char *sp1 = (const char *)memchr(head, ' ', eol - head);
+	const char *sp2 = sp1 == NULL ? NULL : (const char *)memchr(sp1 + 1, ' ', eol - sp1 - 1);
+	if (sp1 == NULL || sp2 == NULL) return -1;
+
+	req.method.assign(head, sp1 - head);
+	req.version.assign(sp2 + 1, eol - sp2 - 1);
+
+	const char *uri = sp1 + 1, *qmark = (const char *)memchr(uri, '?', sp2 - uri);
+	if (qmark != NULL) {
+		req.path.assign(uri, qmark - uri);
+		req.query.assign(qmark + 1, sp2 - qmark - 1);
+	}
+	else {
+		req.path.assign(uri, sp2 - uri);
+	}
+
+	// headers, names lower-cased
+	size_t contentLength = 0;
+	for (size_t pos = eolPos + 2; pos < headEnd + 2; pos = eolPos + 2) {
+		eolPos = conn->input.find("\r\n", pos);
+		const char *line = head + pos;
+		eol = head + eolPos;
+		const char *colon = (const char *)memchr(line, ':', eol - line);
+		if (colon == NULL) return -1;
+
+		std::string name(line, colon - line), value;
+		for (size_t i = 0; i < name.size(); ++i)
+			name[i] = tolower(name[i]);
+
+		const char *vptr = colon + 1;
+		while (vptr < eol && (*vptr == ' ' || *vptr == '\t')) ++vptr;
+		value.assign(vptr, eol - vptr);
+
+		if (name == "content-length") contentLength = strtoul(value.c_str(), NULL, 10);
+		req.headers.push_back(std::make_pair(name, value));
+	}
+
+	if (contentLength > HTTP_MAX_INPUT_SIZE) return -1;
+	if (conn->input.size() < headEnd + 4 + contentLength)
+		return 0;
+
+	req.body.assign(conn->input, headEnd + 4, contentLength);
+	conn->input.erase(0, headEnd + 4 + contentLength);
+
+	// HTTP/1.1 keeps alive unless told not to, HTTP/1.0 the reverse
+	const char *connection = req.getHeader("connection");
+	if (req.version == "HTTP/1.1")
+		req.keepAlive = connection == NULL || strcasecmp(connection, "close") != 0;
+	else
+		req.keepAlive = connection != NULL && strcasecmp(connection, "keep-alive") == 0;
+	req.headOnly = req.method == "HEAD";
+
+	return 1;
+}
+
+void HttpServer::processInput(Connection *conn)
+{
+	while (!conn->busy && !conn->closing && !conn->input.empty()) {
+		Job *job = new (std::nothrow) Job;
+		if (job == NULL) {
+			closeConnection(conn);
+			return;
+		}
+
+		int retval = parseRequest(conn, job->request);
+		if (retval == 0) {
+			delete job;
+			break;
+		}
+		else if (retval < 0) {
+			job->request.keepAlive = false;
+			job->response.setStatus(400);
+			job->response.setContentType("text/plain");
+			job->response.append("bad request\n");
+			respond(conn, job->request, job->response);
+			delete job;
+			break;
+		}
+
+		handler_map_t::iterator iter = handlers.find(job->request.path);
+		if (iter != handlers.end()) {
+			job->conn = conn;
+			job->handler = &iter->second;
+
+			if (workers.empty()) {
+				(*job->handler->handler)(job->handler->arg, job->request, job->response);
+				respond(conn, job->request, job->response);
+				delete job;
+				continue;
+			}
+
+			// sent as it is built, by chunks. not for HTTP/1.0 or
+			// HEAD, where the whole body is needed first
+			job->server = this;
+			if (job->request.version == "HTTP/1.1" && !job->request.headOnly)
+				job->response.setStream(__streamChunk, job);
+
+			// the connection waits for it, later requests stay in input
+			conn->busy = true;
+			if (job->handler->maxThreads > 0) {
+				if (startThread(job) < 0) {
+					conn->busy = false;
+					job->response.setStatus(503);
+					job->response.setContentType("text/plain");
+					job->response.append("too many streams\n");
+					respond(conn, job->request, job->response);
+					delete job;
+					continue;
+				}
+				break;
+			}
+
+			pthread_mutex_lock(&jobLock);
+			pendingJobs.push_back(job);
+			pthread_cond_signal(&jobCond);
+			pthread_mutex_unlock(&jobLock);
+			break;
+		}
+
+		if (job->request.method == "GET" || job->request.method == "HEAD") {
+			serveFile(conn, job->request);
+		}
+		else {
+			job->response.setStatus(405);
+			job->response.setContentType("text/plain");
+			job->response.append("method not allowed\n");
+			respond(conn, job->request, job->response);
+		}
+
+		delete job;
+	}
+
+	flush(conn);
+}
+
+void HttpServer::respond(Connection *conn, const HttpRequest& req, const HttpResponse& rsp)
+{
+	if (rsp.isStreamed()) {
+		// the head and former chunks are out, the rest and the end
+		if (!rsp.body.empty())
+			HttpResponse::encodeChunk(conn->output, rsp.body.data(), rsp.body.size());
+		conn->output.append("0\r\n\r\n", 5);
+	}
+	else {
+		rsp.encodeTo(conn->output, req.keepAlive, req.headOnly);
+	}
+
+	if (!req.keepAlive) conn->closing = true;
+}
+
+void HttpServer::serveFile(Connection *conn, const HttpRequest& req)
+{
+	const static_file_t *file = NULL;
+	int status = files.get(req.path, file);
+
+	if (status != 200) {
+		HttpResponse rsp;
+		rsp.setStatus(status);
+		rsp.setContentType("text/plain");
+		rsp.appendf("%d %s\n", status, HttpResponse::reasonOf(status));
+		respond(conn, req, rsp);
+		return;
+	}
+
+	// the content straight from the cache, no copy into a response
+	char buf[256];
+	snprintf(buf, sizeof buf, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+		file->contentType, (unsigned long)file->content.size(), req.keepAlive ? "keep-alive" : "close");
+	conn->output.append(buf);
+	if (!req.headOnly) conn->output.append(file->content);
+	if (!req.keepAlive) conn->closing = true;
+}
+
+void HttpServer::onJobsDone()
+{
+	char buf[256];
+	while (read(wakeFds[0], buf, sizeof buf) > 0) {
+		/* drain it */
+	}
+
+	// together, so all chunks of a done job are here or were before
+	std::deque<Chunk *> parts;
+	std::deque<Job *> jobs;
+	pthread_mutex_lock(&jobLock);
+	parts.swap(chunks);
+	jobs.swap(doneJobs);
+	pthread_mutex_unlock(&jobLock);
+
+	std::vector<Connection *> streaming;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		Connection *conn = parts[i]->conn;
+		if (conn->fd >= 0) {
+			conn->output.append(parts[i]->data);
+			conn->lastActive = time(NULL);
+			if (streaming.empty() || streaming.back() != conn)
+				streaming.push_back(conn);
+		}
+		delete parts[i];
+	}
+
+	// busy yet, flush() does not free them
+	for (size_t i = 0; i < streaming.size(); ++i) {
+		if (streaming[i]->fd >= 0) flush(streaming[i]);
+	}
+
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		Job *job = jobs[i];
+		Connection *conn = job->conn;
+		if (conn->fd < 0) {
+			// closed while at the worker
+			delete conn;
+			delete job;
+			continue;
+		}
+
+		conn->busy = false;
+		conn->lastActive = time(NULL);
+		respond(conn, job->request, job->response);
+		delete job;
+
+		// pipelined ones behind it
+		processInput(conn);
+	}
+}
+
+//
+// 0 if all written or waiting for EPOLLOUT, -1 if the connection
+// is closed, it must not be touched then
+//
+int HttpServer::flush(Connection *conn)
+{
+	while (conn->written < conn->output.size()) {
+		ssize_t n = write(conn->fd, conn->output.data() + conn->written, conn->output.size() - conn->written);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) {
+			watchOutput(conn, true);
+			return 0;
+		}
+
+		if (n <= 0) {
+			closeConnection(conn);
+			return -1;
+		}
+
+		conn->written += n;
+	}
+
+	conn->output.clear();
+	conn->written = 0;
+	watchOutput(conn, false);
+
+	if (conn->closing && !conn->busy) {
+		closeConnection(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+void HttpServer::watchOutput(Connection *conn, bool on)
+{
+	if (conn->watching == on) return;
+
+	struct epoll_event ev;
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.fd = conn->fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+		conn->watching = on;
+}
+
+void HttpServer::closeConnection(Connection *conn)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+	::close(conn->fd);
+	connections.erase(conn->fd);
+
+	// the worker's job still refers to it, freed when it is done
+	if (conn->busy) {
+		pthread_mutex_lock(&jobLock);
+		conn->closed = true;
+		pthread_mutex_unlock(&jobLock);
+		conn->fd = -1;
+	}
+	else {
+		delete conn;
+	}
+}
+
+void HttpServer::closeIdleConnections()
+{
+	if (idleTimeout <= 0) return;
+
+	time_t now = time(NULL);
+	std::vector<Connection *> idles;
+	for (connection_map_t::iterator iter = connections.begin(); iter != connections.end(); ++iter) {
+		Connection *conn = iter->second;
+		if (!conn->busy && conn->output.empty() && now - conn->lastActive >= idleTimeout)
+			idles.push_back(conn);
+	}
+
+	for (size_t i = 0; i < idles.size(); ++i)
+		closeConnection(idles[i]);
+}
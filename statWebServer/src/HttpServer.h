@@ -0,0 +1,194 @@
+/* HttpServer.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __HTTP_SERVER__H
+#define __HTTP_SERVER__H
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <tr1/unordered_map>
+
+#include "StaticFiles.h"
+
+class HttpRequest {
+public:
+	HttpRequest() : keepAlive(false), headOnly(false) {}
+public:
+	// lower-cased name, NULL if not there
+	const char *getHeader(const char *name) const;
+public:
+	std::string method;
+	std::string path;		// without the query string
+	std::string query;
+	std::string version;
+	std::vector<std::pair<std::string, std::string> > headers;
+	std::string body;
+	bool keepAlive;
+	bool headOnly;
+};
+
+class HttpResponse;
+
+// where a streamed response goes as it is built, first tells the
+// status and headers of rsp go before the data. -1 once the client
+// is gone, nothing more goes then
+typedef int (*http_stream_t)(void *arg, const HttpResponse& rsp, const char *data, size_t size, bool first);
+
+class HttpResponse {
+public:
+	HttpResponse() : status(200), contentType("application/json"), stream(NULL), streamArg(NULL),
+			 streamed(false), gone(false), copy(NULL) {}
+public:
+	void setStatus(int _status) { status = _status; }
+	void setContentType(const char *type) { contentType = type; }
+	void setHeader(const char *name, const char *value);
+
+	void append(const char *data, size_t size) { body.append(data, size); }
+	void append(const std::string& data) { body.append(data); }
+	void appendf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	// the body so far goes out now if the server streams this
+	// response, status and headers can not be changed after the
+	// first time. without a stream it stays in body. -1 if the
+	// client is gone
+	void setStream(http_stream_t _stream, void *arg) { stream = _stream; streamArg = arg; }
+	int flush();
+	bool isStreamed() const { return streamed; }
+	bool canStream() const { return stream != NULL; }
+	// what is streamed is appended to copy too, NULL to stop it
+	void keepCopy(std::string *_copy) { copy = _copy; }
+
+	// a sink of JsonWriter: append, and flush if there is a stream
+	static void write(void *rsp, const char *data, size_t size);
+
+	// status line and headers, by Content-Length or chunked
+	void encodeHead(std::string& out, bool keepAlive, bool chunked) const;
+	// status line, headers and the body (none for HEAD)
+	void encodeTo(std::string& out, bool keepAlive, bool headOnly) const;
+	static void encodeChunk(std::string& out, const char *data, size_t size);
+	static const char *reasonOf(int status);
+public:
+	int status;
+	std::string contentType;
+	std::vector<std::pair<std::string, std::string> > headers;
+	std::string body;
+private:
+	http_stream_t stream;
+	void *streamArg;
+	bool streamed;
+	bool gone;
+	std::string *copy;
+};
+
+// run by a worker thread, it must not touch the server. the
+// response may be flushed on the way, it is sent chunked then
+typedef void (*http_handler_t)(void *arg, const HttpRequest& req, HttpResponse& rsp);
+
+//
+// HTTP/1.1 with keep-alive on one epoll loop. requests of a
+// connection are served in order: static files are answered in the
+// loop from the file cache, handlers run on worker threads and their
+// responses are handed back to the loop through a pipe. a connection
+// idle for idleTimeout seconds is closed. a handler streaming for
+// long, as a live feed does, runs on a thread of its own per request
+// instead of holding a worker.
+//
+class HttpServer {
+public:
+	HttpServer();
+	~HttpServer();
+private:
+	HttpServer(const HttpServer&);
+	HttpServer& operator=(const HttpServer&);
+public:
+	int init(const char *addr, int backlog, int workerCount, int idleTimeout);
+	void setWebRoot(const char *dir, const char *indexPage) { files.setRoot(dir, indexPage); }
+	// maxThreads > 0 for a thread of its own per request, at most
+	// maxThreads of them at a time, others are refused with 503
+	void addHandler(const char *path, http_handler_t handler, void *arg, int maxThreads = 0);
+
+	int run();
+	void stop() { isRunning = false; }
+private:
+	struct Connection {
+		int fd;
+		std::string input;
+		std::string output;
+		size_t written;
+		bool busy;		// the request is at a worker
+		bool closed;		// closed while busy, under jobLock
+		bool closing;		// close once output is written
+		bool watching;		// EPOLLOUT is on
+		time_t lastActive;
+	};
+
+	struct Handler {
+		http_handler_t handler;
+		void *arg;
+		int maxThreads;
+		int threads;		// running, under jobLock
+	};
+
+	struct Job {
+		HttpServer *server;
+		Connection *conn;
+		Handler *handler;
+		HttpRequest request;
+		HttpResponse response;
+	};
+
+	// a part of a streamed response, from a worker to the loop
+	struct Chunk {
+		Connection *conn;
+		std::string data;
+	};
+
+	static void *__workerEntry(void *p);
+	void workerLoop();
+	int startThread(Job *job);
+	static void *__threadEntry(void *p);
+	void finishJob(Job *job, bool ownThread);
+	static int __streamChunk(void *arg, const HttpResponse& rsp, const char *data, size_t size, bool first);
+
+	void onAccept();
+	void onReadable(Connection *conn);
+	void onWritable(Connection *conn);
+	void onJobsDone();
+
+	// parse and dispatch requests in input while none is at a worker
+	void processInput(Connection *conn);
+	int parseRequest(Connection *conn, HttpRequest& req);
+	void respond(Connection *conn, const HttpRequest& req, const HttpResponse& rsp);
+	void serveFile(Connection *conn, const HttpRequest& req);
+
+	int flush(Connection *conn);
+	void watchOutput(Connection *conn, bool on);
+	void closeConnection(Connection *conn);
+	void closeIdleConnections();
+private:
+	typedef std::tr1::unordered_map<std::string, Handler> handler_map_t;
+	typedef std::tr1::unordered_map<int, Connection *> connection_map_t;
+
+	int listenFd;
+	int epollFd;
+	int wakeFds[2];		// workers -> loop
+	int idleTimeout;
+	volatile bool isRunning;
+
+	handler_map_t handlers;
+	connection_map_t connections;
+	StaticFiles files;
+
+	std::vector<pthread_t> workers;
+	int threadCount;	// handlers on threads of their own
+	pthread_mutex_t jobLock;
+	pthread_cond_t jobCond;
+	std::deque<Job *> pendingJobs;
+	std::deque<Job *> doneJobs;
+	std::deque<Chunk *> chunks;
+};
+
+#endif /* __HTTP_SERVER__H */
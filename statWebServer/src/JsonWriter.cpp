@@ -0,0 +1,279 @@
+/* JsonWriter.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "JsonWriter.h"
+
+// room of the longest number
+#define NUMBER_ROOM	32
+
+static const char digitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t powersOf10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+JsonWriter::JsonWriter(void (*_sink)(void *, const char *, size_t), void *_arg, size_t capacity)
+	: sink(_sink), arg(_arg), flushed(0), firstBits(1), depth(0), afterKey(false)
+{
+	if (capacity < 256) capacity = 256;
+	buf = ptr = (char *)malloc(capacity);
+	end = buf != NULL ? buf + capacity : NULL;
+}
+
+JsonWriter::~JsonWriter()
+{
+	flush();
+	free(buf);
+}
+
+void JsonWriter::flush()
+{
+	if (ptr > buf) {
+		(*sink)(arg, buf, ptr - buf);
+		flushed += ptr - buf;
+		ptr = buf;
+	}
+}
+
+//
+// a comma before any element but the first of its container, none
+// after a key
+//
+void JsonWriter::separate()
+{
+	reserve(NUMBER_ROOM);
+	if (afterKey) {
+		afterKey = false;
+		return;
+	}
+
+	uint64_t bit = 1ULL << depth;
+	if (firstBits & bit) firstBits &= ~bit;
+	else *ptr++ = ',';
+}
+
+void JsonWriter::beginObject()
+{
+	separate();
+	*ptr++ = '{';
+	if (depth < JSON_MAX_DEPTH - 1) ++depth;
+	firstBits |= 1ULL << depth;
+}
+
+void JsonWriter::endObject()
+{
+	reserve(1);
+	*ptr++ = '}';
+	if (depth > 0) --depth;
+}
+
+void JsonWriter::beginArray()
+{
+	separate();
+	*ptr++ = '[';
+	if (depth < JSON_MAX_DEPTH - 1) ++depth;
+	firstBits |= 1ULL << depth;
+}
+
+void JsonWriter::endArray()
+{
+	reserve(1);
+	*ptr++ = ']';
+	if (depth > 0) --depth;
+}
+
+void JsonWriter::key(const char *name)
+{
+	separate();
+
+	size_t len = strlen(name);
+	reserve(len + 3);
+	*ptr++ = '"';
+	memcpy(ptr, name, len);
+	ptr += len;
+	*ptr++ = '"';
+	*ptr++ = ':';
+
+	afterKey = true;
+}
+
+// room of NUMBER_ROOM is there
+void JsonWriter::putInt(uint64_t v)
+{
+	char tmp[24], *p = tmp + sizeof tmp;
+	while (v >= 100) {
+		int i = (int)(v % 100) * 2;
+		v /= 100;
+		*--p = digitPairs[i + 1];
+		*--p = digitPairs[i];
+	}
+
+	if (v >= 10) {
+		int i = (int)v * 2;
+		*--p = digitPairs[i + 1];
+		*--p = digitPairs[i];
+	}
+	else {
+		*--p = (char)('0' + v);
+	}
+
+	size_t len = tmp + sizeof tmp - p;
+	memcpy(ptr, p, len);
+	ptr += len;
+}
+
+void JsonWriter::value(int64_t v)
+{
+	separate();
+	if (v < 0) {
+		*ptr++ = '-';
+		putInt((uint64_t)0 - (uint64_t)v);
+	}
+	else {
+		putInt((uint64_t)v);
+	}
+}
+
+//
+// fixed point of at most 9 decimals, trailing zeros dropped. NaN
+// and infinities are null, as json has no way for them
+//
+void JsonWriter::value(double v, int precision)
+{
+	if (isnan(v) || isinf(v)) {
+		null();
+		return;
+	}
+
+	if (precision < 0) precision = 0;
+	else if (precision > 9) precision = 9;
+
+	uint64_t scale = powersOf10[precision];
+	double scaled = floor(fabs(v) * scale + 0.5);
+
+	separate();
+	if (v < 0 && scaled > 0) *ptr++ = '-';
+	if (scaled >= 1e19) {
+		// out of fixed point, integral anyway at this size
+		putInt((uint64_t)1e19 - 1);
+		return;
+	}
+
+	uint64_t n = (uint64_t)scaled;
+	putInt(n / scale);
+
+	uint64_t frac = n % scale;
+	if (frac == 0) return;
+
+	int digits = precision;
+	while (frac % 10 == 0) {
+		frac /= 10;
+		--digits;
+	}
+
+	*ptr++ = '.';
+	char *p = ptr + digits;
+	for (int i = 0; i < digits; ++i) {
+		*--p = (char)('0' + frac % 10);
+		frac /= 10;
+	}
+	ptr += digits;
+}
+
+void JsonWriter::putString(const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	*ptr++ = '"';
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char)str[i];
+		reserve(8);
+
+		if (c == '"' || c == '\\') {
+			*ptr++ = '\\';
+			*ptr++ = c;
+		}
+		else if (c >= 0x20) {
+			*ptr++ = c;
+		}
+		else if (c == '\n') {
+			*ptr++ = '\\'; *ptr++ = 'n';
+		}
+		else if (c == '\r') {
+			*ptr++ = '\\'; *ptr++ = 'r';
+		}
+		else if (c == '\t') {
+			*ptr++ = '\\'; *ptr++ = 't';
+		}
+		else {
+			*ptr++ = '\\'; *ptr++ = 'u'; *ptr++ = '0'; *ptr++ = '0';
+			*ptr++ = hex[c >> 4];
+			*ptr++ = hex[c & 0x0f];
+		}
+	}
+
+	reserve(1);
+	*ptr++ = '"';
+}
+
+void JsonWriter::value(const char *str)
+{
+	if (str == NULL) {
+		null();
+		return;
+	}
+
+	separate();
+	putString(str, strlen(str));
+}
+
+void JsonWriter::value(const char *str, size_t len)
+{
+	separate();
+	putString(str, len);
+}
+
+void JsonWriter::value(bool v)
+{
+	separate();
+	memcpy(ptr, v ? "true" : "false", v ? 4 : 5);
+	ptr += v ? 4 : 5;
+}
+
+void JsonWriter::null()
+{
+	separate();
+	memcpy(ptr, "null", 4);
+	ptr += 4;
+}
+
+void JsonWriter::raw(const char *json, size_t len)
+{
+	separate();
+	if ((size_t)(end - ptr) < len) {
+		flush();
+		if ((size_t)(end - buf) < len) {
+			(*sink)(arg, json, len);
+			flushed += len;
+			return;
+		}
+	}
+
+	memcpy(ptr, json, len);
+	ptr += len;
+}
@@ -0,0 +1,70 @@
+/* JsonWriter.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __JSON_WRITER__H
+#define __JSON_WRITER__H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JSON_BUFFER_SIZE	(64 * 1024)
+#define JSON_MAX_DEPTH		64
+
+//
+// json into a fixed buffer, handed to the sink whenever it is full
+// and at flush(). commas are put by the writer, numbers formatted
+// without stdio. names of members are written as they are, string
+// values are escaped.
+//
+class JsonWriter {
+public:
+	JsonWriter(void (*sink)(void *arg, const char *data, size_t size), void *arg,
+		   size_t capacity = JSON_BUFFER_SIZE);
+	~JsonWriter();
+private:
+	JsonWriter(const JsonWriter&);
+	JsonWriter& operator=(const JsonWriter&);
+public:
+	void beginObject();
+	void endObject();
+	void beginArray();
+	void endArray();
+
+	void key(const char *name);
+	void value(int64_t v);
+	void value(int v) { value((int64_t)v); }
+	void value(double v, int precision);
+	void value(const char *str);
+	void value(const char *str, size_t len);
+	void value(bool v);
+	void null();
+
+	// already encoded json, as one value
+	void raw(const char *json, size_t len);
+
+	void member(const char *name, int64_t v) { key(name); value(v); }
+	void member(const char *name, int v) { key(name); value((int64_t)v); }
+	void member(const char *name, double v, int precision) { key(name); value(v, precision); }
+	void member(const char *name, const char *str) { key(name); value(str); }
+
+	void flush();
+	size_t written() const { return flushed + (ptr - buf); }
+private:
+	void separate();
+	void reserve(size_t n) { if ((size_t)(end - ptr) < n) flush(); }
+	void putInt(uint64_t v);
+	void putString(const char *str, size_t len);
+private:
+	void (*sink)(void *arg, const char *data, size_t size);
+	void *arg;
+
+	char *buf, *ptr, *end;
+	size_t flushed;
+
+	// whether the current container has no element yet, a bit per level
+	uint64_t firstBits;
+	int depth;
+	bool afterKey;
+};
+
+#endif /* __JSON_WRITER__H */
@@ -39,10 +39,35 @@ void QueryParameters::parse(const char *str)
 	return;
 }
 
+static int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// %XX and '+' for a space, a '%' not of two hex digits is kept
 std::string QueryParameters::decodeUrlEncodedString(const std::string& val) const
 {
-	// TODO:	
-	return val;
+	std::string decoded;
+	decoded.reserve(val.size());
+
+	for (size_t i = 0; i < val.size(); ++i) {
+		char c = val[i];
+		if (c == '+') {
+			decoded += ' ';
+		}
+		else if (c == '%' && i + 2 < val.size() && hexValue(val[i + 1]) >= 0 && hexValue(val[i + 2]) >= 0) {
+			decoded += (char)(hexValue(val[i + 1]) * 16 + hexValue(val[i + 2]));
+			i += 2;
+		}
+		else {
+			decoded += c;
+		}
+	}
+
+	return decoded;
 }
 
 bool QueryParameters::exist(const char *name) const
@@ -0,0 +1,76 @@
+/* ResponseCache.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include "Log.h"
+#include "ResponseCache.h"
+
+// what an entry takes besides its strings
+#define ENTRY_OVERHEAD	128
+
+ResponseCache::ResponseCache(size_t _maxBytes, size_t _maxEntryBytes)
+	: maxBytes(_maxBytes), maxEntryBytes(_maxEntryBytes), bytes(0), hits(0), misses(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+ResponseCache::~ResponseCache()
+{
+	APPLOG_INFO("response cache: %llu hits, %llu misses, %lu entries of %lu bytes",
+		(unsigned long long)hits, (unsigned long long)misses,
+		(unsigned long)entries.size(), (unsigned long)bytes);
+	pthread_mutex_destroy(&lock);
+}
+
+bool ResponseCache::get(const std::string& etag, std::string& contentType, std::string& body)
+{
+	if (!isEnabled()) return false;
+
+	pthread_mutex_lock(&lock);
+	response_map_t::iterator iter = index.find(etag);
+	if (iter == index.end()) {
+		++misses;
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	// to the front, the last one to drop
+	entries.splice(entries.begin(), entries, iter->second);
+	contentType = iter->second->contentType;
+	body = iter->second->body;
+	++hits;
+	pthread_mutex_unlock(&lock);
+
+	return true;
+}
+
+void ResponseCache::put(const std::string& etag, const std::string& contentType, const std::string& body)
+{
+	size_t size = etag.size() + contentType.size() + body.size() + ENTRY_OVERHEAD;
+	if (!isEnabled() || size > maxEntryBytes || size > maxBytes)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (index.find(etag) == index.end()) {
+		cached_response_t entry;
+		entry.etag = etag;
+		entry.contentType = contentType;
+		entry.body = body;
+
+		entries.push_front(entry);
+		index[etag] = entries.begin();
+		bytes += size;
+		evict();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// under the lock
+void ResponseCache::evict()
+{
+	while (bytes > maxBytes && !entries.empty()) {
+		const cached_response_t& entry = entries.back();
+		bytes -= entry.etag.size() + entry.contentType.size() + entry.body.size() + ENTRY_OVERHEAD;
+		index.erase(entry.etag);
+		entries.pop_back();
+	}
+}
@@ -0,0 +1,55 @@
+/* ResponseCache.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __RESPONSE_CACHE__H
+#define __RESPONSE_CACHE__H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <tr1/unordered_map>
+
+//
+// encoded responses by their etag, the least recently used dropped
+// once all take more than maxBytes. only for what never changes, as
+// nothing is invalidated. shared by all workers.
+//
+class ResponseCache {
+public:
+	ResponseCache(size_t _maxBytes, size_t _maxEntryBytes);
+	~ResponseCache();
+private:
+	ResponseCache(const ResponseCache&);
+	ResponseCache& operator=(const ResponseCache&);
+public:
+	bool isEnabled() const { return maxBytes > 0; }
+
+	// false if it is not there
+	bool get(const std::string& etag, std::string& contentType, std::string& body);
+	// one larger than maxEntryBytes is not kept
+	void put(const std::string& etag, const std::string& contentType, const std::string& body);
+private:
+	typedef struct cached_response_tag {
+		std::string etag;
+		std::string contentType;
+		std::string body;
+	} cached_response_t;
+
+	typedef std::list<cached_response_t> response_list_t;
+	typedef std::tr1::unordered_map<std::string, response_list_t::iterator> response_map_t;
+
+	void evict();
+private:
+	size_t maxBytes;
+	size_t maxEntryBytes;
+	size_t bytes;
+
+	pthread_mutex_t lock;
+	response_list_t entries;	// the most recently used first
+	response_map_t index;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+#endif /* __RESPONSE_CACHE__H */
@@ -0,0 +1,137 @@
+/* StaticFiles.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+
+#include "Log.h"
+#include "StaticFiles.h"
+
+// larger ones are not served
+#define STATIC_FILE_MAX_SIZE	(16 * 1024 * 1024)
+
+StaticFiles::~StaticFiles()
+{
+	for (file_map_t::iterator iter = files.begin(); iter != files.end(); ++iter)
+		delete iter->second;
+}
+
+void StaticFiles::setRoot(const char *dir, const char *index)
+{
+	root = dir;
+	while (root.size() > 1 && root[root.size() - 1] == '/')
+		root.erase(root.size() - 1);
+	indexPage = index;
+}
+
+const char *StaticFiles::contentTypeOf(const std::string& name)
+{
+	static const struct {
+		const char *ext;
+		const char *type;
+	} types[] = {
+		{ ".html", "text/html; charset=utf-8" },
+		{ ".htm", "text/html; charset=utf-8" },
+		{ ".js", "application/javascript" },
+		{ ".css", "text/css" },
+		{ ".json", "application/json" },
+		{ ".png", "image/png" },
+		{ ".gif", "image/gif" },
+		{ ".jpg", "image/jpeg" },
+		{ ".svg", "image/svg+xml" },
+		{ ".ico", "image/x-icon" },
+		{ ".txt", "text/plain; charset=utf-8" },
+	};
+
+	size_t dot = name.rfind('.');
+	if (dot != std::string::npos) {
+		for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+			if (!strcasecmp(name.c_str() + dot, types[i].ext))
+				return types[i].type;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+int StaticFiles::load(const std::string& name, static_file_t *file, time_t now)
+{
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0) return errno == ENOENT || errno == ENOTDIR ? 404 : 403;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > STATIC_FILE_MAX_SIZE) {
+		close(fd);
+		return 403;
+	}
+
+	file->content.resize(st.st_size);
+	ssize_t got = 0;
+	while (got < st.st_size) {
+		ssize_t n = read(fd, &file->content[got], st.st_size - got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += n;
+	}
+	close(fd);
+
+	if (got != st.st_size) {
+		APPLOG_ERROR("read %s failed: %m", name.c_str());
+		return 500;
+	}
+
+	file->contentType = contentTypeOf(name);
+	file->mtime = st.st_mtime;
+	file->size = st.st_size;
+	file->checked = now;
+	return 200;
+}
+
+int StaticFiles::get(const std::string& path, const static_file_t*& result)
+{
+	// no way out of the root
+	if (path.empty() || path[0] != '/' || path.find("..") != std::string::npos)
+		return 404;
+
+	std::string name = root + path;
+	if (name[name.size() - 1] == '/') name += indexPage;
+
+	time_t now = time(NULL);
+	file_map_t::iterator iter = files.find(name);
+	if (iter != files.end()) {
+		static_file_t *file = iter->second;
+		if (file->checked == now) {
+			result = file;
+			return 200;
+		}
+
+		struct stat st;
+		if (stat(name.c_str(), &st) == 0 && st.st_mtime == file->mtime && st.st_size == file->size) {
+			file->checked = now;
+			result = file;
+			return 200;
+		}
+
+		// changed or gone
+		delete file;
+		files.erase(iter);
+	}
+
+	static_file_t *file = new (std::nothrow) static_file_t;
+	if (file == NULL) return 500;
+
+	int status = load(name, file, now);
+	if (status != 200) {
+		delete file;
+		return status;
+	}
+
+	files.insert(std::make_pair(name, file));
+	result = file;
+	return 200;
+}
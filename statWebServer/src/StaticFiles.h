@@ -0,0 +1,46 @@
+/* StaticFiles.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __STATIC_FILES__H
+#define __STATIC_FILES__H
+
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <tr1/unordered_map>
+
+typedef struct static_file_tag {
+	std::string content;
+	const char *contentType;
+	time_t mtime;
+	off_t size;
+	time_t checked;		// last stat() of it
+} static_file_t;
+
+//
+// files under the web root kept in memory, each one stat()-ed at
+// most once a second and re-read if it changed. for the loop thread
+// only, no locking.
+//
+class StaticFiles {
+public:
+	StaticFiles() : indexPage("index.html") {}
+	~StaticFiles();
+public:
+	void setRoot(const char *dir, const char *index);
+
+	// 200 and the file, or the http status of the failure
+	int get(const std::string& path, const static_file_t*& file);
+
+	static const char *contentTypeOf(const std::string& name);
+private:
+	int load(const std::string& name, static_file_t *file, time_t now);
+private:
+	typedef std::tr1::unordered_map<std::string, static_file_t *> file_map_t;
+
+	std::string root;
+	std::string indexPage;
+	file_map_t files;
+};
+
+#endif /* __STATIC_FILES__H */
@@ -11,7 +11,17 @@
 //	span=auto|5m|30m
 //      align=1m&span=auto|5m|30m
 //
-// width=1024px to termine how span should be if it is not specified.
+// width=1024 pixels of the chart. an auto span gives some periods per
+// pixel, which storage thins to at most width points per series,
+// keeping the highest and lowest of each few pixels. periods without
+// a point are left out of stats then.
+//
+// since=dtime or ms since the epoch, of the last point a client has
+// for the same range and span. only the periods from it on are
+// queried, it included as gauges coming late may have revised it,
+// and width is cut down to their share of the range. start and end
+// are still of the whole range for the client to slide to, with
+// "since" as the first period returned.
 //
 //
 // did=[Depart ID], optional
@@ -20,6 +30,10 @@
 // iid=[all] or {cpu-total,cpu-cores,cpu-0,cpu-1,...,load-avg,mem,net-all,disk-all,net-eth0,disk-sda...}
 // host=auto|ip[,...]
 //
+// explain=1 to add where the time goes into the output as "profile"
+//
+// format=json|bin
+//
 // ** OUTPUT **
 // var  var systemMonitoringStats = { 
 //	start: "2010-01-01 00:00:00",
@@ -44,6 +58,45 @@
 //	] 
 // }
 //
+// format=bin has the same in columns, all little-endian:
+//	"SMB1" headerSize:u32 pointCount:u32 seriesCount:u32
+//	header: json of headerSize bytes, padded with spaces to 8 bytes
+//		{ start, end, span, groups: [ { gtype, pid, ..., name, type, fields: [usr,sys,...] }, ... ] }
+//	dtimes: f64 * pointCount, ms since the epoch
+//	values: (f64 * pointCount) * seriesCount, a series for each field
+//		of each group in order, NaN if it has no value at a point
+//
+// ** CACHING **
+//
+// a range ending closedRangeAge seconds ago or earlier is closed, no
+// late data can change it any more. its response has an ETag of the
+// query, the same for the same query always, and is immutable: a
+// request with If-None-Match of it gets 304 without storage asked,
+// and the response is kept in an LRU of the web server to serve the
+// next ones. explain=1 is never cached, nor a response storage could
+// not load all data of (a file it failed to read, say)
+//
+// ** BATCH **
+//
+// /api/system/batch takes the queries of a dashboard as q0=, q1=, ...
+// each an url-encoded query string of the parameters above, those
+// it has not are taken from the batch, e.g.
+//	?last=4h&width=900&q0=pid%3D1000%26iid%3Dcpu-total&q1=pid%3D1001%26iid%3Dmem
+// all go to storage in one request, which loads a series once for
+// the queries of the same range and span having it. the output is
+// json, their results in order
+//	{ results: [ { start, end, span, stats: [ ... ] }, ... ] }
+//
+// ** LIVE **
+//
+// /api/system/live takes ctx, group, pid, mid, iid and host as above
+// and span=1m of the periods, and answers text/event-stream: storage
+// pushes each period of the selection once it closes, which goes as
+//	event: stats
+//	data: { dtime: "...", data: [ groups as in stats above ] }
+// after an "open" event. a comment line comes with every heartbeat
+// of storage. the first period only primes the counters, no event
+//
 
 // Note: host's pid & mid.
 //
@@ -51,6 +104,8 @@
 #include <sys/stat.h>
 #include <sys/times.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <math.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <stdlib.h>
@@ -61,17 +116,26 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <vector>
+#include <set>
+#include <algorithm>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 
 #include "Log.h"
 #include "utils.h"
 #include "MemoryBuffer.h"
+#include "proto_h16.h"
 #include "StatData.h"
+#include "StatCommand.h"
 #include "StatCombiner.h"
 #include "StatSystemIids.h"
+#include "QueryProfile.h"
 #include "ClientConnection.h"
 #include "QueryParameters.h"
+#include "HttpServer.h"
+#include "JsonWriter.h"
+#include "ResponseCache.h"
+#include "SystemMetrics.h"
 
 #define CT_BUSINESS	0
 #define CT_RESOURCE	1
@@ -86,19 +150,66 @@
 
 #define MULTIVAL_SEPARATORS	", \t"
 
+// first bytes of format=bin
+#define BINARY_MAGIC		"SMB1"
+
+// periods per pixel of an auto span, downsampled by storage
+#define DOWNSAMPLE_RATIO	4
+
+// a range ending this long ago is closed, by default
+#define CLOSED_RANGE_AGE	3600
+
+// of the output, to change etags if it changes
+#define ETAG_VERSION		1
+
+// queries of a batch at most, as storage takes them, and the room of
+// one in the request
+#define BATCH_MAX_QUERIES	64
+#define BATCH_QUERY_SIZE	8192
+
 typedef std::tr1::unordered_set<local_key_t, LocalKeyHash> local_key_set_t;
 typedef std::tr1::unordered_set<rcall_key_t, LocalKeyHash> rcall_key_set_t;
 typedef std::tr1::unordered_set<stat_ip_t, HipHash> host_set_t;
 
-static const char *storageAddress = "tcp://127.0.0.1:6020";
+// a response frame is at most as large as maxOutputSize of storage
+#define RSP_BUFFER_SIZE		(64 * 1024)
+
+// responses of closed ranges, NULL if not kept
+static ResponseCache *responseCache = NULL;
+static int closedRangeAge = CLOSED_RANGE_AGE;
+
+void setResponseCache(ResponseCache *cache, int _closedRangeAge)
+{
+	responseCache = cache;
+	closedRangeAge = _closedRangeAge;
+}
+
+static inline char *put2(char *p, int v)
+{
+	*p++ = (char)('0' + v / 10);
+	*p++ = (char)('0' + v % 10);
+	return p;
+}
 
+// yyyy-mm-dd HH:MM:SS, by hand as it is done for every row
 static char *formatDtime(char *buf, size_t size, int64_t ts)
 {
 	time_t tsecs = ts / 1000;
 	struct tm tmbuf, *ptm = localtime_r(&tsecs, &tmbuf);
-	xsnprintf(buf, size, "%04d-%02d-%02d %02d:%02d:%02d",
-		ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday,
-		ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+	if (ptm == NULL || size < 20 || ptm->tm_year < -1900 || ptm->tm_year >= 8100) {
+		if (size > 0) buf[0] = 0;
+		return buf;
+	}
+
+	char *p = put2(buf, (ptm->tm_year + 1900) / 100);
+	p = put2(p, (ptm->tm_year + 1900) % 100); *p++ = '-';
+	p = put2(p, ptm->tm_mon + 1); *p++ = '-';
+	p = put2(p, ptm->tm_mday); *p++ = ' ';
+	p = put2(p, ptm->tm_hour); *p++ = ':';
+	p = put2(p, ptm->tm_min); *p++ = ':';
+	p = put2(p, ptm->tm_sec);
+	*p = 0;
+
 	return buf;
 }
 
@@ -229,15 +340,21 @@ static int64_t alignTimeDown(int64_t ts, int unit, int count)
 	return ts;
 }
 
-static void outputError(int code, const char *fmt)
+// only before any output, which can not be taken back once streamed
+static void outputError(HttpResponse& rsp, int code, const char *msg)
 {
-	printf("Status: %d %s\r\n", code, fmt);
-	printf("Content-Type: application/json\r\n");
-	printf("\r\n");
-	printf("{\"code\":%d,\"msg\":\"%s\"}", code, fmt);
+	rsp.setStatus(code);
+	rsp.setContentType("application/json");
+	rsp.body.clear();
+
+	JsonWriter w(HttpResponse::write, &rsp, 256);
+	w.beginObject();
+	w.member("code", code);
+	w.member("msg", msg);
+	w.endObject();
 }
 
-static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int64_t& endDtime, int& spanUnit, int& spanCount)
+static int parseDtimeSpan(HttpResponse& rsp, const QueryParameters& parameters, int64_t& startDtime, int64_t& endDtime, int& spanUnit, int& spanCount)
 {
 	int lastUnit, lastCount = 0;
 	int alignUnit, alignCount, width;
@@ -248,7 +365,7 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 		endDtime = time(NULL)*1000;
 		lastCount = strtol(strLast, &eptr, 0);
 		if ((lastUnit = timeUnit(eptr)) == FT_UNKNOWN) {
-			outputError(501, "invalid time unit for last parameter");
+			outputError(rsp, 501, "invalid time unit for last parameter");
 			return -1;
 		}
 	}
@@ -256,7 +373,7 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 		const char *strStart = parameters.getString("start", NULL);
 		const char *strEnd = parameters.getString("end", NULL);
 		if (strStart == NULL || strEnd == NULL) {
-			outputError(501, "No last is provided, neither start/end. one of them must be provifded.");
+			outputError(rsp, 501, "No last is provided, neither start/end. one of them must be provifded.");
 			return -1;
 		}
 
@@ -271,7 +388,7 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 	else {
 		 spanCount = strtol(strSpan, &eptr, 0);
 		if ((spanUnit = timeUnit(eptr)) == FT_UNKNOWN) {
-			outputError(501, "Invalid time unit for span");
+			outputError(rsp, 501, "Invalid time unit for span");
 			return -1;
 		}
 	}
@@ -283,13 +400,13 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 	else {
 		alignCount = strtol(strAlign, &eptr, 0);
 		if ((alignUnit = timeUnit(eptr)) == FT_UNKNOWN) {
-			outputError(502, "Invalid time unit for align");
+			outputError(rsp, 502, "Invalid time unit for align");
 			return -1;
 		}
 	}
 
-	if ((width = parameters.getInt("width", -1)) == -1) {
-		outputError(503, "No width parameter is set");
+	if ((width = parameters.getInt("width", -1)) < 1) {
+		outputError(rsp, 503, "No width parameter is set");
 		return -1;
 	}
 
@@ -310,7 +427,7 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 			startDtime = endDtime - lastCount * 1000 * 60 * 60;
 			break;
 		default:
-			outputError(501, "TODO: support more lastUnit");
+			outputError(rsp, 501, "TODO: support more lastUnit");
 			return -1;
 		}
 	}
@@ -322,9 +439,9 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 	}
 
 	if (spanCount < 1) {
-		// automatically determine span
-		// at most, one pixel, one point
-		int64_t msPerPx = (endDtime - startDtime) / width;
+		// automatically determine span, a few periods per pixel
+		// for storage to pick the peaks of
+		int64_t msPerPx = (endDtime - startDtime) / width / DOWNSAMPLE_RATIO;
 // larger than, unit, count
 // { 60 * 60 * 1000, FT_HOUR, -1 },
 // { M(30), FT_HOUR, 1 },
@@ -409,376 +526,535 @@ static int parseDtimeSpan(QueryParameters& parameters, int64_t& startDtime, int6
 	return 0;
 }
 
-static void outputCpuCombinedGauges(int gtype, const merged_gauge_map_t& prev, const merged_gauge_map_t& gauges,
-				    bool& first, std::tr1::unordered_set<int> cpuIds)
+// where frames of the system stats response go
+typedef struct stats_frames_tag {
+	StatCombiner *combiner;
+	QueryProfile *profile;		// NULL if not asked for
+} stats_frames_t;
+
+//
+// one frame of the system stats response into the combiner, the
+// profile follows the stats in the last one if asked for
+//
+static int __parseStatsFrame(void *arg, MemoryBuffer *rsp)
 {
-	for (std::tr1::unordered_set<int>::const_iterator idIter = cpuIds.begin(); idIter != cpuIds.end(); ++idIter) {
-		local_key_set_t keys;
+	stats_frames_t *frames = (stats_frames_t *)arg;
+	struct proto_h16_res *h = (struct proto_h16_res *)rsp->data();
+	if (h->ret != 0) {
+		APPLOG_ERROR("get system stats failed: ret=%d", (int)h->ret);
+		return -1;
+	}
 
-		for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
-			if (IID_IS4CPU(iter->first.sid.iid) && IID2CPUNO(iter->first.sid.iid) == *idIter) {
-				local_key_t key = iter->first;
-				key.sid.iid = 0;
+	rsp->setRptr(sizeof(*h));
+	int retval = frames->combiner->parseFrom(rsp);
+	if (retval < 0) {
+		APPLOG_ERROR("parse combiner from rsp-msg failed");
+	}
+	else if (retval == 1 && frames->profile != NULL && rsp->getRptr() < rsp->getWptr()
+			&& frames->profile->parseFrom(rsp) < 0) {
+		APPLOG_WARN("parse profile from rsp-msg failed");
+	}
 
-				keys.insert(key);
-			}
+	return retval;
+}
+
+#define FAMILY_MAX_FIELDS	4
+
+//
+// a kind of system stats. a group of it is its fields of one pid,
+// mid or host, and of one no for cpu, net and disk
+//
+typedef struct metric_family_tag {
+	const char *type;
+	const char *prefix;		// of the group name, NULL for none
+	bool counter;			// fields are increases over the span
+	bool (*match)(int iid, int no);
+	int (*iidOf)(int no, int field);
+	int (*noOf)(int iid);		// -1 if not of it, NULL for no "all"
+	int allNo;			// the no for all of them
+	int fieldCount;
+	const char *fields[FAMILY_MAX_FIELDS];
+} metric_family_t;
+
+static bool isCpuOf(int iid, int no) { return IID_IS4CPU(iid) && IID2CPUNO(iid) == no; }
+static bool isMem(int iid, int no) { return IID_IS4MEM(iid); }
+static bool isLoadavg(int iid, int no) { return IID_IS4LOADAVG(iid); }
+static bool isNetOf(int iid, int no) { return IID_IS4NET(iid) && IID2NETNO(iid) == no; }
+static bool isDiskOf(int iid, int no) { return IID_IS4DISK(iid) && IID2DISKNO(iid) == no; }
+static int netNoOf(int iid) { return IID_IS4NET(iid) ? IID2NETNO(iid) : -1; }
+static int diskNoOf(int iid) { return IID_IS4DISK(iid) ? IID2DISKNO(iid) : -1; }
+
+static int cpuIid(int no, int field)
+{
+	static const int types[] = { CPU_USR, CPU_SYS, CPU_IDL, CPU_WT };
+	return IID_CPU(no, types[field]);
+}
+
+static int memIid(int no, int field)
+{
+	static const int iids[] = { IID_MEM_USED, IID_MEM_FREE, IID_MEM_CACHED, IID_MEM_BUFFERS };
+	return iids[field];
+}
+
+static int loadavgIid(int no, int field)
+{
+	static const int iids[] = { IID_LOADAVG_1, IID_LOADAVG_5, IID_LOADAVG_15 };
+	return iids[field];
+}
+
+static int netIid(int no, int field)
+{
+	static const int types[] = { NET_T_IN_BYTES, NET_T_IN_PKTS, NET_T_OUT_BYTES, NET_T_OUT_PKTS };
+	return IID_NET(no, types[field]);
+}
+
+static int diskIid(int no, int field)
+{
+	static const int types[] = { DISK_T_R_CALLS, DISK_T_R_BYTES, DISK_T_W_CALLS, DISK_T_W_BYTES };
+	return IID_DISK(no, types[field]);
+}
+
+#define FAMILY_CPU	0
+#define FAMILY_MEM	1
+#define FAMILY_LOADAVG	2
+#define FAMILY_NET	3
+#define FAMILY_DISK	4
+
+static const metric_family_t families[] = {
+	{ "cpu", "cpu", true, isCpuOf, cpuIid, NULL, 0, 4, { "usr", "sys", "idl", "wt" } },
+	{ "mem", NULL, false, isMem, memIid, NULL, 0, 4, { "used", "free", "cached", "buffers" } },
+	{ "load-avg", NULL, false, isLoadavg, loadavgIid, NULL, 0, 3, { "1m", "5m", "15m" } },
+	{ "net", "net", true, isNetOf, netIid, netNoOf, IID_NET_ALL, 4, { "ib", "ip", "ob", "op" } },
+	{ "disk", "disk", true, isDiskOf, diskIid, diskNoOf, IID_DISK_ALL, 4, { "r-calls", "r-bytes", "w-calls", "w-bytes" } }
+};
+
+// a family and its no asked for, in the order of output
+typedef std::pair<int, int> metric_select_t;
+typedef std::vector<metric_select_t> metric_select_list_t;
+
+// values of a group at one period
+typedef struct group_point_tag {
+	int select;			// of the selects
+	local_key_t key;		// iid cleared
+	bool valid;			// false if a counter misses an end
+	int64_t values[FAMILY_MAX_FIELDS];
+} group_point_t;
+
+typedef std::vector<group_point_t> group_point_list_t;
+
+// what the output needs of a query
+typedef struct metrics_result_tag {
+	const StatCombiner *combiner;
+	metric_select_list_t selects;
+	int gtype;
+	int64_t startDtime;		// one span before the first period
+	int64_t endDtime;
+	int64_t rangeStart;		// first period of the range asked for
+	int64_t sinceDtime;		// first period returned, 0 for all
+	int spanUnit;
+	int spanCount;
+	int mergeCount;
+	const QueryProfile *profile;	// NULL if not explained
+	int64_t requestUsec;
+	int64_t formatSince;
+} metrics_result_t;
+
+//
+// a net-all or disk-all select as one select for each no in the
+// result, but the ones also asked for by no
+//
+static void expandSelects(metrics_result_t& result, const metric_select_list_t& selects)
+{
+	result.selects.clear();
+	for (size_t s = 0; s < selects.size(); ++s) {
+		const metric_family_t& family = families[selects[s].first];
+		if (family.noOf == NULL || selects[s].second != family.allNo) {
+			result.selects.push_back(selects[s]);
+			continue;
 		}
 
-		for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
-			if (first) first = false; else printf(",");
-			if (gtype == GT_PRODUCT) {
-				// {pid,mid=0,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"P\",\"pid\":%d,\"type\":\"cpu\"", iter->sid.pid);
-			}
-			else if (gtype == GT_MODULE) {
-				// {pid,mid,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"M\",\"pid\":%d,\"mid\":%d", iter->sid.pid, iter->sid.mid);
-			}
-			else if (gtype == GT_HOST) {
-				// {pid=0,mid=0,usr|sys|idl|wt,host}
-				// TODO: host-name, and support ip6
-				char buf[128];
-				if (iter->hip.ver == 4) inet_ntop(AF_INET, &iter->hip.ip.ip4, buf, sizeof buf);
-				else if (iter->hip.ver == 6) inet_ntop(AF_INET6, &iter->hip.ip.ip6[0], buf, sizeof buf);
-				printf("{\"gtype\":\"H\",\"ip\":\"%s\",\"host\":\"%s\"", buf, buf);
+		std::set<int> nos;
+		for (int i = 0; result.combiner != NULL && i < result.mergeCount; ++i) {
+			const merged_gauge_map_t& gauges = result.combiner->mergedGauges[i];
+			for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
+				int no = (*family.noOf)(iter->first.sid.iid);
+				if (no >= 0 && no != family.allNo) nos.insert(no);
 			}
+		}
 
-			if (*idIter == IID_CPU_TOTAL) printf(",\"name\":\"cpu\"");
-			else printf(",\"name\":\"cpu-%d\"", *idIter);
-		
-			local_key_t key = *iter; 
-			key.sid.iid = IID_CPU(*idIter, CPU_USR);
-			int64_t usr = -1, sys = -1, idl = -1, wt = -1;
-			const_gauge_iterator iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				usr = iter2->second.gval - iter1->second.gval;
-
-			key.sid.iid = IID_CPU(*idIter, CPU_SYS);
-			iter1 = prev.find(key); iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				sys = iter2->second.gval - iter1->second.gval;
-
-			key.sid.iid = IID_CPU(*idIter, CPU_IDL);
-			iter1 = prev.find(key); iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				idl = iter2->second.gval - iter1->second.gval;
-			
-			key.sid.iid = IID_CPU(*idIter, CPU_WT);
-			iter1 = prev.find(key); iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				wt = iter2->second.gval - iter1->second.gval;
-
-			if (usr == -1 || sys == -1 || idl == -1 || wt == -1) {
-				printf(",\"values\":{}}");
-			}
-			else {
-				// TODO: change to percent
-				//int total = usr + sys + idl + wt;
-				//int all = spanLength(spanUnit, spanCount) / 1000 * 100;
-				//if (all % 100
-				
-				printf(",\"values\":{\"usr\":%ld,\"sys\":%ld,\"idl\":%ld,\"wt\":%ld}}", usr,sys,idl,wt);
-			}
+		for (std::set<int>::const_iterator iter = nos.begin(); iter != nos.end(); ++iter) {
+			metric_select_t one(selects[s].first, *iter);
+			if (std::find(selects.begin(), selects.end(), one) == selects.end())
+				result.selects.push_back(one);
 		}
 	}
 }
 
-void outputMemCombinedGauges(int gtype, const merged_gauge_map_t& prev, const merged_gauge_map_t& gauges, bool& first)
+// keys of the gauges matched, with iid cleared
+static void groupKeys(const merged_gauge_map_t& gauges, bool (*match)(int iid, int no), int no, local_key_set_t& keys)
 {
-	local_key_set_t keys;
 	for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
-		if (IID_IS4MEM(iter->first.sid.iid)) {
+		if ((*match)(iter->first.sid.iid, no)) {
 			local_key_t key = iter->first;
 			key.sid.iid = 0;
 
 			keys.insert(key);
 		}
 	}
+}
 
-	for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
-		if (first) first = false; else printf(",");
-		if (gtype == GT_PRODUCT) {
-			// {pid,mid=0,usr|sys|idl|wt,host=0}
-			printf("{\"gtype\":\"P\",\"pid\":%d,\"type\":\"mem\"", iter->sid.pid);
-		}
-		else if (gtype == GT_MODULE) {
-			// {pid,mid,usr|sys|idl|wt,host=0}
-			printf("{\"gtype\":\"M\",\"pid\":%d,\"mid\":%d,\"type\":\"mem\"", iter->sid.pid, iter->sid.mid);
-		}
-		else if (gtype == GT_HOST) {
-			// {pid=0,mid=0,usr|sys|idl|wt,host}
-			// TODO: host-name, ip6
-			char buf[128];
-			if (iter->hip.ver == 4) inet_ntop(AF_INET, &iter->hip.ip.ip4, buf, sizeof buf);
-			else if (iter->hip.ver == 6) inet_ntop(AF_INET6, &iter->hip.ip.ip6[0], buf, sizeof buf);
-			printf("{\"gtype\":\"H\",\"ip\":\"%s\",\"host\":\"%s\",\"type\":\"mem\"", buf, buf);
-		}
+// groups of period i, false if it has no point as thinned out by
+// storage, or kept only as the previous one of a counter point
+static bool collectPoints(const metrics_result_t& result, int i, group_point_list_t& points)
+{
+	const merged_gauge_map_t& prev = result.combiner->mergedGauges[i-1];
+	const merged_gauge_map_t& gauges = result.combiner->mergedGauges[i];
 
-		local_key_t key = *iter;
-		const_gauge_iterator iter2;
-		int64_t free = 0, cached = 0, buffers = 0, used = 0;
-		key.sid.iid = IID_MEM_USED; if ((iter2 = gauges.find(key)) != gauges.end()) used = iter2->second.gval;
-		key.sid.iid = IID_MEM_FREE; if ((iter2 = gauges.find(key)) != gauges.end()) free = iter2->second.gval;
-		key.sid.iid = IID_MEM_CACHED; if ((iter2 = gauges.find(key)) != gauges.end()) cached = iter2->second.gval;
-		key.sid.iid = IID_MEM_BUFFERS; if ((iter2 = gauges.find(key)) != gauges.end()) buffers = iter2->second.gval;
-		printf(",\"values\":{\"used\":%ld,\"free\":%ld,\"cached\":%ld,\"buffers\":%ld}}", used, free, cached, buffers);
+	points.clear();
+	if (gauges.empty() || prev.empty())
+		return false;
+
+	for (size_t s = 0; s < result.selects.size(); ++s) {
+		const metric_family_t& family = families[result.selects[s].first];
+		int no = result.selects[s].second;
+
+		local_key_set_t keys;
+		groupKeys(gauges, family.match, no, keys);
+
+		for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
+			group_point_t point;
+			point.select = s;
+			point.key = *iter;
+			point.valid = true;
+
+			for (int f = 0; f < family.fieldCount; ++f) {
+				local_key_t key = *iter;
+				key.sid.iid = (*family.iidOf)(no, f);
+
+				const_gauge_iterator iter2 = gauges.find(key);
+				if (!family.counter) {
+					point.values[f] = iter2 != gauges.end() ? iter2->second.gval : 0;
+					continue;
+				}
+
+				const_gauge_iterator iter1 = prev.find(key);
+				if (iter1 == prev.end() || iter2 == gauges.end()) {
+					point.valid = false;
+					break;
+				}
+
+				point.values[f] = iter2->second.gval - iter1->second.gval;
+			}
+
+			points.push_back(point);
+		}
 	}
 
-	return;
+	return true;
 }
 
-void outputLoadavgCombinedGauges(int gtype, const merged_gauge_map_t& prev, const merged_gauge_map_t& gauges, bool& first)
+// the json object of a group, left open for its values
+static void writeGroup(JsonWriter& w, int gtype, const local_key_t& key, const metric_select_t& select)
 {
-	local_key_set_t keys;
-	for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
-		if (IID_IS4LOADAVG(iter->first.sid.iid)) {
-			local_key_t key = iter->first;
-			key.sid.iid = 0;
+	const metric_family_t& family = families[select.first];
 
-			keys.insert(key);
-		}
+	w.beginObject();
+	if (gtype == GT_PRODUCT) {
+		// {pid,mid=0,host=0}
+		w.member("gtype", "P");
+		w.member("pid", (int)key.sid.pid);
+	}
+	else if (gtype == GT_MODULE) {
+		// {pid,mid,host=0}
+		w.member("gtype", "M");
+		w.member("pid", (int)key.sid.pid);
+		w.member("mid", (int)key.sid.mid);
+	}
+	else if (gtype == GT_HOST) {
+		// {pid=0,mid=0,host}
+		// TODO: host-name
+		char buf[128];
+		hip2str(buf, sizeof buf, key.hip);
+		w.member("gtype", "H");
+		w.member("ip", buf);
+		w.member("host", buf);
 	}
 
-	for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
-		if (first) first = false; else printf(",");
-		if (gtype == GT_PRODUCT) {
-			// {pid,mid=0,usr|sys|idl|wt,host=0}
-			printf("{\"gtype\":\"P\",\"pid\":%d,\"type\":\"load-avg\"", iter->sid.pid);
-		}
-		else if (gtype == GT_MODULE) {
-			// {pid,mid,usr|sys|idl|wt,host=0}
-			printf("{\"gtype\":\"M\",\"pid\":%d,\"mid\":%d,\"type\":\"load-avg\"", iter->sid.pid, iter->sid.mid);
-		}
-		else if (gtype == GT_HOST) {
-			// {pid=0,mid=0,usr|sys|idl|wt,host}
-			// TODO: host-name, ip6
-			char buf[128];
-			if (iter->hip.ver == 4) inet_ntop(AF_INET, &iter->hip.ip.ip4, buf, sizeof buf);
-			else if (iter->hip.ver == 6) inet_ntop(AF_INET6, &iter->hip.ip.ip6[0], buf, sizeof buf);
-			printf("{\"gtype\":\"H\",\"ip\":\"%s\",\"host\":\"%s\",\"type\":\"load-avg\"", buf, buf);
-		}
-
-		local_key_t key = *iter; 
-		const_gauge_iterator iter2;
-		int64_t m1 = 0, m5 = 0, m15 = 0;
-		key.sid.iid = IID_LOADAVG_1; if ((iter2 = gauges.find(key)) != gauges.end()) m1 = iter2->second.gval;
-		key.sid.iid = IID_LOADAVG_5; if ((iter2 = gauges.find(key)) != gauges.end()) m5 = iter2->second.gval;
-		key.sid.iid = IID_LOADAVG_15; if ((iter2 = gauges.find(key)) != gauges.end()) m15 = iter2->second.gval;
-		printf(",\"values\":{\"1m\":%ld,\"5m\":%ld,\"15m\":%ld}}", m1, m5, m15);
+	w.member("type", family.type);
+	if (family.prefix != NULL) {
+		// TODO: names of net and disk
+		char name[32];
+		if (select.first == FAMILY_CPU && select.second == IID_CPU_TOTAL)
+			snprintf(name, sizeof name, "%s", family.prefix);
+		else
+			snprintf(name, sizeof name, "%s-%d", family.prefix, select.second);
+		w.member("name", name);
 	}
+}
 
-	return;
+static void outputProfile(JsonWriter& w, const QueryProfile& profile, int64_t requestUsec, int64_t formatUsec)
+{
+	w.key("profile");
+	w.beginObject();
+	w.key("storage");
+	w.beginObject();
+	for (int i = 0; i < PROFILE_STAGES; ++i)
+		w.member(QueryProfile::stageName(i), (int64_t)profile.getTime(i));
+	for (int i = 0; i < PROFILE_COUNTERS; ++i)
+		w.member(QueryProfile::counterName(i), (int64_t)profile.getCount(i));
+	w.endObject();
+
+	w.member("request", requestUsec);
+	w.member("format", formatUsec);
+	w.endObject();
 }
 
-void outputNetCombinedGauges(int gtype, const merged_gauge_map_t& prev, const merged_gauge_map_t& gauges,
-			     bool& first, const std::tr1::unordered_set<int>& netIds)
+// start, end and span of the result
+static void writeRange(JsonWriter& w, const metrics_result_t& result)
 {
-	for (std::tr1::unordered_set<int>::const_iterator idIter = netIds.begin(); idIter != netIds.end(); ++idIter) {
-		local_key_set_t keys;
+	char buf[128];
 
-		for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
-			if (IID_IS4NET(iter->first.sid.iid) && IID2NETNO(iter->first.sid.iid) == *idIter) {
-				local_key_t key = iter->first;
-				key.sid.iid = 0;
-				
-				keys.insert(key);
-			}
-		}
+	w.member("start", formatDtime(buf, sizeof buf, result.rangeStart));
+	w.member("end", formatDtime(buf, sizeof buf, result.endDtime));
+	w.member("span", formatSpan(buf, sizeof buf, result.spanUnit, result.spanCount));
+	if (result.sinceDtime > 0)
+		w.member("since", formatDtime(buf, sizeof buf, result.sinceDtime));
+}
 
-		
-		for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
-			if (first) first = false; else printf(",");
-			if (gtype == GT_PRODUCT) {
-				// {pid,mid=0,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"P\",\"pid\":%d,\"type\":\"net\"", iter->sid.pid);
-			}
-			else if (gtype == GT_MODULE) {
-				// {pid,mid,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"M\",\"pid\":%d,\"mid\":%d", iter->sid.pid, iter->sid.mid);
-			}
-			else if (gtype == GT_HOST) {
-				// {pid=0,mid=0,usr|sys|idl|wt,host}
-				// TODO: host-name, ip6
-				char buf[128];
-				if (iter->hip.ver == 4) inet_ntop(AF_INET, &iter->hip.ip.ip4, buf, sizeof buf);
-				else if (iter->hip.ver == 6) inet_ntop(AF_INET6, &iter->hip.ip.ip6[0], buf, sizeof buf);
-				printf("{\"gtype\":\"H\",\"ip\":\"%s\",\"host\":\"%s\"", buf, buf);
-			}
+// a period of stats: { dtime, data: [ groups ] }
+static void writePeriod(JsonWriter& w, const metrics_result_t& result, int64_t dtime, const group_point_list_t& points)
+{
+	char buf[128];
 
-			// TODO: get its name
-			printf(",\"name\":\"net-%d\"", *idIter);
-		
-			int64_t inBytes = 0, inPkts = 0, outBytes = 0, outPkts = 0;
-			local_key_t key = *iter; 
+	w.beginObject();
+	w.member("dtime", formatDtime(buf, sizeof buf, dtime));
+	w.key("data");
+	w.beginArray();
+
+	for (size_t p = 0; p < points.size(); ++p) {
+		const group_point_t& point = points[p];
+		const metric_family_t& family = families[result.selects[point.select].first];
+
+		writeGroup(w, result.gtype, point.key, result.selects[point.select]);
+		w.key("values");
+		w.beginObject();
+		if (point.valid) {
+			for (int f = 0; f < family.fieldCount; ++f)
+				w.member(family.fields[f], point.values[f]);
+		}
+		w.endObject();
+		w.endObject();
+	}
 
-			key.sid.iid = IID_NET(*idIter, NET_T_IN_BYTES);
-			const_gauge_iterator iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				inBytes = iter2->second.gval - iter1->second.gval;
+	w.endArray();
+	w.endObject();
+}
 
-			key.sid.iid = IID_NET(*idIter, NET_T_IN_PKTS);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				inPkts = iter2->second.gval - iter1->second.gval;
+// the range and stats of a result, members of an open object
+static void writeStats(JsonWriter& w, const metrics_result_t& result)
+{
+	int64_t spanInterval = spanLength(result.spanUnit, result.spanCount);
+	group_point_list_t points;
+
+	writeRange(w, result);
+	w.key("stats");
+	w.beginArray();
+	for (int i = 1; i < result.mergeCount; ++i) {
+		if (collectPoints(result, i, points))
+			writePeriod(w, result, result.startDtime + i * spanInterval, points);
+	}
 
-			key.sid.iid = IID_NET(*idIter, NET_T_OUT_BYTES);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				outBytes = iter2->second.gval - iter1->second.gval;
+	w.endArray();
+}
 
-			key.sid.iid = IID_NET(*idIter, NET_T_OUT_PKTS);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				outPkts = iter2->second.gval - iter1->second.gval;
+//
+// period by period, streamed out by the writer as its buffer fills
+// up
+//
+static void outputJson(HttpResponse& rsp, const metrics_result_t& result)
+{
+	rsp.setContentType("application/json");
+	JsonWriter w(HttpResponse::write, &rsp);
 
-			printf(",\"values\":{\"ib\":%ld,\"ip\":%ld,\"ob\":%ld,\"op\":%ld}}", inBytes,inPkts,outBytes,outPkts);
-		}
+	w.beginObject();
+	writeStats(w, result);
+	if (result.profile != NULL) {
+		outputProfile(w, *result.profile, result.requestUsec, QueryProfile::now() - result.formatSince);
 	}
 
-	return;
+	w.endObject();
+	w.flush();
 }
 
-void outputDiskCombinedGauges(int gtype, const merged_gauge_map_t& prev, const merged_gauge_map_t& gauges,
-			      bool& first, const std::tr1::unordered_set<int>& diskIds)
+static void __appendString(void *arg, const char *data, size_t size)
 {
-	for (std::tr1::unordered_set<int>::const_iterator idIter = diskIds.begin(); idIter != diskIds.end(); ++idIter) {
-		local_key_set_t keys;
+	((std::string *)arg)->append(data, size);
+}
 
-		for (const_gauge_iterator iter = gauges.begin(); iter != gauges.end(); ++iter) {
-			if (IID_IS4DISK(iter->first.sid.iid) && IID2DISKNO(iter->first.sid.iid)== *idIter) {
-				local_key_t key = iter->first;
-				key.sid.iid = 0;
+static void appendUint32(HttpResponse& rsp, uint32_t v)
+{
+	v = htole32(v);
+	rsp.append((const char *)&v, sizeof v);
+}
 
-				keys.insert(key);
-			}
-		}
+static void appendFloat64s(HttpResponse& rsp, const double *values, size_t count)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	rsp.append((const char *)values, count * sizeof(double));
+#else
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t bits;
+		memcpy(&bits, &values[i], sizeof bits);
+		bits = htole64(bits);
+		rsp.append((const char *)&bits, sizeof bits);
+	}
+#endif
 
-		
-		for (local_key_set_t::iterator iter = keys.begin(); iter != keys.end(); ++iter) {
-			if (first) first = false; else printf(",");
-			if (gtype == GT_PRODUCT) {
-				// {pid,mid=0,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"P\",\"pid\":%d,\"type\":\"disk\"", iter->sid.pid);
-			}
-			else if (gtype == GT_MODULE) {
-				// {pid,mid,usr|sys|idl|wt,host=0}
-				printf("{\"gtype\":\"M\",\"pid\":%d,\"mid\":%d,\"type\":\"disk\"", iter->sid.pid, iter->sid.mid);
-			}
-			else if (gtype == GT_HOST) {
-				// {pid=0,mid=0,usr|sys|idl|wt,host}
-				// TODO: host-name, ip6
-				char buf[128];
-				if (iter->hip.ver == 4) inet_ntop(AF_INET, &iter->hip.ip.ip4, buf, sizeof buf);
-				else if (iter->hip.ver == 6) inet_ntop(AF_INET6, &iter->hip.ip.ip6[0], buf, sizeof buf);
-				printf("{\"gtype\":\"H\",\"ip\":\"%s\",\"host\":\"%s\",\"type\":\"disk\"", buf, buf);
-			}
+	if (rsp.body.size() >= JSON_BUFFER_SIZE)
+		rsp.flush();
+}
 
-			printf(",\"name\":\"disk-%d\"", *idIter);
-		
-			int64_t rCalls = 0, rBytes = 0, wCalls = 0, wBytes = 0;
-			local_key_t key = *iter; 
+//
+// columns of all periods: the groups first, and a series for each
+// field of a group, see format=bin above
+//
+static void outputBinary(HttpResponse& rsp, const metrics_result_t& result)
+{
+	int64_t spanInterval = spanLength(result.spanUnit, result.spanCount);
+	std::vector<double> times;
+	std::vector<group_point_list_t> periods;
+	group_point_list_t points;
+
+	// groups in the order first seen, by select and key
+	std::vector<std::tr1::unordered_map<local_key_t, int, LocalKeyHash> > seriesOf(result.selects.size());
+	group_point_list_t groups;
+	size_t seriesCount = 0;
+
+	for (int i = 1; i < result.mergeCount; ++i) {
+		if (!collectPoints(result, i, points))
+			continue;
+
+		for (size_t p = 0; p < points.size(); ++p) {
+			std::tr1::unordered_map<local_key_t, int, LocalKeyHash>& series = seriesOf[points[p].select];
+			if (series.find(points[p].key) == series.end()) {
+				series[points[p].key] = seriesCount;
+				seriesCount += families[result.selects[points[p].select].first].fieldCount;
+				groups.push_back(points[p]);
+			}
+		}
 
-			key.sid.iid = IID_DISK(*idIter, DISK_T_R_CALLS);
-			const_gauge_iterator iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				rCalls = iter2->second.gval - iter1->second.gval;
+		times.push_back((double)(result.startDtime + i * spanInterval));
+		periods.push_back(points);
+	}
 
-			key.sid.iid = IID_DISK(*idIter, DISK_T_R_BYTES);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				rBytes = iter2->second.gval - iter1->second.gval;
+	std::vector<double> values(seriesCount * times.size(), NAN);
+	for (size_t t = 0; t < periods.size(); ++t) {
+		for (size_t p = 0; p < periods[t].size(); ++p) {
+			const group_point_t& point = periods[t][p];
+			if (!point.valid) continue;
 
-			key.sid.iid = IID_DISK(*idIter, DISK_T_W_CALLS);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				wCalls = iter2->second.gval - iter1->second.gval;
+			int first = seriesOf[point.select][point.key];
+			int count = families[result.selects[point.select].first].fieldCount;
+			for (int f = 0; f < count; ++f)
+				values[(first + f) * times.size() + t] = (double)point.values[f];
+		}
+	}
 
-			key.sid.iid = IID_NET(*idIter, DISK_T_W_BYTES);
-			iter1 = prev.find(key), iter2 = gauges.find(key);
-			if (iter1 != prev.end() && iter2 != gauges.end())
-				wBytes = iter2->second.gval - iter1->second.gval;
+	// the header, spaces after it to align the arrays
+	std::string header;
+	{
+		JsonWriter w(__appendString, &header, 4096);
+		w.beginObject();
+		writeRange(w, result);
+		w.key("groups");
+		w.beginArray();
+		for (size_t g = 0; g < groups.size(); ++g) {
+			const metric_select_t& select = result.selects[groups[g].select];
+			const metric_family_t& family = families[select.first];
+
+			writeGroup(w, result.gtype, groups[g].key, select);
+			w.key("fields");
+			w.beginArray();
+			for (int f = 0; f < family.fieldCount; ++f)
+				w.value(family.fields[f]);
+			w.endArray();
+			w.endObject();
+		}
+		w.endArray();
 
-			printf(",\"values\":{\"r-calls\":%ld,\"r-bytes\":%ld,\"w-calls\":%ld,\"w-bytes\":%ld}}", rCalls, rBytes, wCalls, wBytes);
+		if (result.profile != NULL) {
+			outputProfile(w, *result.profile, result.requestUsec, QueryProfile::now() - result.formatSince);
 		}
+
+		w.endObject();
 	}
 
-	return;
+	header.append((8 - header.size() % 8) % 8, ' ');
+
+	rsp.setContentType("application/octet-stream");
+	rsp.append(BINARY_MAGIC, 4);
+	appendUint32(rsp, header.size());
+	appendUint32(rsp, times.size());
+	appendUint32(rsp, seriesCount);
+	rsp.append(header);
+
+	if (!times.empty()) {
+		appendFloat64s(rsp, &times[0], times.size());
+		for (size_t s = 0; s < seriesCount; ++s)
+			appendFloat64s(rsp, &values[s * times.size()], times.size());
+	}
 }
 
-//
-// case 0: depart-level
-//	dep-id => [pid,...] => [{pid,*,*}, ...]
-//	host=[auto]
-// case 1: pid-level
-//	pid, *, *
-//	host=[auto]
-// case 2: mid-level
-//	pid, mid, *
-//	host=[auto]
-// case 3: host-level
-//	pid, mid, *
-//	host=ip
-// case 4: expand-to-individual-hosts
-//	pid,mid,iid as in [0-2] (no case #3)
-//	host=[auto]
-//
-static void handleRequest(QueryParameters& parameters)
+// what a request selects, all but the time
+typedef struct metrics_selection_tag {
+	int context;
+	int totalView;
+	uint16_t pid;
+	uint16_t mid;
+	std::vector<int> iids;		// as storage takes them
+	host_set_t hosts;
+	metric_select_list_t selects;	// groups of the output, in order
+	int gtype;
+} metrics_selection_t;
+
+// ctx, group, pid, mid, iid and host, -1 after the error is output
+static int parseSelection(HttpResponse& rsp, const QueryParameters& parameters, metrics_selection_t& selection)
 {
 	// step 1: context
 	const char *strContext = parameters.getString("context", "resource");
-	int context;
 	if (!strcmp(strContext, "business")) {
-		context = CT_BUSINESS;
+		selection.context = CT_BUSINESS;
 	}
 	else if (!strcmp(strContext, "resource")) {
-		context = CT_RESOURCE;
+		selection.context = CT_RESOURCE;
 	}
 	else {
-		outputError(501, "Invalid context parameter");
-		return;
+		outputError(rsp, 501, "Invalid context parameter");
+		return -1;
 	}
 
 	// step 2: group - how to combine stats together
-	int totalView = 0;
 	const char *strGroup = parameters.getString("group", "total");
 	if (!strcmp(strGroup, "total")) {
-		totalView = 1;
+		selection.totalView = 1;
 	}
 	else if (!strcmp(strGroup, "list")) {
-		totalView = 0;
+		selection.totalView = 0;
 	}
 	else {
-		outputError(501, "invalid group parameter, which should be total|list.");
-		return;
+		outputError(rsp, 501, "invalid group parameter, which should be total|list.");
+		return -1;
 	}
-	
-	// step 3: time period, span, align
-	int64_t startDtime, endDtime;
-	int spanUnit, spanCount;
-	if (parseDtimeSpan(parameters, startDtime, endDtime, spanUnit, spanCount) < 0)
-		return;
-
-	// move ahead one span for some calculation need its previous stats
-	startDtime -= spanLength(spanUnit, spanCount);
-	int mergeCount = (endDtime - startDtime) / spanLength(spanUnit, spanCount);
-
-//	char buf1[128], buf2[128];
-//	APPLOG_DEBUG("parsed start=%s, end=%s, mergeCount=%d", 
-//		formatDtime(buf1, sizeof buf1, startDtime),
-//		formatDtime(buf2, sizeof buf2, endDtime), mergeCount);
 
-	StatMerger merger(NULL, NULL, NULL, NULL, spanUnit, spanCount, mergeCount);
-	merger.periodStartTime = startDtime;
-	
 	// step 4: ids
 // TODO: group by department...
 //	uint16_t did = parameters.getInt("did", 0);
-	uint16_t pid = parameters.getInt("pid", 0);
-	uint16_t mid = parameters.getInt("mid", 0);
+	uint16_t pid = selection.pid = parameters.getInt("pid", 0);
+	uint16_t mid = selection.mid = parameters.getInt("mid", 0);
 
 	if (pid == 0) {
-		outputError(501, "pid can not be 0(ANY) now");
-		return;
+		outputError(rsp, 501, "pid can not be 0(ANY) now");
+		return -1;
 	}
 
 	int cpuTotal = 0, cpuCores = 0; std::tr1::unordered_set<int> cpuIds;
@@ -814,18 +1090,14 @@ static void handleRequest(QueryParameters& parameters)
 			// TODO: mapping disk-name to its id
 			else if (!strncmp(nptr, "disk-", 5)) diskIds.insert(strtol(nptr + 5, NULL, 0));
 			else {
-				outputError(501, "invalid iid parameter");
-				return;
+				outputError(rsp, 501, "invalid iid parameter");
+				return -1;
 			}
 
 			nptr = strtok_r(NULL, MULTIVAL_SEPARATORS, &endptr);
 		}
 	}
 
-	// step 4.2: get all possible iids first
-	local_key_set_t ids;
-	host_set_t hosts;
-
 	// step 4.3: get hosts and mapping iids with hosts
 	const char *strHost = parameters.getString("host", "auto");
 	if (strcmp(strHost, "auto")) {
@@ -843,114 +1115,698 @@ static void handleRequest(QueryParameters& parameters)
 				hip.ver = 6;
 			}
 			else {
-				outputError(501, "invalid host parameter");
-				return;
+				outputError(rsp, 501, "invalid host parameter");
+				return -1;
 			}
 
-			hosts.insert(hip);
+			selection.hosts.insert(hip);
 			nptr = strtok_r(NULL, MULTIVAL_SEPARATORS, &endptr);
 		}
 	}
 
-	unsigned char buf[8192], rspBuf[8192];
-	Memorybuffer msg(buf, sizeof buf, false);
-	MemoryBuffer rsp(rspBuf, sizeof rspBuf, false);
+	// step 4.2: iids for storage, and groups of the output
+	std::vector<int>& iids = selection.iids;
+	if (cpuTotal) { iids.push_back(IID_CPU(IID_CPU_TOTAL, 0)); cpuIds.insert(IID_CPU_TOTAL); }
+	if (cpuCores) iids.push_back(IID_CPU(IID_CPU_CORES, 0));
+	for (std::tr1::unordered_set<int>::const_iterator iter = cpuIds.begin(); iter != cpuIds.end(); ++iter)
+		if (*iter != IID_CPU_TOTAL) iids.push_back(IID_CPU(*iter, 0));
+	if (memory) iids.push_back(IID_MEM_USED);
+	if (loadAvg) iids.push_back(IID_LOADAVG_1);
+	if (netAll) iids.push_back(IID_NET(IID_NET_ALL, 0));
+	for (std::tr1::unordered_set<int>::const_iterator iter = netIds.begin(); iter != netIds.end(); ++iter)
+		iids.push_back(IID_NET(*iter, 0));
+	if (diskAll) iids.push_back(IID_DISK(IID_DISK_ALL, 0));
+	for (std::tr1::unordered_set<int>::const_iterator iter = diskIds.begin(); iter != diskIds.end(); ++iter)
+		iids.push_back(IID_DISK(*iter, 0));
+
+	if (pid == 0 || (mid == 0 && selection.totalView)) selection.gtype = GT_PRODUCT;
+	else if (mid == 0 || selection.totalView) selection.gtype = GT_MODULE;
+	else selection.gtype = GT_HOST;
+
+	metric_select_list_t& selects = selection.selects;
+	for (std::tr1::unordered_set<int>::const_iterator iter = cpuIds.begin(); iter != cpuIds.end(); ++iter)
+		selects.push_back(metric_select_t(FAMILY_CPU, *iter));
+	if (memory) selects.push_back(metric_select_t(FAMILY_MEM, 0));
+	if (loadAvg) selects.push_back(metric_select_t(FAMILY_LOADAVG, 0));
+	for (std::tr1::unordered_set<int>::const_iterator iter = netIds.begin(); iter != netIds.end(); ++iter)
+		selects.push_back(metric_select_t(FAMILY_NET, *iter));
+	if (netAll) selects.push_back(metric_select_t(FAMILY_NET, IID_NET_ALL));
+	for (std::tr1::unordered_set<int>::const_iterator iter = diskIds.begin(); iter != diskIds.end(); ++iter)
+		selects.push_back(metric_select_t(FAMILY_DISK, *iter));
+	if (diskAll) selects.push_back(metric_select_t(FAMILY_DISK, IID_DISK_ALL));
+
+	return 0;
+}
 
+// pid, mid, iids and hosts of a request to storage
+static void writeSelection(MemoryBuffer& msg, const metrics_selection_t& selection)
+{
+	msg.writeUint16(selection.pid);
+	msg.writeUint16(selection.mid);
+
+	msg.writeUint16(selection.iids.size());
+	for (size_t i = 0; i < selection.iids.size(); ++i)
+		msg.writeUint16(selection.iids[i]);
+
+	msg.writeUint16(selection.hosts.size());
+	for (host_set_t::const_iterator iter = selection.hosts.begin(); iter != selection.hosts.end(); ++iter) {
+		if (encodeTo(&msg, *iter) < 0)
+			break;
+	}
+}
+
+// the head of a request to storage
+static struct proto_h16_head *beginRequest(MemoryBuffer& msg, int cmd)
+{
 	struct proto_h16_head *h = (struct proto_h16_head *)msg.data();
-	memset(h, sizeof(*h), 0);
+	memset(h, 0, sizeof(*h));
 	msg.setWptr(sizeof(*h));
 
-	h->cmd = CMD_STAT_GET_SYSTEM_STATS_REQ;
-	h->syn = nextSyn++;
+	h->cmd = cmd;
+	h->syn = 0;	// stamped by the connection
 	h->ack = 0;
 	h->ver = 1;
-	
-	msg.writeUint8(context);
-	msg.writeUint8(totalView);
-	msg.writeInt64(startDtime);
-	msg.writeInt64(endDtime);
-	msg.writeUint8(spanUnit);
-	msg.writeUint8(spanCount);
-	msg.writeUint16(pid);
-	msg.writeUint16(mid);
+	return h;
+}
 
-	msg.writeUint16(hosts.size());
-	for (hosts::iterator iter = hosts.begin(); iter != hosts.end(); ++iter) {
-		if (encodeTo(msg, *iter) < 0)
-			break;
+// a query parsed, what goes to storage and what the output needs
+typedef struct metrics_query_tag {
+	metrics_selection_t selection;
+	int64_t startDtime;		// one span before the first period
+	int64_t endDtime;
+	int64_t rangeStart;
+	int64_t sinceDtime;
+	int spanUnit;
+	int spanCount;
+	int mergeCount;
+	int width;			// points of a series at most
+} metrics_query_t;
+
+// steps 1 to 4 of a request, -1 after the error is output
+static int parseQuery(HttpResponse& rsp, const QueryParameters& parameters, metrics_query_t& query)
+{
+	// step 1, 2, 4: context, group and ids
+	if (parseSelection(rsp, parameters, query.selection) < 0)
+		return -1;
+
+	// step 3: time period, span, align
+	int64_t startDtime, endDtime;
+	int spanUnit, spanCount;
+	if (parseDtimeSpan(rsp, parameters, startDtime, endDtime, spanUnit, spanCount) < 0)
+		return -1;
+
+	int64_t spanInterval = spanLength(spanUnit, spanCount);
+	int64_t rangeStart = startDtime;
+
+	// checked by parseDtimeSpan
+	int width = parameters.getInt("width", -1);
+
+	// step 3.1: since, only the periods a client has not got yet, and
+	// the last one it has for a revision. the points it has are as
+	// thinned for the whole range, so are the new ones
+	int64_t sinceDtime = 0;
+	const char *strSince = parameters.getString("since", NULL);
+	if (strSince != NULL) {
+		char *eptr;
+		sinceDtime = strtoll(strSince, &eptr, 0);
+		if (*eptr != 0) sinceDtime = parseDtime(strSince);
+		sinceDtime = alignTimeDown(sinceDtime, spanUnit, spanCount);
+
+		if (sinceDtime <= startDtime) {
+			sinceDtime = 0;
+		}
+		else {
+			if (sinceDtime >= endDtime) sinceDtime = endDtime - spanInterval;
+			width = (int)((int64_t)width * (endDtime - sinceDtime) / (endDtime - rangeStart));
+			if (width < 1) width = 1;
+			startDtime = sinceDtime;
+		}
+	}
+
+	// move ahead one span for some calculation need its previous stats
+	startDtime -= spanInterval;
+
+	query.startDtime = startDtime;
+	query.endDtime = endDtime;
+	query.rangeStart = rangeStart;
+	query.sinceDtime = sinceDtime;
+	query.spanUnit = spanUnit;
+	query.spanCount = spanCount;
+	query.mergeCount = (endDtime - startDtime) / spanInterval;
+	query.width = width;
+
+//	char buf1[128], buf2[128];
+//	APPLOG_DEBUG("parsed start=%s, end=%s, mergeCount=%d", 
+//		formatDtime(buf1, sizeof buf1, startDtime),
+//		formatDtime(buf2, sizeof buf2, endDtime), mergeCount);
+
+	return 0;
+}
+
+// a query as storage takes it, before flags or maxPoints
+static void writeQuery(MemoryBuffer& msg, const metrics_query_t& query)
+{
+	msg.writeUint8(query.selection.context);
+	msg.writeUint8(query.selection.totalView);
+	msg.writeInt64(query.startDtime);
+	msg.writeInt64(query.endDtime);
+	msg.writeUint8(query.spanUnit);
+	msg.writeUint8(query.spanCount);
+	writeSelection(msg, query.selection);
+}
+
+static void initResult(metrics_result_t& result, const metrics_query_t& query, const StatCombiner *combiner)
+{
+	result.combiner = combiner;
+	result.startDtime = query.startDtime;
+	result.endDtime = query.endDtime;
+	result.rangeStart = query.rangeStart;
+	result.sinceDtime = query.sinceDtime;
+	result.spanUnit = query.spanUnit;
+	result.spanCount = query.spanCount;
+	result.mergeCount = query.mergeCount;
+	result.profile = NULL;
+	result.requestUsec = 0;
+	result.formatSince = 0;
+	result.gtype = query.selection.gtype;
+	expandSelects(result, query.selection.selects);
+}
+
+//
+// case 0: depart-level
+//	dep-id => [pid,...] => [{pid,*,*}, ...]
+//	host=[auto]
+// case 1: pid-level
+//	pid, *, *
+//	host=[auto]
+// case 2: mid-level
+//	pid, mid, *
+//	host=[auto]
+// case 3: host-level
+//	pid, mid, *
+//	host=ip
+// case 4: expand-to-individual-hosts
+//	pid,mid,iid as in [0-2] (no case #3)
+//	host=[auto]
+//
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static inline uint64_t fnv1a(uint64_t hash, int64_t v)
+{
+	return fnv1a(hash, &v, sizeof v);
+}
+
+//
+// a strong etag of all a response is made of, which is the query
+// once the range is closed. iids and hosts are taken in any order
+//
+static void makeEtag(std::string& etag, const metrics_query_t& query, bool binary)
+{
+	const metrics_selection_t& selection = query.selection;
+	uint64_t hash = 14695981039346656037ULL;
+
+	hash = fnv1a(hash, ETAG_VERSION);
+	hash = fnv1a(hash, binary ? 1 : 0);
+	hash = fnv1a(hash, selection.context);
+	hash = fnv1a(hash, selection.totalView);
+	hash = fnv1a(hash, selection.pid);
+	hash = fnv1a(hash, selection.mid);
+	hash = fnv1a(hash, query.startDtime);
+	hash = fnv1a(hash, query.endDtime);
+	hash = fnv1a(hash, query.rangeStart);
+	hash = fnv1a(hash, query.sinceDtime);
+	hash = fnv1a(hash, query.spanUnit);
+	hash = fnv1a(hash, query.spanCount);
+	hash = fnv1a(hash, query.width);
+
+	std::vector<int> iids(selection.iids);
+	std::sort(iids.begin(), iids.end());
+	for (size_t i = 0; i < iids.size(); ++i)
+		hash = fnv1a(hash, iids[i]);
+	for (size_t i = 0; i < selection.selects.size(); ++i) {
+		hash = fnv1a(hash, selection.selects[i].first);
+		hash = fnv1a(hash, selection.selects[i].second);
+	}
+
+	uint64_t hosts = 0;
+	for (host_set_t::const_iterator iter = selection.hosts.begin(); iter != selection.hosts.end(); ++iter) {
+		uint64_t h = fnv1a(14695981039346656037ULL, iter->ver);
+		h = iter->ver == 6 ? fnv1a(h, iter->ip.ip6, sizeof iter->ip.ip6) : fnv1a(h, iter->ip.ip4);
+		hosts += h;
+	}
+	hash = fnv1a(hash, (int64_t)hosts);
+
+	char buf[24];
+	snprintf(buf, sizeof buf, "\"%016llx\"", (unsigned long long)hash);
+	etag = buf;
+}
+
+// If-None-Match of "*" or a list having etag, weak or not
+static bool etagMatches(const char *ifNoneMatch, const std::string& etag)
+{
+	if (ifNoneMatch == NULL) return false;
+
+	while (*ifNoneMatch == ' ') ++ifNoneMatch;
+	return !strcmp(ifNoneMatch, "*") || strstr(ifNoneMatch, etag.c_str()) != NULL;
+}
+
+// not of an error, which may go away
+static void setClosedHeaders(HttpResponse& rsp, const std::string& etag)
+{
+	rsp.setHeader("ETag", etag.c_str());
+	rsp.setHeader("Cache-Control", "public, max-age=31536000, immutable");
+}
+
+//
+// a closed range is answered by its etag or from the cache if it can
+// be, true then. nothing is asked of storage for it
+//
+static bool answerClosed(const HttpRequest& req, HttpResponse& rsp, const std::string& etag)
+{
+	if (etagMatches(req.getHeader("if-none-match"), etag)) {
+		rsp.setStatus(304);
+		setClosedHeaders(rsp, etag);
+		return true;
+	}
+
+	std::string contentType;
+	if (responseCache != NULL && responseCache->get(etag, contentType, rsp.body)) {
+		rsp.setStatus(200);
+		rsp.setContentType(contentType.c_str());
+		setClosedHeaders(rsp, etag);
+		return true;
+	}
+
+	return false;
+}
+
+static void handleRequest(ClientConnection *storage, const HttpRequest& req, const QueryParameters& parameters,
+			  HttpResponse& rsp)
+{
+	metrics_query_t query;
+	if (parseQuery(rsp, parameters, query) < 0)
+		return;
+
+	// format of the output
+	const char *strFormat = parameters.getString("format", "json");
+	bool binary = false;
+	if (!strcmp(strFormat, "bin")) {
+		binary = true;
+	}
+	else if (strcmp(strFormat, "json")) {
+		outputError(rsp, 501, "invalid format parameter, which should be json|bin.");
+		return;
+	}
+
+	bool explain = parameters.getInt("explain", 0) != 0;
+	bool closed = !explain && query.endDtime <= ((int64_t)time(NULL) - closedRangeAge) * 1000;
+
+	std::string etag;
+	if (closed) {
+		makeEtag(etag, query, binary);
+		if (answerClosed(req, rsp, etag))
+			return;
 	}
+
+	unsigned char reqBuf[8192];
+	MemoryBuffer msg(reqBuf, sizeof reqBuf, false);
+	MemoryBuffer frame(malloc(RSP_BUFFER_SIZE), RSP_BUFFER_SIZE, true);
+
+	struct proto_h16_head *h = beginRequest(msg, CMD_STAT_GET_SYSTEM_STATS_REQ);
+
+	// step 5: request the storage server, frames of the result are
+	// parsed into the combiner as they come
+	writeQuery(msg, query);
+
+	msg.writeUint8(explain ? QUERY_FLAG_PROFILE : 0);
+	msg.writeUint16(query.width > 0xffff ? 0xffff : query.width);
+
+	h->len = msg.getWptr();
 	
-	beyondy::TimedoutCountdown timer(10*1000);
-	ClientConnection client(storageAddress, 10*1000, 3);
-	if (client.request(&msg, &rsp) < 0) {
-		APPLOG_ERROR("request to %s failed: %m", storageAddress);
+	StatCombiner combiner(query.spanUnit, query.spanCount, query.startDtime, query.mergeCount);
+	QueryProfile profile;
+	stats_frames_t frames = { &combiner, explain ? &profile : NULL };
+
+	int64_t requestSince = QueryProfile::now();
+	if (storage->request(&msg, &frame, __parseStatsFrame, &frames) < 0) {
+		APPLOG_ERROR("request to %s failed: %m", storage->address());
+		outputError(rsp, 500, "query storage server failed");
+		return;
+	}
+
+	int64_t formatSince = QueryProfile::now();
+
+	metrics_result_t result;
+	initResult(result, query, &combiner);
+	result.profile = explain ? &profile : NULL;
+	result.requestUsec = formatSince - requestSince;
+	result.formatSince = formatSince;
+
+	// storage could not load all of it, not to be kept as it is
+	if (closed && combiner.incomplete) {
+		APPLOG_WARN("stats of pid=%d, mid=%d are incomplete, not cached", query.selection.pid, query.selection.mid);
+		closed = false;
+	}
+
+	// nothing can fail from here, what is streamed is kept for the
+	// cache as it goes
+	std::string copy;
+	bool caching = closed && responseCache != NULL && responseCache->isEnabled();
+	if (caching) rsp.keepCopy(&copy);
+	if (closed) setClosedHeaders(rsp, etag);
+
+	rsp.setStatus(200);
+	if (binary) outputBinary(rsp, result);
+	else outputJson(rsp, result);
+
+	if (caching) {
+		rsp.keepCopy(NULL);
+		copy.append(rsp.body);
+		responseCache->put(etag, rsp.contentType, copy);
+	}
+}
+
+void handleSystemMetrics(void *arg, const HttpRequest& req, HttpResponse& rsp)
+{
+	QueryParameters parameters(req.query.c_str());
+	handleRequest((ClientConnection *)arg, req, parameters, rsp);
+}
+
+// where frames of the batch response go
+typedef struct batch_frames_tag {
+	std::vector<StatCombiner *> combiners;
+	int done;			// queries with their last frame in
+	QueryProfile *profile;		// NULL if not asked for
+} batch_frames_t;
+
+//
+// one frame of a query in the batch into its combiner. the profile
+// follows the stats in the last frame of the last query if asked for
+//
+static int __parseBatchFrame(void *arg, MemoryBuffer *rsp)
+{
+	batch_frames_t *frames = (batch_frames_t *)arg;
+	struct proto_h16_res *h = (struct proto_h16_res *)rsp->data();
+	if (h->ret != 0) {
+		APPLOG_ERROR("get system stats batch failed: ret=%d", (int)h->ret);
 		return -1;
 	}
 
-	struct proto_h16_res *h2 = (struct proto_h16_res *)rsp.data();
-	rsp.setRptr(sizeof(*h2));
+	rsp->setRptr(sizeof(*h));
+	uint16_t index;
+	if (rsp->readUint16(index) < 0 || index >= frames->combiners.size()) {
+		APPLOG_ERROR("invalid query index of a batch frame");
+		return -1;
+	}
 
-	if (combiner.parseFrom(&rsp) < 0) {
-		APPLOG_ERROR("parse combiner from rsp-msg failed");
+	int retval = frames->combiners[index]->parseFrom(rsp);
+	if (retval < 0) {
+		APPLOG_ERROR("parse combiner of query %d from rsp-msg failed", (int)index);
 		return -1;
 	}
 
-	// further merge
-	StatCombiner combiner(spanUnit, spanCount, startDtime, mergeCount);
-	int gtype = combiner.groupType();
+	if (retval == 1 && ++frames->done < (int)frames->combiners.size())
+		return 0;
 
-	// output
-	printf("Status: 200 OK\r\n");
-	printf("Content-Type: application/json\r\n");
-	printf("\r\n");
+	if (retval == 1 && frames->profile != NULL && rsp->getRptr() < rsp->getWptr()
+			&& frames->profile->parseFrom(rsp) < 0) {
+		APPLOG_WARN("parse profile from rsp-msg failed");
+	}
 
-	int64_t spanInterval = spanLength(spanUnit, spanCount);
-	int64_t ts = startDtime + spanInterval;
-	char buf[128];
-	printf("{\"start\":\"%s\"", formatDtime(buf, sizeof buf, ts));
-	printf(",\"end\":\"%s\"", formatDtime(buf, sizeof buf, endDtime));
-	printf(",\"span\":\"%s\"", formatSpan(buf, sizeof buf, spanUnit, spanCount));
-	printf(",\"stats\":[");
-	for (int i = 1; i < mergeCount; ++i) {
-		
-		printf("%s{\"dtime\":\"%s\"", i == 1 ? "" : ",", formatDtime(buf, sizeof buf, ts));
-		printf(",\"data\":[");
+	return retval;
+}
 
-		bool first = true;
-		if (!cpuIds.empty()) {
-			outputCpuCombinedGauges(gtype, combiner.mergedGauges[i-1], combiner.mergedGauges[i], first, cpuIds);
-		}
+//
+// the queries q0, q1, ... in one request to storage, the results in
+// the same order. each query string is url-encoded and has what it
+// has of its own, the parameters of the batch are for all of them
+//
+static void handleBatch(ClientConnection *storage, const HttpRequest& req, HttpResponse& rsp)
+{
+	QueryParameters batchParameters(req.query.c_str());
+	std::vector<metrics_query_t> queries;
+
+	for (int i = 0; i < BATCH_MAX_QUERIES; ++i) {
+		char name[16];
+		snprintf(name, sizeof name, "q%d", i);
+		const char *strQuery = batchParameters.getString(name, NULL);
+		if (strQuery == NULL)
+			break;
 
-		if (memory) {
-			outputMemCombinedGauges(gtype, combiner.mergedGauges[i-1], combiner.mergedGauges[i], first);
-		}
+		// the first of a parameter is taken, the query's own then
+		std::string str(strQuery);
+		str.append("&").append(req.query);
+		QueryParameters parameters(str.c_str());
+
+		queries.push_back(metrics_query_t());
+		if (parseQuery(rsp, parameters, queries.back()) < 0)
+			return;
+	}
+
+	if (queries.empty()) {
+		outputError(rsp, 501, "No query is provided, as q0, q1 and so on.");
+		return;
+	}
+
+	size_t reqSize = 64 + queries.size() * BATCH_QUERY_SIZE;
+	MemoryBuffer msg(malloc(reqSize), reqSize, true);
+	MemoryBuffer frame(malloc(RSP_BUFFER_SIZE), RSP_BUFFER_SIZE, true);
+
+	struct proto_h16_head *h = beginRequest(msg, CMD_STAT_GET_SYSTEM_STATS_BATCH_REQ);
+	bool explain = batchParameters.getInt("explain", 0) != 0;
+	msg.writeUint8(explain ? QUERY_FLAG_PROFILE : 0);
+	msg.writeUint16(queries.size());
+	for (size_t i = 0; i < queries.size(); ++i) {
+		writeQuery(msg, queries[i]);
+		msg.writeUint16(queries[i].width > 0xffff ? 0xffff : queries[i].width);
+	}
+
+	h->len = msg.getWptr();
+
+	QueryProfile profile;
+	batch_frames_t frames;
+	frames.done = 0;
+	frames.profile = explain ? &profile : NULL;
+	for (size_t i = 0; i < queries.size(); ++i) {
+		frames.combiners.push_back(new StatCombiner(queries[i].spanUnit, queries[i].spanCount,
+			queries[i].startDtime, queries[i].mergeCount));
+	}
 
-		if (loadAvg) {
-			outputLoadavgCombinedGauges(gtype, combiner.mergedGauges[i-1], combiner.mergedGauges[i], first);
+	int64_t requestSince = QueryProfile::now();
+	if (storage->request(&msg, &frame, __parseBatchFrame, &frames) < 0) {
+		APPLOG_ERROR("request to %s failed: %m", storage->address());
+		outputError(rsp, 500, "query storage server failed");
+	}
+	else {
+		int64_t formatSince = QueryProfile::now();
+
+		rsp.setStatus(200);
+		rsp.setContentType("application/json");
+		JsonWriter w(HttpResponse::write, &rsp);
+
+		w.beginObject();
+		w.key("results");
+		w.beginArray();
+		for (size_t i = 0; i < queries.size(); ++i) {
+			metrics_result_t result;
+			initResult(result, queries[i], frames.combiners[i]);
+
+			w.beginObject();
+			writeStats(w, result);
+			w.endObject();
+
+			// freed as soon as it is out
+			delete frames.combiners[i];
+			frames.combiners[i] = NULL;
 		}
+		w.endArray();
 
-		if (!netIds.empty()) {
-			outputNetCombinedGauges(gtype, combiner.mergedGauges[i-1], combiner.mergedGauges[i], first, netIds);
+		if (explain) {
+			outputProfile(w, profile, formatSince - requestSince, QueryProfile::now() - formatSince);
 		}
 
-		if (!diskIds.empty()) {
-			outputDiskCombinedGauges(gtype, combiner.mergedGauges[i-1], combiner.mergedGauges[i], first, diskIds);
+		w.endObject();
+		w.flush();
+	}
+
+	for (size_t i = 0; i < frames.combiners.size(); ++i)
+		delete frames.combiners[i];
+}
+
+void handleSystemBatch(void *arg, const HttpRequest& req, HttpResponse& rsp)
+{
+	handleBatch((ClientConnection *)arg, req, rsp);
+}
+
+// a subscription being forwarded to the client
+typedef struct live_stream_tag {
+	HttpResponse *rsp;
+	metrics_result_t result;	// of the last period pushed
+	metric_select_list_t selects;	// asked for, all ones not expanded
+	uint64_t id;			// of the subscription, 0 before the ack
+	int64_t span;
+	int64_t lastTime;		// of last, 0 if none yet
+	merged_gauge_map_t last;	// for counters of the next period
+} live_stream_t;
+
+//
+// a frame of the subscription out as an event. -1 ends it, for an
+// error or once the client is gone
+//
+static int __forwardLiveFrame(void *arg, MemoryBuffer *rsp)
+{
+	live_stream_t *live = (live_stream_t *)arg;
+	HttpResponse& out = *live->rsp;
+	struct proto_h16_res *h = (struct proto_h16_res *)rsp->data();
+	if (h->ret != 0) {
+		APPLOG_ERROR("subscribe system stats failed: ret=%d", (int)h->ret);
+		return -1;
+	}
+
+	rsp->setRptr(sizeof(*h));
+	uint8_t kind;
+	if (rsp->readUint8(kind) < 0)
+		return -1;
+
+	if (kind == LIVE_FRAME_ACK) {
+		if (rsp->readUint64(live->id) < 0)
+			return -1;
+
+		char buf[32];
+		out.append("retry: 5000\nevent: open\ndata: ");
+		JsonWriter w(__appendString, &out.body, 256);
+		w.beginObject();
+		w.member("span", formatSpan(buf, sizeof buf, live->result.spanUnit, live->result.spanCount));
+		w.endObject();
+		w.flush();
+		out.append("\n\n");
+	}
+	else if (kind == LIVE_FRAME_STATS) {
+		// the period start, to line the one before up with it
+		long rptr = rsp->getRptr();
+		uint8_t flags, ftype, freqs;
+		int64_t start;
+		if (rsp->readUint8(flags) < 0 || rsp->readUint8(ftype) < 0 || rsp->readUint8(freqs) < 0
+				|| rsp->readInt64(start) < 0)
+			return -1;
+		rsp->setRptr(rptr);
+
+		StatCombiner combiner(live->result.spanUnit, live->result.spanCount, start - live->span, 2);
+		if (live->lastTime == start - live->span)
+			combiner.mergedGauges[0].swap(live->last);
+		if (combiner.parseFrom(rsp) < 0) {
+			APPLOG_ERROR("parse live period of subscription %llu failed", (unsigned long long)live->id);
+			return -1;
 		}
 
-		printf("]}");
+		group_point_list_t points;
+		live->result.combiner = &combiner;
+		live->result.startDtime = start - live->span;
+		expandSelects(live->result, live->selects);
+		if (collectPoints(live->result, 1, points)) {
+			out.append("event: stats\ndata: ");
+			JsonWriter w(__appendString, &out.body);
+			writePeriod(w, live->result, start, points);
+			w.flush();
+			out.append("\n\n");
+		}
 
-		ts += spanInterval;
+		live->result.combiner = NULL;
+		live->last.swap(combiner.mergedGauges[1]);
+		live->lastTime = start;
+	}
+	else {
+		// a comment, to find out a client gone
+		out.append(":\n\n");
 	}
 
-	printf("]}");
-	return;
+	return out.flush() < 0 ? -1 : 0;
 }
 
-int main(int argc, char **argv)
+//
+// subscribes to storage and forwards its periods while the client
+// stays, on a thread of its own. the subscription is ended after
+//
+static void handleLive(ClientConnection *storage, const QueryParameters& parameters, HttpResponse& rsp)
 {
-	QueryParameters parameters(argc == 2 ? argv[1] : getenv("QUERY_STRING"));
-	handleRequest(parameters);
+	metrics_selection_t selection;
+	if (parseSelection(rsp, parameters, selection) < 0)
+		return;
 
-	return 0;
+	char *eptr;
+	const char *strSpan = parameters.getString("span", "1m");
+	int spanCount = strtol(strSpan, &eptr, 0);
+	int spanUnit = timeUnit(eptr);
+	if (spanCount < 1 || spanCount > 0xff || spanUnit == FT_UNKNOWN || spanLength(spanUnit, spanCount) <= 0) {
+		outputError(rsp, 501, "Invalid span parameter");
+		return;
+	}
+
+	// nothing would go out before the end without a stream
+	if (!rsp.canStream()) {
+		outputError(rsp, 400, "live stats need a HTTP/1.1 GET");
+		return;
+	}
+
+	unsigned char reqBuf[8192];
+	MemoryBuffer msg(reqBuf, sizeof reqBuf, false);
+	MemoryBuffer frame(malloc(RSP_BUFFER_SIZE), RSP_BUFFER_SIZE, true);
+
+	struct proto_h16_head *h = beginRequest(msg, CMD_STAT_SUBSCRIBE_REQ);
+	msg.writeUint8(selection.context);
+	msg.writeUint8(selection.totalView);
+	msg.writeUint8(spanUnit);
+	msg.writeUint8(spanCount);
+	writeSelection(msg, selection);
+	h->len = msg.getWptr();
+
+	live_stream_t live;
+	live.rsp = &rsp;
+	live.result.combiner = NULL;
+	live.selects = selection.selects;
+	live.result.gtype = selection.gtype;
+	live.result.spanUnit = spanUnit;
+	live.result.spanCount = spanCount;
+	live.result.mergeCount = 2;
+	live.result.rangeStart = 0;
+	live.result.sinceDtime = 0;
+	live.result.profile = NULL;
+	live.id = 0;
+	live.span = spanLength(spanUnit, spanCount);
+	live.lastTime = 0;
+
+	rsp.setStatus(200);
+	rsp.setContentType("text/event-stream");
+	rsp.setHeader("Cache-Control", "no-cache");
+
+	// returns when the client, storage or the connection to it is gone
+	storage->request(&msg, &frame, __forwardLiveFrame, &live);
+	if (live.id == 0) {
+		APPLOG_ERROR("subscribe to %s failed: %m", storage->address());
+		outputError(rsp, 500, "subscribe to storage server failed");
+		return;
+	}
+
+	msg.setWptr(0);
+	h = beginRequest(msg, CMD_STAT_UNSUBSCRIBE_REQ);
+	msg.writeUint64(live.id);
+	h->len = msg.getWptr();
+	if (storage->request(&msg, &frame) < 0) {
+		APPLOG_WARN("unsubscribe %llu from %s failed: %m", (unsigned long long)live.id, storage->address());
+	}
 }
 
+void handleSystemLive(void *arg, const HttpRequest& req, HttpResponse& rsp)
+{
+	QueryParameters parameters(req.query.c_str());
+	handleLive((ClientConnection *)arg, parameters, rsp);
+}
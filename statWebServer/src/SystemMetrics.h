@@ -0,0 +1,27 @@
+/* SystemMetrics.h
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#ifndef __SYSTEM_METRICS__H
+#define __SYSTEM_METRICS__H
+
+class HttpRequest;
+class HttpResponse;
+class ResponseCache;
+
+// where responses of closed ranges are kept, NULL for none, and how
+// many seconds ago a range ends to be closed
+void setResponseCache(ResponseCache *cache, int closedRangeAge);
+
+// the system stats in json, see SystemMetrics.cpp for the parameters.
+// arg is the ClientConnection of the storage server
+void handleSystemMetrics(void *arg, const HttpRequest& req, HttpResponse& rsp);
+
+// the system stats of several queries in one request to storage
+void handleSystemBatch(void *arg, const HttpRequest& req, HttpResponse& rsp);
+
+// the system stats of a selection as server-sent events, a period
+// each as storage closes it. it lasts as long as the client stays,
+// so it must run on a thread of its own
+void handleSystemLive(void *arg, const HttpRequest& req, HttpResponse& rsp);
+
+#endif /* __SYSTEM_METRICS__H */
@@ -1,10 +1,73 @@
+/* main.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "Log.h"
+#include "ConfigProperty.h"
+#include "ClientConnection.h"
+#include "HttpServer.h"
+#include "ResponseCache.h"
+#include "SystemMetrics.h"
 
+static HttpServer *httpServer = NULL;
 
-int doGetOrgTree();
+static void onSignal(int signo)
+{
+	if (httpServer != NULL) httpServer->stop();
+}
 
-int doGetStatData()
+int main(int argc, char **argv)
 {
-	qs = "type={GAUGE|LCALL|RCALL|RCALLED}&pid=&mid=&iid=&host&dst-{pid,mid,iid,host}=time=30m/1h/4h/8h/12h/1d/2d/3d/5d/1w/2w/3w/1m/2m/3m/6m/1y/2y/3y/5y/specifc-day/range";
+	const char *file = argc > 1 ? argv[1] : "../conf/web.conf";
+	ConfigProperty cfp;
+	if (cfp.parse(file) < 0) {
+		fprintf(stderr, "parse %s failed: %m\n", file);
+		exit(1);
+	}
+
+	// shared by all workers
+	ClientConnection storage(cfp.getString("storageAddress", "tcp://127.0.0.1:6020"),
+			cfp.getInt("storageTimeout", 10 * 1000), cfp.getInt("storageRetries", 2));
+	storage.setPool(cfp.getInt("storagePoolSize", 4), cfp.getInt("storagePipelineDepth", 8),
+			cfp.getInt("storageHealthInterval", 10));
+
+	// responses of closed ranges, by their etags
+	ResponseCache responseCache((size_t)cfp.getInt("responseCacheMB", 64) * 1024 * 1024,
+			(size_t)cfp.getInt("responseCacheEntryKB", 4096) * 1024);
+	setResponseCache(&responseCache, cfp.getInt("closedRangeAge", 3600));
+
+	HttpServer server;
+	server.setWebRoot(cfp.getString("webRoot", "../../statWebRoot"), cfp.getString("indexPage", "system.html"));
+	server.addHandler("/api/system", handleSystemMetrics, &storage);
+	server.addHandler("/api/system/batch", handleSystemBatch, &storage);
+	// each client of the live feed holds a thread while it stays
+	server.addHandler("/api/system/live", handleSystemLive, &storage, cfp.getInt("liveMaxStreams", 64));
+	// where the cgi was, for pages still asking there
+	server.addHandler("/cgi-bin/systemMetrics.cgi", handleSystemMetrics, &storage);
+
+	const char *listenAddress = cfp.getString("listenAddress", "tcp://0.0.0.0:8080");
+	if (server.init(listenAddress, cfp.getInt("listenBacklog", 1024),
+			cfp.getInt("workerThreadCount", 4), cfp.getInt("connectionIdleTimeout", 30)) < 0) {
+		fprintf(stderr, "start http server on %s failed\n", listenAddress);
+		exit(1);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	httpServer = &server;
+	APPLOG_INFO("http server listens on %s", listenAddress);
+	server.run();
+	httpServer = NULL;
 
+	APPLOG_INFO("http server exits");
+	return 0;
 }
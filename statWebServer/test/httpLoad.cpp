@@ -0,0 +1,298 @@
+/* httpLoad.cpp
+ * Copyright by Beyondy.c.w 2002-2020
+**/
+// requests/sec and latency of an http url by N concurrent clients,
+// e.g. the metrics api of statWebServer against the cgi under any
+// web server:
+//
+//	httpLoad -c 32 -d 30 -k 'http://127.0.0.1:8080/api/system?pid=1000&last=4h&width=800'
+//	httpLoad -c 32 -d 30 'http://127.0.0.1/cgi-bin/systemMetrics.cgi?pid=1000&last=4h&width=800'
+//
+// -k keeps connections alive, otherwise one connection per request.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+typedef struct load_options_tag {
+	struct sockaddr_in addr;
+	std::string host;
+	std::string uri;
+	int connections;
+	int seconds;
+	bool keepAlive;
+} load_options_t;
+
+typedef struct load_result_tag {
+	long requests;
+	long errors;
+	long bytes;
+	std::vector<int> latencies;	// usec
+} load_result_t;
+
+typedef struct load_worker_tag {
+	pthread_t tid;
+	const load_options_t *options;
+	load_result_t result;
+} load_worker_t;
+
+static volatile bool isRunning = true;
+
+static int64_t nowUsec()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int parseUrl(const char *url, load_options_t *options)
+{
+	if (strncmp(url, "http://", 7) != 0) return -1;
+	url += 7;
+
+	const char *slash = strchr(url, '/');
+	std::string hostPort = slash != NULL ? std::string(url, slash - url) : std::string(url);
+	options->uri = slash != NULL ? slash : "/";
+	options->host = hostPort;
+
+	int port = 80;
+	size_t colon = hostPort.find(':');
+	if (colon != std::string::npos) {
+		port = atoi(hostPort.c_str() + colon + 1);
+		hostPort.erase(colon);
+	}
+
+	memset(&options->addr, 0, sizeof options->addr);
+	options->addr.sin_family = AF_INET;
+	options->addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, hostPort.c_str(), &options->addr.sin_addr) != 1) return -1;
+
+	return 0;
+}
+
+static int connectTo(const load_options_t *options)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	if (connect(fd, (const struct sockaddr *)&options->addr, sizeof options->addr) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int writeAll(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		data += n; size -= n;
+	}
+
+	return 0;
+}
+
+// more input into buf, 0 at eof
+static ssize_t readMore(int fd, std::string& buf)
+{
+	char tmp[16 * 1024];
+	while (true) {
+		ssize_t n = read(fd, tmp, sizeof tmp);
+		if (n < 0 && errno == EINTR) continue;
+		if (n > 0) buf.append(tmp, n);
+		return n;
+	}
+}
+
+//
+// one response off buf (bytes after it are kept): by content-length,
+// chunked or until closed. the status, or -1. closed is set if the
+// connection can not be used again.
+//
+static int readResponse(int fd, std::string& buf, long& bytes, bool& closed)
+{
+	size_t headEnd;
+	while ((headEnd = buf.find("\r\n\r\n")) == std::string::npos) {
+		if (readMore(fd, buf) <= 0) return -1;
+	}
+
+	std::string head(buf, 0, headEnd + 2);
+	buf.erase(0, headEnd + 4);
+	for (size_t i = 0; i < head.size(); ++i) head[i] = tolower(head[i]);
+
+	int status = 0;
+	if (sscanf(head.c_str(), "http/%*d.%*d %d", &status) != 1) return -1;
+
+	closed = head.find("connection: close\r\n") != std::string::npos;
+	size_t pos = head.find("content-length:");
+	if (pos != std::string::npos) {
+		size_t length = strtoul(head.c_str() + pos + 15, NULL, 10);
+		while (buf.size() < length) {
+			if (readMore(fd, buf) <= 0) return -1;
+		}
+
+		buf.erase(0, length);
+		bytes += length;
+	}
+	else if (head.find("transfer-encoding: chunked") != std::string::npos) {
+		while (true) {
+			size_t eol;
+			while ((eol = buf.find("\r\n")) == std::string::npos) {
+				if (readMore(fd, buf) <= 0) return -1;
+			}
+
+			size_t size = strtoul(buf.c_str(), NULL, 16);
+			while (buf.size() < eol + 2 + size + 2) {
+				if (readMore(fd, buf) <= 0) return -1;
+			}
+
+			buf.erase(0, eol + 2 + size + 2);
+			bytes += size;
+			if (size == 0) break;
+		}
+	}
+	else {
+		while (readMore(fd, buf) > 0) {
+			/* until closed */
+		}
+
+		bytes += buf.size();
+		buf.clear();
+		closed = true;
+	}
+
+	return status;
+}
+
+static void *__workerEntry(void *p)
+{
+	load_worker_t *worker = (load_worker_t *)p;
+	const load_options_t *options = worker->options;
+	load_result_t& result = worker->result;
+
+	std::string request = "GET " + options->uri + " HTTP/1.1\r\nHost: " + options->host + "\r\n";
+	request += options->keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+	std::string buf;
+	int fd = -1;
+	while (isRunning) {
+		int64_t since = nowUsec();
+		if (fd < 0 && (fd = connectTo(options)) < 0) {
+			++result.errors;
+			usleep(10 * 1000);
+			continue;
+		}
+
+		bool closed = !options->keepAlive;
+		int status = -1;
+		if (writeAll(fd, request.data(), request.size()) == 0)
+			status = readResponse(fd, buf, result.bytes, closed);
+
+		if (status < 0 || closed || !options->keepAlive) {
+			close(fd);
+			fd = -1;
+			buf.clear();
+		}
+
+		if (status == 200) {
+			++result.requests;
+			result.latencies.push_back((int)(nowUsec() - since));
+		}
+		else {
+			++result.errors;
+		}
+	}
+
+	if (fd >= 0) close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c connections] [-d seconds] [-k] http://ip:port/uri\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	load_options_t options;
+	options.connections = 16;
+	options.seconds = 10;
+	options.keepAlive = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:k")) != -1) {
+		switch (opt) {
+		case 'c': options.connections = atoi(optarg); break;
+		case 'd': options.seconds = atoi(optarg); break;
+		case 'k': options.keepAlive = true; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || options.connections < 1 || options.seconds < 1)
+		usage(argv[0]);
+	if (parseUrl(argv[optind], &options) < 0) {
+		fprintf(stderr, "invalid url (only http://ip:port/uri): %s\n", argv[optind]);
+		exit(1);
+	}
+
+	std::vector<load_worker_t> workers(options.connections);
+	int64_t since = nowUsec();
+	for (int i = 0; i < options.connections; ++i) {
+		workers[i].options = &options;
+		workers[i].result.requests = workers[i].result.errors = workers[i].result.bytes = 0;
+		if ((errno = pthread_create(&workers[i].tid, NULL, __workerEntry, &workers[i])) != 0) {
+			fprintf(stderr, "create worker #%d failed: %m\n", i);
+			exit(1);
+		}
+	}
+
+	sleep(options.seconds);
+	isRunning = false;
+
+	load_result_t total;
+	total.requests = total.errors = total.bytes = 0;
+	for (int i = 0; i < options.connections; ++i) {
+		pthread_join(workers[i].tid, NULL);
+		total.requests += workers[i].result.requests;
+		total.errors += workers[i].result.errors;
+		total.bytes += workers[i].result.bytes;
+		total.latencies.insert(total.latencies.end(), workers[i].result.latencies.begin(),
+				workers[i].result.latencies.end());
+	}
+
+	double elapsed = (nowUsec() - since) / 1000000.0;
+	printf("%s, %d connections%s, %.1fs\n", argv[optind], options.connections,
+		options.keepAlive ? " (keep-alive)" : "", elapsed);
+	printf("requests: %ld ok, %ld failed, %.1f requests/sec, %.1f KB/sec\n",
+		total.requests, total.errors, total.requests / elapsed, total.bytes / elapsed / 1024);
+
+	if (!total.latencies.empty()) {
+		std::sort(total.latencies.begin(), total.latencies.end());
+		size_t n = total.latencies.size();
+		printf("latency: p50=%.2fms, p90=%.2fms, p99=%.2fms, max=%.2fms\n",
+			total.latencies[n * 50 / 100] / 1000.0, total.latencies[n * 90 / 100] / 1000.0,
+			total.latencies[n * 99 / 100] / 1000.0, total.latencies[n - 1] / 1000.0);
+	}
+
+	return 0;
+}